@@ -11,6 +11,49 @@
 // Enables the MQTT watchdog
 // #define LIBIOT_ENABLE_MQTT_WATCHDOG
 
+// Number of records in the `libiot_mqtt_post*()` ring buffer (a power of two),
+// and the maximum combined length of the topic and message of each record.
+// #define LIBIOT_MQTT_POST_QUEUE_LENGTH 32
+// #define LIBIOT_MQTT_POST_RECORD_SIZE 256
+
+// Size of the stack scratch buffer into which formatted messages are written.
+// (Longer messages fall back to a heap allocation.)
+// #define LIBIOT_FORMAT_SCRATCH_SIZE 256
+
+// The largest inbound MQTT message which is reassembled for (non-stream)
+// routes when it arrives in more than one chunk, i.e. when it is larger than
+// CONFIG_MQTT_BUFFER_SIZE. Only one message is reassembled at a time, into an
+// allocation of exactly its size.
+// #define LIBIOT_MQTT_REASSEMBLY_MAX_BYTES 16384
+
+// Number of samples kept by the heap monitor, over which the min/max values
+// it reports are taken.
+// #define LIBIOT_HEAP_MONITOR_HISTORY 16
+
+// How often the progress of an OTA download is published.
+// #define LIBIOT_OTA_PROGRESS_INTERVAL_MS 5000
+
+// When an OTA image is sent over MQTT, the number of bytes beyond those
+// acknowledged which the sender may have in flight (and which we may have to
+// hold in RAM).
+// #define LIBIOT_OTA_MQTT_WINDOW_BYTES 16384
+
+// After waking from deep sleep within this many seconds of obtaining a DHCP
+// lease, we reuse the lease rather than asking for it again (if we reconnect
+// to the same AP). The address is then kept until we next disconnect, so
+// this must be well within the lease time of the network, and it only suits
+// nodes which sleep between short wakes. (The default of 0 always uses DHCP.)
+// #define LIBIOT_WIFI_LEASE_REUSE_S 0
+
+// Builds the JSON built-in messages via cJSON trees, rather than writing them
+// directly into a single buffer.
+// #define LIBIOT_JSON_USE_CJSON
+
+// Enables the '_cmd/bench' route, which compares the JSON and CBOR encodings
+// of the built-in messages. Note that this replaces the cJSON allocator (with
+// one which counts allocations), which stops cJSON from using `realloc()`.
+// #define LIBIOT_ENABLE_BENCH
+
 ////////
 
 // NOTE In practice we require the following in `sdkconfig`:
@@ -19,9 +62,6 @@
 // * CONFIG_MBEDTLS_SSL_OUT_CONTENT_LEN=8192
 //      (Otherwise our certificate chain might be too large to send during SSL
 //      auth.)
-// * CONFIG_MQTT_BUFFER_SIZE=4096
-//      (Otherwise the url and certificate in OTA packets may be too big to
-//      recieve.)
 // * CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE=y
 //      (In order to enable OTA rollback.)
 
@@ -51,6 +91,44 @@
     IOT_MQTT_DEVICE_TOPIC_ROOT(device_name_literal)              \
     "/" name_literal
 
+// What `libiot_mqtt_post*()` does when its ring buffer is full.
+typedef enum libiot_mqtt_post_policy {
+    // Discard the oldest queued message to make room. (The default.)
+    LIBIOT_MQTT_POST_DROP_OLDEST = 0,
+    // Discard the message being posted.
+    LIBIOT_MQTT_POST_DROP_NEWEST,
+    // Wait up to `mqtt_post_timeout_ms` for room, and then discard the message
+    // being posted.
+    LIBIOT_MQTT_POST_BLOCK,
+} libiot_mqtt_post_policy_t;
+
+// How we prove to the broker that we are still up.
+typedef enum libiot_liveness_mode {
+    // esp-mqtt sends PINGREQs on a fixed schedule. (The default.)
+    LIBIOT_LIVENESS_FIXED = 0,
+    // PINGREQs are suppressed while we are sending other packets often enough
+    // to prove our liveness anyway, and resume when that traffic stops.
+    LIBIOT_LIVENESS_ADAPTIVE,
+} libiot_liveness_mode_t;
+
+// The encoding of the built-in status, info, startup and mem_check payloads.
+typedef enum libiot_payload_format {
+    // JSON, published under the usual '_info/<name>' topics. (The default.)
+    LIBIOT_PAYLOAD_JSON = 0,
+    // CBOR (with the same structure as the JSON), published under
+    // '_info/<name>/cbor' topics so that subscribers know how to decode them.
+    LIBIOT_PAYLOAD_CBOR,
+} libiot_payload_format_t;
+
+// A static IPv4 configuration, as dotted quads.
+typedef struct libiot_static_ip {
+    const char *ip;
+    const char *netmask;
+    const char *gw;
+    // May be NULL.
+    const char *dns;
+} libiot_static_ip_t;
+
 typedef struct node_config {
     const char *name;
 
@@ -58,16 +136,55 @@ typedef struct node_config {
     const char *ssid;
     const char *pass;
     wifi_ps_type_t ps_type;
+    // If set, used instead of DHCP. May be NULL.
+    const libiot_static_ip_t *static_ip;
 
     // MQTT
     const char *uri;
     const char *cert;
     const char *key;
     const char *mqtt_pass;
+    // Called for every esp-mqtt event. (Prefer `libiot_mqtt_route()` for
+    // handling messages on particular topics.) May be NULL.
     void (*mqtt_cb)(esp_mqtt_event_handle_t event);
 
     // Options (not setting these yields reasonable defaults)
     int mqtt_task_stack_size;
+    libiot_mqtt_post_policy_t mqtt_post_policy;
+    int mqtt_post_timeout_ms;
+    // Messages per second replayed from the outbox after reconnecting.
+    int outbox_replay_rate;
+    // The window (in ms) over which the status/info/startup messages are
+    // published after connecting, at a random offset, so that many nodes
+    // reconnecting at once do not all publish at once.
+    int mqtt_connect_window_ms;
+    // The broker notices that we are down (and publishes our LWT) at most
+    // `liveness_down_detect_ms` after we go, which determines the MQTT
+    // keepalive. (The default is 1500ms.) When idle, the radio wakes to send
+    // a PINGREQ twice per keepalive; a positive
+    // `liveness_max_idle_wakes_per_min` caps this, lengthening the keepalive
+    // (and so relaxing the down detection target) if necessary.
+    libiot_liveness_mode_t liveness_mode;
+    int liveness_down_detect_ms;
+    int liveness_max_idle_wakes_per_min;
+    libiot_payload_format_t payload_format;
+    // How often the heap monitor samples the heaps. (The default is 10s.)
+    int heap_monitor_interval_ms;
+    // A PEM public key (RSA or EC). If set, OTA update commands must carry
+    // the `sha256` of the image and a `signature`, the base64 signature of
+    // that hash by the corresponding private key.
+    const char *ota_signing_key;
+    // After booting into a new OTA image, libiot decides by itself whether to
+    // keep it. The image is marked valid if the reset which booted it was not
+    // exceptional, MQTT connects (within 5 minutes) and is still connected
+    // `ota_health_window_ms` later (the default is 60s), the free heap never
+    // fell below `ota_health_min_free_heap` bytes (the default is 16kB), and
+    // every probe added with `libiot_ota_add_health_probe()` passes.
+    // Otherwise it is rolled back. If `ota_manual_validation` is set, the image
+    // is instead left for the `validate` and `rollback` OTA commands.
+    int ota_health_window_ms;
+    int ota_health_min_free_heap;
+    bool ota_manual_validation;
 
     // App init - called before wifi or mqtt has been started. May be NULL.
     void (*app_init)();
@@ -93,18 +210,110 @@ void libiot_logf_error(const char *tag, const char *format, ...)
 
 const char *libiot_get_local_ip();
 
+/// OTA Health
+/// Probes are called once, on a libiot task, at the end of the health window
+/// of a new OTA image (see `node_config_t.ota_health_window_ms`), and should
+/// return false if the app is not working, in which case the image is rolled
+/// back. Add them during `app_init()`. At most 8 probes may be added.
+
+typedef bool (*libiot_ota_health_probe_t)(void *ctx);
+
+// `name` is reported if the probe fails, and must remain valid.
+void libiot_ota_add_health_probe(const char *name,
+                                 libiot_ota_health_probe_t cb, void *ctx);
+
+/// MQTT Routing
+/// Handlers are invoked on the esp-mqtt task for every `MQTT_EVENT_DATA` event
+/// whose topic matches the given filter, which may contain the `+` and `#`
+/// wildcards. Matching takes time proportional to the length of the topic,
+/// not the number of routes. Routes cannot be removed once registered.
+///
+/// Note that routing a topic does not subscribe to it. (All topics under
+/// 'hoek/iot/<device_name>/' are subscribed to automatically.)
+///
+/// Messages larger than CONFIG_MQTT_BUFFER_SIZE arrive from esp-mqtt in
+/// chunks. Routes see the whole message once it has been reassembled (see
+/// `LIBIOT_MQTT_REASSEMBLY_MAX_BYTES`), while stream routes are invoked for
+/// each chunk as it arrives, with `event->topic` always set. A chunk is the
+/// last of its message when `event->current_data_offset + event->data_len ==
+/// event->total_data_len`.
+
+typedef void (*libiot_mqtt_route_cb_t)(esp_mqtt_event_handle_t event,
+                                       void *ctx);
+
+// Routes messages published under '<topic_filter>'.
+void libiot_mqtt_route(const char *topic_filter, libiot_mqtt_route_cb_t cb,
+                       void *ctx);
+// Routes messages published under
+// 'hoek/iot/<device_name>/<topic_filter_suffix>'.
+void libiot_mqtt_route_local(const char *topic_filter_suffix,
+                             libiot_mqtt_route_cb_t cb, void *ctx);
+// As above, but invoked for each chunk of a message.
+void libiot_mqtt_route_stream(const char *topic_filter,
+                              libiot_mqtt_route_cb_t cb, void *ctx);
+void libiot_mqtt_route_stream_local(const char *topic_filter_suffix,
+                                    libiot_mqtt_route_cb_t cb, void *ctx);
+
 /// MQTT Subscribe
-/// Just like esp-mqtt, these functions **block** until they complete, or there
-/// is a failure.
+/// Subscriptions are remembered, and renewed every time MQTT (re)connects,
+/// pipelining one SUBSCRIBE packet per topic. These functions return
+/// immediately; SUBACKs are tracked in the background, and topics which are
+/// not acknowledged in time are subscribed to again (a few times, before being
+/// marked as failed until the next connect).
+///
+/// Once every topic has been acknowledged after a connect, the latency is
+/// published to 'hoek/iot/<device_name>/_info/subscriptions'.
 
 // Subscribes to '<topic>'
 void libiot_mqtt_subscribe(const char *topic, int qos);
 // Subscribes to 'hoek/iot/<device_name>/<topic_suffix>'
 void libiot_mqtt_subscribe_local(const char *topic_suffix, int qos);
 
+typedef enum libiot_mqtt_subscription_state {
+    // `libiot_mqtt_subscribe()` has not been called with this topic.
+    LIBIOT_MQTT_SUB_UNKNOWN = 0,
+    // Not yet acknowledged (possibly because we are disconnected).
+    LIBIOT_MQTT_SUB_PENDING,
+    LIBIOT_MQTT_SUB_SUBSCRIBED,
+    // Refused by the broker, or never acknowledged.
+    LIBIOT_MQTT_SUB_FAILED,
+} libiot_mqtt_subscription_state_t;
+
+libiot_mqtt_subscription_state_t
+libiot_mqtt_subscription_get_state(const char *topic);
+
+// Blocks until MQTT is connected and no subscription is pending, or
+// `timeout_ms` has elapsed (a negative `timeout_ms` waits forever). Returns
+// whether that happened.
+bool libiot_mqtt_wait_subscribed(int timeout_ms);
+
+typedef struct libiot_mqtt_subscription_stats {
+    // Registered topics, and their current states.
+    uint32_t count;
+    uint32_t pending;
+    uint32_t subscribed;
+    uint32_t failed;
+
+    // SUBSCRIBE packets sent, and topics sent again after a SUBACK timeout.
+    uint32_t packets;
+    uint32_t retries;
+
+    // Time from the last connect until no subscription was pending.
+    uint32_t last_latency_ms;
+} libiot_mqtt_subscription_stats_t;
+
+void libiot_mqtt_subscription_get_stats(
+    libiot_mqtt_subscription_stats_t *stats);
+
 /// MQTT Publish
 /// Just like esp-mqtt, these functions **block** until they complete, or there
 /// is a failure.
+///
+/// If the partition table contains a data partition labelled "outbox", then
+/// QoS >= 1 messages published or enqueued while MQTT is disconnected are
+/// instead stored in that partition, and replayed in order (at
+/// `node_config_t.outbox_replay_rate`) once MQTT reconnects. Once the
+/// partition is full the oldest messages are evicted.
 
 // Publishes under '<topic>'.
 void libiot_mqtt_publish(const char *topic, int qos, int retain,
@@ -117,6 +326,15 @@ void libiot_mqtt_publishv_local(const char *topic_suffix, int qos, int retain,
 void libiot_mqtt_publishf_local(const char *topic_suffix, int qos, int retain,
                                 const char *fmt, ...) __printflike(4, 5);
 
+// Publishes the `len` bytes at `data` (which need not be null terminated, e.g.
+// a CBOR payload) under '<topic>'.
+void libiot_mqtt_publishb(const char *topic, int qos, int retain,
+                          const void *data, size_t len);
+// Publishes the `len` bytes at `data` under
+// 'hoek/iot/<device_name>/<topic_suffix>'.
+void libiot_mqtt_publishb_local(const char *topic_suffix, int qos, int retain,
+                                const void *data, size_t len);
+
 /// MQTT Enqueue
 /// Just like esp-mqtt, these functions **do not block**, simply enqueuing a
 /// message to be sent.
@@ -132,6 +350,330 @@ void libiot_mqtt_enqueuev_local(const char *topic_suffix, int qos, int retain,
 void libiot_mqtt_enqueuef_local(const char *topic_suffix, int qos, int retain,
                                 const char *fmt, ...) __printflike(4, 5);
 
+/// MQTT Post
+/// These functions **do not block** on the network: the message is copied into
+/// a fixed-size lock-free ring buffer, which is drained by a libiot sender task
+/// (in order, once MQTT is connected). When the buffer is full the message is
+/// handled according to `node_config_t.mqtt_post_policy`. They may be called
+/// from any task (including timer callbacks), but not from an ISR.
+///
+/// Each returns `false` if the message was dropped.
+
+// Publishes under '<topic>'
+bool libiot_mqtt_post(const char *topic, int qos, int retain, const char *msg);
+// Publishes under 'hoek/iot/<device_name>/<topic_suffix>'
+bool libiot_mqtt_post_local(const char *topic_suffix, int qos, int retain,
+                            const char *msg);
+bool libiot_mqtt_postv_local(const char *topic_suffix, int qos, int retain,
+                             const char *fmt, va_list va);
+bool libiot_mqtt_postf_local(const char *topic_suffix, int qos, int retain,
+                             const char *fmt, ...) __printflike(4, 5);
+
+typedef struct libiot_mqtt_post_stats {
+    uint32_t posted;
+    uint32_t sent;
+    // Messages which esp-mqtt failed to publish.
+    uint32_t failed;
+
+    uint32_t dropped_oldest;
+    uint32_t dropped_newest;
+    // Messages too large to fit in a record (see
+    // `LIBIOT_MQTT_POST_RECORD_SIZE`).
+    uint32_t dropped_oversize;
+
+    // The greatest number of records which have been queued at once.
+    uint32_t high_water;
+    uint32_t capacity;
+} libiot_mqtt_post_stats_t;
+
+void libiot_mqtt_post_get_stats(libiot_mqtt_post_stats_t *stats);
+
+/// MQTT Topic Handles
+/// A `libiot_topic_t` holds a fully built topic, so that publishing through it
+/// does not rebuild the topic every time. Its fields should be treated as
+/// private.
+
+typedef struct libiot_topic {
+    const char *str;
+    size_t len;
+} libiot_topic_t;
+
+// An initializer for a handle for the topic 'hoek/iot/<device_name>/<name>',
+// built entirely at compile time. The topic string is a literal, so it lives
+// forever, but the handle lives as long as the object it initializes, e.g.:
+//
+//   static const libiot_topic_t temp_topic =
+//       LIBIOT_TOPIC_INIT("mydevice", "temp");
+//
+// (Positional, so that it is valid C++ as well as C.)
+#define LIBIOT_TOPIC_INIT(device_name_literal, name_literal)          \
+    {                                                                 \
+        IOT_MQTT_DEVICE_TOPIC(device_name_literal, name_literal),     \
+            sizeof(IOT_MQTT_DEVICE_TOPIC(device_name_literal,         \
+                                         name_literal))               \
+                - 1,                                                  \
+    }
+
+// Returns the handle for '<topic>'. Handles are interned (so resolving a topic
+// twice yields the same handle), and are valid forever.
+const libiot_topic_t *libiot_mqtt_topic(const char *topic);
+// Returns the handle for 'hoek/iot/<device_name>/<topic_suffix>'.
+const libiot_topic_t *libiot_mqtt_topic_local(const char *topic_suffix);
+
+// As for `libiot_mqtt_publish()`.
+void libiot_mqtt_publish_topic(const libiot_topic_t *topic, int qos,
+                               int retain, const char *msg);
+void libiot_mqtt_publishv_topic(const libiot_topic_t *topic, int qos,
+                                int retain, const char *fmt, va_list va);
+void libiot_mqtt_publishf_topic(const libiot_topic_t *topic, int qos,
+                                int retain, const char *fmt, ...)
+    __printflike(4, 5);
+void libiot_mqtt_publishb_topic(const libiot_topic_t *topic, int qos,
+                                int retain, const void *data, size_t len);
+
+// As for `libiot_mqtt_enqueue()`.
+void libiot_mqtt_enqueue_topic(const libiot_topic_t *topic, int qos,
+                               int retain, const char *msg);
+void libiot_mqtt_enqueuev_topic(const libiot_topic_t *topic, int qos,
+                                int retain, const char *fmt, va_list va);
+void libiot_mqtt_enqueuef_topic(const libiot_topic_t *topic, int qos,
+                                int retain, const char *fmt, ...)
+    __printflike(4, 5);
+
+// As for `libiot_mqtt_post()`.
+bool libiot_mqtt_post_topic(const libiot_topic_t *topic, int qos, int retain,
+                            const char *msg);
+bool libiot_mqtt_postv_topic(const libiot_topic_t *topic, int qos, int retain,
+                             const char *fmt, va_list va);
+bool libiot_mqtt_postf_topic(const libiot_topic_t *topic, int qos, int retain,
+                             const char *fmt, ...) __printflike(4, 5);
+
+/// MQTT Series
+/// A series coalesces small samples (each a JSON value) destined for a single
+/// topic into one JSON array payload, `[<sample>,<sample>,...]`, which is sent
+/// with `libiot_mqtt_enqueue()` once the payload would exceed `max_bytes`, or
+/// `max_age_ms` after the first sample in the batch was appended. This saves
+/// the MQTT and TLS framing (and radio wake) of one packet per sample.
+///
+/// A series may be appended to from any task.
+
+typedef struct libiot_series libiot_series_t;
+
+// Returns NULL if out of memory. `max_bytes` bounds the payload, including
+// the enclosing "[]" and a null terminator.
+libiot_series_t *libiot_mqtt_series_create(const libiot_topic_t *topic,
+                                           int qos, size_t max_bytes,
+                                           uint32_t max_age_ms);
+// Batches under 'hoek/iot/<device_name>/<topic_suffix>'.
+libiot_series_t *libiot_mqtt_series_create_local(const char *topic_suffix,
+                                                 int qos, size_t max_bytes,
+                                                 uint32_t max_age_ms);
+
+void libiot_mqtt_series_append(libiot_series_t *series, const char *sample);
+void libiot_mqtt_series_appendv(libiot_series_t *series, const char *fmt,
+                                va_list va);
+void libiot_mqtt_series_appendf(libiot_series_t *series, const char *fmt, ...)
+    __printflike(2, 3);
+
+// Sends the current batch immediately (if it is non-empty).
+void libiot_mqtt_series_flush(libiot_series_t *series);
+
+typedef struct libiot_mqtt_series_stats {
+    uint32_t samples;
+    // Samples too large to fit in a payload by themselves, or in a batch
+    // which esp-mqtt could not enqueue.
+    uint32_t dropped;
+    uint32_t packets;
+
+    uint32_t sample_bytes;
+    uint32_t payload_bytes;
+    // An estimate of the bytes (of MQTT and TLS framing, net of the array
+    // syntax) saved compared to sending each sample in its own packet.
+    int32_t bytes_saved;
+} libiot_mqtt_series_stats_t;
+
+// The compression ratio achieved is `samples / packets`.
+void libiot_mqtt_series_get_stats(libiot_series_t *series,
+                                  libiot_mqtt_series_stats_t *stats);
+
+/// CBOR
+/// A minimal CBOR (RFC 8949) writer, for compact binary payloads. Nothing is
+/// allocated: items are written into the caller's buffer. If the buffer is
+/// NULL (or once it has overflowed) nothing more is written, but `len` still
+/// counts the bytes which would have been, so a first pass with a NULL buffer
+/// gives the exact size to allocate for a second.
+///
+/// Publish the result with `libiot_mqtt_publishb*()`.
+
+typedef struct libiot_cbor_writer {
+    uint8_t *buff;
+    size_t cap;
+    // The number of bytes written (or which would have been written).
+    size_t len;
+} libiot_cbor_writer_t;
+
+void libiot_cbor_init(libiot_cbor_writer_t *w, void *buff, size_t cap);
+// Whether everything written so far fitted in the buffer.
+bool libiot_cbor_ok(const libiot_cbor_writer_t *w);
+
+void libiot_cbor_uint(libiot_cbor_writer_t *w, uint64_t val);
+void libiot_cbor_int(libiot_cbor_writer_t *w, int64_t val);
+void libiot_cbor_bool(libiot_cbor_writer_t *w, bool val);
+void libiot_cbor_null(libiot_cbor_writer_t *w);
+void libiot_cbor_float(libiot_cbor_writer_t *w, float val);
+void libiot_cbor_double(libiot_cbor_writer_t *w, double val);
+void libiot_cbor_bytes(libiot_cbor_writer_t *w, const void *data, size_t len);
+// Writes null if `str` is NULL.
+void libiot_cbor_text(libiot_cbor_writer_t *w, const char *str);
+void libiot_cbor_textn(libiot_cbor_writer_t *w, const char *str, size_t len);
+// Appends `len` bytes of already encoded CBOR.
+void libiot_cbor_raw(libiot_cbor_writer_t *w, const void *data, size_t len);
+
+// Begins an array (map) of exactly `count` items (key/value pairs), which
+// must be written next.
+void libiot_cbor_array(libiot_cbor_writer_t *w, size_t count);
+void libiot_cbor_map(libiot_cbor_writer_t *w, size_t count);
+// Begins an array (map) of any number of items (key/value pairs), which must
+// be followed by `libiot_cbor_close()`.
+void libiot_cbor_array_open(libiot_cbor_writer_t *w);
+void libiot_cbor_map_open(libiot_cbor_writer_t *w);
+void libiot_cbor_close(libiot_cbor_writer_t *w);
+
+/// JSON Parsing
+/// A tokenizer for reading small JSON documents (e.g. the payloads of
+/// '_cmd/*' messages) without building a tree. Tokens refer to byte ranges of
+/// the buffer, so nothing is allocated, and the caller provides the token
+/// array (one token per value and per key).
+///
+/// Since `libiot_json_str()` decodes in place, a route should parse its own
+/// copy of `event->data` (which later routes, and `mqtt_cb`, are also given).
+///
+/// e.g.
+///     char *buff = strndup(event->data, event->data_len);
+///     libiot_json_tok_t toks[16];
+///     int n = libiot_json_tokenize(buff, strlen(buff), toks, 16);
+///     if (n >= 0) {  // The tokens are only valid if `n >= 0`.
+///         int url = libiot_json_get(buff, toks, 0, "url");
+///         if (url >= 0) {
+///             const char *str = libiot_json_str(buff, &toks[url]);
+///             ...
+///         }
+///     }
+///     free(buff);
+
+typedef enum libiot_json_type {
+    LIBIOT_JSON_OBJECT = 1,
+    LIBIOT_JSON_ARRAY,
+    LIBIOT_JSON_STRING,
+    // Numbers, `true`, `false` and `null`.
+    LIBIOT_JSON_PRIMITIVE,
+} libiot_json_type_t;
+
+typedef struct libiot_json_tok {
+    libiot_json_type_t type;
+    // The byte range of the value in the buffer. For strings this excludes
+    // the quotes.
+    uint32_t start;
+    uint32_t end;
+    // The number of members of an object, or elements of an array.
+    uint32_t size;
+    // The number of tokens making up the value, including this one, so that
+    // the next sibling is at `this + span`.
+    uint32_t span;
+    // Set once `libiot_json_str()` has decoded the string in place.
+    bool decoded;
+} libiot_json_tok_t;
+
+#define LIBIOT_JSON_ERR_NOMEM -1
+#define LIBIOT_JSON_ERR_INVAL -2
+// The document was cut short.
+#define LIBIOT_JSON_ERR_PART -3
+
+// Returns the number of tokens used, with the root value at index 0, or one
+// of the `LIBIOT_JSON_ERR_*` errors (`NOMEM` if `max_toks` are not enough).
+int libiot_json_tokenize(const char *buff, size_t len, libiot_json_tok_t *toks,
+                         size_t max_toks);
+
+// Returns the index of the value of the member `key` of the object at index
+// `obj`, or -1 if there is no such member (or `obj` is not an object). Keys
+// are compared without decoding escapes.
+int libiot_json_get(const char *buff, const libiot_json_tok_t *toks, int obj,
+                    const char *key);
+
+// Whether `tok` is a string equal to `str` (compared without decoding
+// escapes).
+bool libiot_json_eq(const char *buff, const libiot_json_tok_t *tok,
+                    const char *str);
+
+// Decodes the escapes in the string `tok` in place, and null terminates it
+// (over its closing quote), returning a pointer to it inside `buff`. Returns
+// NULL if `tok` is not a string.
+//
+// Note that this modifies `buff`, so it must not be used on a buffer which
+// others will read, such as `event->data`.
+char *libiot_json_str(char *buff, libiot_json_tok_t *tok);
+
+// Return false if `tok` is not of the requested type. (Only integers are
+// accepted by `libiot_json_int()`.)
+bool libiot_json_int(const char *buff, const libiot_json_tok_t *tok,
+                     int64_t *val);
+bool libiot_json_bool(const char *buff, const libiot_json_tok_t *tok,
+                      bool *val);
+
+/// Heap Monitor
+/// A background task samples the free bytes and largest free block of each
+/// heap capability every `heap_monitor_interval_ms`. Capabilities which have
+/// changed noticeably since they were last reported are published (with the
+/// change) to 'hoek/iot/<device_name>/_info/heap'. A summary of the history
+/// is published to '_info/heap_stats' in response to '_cmd/heap'.
+///
+/// Sampling never walks the heaps or checks their integrity; '_cmd/mem_check'
+/// does so on demand.
+
+typedef struct libiot_heap_cap_stats {
+    const char *name;
+
+    // As of the latest sample.
+    uint32_t free_bytes;
+    uint32_t largest_free_block;
+    // The share of the free bytes (in thousandths) not in the largest free
+    // block, i.e. which a single allocation cannot use.
+    uint16_t frag_permille;
+
+    // Over the samples in the history.
+    uint32_t free_min;
+    uint32_t free_max;
+    uint32_t largest_min;
+    uint32_t largest_max;
+    uint16_t frag_min;
+    uint16_t frag_max;
+
+    // Exponentially weighted moving averages over all samples.
+    uint32_t free_ewma;
+    uint32_t largest_ewma;
+    uint16_t frag_ewma;
+
+    // The low water mark since boot.
+    uint32_t minimum_free_bytes;
+} libiot_heap_cap_stats_t;
+
+// Fills in at most `*count` entries of `stats`, one for each heap capability
+// which is present, and sets `*count` to the number filled in.
+void libiot_heap_monitor_get_stats(libiot_heap_cap_stats_t *stats,
+                                   size_t *count);
+
+typedef struct libiot_format_stats {
+    // Messages formatted by the `*f_local()`/`*v_local()` functions and
+    // `libiot_logf_error()`.
+    uint32_t formatted;
+    // Messages which overflowed `LIBIOT_FORMAT_SCRATCH_SIZE`, and so required
+    // a heap allocation. This stays constant while steady-state publishing is
+    // allocation-free.
+    uint32_t heap_allocs;
+} libiot_format_stats_t;
+
+void libiot_format_get_stats(libiot_format_stats_t *stats);
+
 // Convenience method to obtain 'hoek/iot/<device_name>/<topic_suffix>'
 void libiot_mqtt_build_local_topic_from_suffix(char *buff, size_t buff_len,
                                                const char *topic_suffix);
@@ -0,0 +1,183 @@
+#include "bench.h"
+
+#ifdef LIBIOT_ENABLE_BENCH
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <libesp/json.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cbor_builder.h"
+#include "json_builder.h"
+#include "mqtt.h"
+#include "payload.h"
+
+// Each encoding is timed over this many runs.
+#define BENCH_ITERATIONS 5
+
+// The bench runs every builder (and a heap integrity check), so it gets a
+// task of its own rather than holding up the esp-mqtt task.
+#define BENCH_TASK_STACK_SIZE 6144
+#define BENCH_TASK_PRIORITY 2
+
+typedef struct bench_case {
+    const char *name;
+    char *(*build_json)();
+    char *(*build_cjson)();
+    void (*build_cbor)(libiot_cbor_writer_t *w);
+} bench_case_t;
+
+static const bench_case_t CASES[] = {
+    {
+        .name = "state_up",
+        .build_json = libiot_json_build_state_up,
+        .build_cjson = libiot_json_build_state_up_cjson,
+        .build_cbor = libiot_cbor_build_state_up,
+    },
+    {
+        .name = "startup",
+        .build_json = libiot_json_build_startup,
+        .build_cjson = libiot_json_build_startup_cjson,
+        .build_cbor = libiot_cbor_build_startup,
+    },
+    {
+        .name = "system_id",
+        .build_json = libiot_json_build_system_id,
+        .build_cjson = libiot_json_build_system_id_cjson,
+        .build_cbor = libiot_cbor_build_system_id,
+    },
+    {
+        .name = "mem_check",
+        .build_json = libiot_json_build_mem_check,
+        .build_cjson = libiot_json_build_mem_check_cjson,
+        .build_cbor = libiot_cbor_build_mem_check,
+    },
+};
+
+#define NUM_CASES (sizeof(CASES) / sizeof(CASES[0]))
+
+typedef struct bench_result {
+    size_t json_bytes;
+    size_t cbor_bytes;
+    uint32_t json_us;
+    uint32_t cjson_us;
+    uint32_t cbor_us;
+    uint32_t cjson_allocs;
+} bench_result_t;
+
+// The bench task, while it runs. Only its allocations are counted, so the
+// count is only ever touched by that task.
+static TaskHandle_t bench_task;
+static uint32_t cjson_alloc_count;
+
+// Installed once at init and never swapped, so every cJSON node is freed by
+// the allocator which allocated it (which is `malloc()` either way).
+static void *counting_malloc(size_t size) {
+    if (xTaskGetCurrentTaskHandle() == bench_task) {
+        cjson_alloc_count++;
+    }
+    return malloc(size);
+}
+
+static void counting_free(void *ptr) {
+    free(ptr);
+}
+
+static void run_case(const bench_case_t *c, bench_result_t *res) {
+    // Note that the direct path always makes exactly one allocation, for the
+    // output buffer.
+    cjson_alloc_count = 0;
+
+    int64_t start_us = esp_timer_get_time();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        free(c->build_cjson());
+    }
+    res->cjson_us = (esp_timer_get_time() - start_us) / BENCH_ITERATIONS;
+
+    res->cjson_allocs = cjson_alloc_count / BENCH_ITERATIONS;
+
+    start_us = esp_timer_get_time();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        char *msg = c->build_json();
+        res->json_bytes = msg ? strlen(msg) : 0;
+        free(msg);
+    }
+    res->json_us = (esp_timer_get_time() - start_us) / BENCH_ITERATIONS;
+
+    start_us = esp_timer_get_time();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        payload_t payload;
+        libiot_payload_encode_cbor(c->build_cbor, &payload);
+        res->cbor_bytes = payload.len;
+        libiot_payload_free(&payload);
+    }
+    res->cbor_us = (esp_timer_get_time() - start_us) / BENCH_ITERATIONS;
+}
+
+// Whether a bench task is running, in which case further requests are
+// ignored.
+static bool running;
+
+static void task_bench(void *unused) {
+    bench_task = xTaskGetCurrentTaskHandle();
+
+    // Note that the mem_check cases include a heap integrity check, which
+    // costs the same for both encodings.
+    char buff[192 * NUM_CASES];
+    size_t len = 0;
+
+    buff[len++] = '{';
+    for (int i = 0; i < NUM_CASES; i++) {
+        bench_result_t res;
+        run_case(&CASES[i], &res);
+
+        len += snprintf(buff + len, sizeof(buff) - len,
+                        "%s\"%s\":{\"json_bytes\":%u,\"cbor_bytes\":%u,"
+                        "\"json_us\":%u,\"cjson_us\":%u,\"cbor_us\":%u,"
+                        "\"cjson_allocs\":%u}",
+                        i ? "," : "", CASES[i].name, res.json_bytes,
+                        res.cbor_bytes, res.json_us, res.cjson_us, res.cbor_us,
+                        res.cjson_allocs);
+        assert(len + 2 <= sizeof(buff));
+    }
+    buff[len++] = '}';
+    buff[len] = '\0';
+
+    libiot_mqtt_publish_local(MQTT_TOPIC_INFO("bench"), 0, 0, buff);
+
+    bench_task = NULL;
+    __atomic_store_n(&running, false, __ATOMIC_RELEASE);
+    vTaskDelete(NULL);
+}
+
+static void route_bench(esp_mqtt_event_handle_t event, void *unused) {
+    ESP_LOGI(TAG, "mqtt: bench");
+
+    if (__atomic_exchange_n(&running, true, __ATOMIC_ACQ_REL)) {
+        ESP_LOGW(TAG, "bench: already running");
+        return;
+    }
+
+    if (xTaskCreate(task_bench, "libiot_bench", BENCH_TASK_STACK_SIZE, NULL,
+                    BENCH_TASK_PRIORITY, NULL)
+        != pdPASS) {
+        ESP_LOGE(TAG, "bench: can't start task");
+        __atomic_store_n(&running, false, __ATOMIC_RELEASE);
+    }
+}
+
+void libiot_init_bench() {
+    // Called before `app_init`, so before any other cJSON use we know of.
+    cJSON_Hooks hooks = {
+        .malloc_fn = counting_malloc,
+        .free_fn = counting_free,
+    };
+    cJSON_InitHooks(&hooks);
+
+    libiot_mqtt_route_local(MQTT_TOPIC_CMD("bench"), route_bench, NULL);
+}
+
+#endif
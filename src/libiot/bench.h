@@ -0,0 +1,14 @@
+#pragma once
+
+#include "private.h"
+
+// Only built with `LIBIOT_ENABLE_BENCH`.
+//
+// Registers the '_cmd/bench' route, which encodes each built-in payload as
+// both JSON and CBOR and publishes the sizes and encode times to
+// '_info/bench'.
+//
+// Also installs cJSON hooks (which wrap `malloc()`/`free()`) to count the
+// bench's own allocations. An app which installs its own hooks must do so
+// from `app_init` or later, which just leaves the count at zero.
+void libiot_init_bench();
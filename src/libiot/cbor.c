@@ -0,0 +1,163 @@
+#include <string.h>
+
+#include "private.h"
+
+#define MAJOR_UINT 0
+#define MAJOR_NINT 1
+#define MAJOR_BYTES 2
+#define MAJOR_TEXT 3
+#define MAJOR_ARRAY 4
+#define MAJOR_MAP 5
+#define MAJOR_SIMPLE 7
+
+#define SIMPLE_FALSE 20
+#define SIMPLE_TRUE 21
+#define SIMPLE_NULL 22
+#define SIMPLE_FLOAT32 26
+#define SIMPLE_FLOAT64 27
+
+// The additional information value indicating an indefinite length.
+#define INDEFINITE 31
+#define BREAK 0xFF
+
+static void put(libiot_cbor_writer_t *w, const void *data, size_t len) {
+    if (w->buff && w->len + len <= w->cap) {
+        memcpy(w->buff + w->len, data, len);
+    } else {
+        // Once anything has not fitted, nothing more is written (so that the
+        // buffer never holds a truncated value followed by a later one).
+        w->buff = NULL;
+    }
+    w->len += len;
+}
+
+static void put_byte(libiot_cbor_writer_t *w, uint8_t b) {
+    put(w, &b, 1);
+}
+
+// Writes the initial byte (and argument) of a data item, big-endian as CBOR
+// requires.
+static void put_head(libiot_cbor_writer_t *w, uint8_t major, uint64_t val) {
+    uint8_t head[9];
+    size_t len;
+
+    if (val < 24) {
+        head[0] = (major << 5) | val;
+        len = 1;
+    } else if (val <= UINT8_MAX) {
+        head[0] = (major << 5) | 24;
+        len = 2;
+    } else if (val <= UINT16_MAX) {
+        head[0] = (major << 5) | 25;
+        len = 3;
+    } else if (val <= UINT32_MAX) {
+        head[0] = (major << 5) | 26;
+        len = 5;
+    } else {
+        head[0] = (major << 5) | 27;
+        len = 9;
+    }
+
+    for (size_t i = len - 1; i > 0; i--) {
+        head[i] = val & 0xFF;
+        val >>= 8;
+    }
+
+    put(w, head, len);
+}
+
+void libiot_cbor_init(libiot_cbor_writer_t *w, void *buff, size_t cap) {
+    w->buff = buff;
+    w->cap = buff ? cap : 0;
+    w->len = 0;
+}
+
+bool libiot_cbor_ok(const libiot_cbor_writer_t *w) {
+    return w->buff && w->len <= w->cap;
+}
+
+void libiot_cbor_uint(libiot_cbor_writer_t *w, uint64_t val) {
+    put_head(w, MAJOR_UINT, val);
+}
+
+void libiot_cbor_int(libiot_cbor_writer_t *w, int64_t val) {
+    if (val >= 0) {
+        put_head(w, MAJOR_UINT, val);
+    } else {
+        // Encodes -1 - n.
+        put_head(w, MAJOR_NINT, -(val + 1));
+    }
+}
+
+void libiot_cbor_bool(libiot_cbor_writer_t *w, bool val) {
+    put_byte(w, (MAJOR_SIMPLE << 5) | (val ? SIMPLE_TRUE : SIMPLE_FALSE));
+}
+
+void libiot_cbor_null(libiot_cbor_writer_t *w) {
+    put_byte(w, (MAJOR_SIMPLE << 5) | SIMPLE_NULL);
+}
+
+void libiot_cbor_float(libiot_cbor_writer_t *w, float val) {
+    uint32_t bits;
+    memcpy(&bits, &val, sizeof(bits));
+
+    put_byte(w, (MAJOR_SIMPLE << 5) | SIMPLE_FLOAT32);
+    uint8_t be[4] = {bits >> 24, bits >> 16, bits >> 8, bits};
+    put(w, be, sizeof(be));
+}
+
+void libiot_cbor_double(libiot_cbor_writer_t *w, double val) {
+    uint64_t bits;
+    memcpy(&bits, &val, sizeof(bits));
+
+    put_byte(w, (MAJOR_SIMPLE << 5) | SIMPLE_FLOAT64);
+    uint8_t be[8];
+    for (int i = 7; i >= 0; i--) {
+        be[i] = bits & 0xFF;
+        bits >>= 8;
+    }
+    put(w, be, sizeof(be));
+}
+
+void libiot_cbor_bytes(libiot_cbor_writer_t *w, const void *data, size_t len) {
+    put_head(w, MAJOR_BYTES, len);
+    put(w, data, len);
+}
+
+void libiot_cbor_textn(libiot_cbor_writer_t *w, const char *str, size_t len) {
+    put_head(w, MAJOR_TEXT, len);
+    put(w, str, len);
+}
+
+void libiot_cbor_text(libiot_cbor_writer_t *w, const char *str) {
+    if (!str) {
+        libiot_cbor_null(w);
+        return;
+    }
+
+    libiot_cbor_textn(w, str, strlen(str));
+}
+
+void libiot_cbor_raw(libiot_cbor_writer_t *w, const void *data, size_t len) {
+    put(w, data, len);
+}
+
+void libiot_cbor_array(libiot_cbor_writer_t *w, size_t count) {
+    put_head(w, MAJOR_ARRAY, count);
+}
+
+void libiot_cbor_map(libiot_cbor_writer_t *w, size_t count) {
+    put_head(w, MAJOR_MAP, count);
+}
+
+void libiot_cbor_array_open(libiot_cbor_writer_t *w) {
+    put_byte(w, (MAJOR_ARRAY << 5) | INDEFINITE);
+}
+
+void libiot_cbor_map_open(libiot_cbor_writer_t *w) {
+    put_byte(w, (MAJOR_MAP << 5) | INDEFINITE);
+}
+
+void libiot_cbor_close(libiot_cbor_writer_t *w) {
+    put_byte(w, BREAK);
+}
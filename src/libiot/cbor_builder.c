@@ -0,0 +1,382 @@
+#include "cbor_builder.h"
+
+#include <esp_log.h>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <esp_wifi.h>
+#include <libesp.h>
+#include <string.h>
+
+#include "json_builder.h"
+#include "liveness.h"
+#include "reset_info.h"
+#include "system_id.h"
+#include "wifi.h"
+
+void libiot_cbor_build_state_up(libiot_cbor_writer_t *w) {
+    wifi_ap_record_t ap;
+    esp_wifi_sta_get_ap_info(&ap);
+
+    wifi_ps_type_t ps_type;
+    esp_wifi_get_ps(&ps_type);
+
+    liveness_state_t liveness;
+    libiot_liveness_get_state(&liveness);
+
+    libiot_cbor_map(w, 5);
+    libiot_cbor_text(w, "state");
+    libiot_cbor_text(w, "up");
+    libiot_cbor_text(w, "instance_uuid");
+    libiot_cbor_text(w, libiot_get_instance_uuid());
+    libiot_cbor_text(w, "uptime_us");
+    libiot_cbor_int(w, esp_timer_get_time());
+
+    libiot_cbor_text(w, "wifi");
+    libiot_cbor_map(w, 2);
+    libiot_cbor_text(w, "rssi");
+    libiot_cbor_int(w, ap.rssi);
+    libiot_cbor_text(w, "ps_type");
+    libiot_cbor_text(w, libiot_describe_ps_type(ps_type));
+
+    libiot_cbor_text(w, "liveness");
+    libiot_cbor_map(w, 3);
+    libiot_cbor_text(w, "keepalive_s");
+    libiot_cbor_uint(w, liveness.keepalive_s);
+    libiot_cbor_text(w, "pings_suppressed");
+    libiot_cbor_bool(w, liveness.pings_suppressed);
+    libiot_cbor_text(w, "wakes_per_min");
+    libiot_cbor_uint(w, liveness.wakes_per_min);
+}
+
+void libiot_cbor_build_state_down(libiot_cbor_writer_t *w) {
+    libiot_cbor_map(w, 2);
+    libiot_cbor_text(w, "state");
+    libiot_cbor_text(w, "down");
+    libiot_cbor_text(w, "instance_uuid");
+    libiot_cbor_text(w, libiot_get_instance_uuid());
+}
+
+void libiot_cbor_build_startup(libiot_cbor_writer_t *w) {
+    reset_info_t *reset_info = libiot_reset_info_get();
+
+    wifi_timing_t wifi;
+    libiot_wifi_get_timing(&wifi);
+
+    libiot_cbor_map(w, 5);
+    libiot_cbor_text(w, "start_epoch_time_ms");
+    libiot_cbor_uint(w, libiot_get_start_epoch_time_ms());
+    libiot_cbor_text(w, "reason");
+    libiot_cbor_text(w, reset_info->reason);
+    libiot_cbor_text(w, "code");
+    libiot_cbor_int(w, reset_info->raw);
+    libiot_cbor_text(w, "exceptional");
+    libiot_cbor_bool(w, reset_info->exceptional);
+
+    libiot_cbor_text(w, "wifi");
+    libiot_cbor_map(w, 7);
+    libiot_cbor_text(w, "fast");
+    libiot_cbor_bool(w, wifi.fast);
+    libiot_cbor_text(w, "lease_reused");
+    libiot_cbor_bool(w, wifi.lease_reused);
+    libiot_cbor_text(w, "scan_ms");
+    libiot_cbor_uint(w, wifi.scan_ms);
+    libiot_cbor_text(w, "connect_ms");
+    libiot_cbor_uint(w, wifi.connect_ms);
+    libiot_cbor_text(w, "dhcp_ms");
+    libiot_cbor_uint(w, wifi.dhcp_ms);
+    libiot_cbor_text(w, "total_ms");
+    libiot_cbor_uint(w, wifi.total_ms);
+    libiot_cbor_text(w, "attempts");
+    libiot_cbor_uint(w, wifi.attempts);
+}
+
+void libiot_cbor_build_mem_check(libiot_cbor_writer_t *w) {
+    bool heap_integrity_sound = heap_caps_check_integrity_all(true);
+    if (heap_integrity_sound) {
+        ESP_LOGI(TAG, "heap integrity sound");
+    } else {
+        ESP_LOGE(TAG, "heap integrity unsound!");
+    }
+
+    // As for the JSON, obtain all of the allocation information first.
+    multi_heap_info_t heap_info[LIBIOT_HEAP_CAPS_COUNT];
+    for (size_t i = 0; i < LIBIOT_HEAP_CAPS_COUNT; i++) {
+        heap_caps_get_info(&heap_info[i], LIBIOT_HEAP_CAPS[i].code);
+    }
+
+    libiot_cbor_map(w, 2);
+    libiot_cbor_text(w, "heap_integrity_sound");
+    libiot_cbor_bool(w, heap_integrity_sound);
+
+    libiot_cbor_text(w, "heap_capabilities");
+    libiot_cbor_array(w, LIBIOT_HEAP_CAPS_COUNT);
+    for (size_t i = 0; i < LIBIOT_HEAP_CAPS_COUNT; i++) {
+        const multi_heap_info_t *info = &heap_info[i];
+
+        libiot_cbor_map(w, 8);
+        libiot_cbor_text(w, "name");
+        libiot_cbor_text(w, LIBIOT_HEAP_CAPS[i].name);
+        libiot_cbor_text(w, "total_free_bytes");
+        libiot_cbor_uint(w, info->total_free_bytes);
+        libiot_cbor_text(w, "total_allocated_bytes");
+        libiot_cbor_uint(w, info->total_allocated_bytes);
+        libiot_cbor_text(w, "largest_free_block");
+        libiot_cbor_uint(w, info->largest_free_block);
+        libiot_cbor_text(w, "minimum_free_bytes");
+        libiot_cbor_uint(w, info->minimum_free_bytes);
+        libiot_cbor_text(w, "allocated_blocks");
+        libiot_cbor_uint(w, info->allocated_blocks);
+        libiot_cbor_text(w, "free_blocks");
+        libiot_cbor_uint(w, info->free_blocks);
+        libiot_cbor_text(w, "total_blocks");
+        libiot_cbor_uint(w, info->total_blocks);
+    }
+}
+
+static void add_part_type(libiot_cbor_writer_t *w, esp_partition_type_t type,
+                          esp_partition_subtype_t subtype) {
+    const char *type_name;
+    const char *subtype_name;
+    int ota_id =
+        libiot_describe_part_type(type, subtype, &type_name, &subtype_name);
+
+    libiot_cbor_map(w, 2);
+    libiot_cbor_text(w, "subtype");
+    libiot_cbor_map(w, ota_id >= 0 ? 2 : 1);
+    if (ota_id >= 0) {
+        libiot_cbor_text(w, "id");
+        libiot_cbor_uint(w, ota_id);
+    }
+    libiot_cbor_text(w, "name");
+    libiot_cbor_text(w, subtype_name);
+    libiot_cbor_text(w, "name");
+    libiot_cbor_text(w, type_name);
+}
+
+static void add_partitions(libiot_cbor_writer_t *w) {
+    const esp_partition_t *const *parts;
+    size_t count = libiot_system_id_get_partitions(&parts);
+
+    libiot_cbor_array(w, count);
+    for (size_t i = 0; i < count; i++) {
+        const esp_partition_t *part = parts[i];
+
+        libiot_cbor_map(w, 7);
+        libiot_cbor_text(w, "flash_chip_id");
+        libiot_cbor_uint(w, part->flash_chip->chip_id);
+        libiot_cbor_text(w, "type");
+        add_part_type(w, part->type, part->subtype);
+        libiot_cbor_text(w, "address");
+        libiot_cbor_uint(w, part->address);
+        libiot_cbor_text(w, "size");
+        libiot_cbor_uint(w, part->size);
+        libiot_cbor_text(w, "label");
+        libiot_cbor_text(w, part->label);
+        libiot_cbor_text(w, "encrypted");
+        libiot_cbor_bool(w, part->encrypted);
+        libiot_cbor_text(w, "ota_state");
+        libiot_cbor_text(w, libiot_system_id_get_ota_state(part));
+    }
+}
+
+static void add_partition_address(libiot_cbor_writer_t *w, const char *name,
+                                  const esp_partition_t *part) {
+    libiot_cbor_text(w, name);
+    if (part) {
+        libiot_cbor_uint(w, part->address);
+    } else {
+        libiot_cbor_null(w);
+    }
+}
+
+static void system_id_write_partitions(libiot_cbor_writer_t *w,
+                                      const system_id_volatile_t *v) {
+    libiot_cbor_map(w, 6);
+    libiot_cbor_text(w, "is_rollback_possible");
+    libiot_cbor_bool(w, v->is_rollback_possible);
+    add_partition_address(w, "boot", v->boot);
+    add_partition_address(w, "running", v->running);
+    add_partition_address(w, "last_invalid", v->last_invalid);
+    add_partition_address(w, "next_update", v->next_update);
+    libiot_cbor_text(w, "list");
+    add_partitions(w);
+}
+
+// As for the JSON builder, records where the (volatile) "partitions" map was
+// written.
+typedef struct system_id_splice {
+    system_id_volatile_t v;
+    size_t partitions_start;
+    size_t partitions_end;
+} system_id_splice_t;
+
+static void system_id_write(libiot_cbor_writer_t *w,
+                            system_id_splice_t *splice) {
+    esp_chip_info_t chip_info;
+    esp_chip_info(&chip_info);
+
+    const esp_app_desc_t *app_desc = esp_ota_get_app_description();
+
+    uint8_t mac_default[6];
+    memset(mac_default, 0, sizeof(mac_default));
+    // Even if this fails, we use the value of the zero-memset'ed arrays.
+    esp_err_t err_mac_default = esp_efuse_mac_get_default(mac_default);
+
+#ifdef REPORT_MAC_CUSTOM_BLK3
+    uint8_t mac_custom[6];
+    memset(mac_custom, 0, sizeof(mac_custom));
+    // Even if this fails, we use the value of the zero-memset'ed arrays.
+    esp_err_t err_mac_custom = esp_efuse_mac_get_custom(mac_custom);
+#endif
+
+    libiot_cbor_map(w, 3);
+
+    libiot_cbor_text(w, "software");
+    libiot_cbor_map(w, 3);
+    {
+        libiot_cbor_text(w, "app_desc");
+        libiot_cbor_map(w, 8);
+        libiot_cbor_text(w, "magic_word");
+        libiot_cbor_uint(w, app_desc->magic_word);
+        libiot_cbor_text(w, "secure_version");
+        libiot_cbor_uint(w, app_desc->secure_version);
+        libiot_cbor_text(w, "version");
+        libiot_cbor_text(w, app_desc->version);
+        libiot_cbor_text(w, "project_name");
+        libiot_cbor_text(w, app_desc->project_name);
+        libiot_cbor_text(w, "time");
+        libiot_cbor_text(w, app_desc->time);
+        libiot_cbor_text(w, "date");
+        libiot_cbor_text(w, app_desc->date);
+        libiot_cbor_text(w, "idf_ver");
+        libiot_cbor_text(w, app_desc->idf_ver);
+        libiot_cbor_text(w, "app_elf_sha256");
+        libiot_cbor_bytes(w, app_desc->app_elf_sha256,
+                          sizeof(app_desc->app_elf_sha256));
+
+        libiot_cbor_text(w, "partitions");
+        splice->partitions_start = w->len;
+        system_id_write_partitions(w, &splice->v);
+        splice->partitions_end = w->len;
+
+        libiot_cbor_text(w, "idf_version");
+        libiot_cbor_map(w, 4);
+        libiot_cbor_text(w, "major");
+        libiot_cbor_uint(w, ESP_IDF_VERSION_MAJOR);
+        libiot_cbor_text(w, "minor");
+        libiot_cbor_uint(w, ESP_IDF_VERSION_MINOR);
+        libiot_cbor_text(w, "patch");
+        libiot_cbor_uint(w, ESP_IDF_VERSION_PATCH);
+        libiot_cbor_text(w, "blob");
+        libiot_cbor_text(w, IDF_VER);
+    }
+
+    libiot_cbor_text(w, "efuse");
+#ifdef REPORT_MAC_CUSTOM_BLK3
+    libiot_cbor_map(w, 3);
+#else
+    libiot_cbor_map(w, 2);
+#endif
+    {
+        libiot_cbor_text(w, "err");
+#ifdef REPORT_MAC_CUSTOM_BLK3
+        libiot_cbor_map(w, 2);
+#else
+        libiot_cbor_map(w, 1);
+#endif
+        libiot_cbor_text(w, "mac_default");
+        libiot_cbor_int(w, err_mac_default);
+#ifdef REPORT_MAC_CUSTOM_BLK3
+        libiot_cbor_text(w, "mac_custom");
+        libiot_cbor_int(w, err_mac_custom);
+#endif
+
+        libiot_cbor_text(w, "mac_default");
+        libiot_cbor_bytes(w, mac_default, sizeof(mac_default));
+#ifdef REPORT_MAC_CUSTOM_BLK3
+        libiot_cbor_text(w, "mac_custom");
+        libiot_cbor_bytes(w, mac_custom, sizeof(mac_custom));
+#endif
+    }
+
+    libiot_cbor_text(w, "chip");
+    libiot_cbor_map(w, 4);
+    {
+        libiot_cbor_text(w, "model");
+        libiot_cbor_text(w, libiot_describe_chip_model(chip_info.model));
+        libiot_cbor_text(w, "cores");
+        libiot_cbor_uint(w, chip_info.cores);
+        libiot_cbor_text(w, "revision");
+        libiot_cbor_uint(w, chip_info.revision);
+
+        libiot_cbor_text(w, "features");
+        libiot_cbor_array_open(w);
+        if (chip_info.features & CHIP_FEATURE_EMB_FLASH) {
+            libiot_cbor_text(w, "EMB_FLASH");
+        }
+        if (chip_info.features & CHIP_FEATURE_WIFI_BGN) {
+            libiot_cbor_text(w, "WIFI_BGN");
+        }
+        if (chip_info.features & CHIP_FEATURE_BLE) {
+            libiot_cbor_text(w, "BLE");
+        }
+        if (chip_info.features & CHIP_FEATURE_BT) {
+            libiot_cbor_text(w, "BT");
+        }
+        libiot_cbor_close(w);
+    }
+}
+
+static uint8_t *system_id_blob;
+static size_t system_id_head_len;
+static size_t system_id_tail_len;
+
+void libiot_cbor_cache_system_id() {
+    system_id_splice_t splice;
+    libiot_system_id_get_volatile(&splice.v);
+
+    libiot_cbor_writer_t w;
+    libiot_cbor_init(&w, NULL, 0);
+    system_id_write(&w, &splice);
+
+    uint8_t *buff;
+    while (true) {
+        size_t size = w.len;
+        buff = malloc(size ? size : 1);
+        assert(buff);
+
+        libiot_cbor_init(&w, buff, size);
+        system_id_write(&w, &splice);
+        if (libiot_cbor_ok(&w)) {
+            break;
+        }
+
+        // An OTA state changed in between.
+        free(buff);
+    }
+
+    // Drop the partitions map we just wrote.
+    size_t tail_len = w.len - splice.partitions_end;
+    memmove(buff + splice.partitions_start, buff + splice.partitions_end,
+            tail_len);
+
+    size_t blob_len = splice.partitions_start + tail_len;
+    uint8_t *shrunk = realloc(buff, blob_len ? blob_len : 1);
+    system_id_blob = shrunk ? shrunk : buff;
+    system_id_head_len = splice.partitions_start;
+    system_id_tail_len = tail_len;
+}
+
+void libiot_cbor_build_system_id(libiot_cbor_writer_t *w) {
+    assert(system_id_blob);
+
+    system_id_volatile_t v;
+    libiot_system_id_get_volatile(&v);
+
+    libiot_cbor_raw(w, system_id_blob, system_id_head_len);
+    system_id_write_partitions(w, &v);
+    libiot_cbor_raw(w, system_id_blob + system_id_head_len,
+                    system_id_tail_len);
+}
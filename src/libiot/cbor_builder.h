@@ -0,0 +1,20 @@
+#pragma once
+
+#include "private.h"
+
+// CBOR equivalents of the `libiot_json_build_*()` functions, with the same
+// structure (except that byte arrays, e.g. hashes and MAC addresses, are CBOR
+// byte strings).
+
+void libiot_cbor_build_state_up(libiot_cbor_writer_t *w);
+
+void libiot_cbor_build_state_down(libiot_cbor_writer_t *w);
+
+void libiot_cbor_build_startup(libiot_cbor_writer_t *w);
+
+void libiot_cbor_build_mem_check(libiot_cbor_writer_t *w);
+
+void libiot_cbor_build_system_id(libiot_cbor_writer_t *w);
+
+// As for `libiot_json_cache_system_id()`.
+void libiot_cbor_cache_system_id();
@@ -0,0 +1,139 @@
+#include "connect_seq.h"
+
+#include <esp_log.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <libesp.h>
+
+#include "mqtt.h"
+#include "outbox.h"
+#include "subscriptions.h"
+
+#define CONNECT_SEQ_TASK_STACK_SIZE 4096
+#define CONNECT_SEQ_TASK_PRIORITY 5
+
+#define DEFAULT_WINDOW_MS 2000
+
+typedef bool (*step_fn_t)();
+
+typedef struct step {
+    const char *name;
+    step_fn_t fn;
+} step_t;
+
+static bool step_startup();
+static bool step_outbox();
+
+// Performed in order. The first step is performed at a random offset within
+// the first half of the window, and the rest are evenly spaced after it.
+static const step_t STEPS[] = {
+    {.name = "status", .fn = libiot_mqtt_connect_send_status},
+    {.name = "info", .fn = libiot_mqtt_connect_send_info},
+    {.name = "startup", .fn = step_startup},
+    {.name = "outbox", .fn = step_outbox},
+};
+
+#define NUM_STEPS (sizeof(STEPS) / sizeof(STEPS[0]))
+
+static TaskHandle_t task;
+static uint32_t window_ms;
+
+// The startup message is only sent once per boot, but we keep trying on each
+// connect until it has been.
+static bool startup_sent;
+
+static bool step_startup() {
+    if (!startup_sent) {
+        startup_sent = libiot_mqtt_connect_send_startup();
+    }
+    return startup_sent;
+}
+
+static bool step_outbox() {
+    // Replay anything we stored while we were disconnected.
+    libiot_outbox_replay();
+    return true;
+}
+
+// Waits until `ticks` after `start`. Returns false if we were notified of
+// another connect in the meantime.
+static bool wait_until(TickType_t start, TickType_t ticks) {
+    TickType_t elapsed = xTaskGetTickCount() - start;
+    if (elapsed >= ticks) {
+        return true;
+    }
+
+    return !ulTaskNotifyTake(pdTRUE, ticks - elapsed);
+}
+
+// Returns false if the sequence should be started again.
+static bool run_sequence() {
+    int64_t start_us = esp_timer_get_time();
+
+    // Subscribe straight away, so that commands are received even if the
+    // broker is still busy with everyone else.
+    if (!libiot_subscriptions_renew()) {
+        ESP_LOGW(TAG, "mqtt connect: subscribe failed");
+        return true;
+    }
+
+    uint32_t half_window_ms = window_ms / 2;
+    uint32_t jitter_ms = half_window_ms ? esp_random() % half_window_ms : 0;
+    uint32_t spacing_ms = half_window_ms / NUM_STEPS;
+
+    TickType_t start = xTaskGetTickCount();
+    for (int i = 0; i < NUM_STEPS; i++) {
+        if (!wait_until(start, (jitter_ms + i * spacing_ms)
+                                   / portTICK_PERIOD_MS)) {
+            return false;
+        }
+
+        if (!libiot_mqtt_wait_connected(0)) {
+            ESP_LOGW(TAG, "mqtt connect: disconnected before '%s'",
+                     STEPS[i].name);
+            return true;
+        }
+
+        if (!STEPS[i].fn()) {
+            ESP_LOGW(TAG, "mqtt connect: '%s' failed", STEPS[i].name);
+            return true;
+        }
+    }
+
+    ESP_LOGI(TAG, "mqtt connect: up status published (%lldms, jitter %ums)",
+             (esp_timer_get_time() - start_us) / 1000, jitter_ms);
+    return true;
+}
+
+static void task_connect_seq(void *unused) {
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        while (!run_sequence())
+            ;
+
+        ESP_ERROR_CHECK(util_stack_overflow_check());
+    }
+
+    vTaskDelete(NULL);
+}
+
+void libiot_start_connect_seq(int new_window_ms) {
+    window_ms = new_window_ms > 0 ? new_window_ms : DEFAULT_WINDOW_MS;
+
+    if (xTaskCreate(task_connect_seq, "mqtt_connect",
+                    CONNECT_SEQ_TASK_STACK_SIZE, NULL,
+                    CONNECT_SEQ_TASK_PRIORITY, &task)
+        != pdPASS) {
+        ESP_LOGE(TAG, "mqtt connect: failed to start task");
+        task = NULL;
+    }
+}
+
+void libiot_connect_seq_notify() {
+    if (task) {
+        xTaskNotifyGive(task);
+    }
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "private.h"
+
+// Starts the task which performs the connect sequence (subscribing, and
+// publishing the status, info and startup messages) whenever MQTT connects.
+// Must be called before `libiot_start_mqtt()`.
+//
+// The publishes are spread over a randomly offset window of `window_ms`, so
+// that a fleet of nodes reconnecting at once (e.g. after a broker restart)
+// does not all publish at once. If `window_ms` is not positive then a default
+// is used.
+void libiot_start_connect_seq(int window_ms);
+
+// Called from the esp-mqtt event task on `MQTT_EVENT_CONNECTED`. Any sequence
+// which is still in progress is abandoned and started again.
+void libiot_connect_seq_notify();
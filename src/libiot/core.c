@@ -6,14 +6,26 @@
 #include <libesp.h>
 #include <nvs_flash.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/cdefs.h>
 
+#include "connect_seq.h"
+#include "format.h"
 #include "gpio.h"
+#include "heap_monitor.h"
 #include "libiot.h"
+#include "liveness.h"
 #include "mqtt.h"
 #include "ota.h"
+#include "ota_health.h"
+#include "outbox.h"
+#include "payload.h"
+#include "post_queue.h"
 #include "reset_info.h"
+#include "series.h"
 #include "sntp.h"
+#include "system_id.h"
 #include "wifi.h"
 
 static char *instance_uuid = NULL;
@@ -88,14 +100,28 @@ static void run_app(const node_config_t *cfg) {
     ESP_ERROR_CHECK(init_spiffs());
 #endif
 
+#ifndef LIBIOT_DISABLE_WIFI
+    libiot_init_outbox(cfg->outbox_replay_rate);
+#endif
+
 #ifndef LIBIOT_DISABLE_OTA
-    ESP_ERROR_CHECK(libiot_init_ota());
+    ESP_ERROR_CHECK(libiot_init_ota(cfg->ota_signing_key));
+    libiot_init_ota_health(cfg->ota_health_window_ms,
+                           cfg->ota_health_min_free_heap,
+                           cfg->ota_manual_validation);
 #endif
 
     // Called even if wifi/mqtt will not be started in order to initialize
     // logging structures before calls to access them may be made during
     // `cfg->app_init`.
+    libiot_init_payload(cfg->payload_format);
+    libiot_init_system_id();
     libiot_init_mqtt(cfg->name);
+    libiot_init_post_queue(cfg->mqtt_post_policy, cfg->mqtt_post_timeout_ms);
+    libiot_init_series();
+    libiot_init_liveness(cfg->liveness_mode, cfg->liveness_down_detect_ms,
+                         cfg->liveness_max_idle_wakes_per_min);
+    libiot_init_heap_monitor(cfg->heap_monitor_interval_ms);
 
     if (cfg->app_init) {
         cfg->app_init();
@@ -104,7 +130,8 @@ static void run_app(const node_config_t *cfg) {
 #ifndef LIBIOT_DISABLE_WIFI
     ESP_LOGI(TAG, "init wifi/mqtt");
     if (cfg->ssid) {
-        libiot_start_wifi(cfg->ssid, cfg->pass, cfg->name, cfg->ps_type);
+        libiot_start_wifi(cfg->ssid, cfg->pass, cfg->name, cfg->ps_type,
+                          cfg->static_ip);
 
         libiot_init_sntp();
         // This function blocks until the network time has been synced for the
@@ -115,6 +142,7 @@ static void run_app(const node_config_t *cfg) {
 
         // Note that if `cfg->mqtt_task_stack_size == 0` then a default is used.
         if (cfg->uri) {
+            libiot_start_connect_seq(cfg->mqtt_connect_window_ms);
             libiot_start_mqtt(cfg->uri, cfg->cert, cfg->key, cfg->name,
                               cfg->mqtt_pass, cfg->mqtt_task_stack_size,
                               cfg->mqtt_cb);
@@ -149,18 +177,45 @@ void libiot_startup(const node_config_t *cfg) {
                 (void *) cfg, STARTUP_TASK_PRIORITY, NULL);
 }
 
+// Error messages are formatted once, since this is called from small stacks
+// (event handlers, the OTA task).
 void libiot_logf_error(const char *tag, const char *format, ...) {
-    va_list va;
-    va_start(va, format);
+    char buff[LIBIOT_FORMAT_SCRATCH_SIZE];
 
-    char *msg;
-    assert(vasprintf(&msg, format, va) >= 0);
+    // The published message is prefixed with the tag, which we skip for the
+    // log (which shows it anyway).
+    int prefix_len = snprintf(buff, sizeof(buff), "%s: ", tag);
+    if (prefix_len < 0 || prefix_len >= sizeof(buff)) {
+        prefix_len = 0;
+    }
 
+    char *scratch = buff + prefix_len;
+    va_list va;
+    va_start(va, format);
+    char *msg =
+        libiot_vformat(scratch, sizeof(buff) - prefix_len, format, va);
     va_end(va);
+    if (!msg) {
+        ESP_LOGE(tag, "(can't format error: %s)", format);
+        return;
+    }
 
     ESP_LOGE(tag, "%s", msg);
-    libiot_mqtt_publishf_local(MQTT_TOPIC_INFO("error"), 2, 0, "%s: %s", tag,
-                               msg);
 
-    free(msg);
+    if (msg == scratch) {
+        libiot_mqtt_publish_local(MQTT_TOPIC_INFO("error"), 2, 0, buff);
+        return;
+    }
+
+    // The message overflowed onto the heap, without the prefix, so we grow
+    // it to fit the prefix too.
+    size_t msg_len = strlen(msg);
+    char *full = realloc(msg, prefix_len + msg_len + 1);
+    if (full) {
+        memmove(full + prefix_len, full, msg_len + 1);
+        memcpy(full, buff, prefix_len);
+        msg = full;
+    }
+    libiot_mqtt_publish_local(MQTT_TOPIC_INFO("error"), 2, 0, msg);
+    libiot_format_release(scratch, msg);
 }
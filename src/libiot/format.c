@@ -0,0 +1,47 @@
+#include "format.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static libiot_format_stats_t stats;
+
+char *libiot_vformat(char *buff, size_t buff_len, const char *fmt,
+                     va_list va) {
+    __atomic_fetch_add(&stats.formatted, 1, __ATOMIC_RELAXED);
+
+    va_list va_retry;
+    va_copy(va_retry, va);
+
+    int len = vsnprintf(buff, buff_len, fmt, va);
+    if (len < 0) {
+        va_end(va_retry);
+        return NULL;
+    }
+
+    if (len < buff_len) {
+        va_end(va_retry);
+        return buff;
+    }
+
+    // The message overflowed the scratch buffer, so fall back to the heap.
+    __atomic_fetch_add(&stats.heap_allocs, 1, __ATOMIC_RELAXED);
+
+    char *msg = malloc(len + 1);
+    if (msg) {
+        vsnprintf(msg, len + 1, fmt, va_retry);
+    }
+
+    va_end(va_retry);
+    return msg;
+}
+
+void libiot_format_release(const char *buff, char *msg) {
+    if (msg != buff) {
+        free(msg);
+    }
+}
+
+void libiot_format_get_stats(libiot_format_stats_t *out) {
+    out->formatted = __atomic_load_n(&stats.formatted, __ATOMIC_RELAXED);
+    out->heap_allocs = __atomic_load_n(&stats.heap_allocs, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdarg.h>
+
+#include "private.h"
+
+#ifndef LIBIOT_FORMAT_SCRATCH_SIZE
+#define LIBIOT_FORMAT_SCRATCH_SIZE 256
+#endif
+
+// Formats into the caller-supplied scratch buffer `buff` if the result fits,
+// and into a heap allocation only if it does not. Returns NULL on failure.
+//
+// The result must be released with `libiot_format_release()`.
+char *libiot_vformat(char *buff, size_t buff_len, const char *fmt,
+                     va_list va);
+void libiot_format_release(const char *buff, char *msg);
@@ -0,0 +1,389 @@
+#include "heap_monitor.h"
+
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <libesp.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "json_builder.h"
+#include "json_writer.h"
+#include "mqtt.h"
+
+#ifndef LIBIOT_HEAP_MONITOR_HISTORY
+#define LIBIOT_HEAP_MONITOR_HISTORY 16
+#endif
+
+#define HEAP_MONITOR_TASK_STACK_SIZE 3072
+#define HEAP_MONITOR_TASK_PRIORITY 2
+
+#define DEFAULT_INTERVAL_MS 10000
+
+// A capability is included in a delta message once any of these have moved
+// this far from the values last published.
+#define DELTA_MIN_BYTES 1024
+#define DELTA_MIN_FRAG_PERMILLE 20
+
+// The weight of each new sample in the moving averages is 1/2^EWMA_SHIFT.
+#define EWMA_SHIFT 3
+
+// A delta message is at most this header plus an entry for every capability.
+// (Both allow for every number having its maximum number of digits, and
+// entries for capability names of up to 16 characters.)
+#define DELTA_HEADER_SIZE 48
+#define DELTA_CAP_SIZE 128
+
+#define STATS_MSG_SIZE 1536
+
+typedef struct heap_sample {
+    uint32_t free_bytes;
+    uint32_t largest_free_block;
+    uint16_t frag_permille;
+} heap_sample_t;
+
+typedef struct heap_cap_state {
+    // Whether any heap has this capability at all. (If not, it is never
+    // sampled or reported.)
+    bool present;
+
+    heap_sample_t published;
+
+    // Scaled up by 2^EWMA_SHIFT to keep the fractional part.
+    uint32_t free_ewma;
+    uint32_t largest_ewma;
+    uint32_t frag_ewma;
+} heap_cap_state_t;
+
+static StaticSemaphore_t mutex_static;
+static SemaphoreHandle_t mutex;
+
+static uint32_t interval_ms;
+static const libiot_topic_t *topic_heap;
+static const libiot_topic_t *topic_heap_stats;
+
+static heap_cap_state_t *caps;
+// `LIBIOT_HEAP_MONITOR_HISTORY` rows of `LIBIOT_HEAP_CAPS_COUNT` samples.
+static heap_sample_t *history;
+static size_t history_next;
+static size_t history_count;
+
+static void lock() {
+    while (xSemaphoreTake(mutex, portMAX_DELAY) == pdFALSE)
+        ;
+}
+
+static void unlock() {
+    xSemaphoreGive(mutex);
+}
+
+static uint16_t frag_permille(uint32_t free_bytes, uint32_t largest) {
+    if (!free_bytes || largest >= free_bytes) {
+        return 0;
+    }
+    return 1000 - (uint16_t) (((uint64_t) largest * 1000) / free_bytes);
+}
+
+static void ewma_update(uint32_t *ewma, uint32_t val, bool first) {
+    uint32_t scaled = val << EWMA_SHIFT;
+    if (first) {
+        *ewma = scaled;
+    } else {
+        *ewma = *ewma - (*ewma >> EWMA_SHIFT) + val;
+    }
+}
+
+static uint32_t abs_diff(uint32_t a, uint32_t b) {
+    return a > b ? a - b : b - a;
+}
+
+static bool changed(const heap_sample_t *a, const heap_sample_t *b) {
+    return abs_diff(a->free_bytes, b->free_bytes) >= DELTA_MIN_BYTES
+           || abs_diff(a->largest_free_block, b->largest_free_block)
+                  >= DELTA_MIN_BYTES
+           || abs_diff(a->frag_permille, b->frag_permille)
+                  >= DELTA_MIN_FRAG_PERMILLE;
+}
+
+// Note that while the free size is a cheap per-heap counter,
+// `heap_caps_get_largest_free_block()` walks the free list of each heap (with
+// the heap locked) on IDF v4, which is why we only sample every
+// `interval_ms`. We never check the integrity of the heap (which
+// `_cmd/mem_check` does on demand).
+static void take_sample(heap_sample_t *row) {
+    for (size_t i = 0; i < LIBIOT_HEAP_CAPS_COUNT; i++) {
+        if (!caps[i].present) {
+            memset(&row[i], 0, sizeof(row[i]));
+            continue;
+        }
+
+        row[i].free_bytes = heap_caps_get_free_size(LIBIOT_HEAP_CAPS[i].code);
+        row[i].largest_free_block =
+            heap_caps_get_largest_free_block(LIBIOT_HEAP_CAPS[i].code);
+        row[i].frag_permille =
+            frag_permille(row[i].free_bytes, row[i].largest_free_block);
+    }
+}
+
+static void write_delta(json_writer_t *w, const heap_sample_t *row,
+                        bool *any) {
+    json_writer_obj_open(w);
+    json_writer_key(w, "uptime_s", 8);
+    json_writer_uint(w, esp_timer_get_time() / 1000000);
+    json_writer_key(w, "caps", 4);
+    json_writer_obj_open(w);
+    for (size_t i = 0; i < LIBIOT_HEAP_CAPS_COUNT; i++) {
+        const heap_sample_t *now = &row[i];
+        const heap_sample_t *then = &caps[i].published;
+        if (!caps[i].present || !changed(now, then)) {
+            continue;
+        }
+
+        const char *name = LIBIOT_HEAP_CAPS[i].name;
+        json_writer_key(w, name, strlen(name));
+        json_writer_obj_open(w);
+        json_writer_key(w, "free", 4);
+        json_writer_uint(w, now->free_bytes);
+        json_writer_key(w, "dfree", 5);
+        json_writer_int(w, (int64_t) now->free_bytes - then->free_bytes);
+        json_writer_key(w, "largest", 7);
+        json_writer_uint(w, now->largest_free_block);
+        json_writer_key(w, "dlargest", 8);
+        json_writer_int(w, (int64_t) now->largest_free_block
+                               - then->largest_free_block);
+        json_writer_key(w, "frag", 4);
+        json_writer_uint(w, now->frag_permille);
+        json_writer_obj_close(w);
+
+        *any = true;
+    }
+    json_writer_obj_close(w);
+    json_writer_obj_close(w);
+}
+
+static size_t delta_msg_size() {
+    return DELTA_HEADER_SIZE + DELTA_CAP_SIZE * LIBIOT_HEAP_CAPS_COUNT;
+}
+
+static void record(const heap_sample_t *row) {
+    lock();
+
+    bool first = !history_count;
+    for (size_t i = 0; i < LIBIOT_HEAP_CAPS_COUNT; i++) {
+        ewma_update(&caps[i].free_ewma, row[i].free_bytes, first);
+        ewma_update(&caps[i].largest_ewma, row[i].largest_free_block, first);
+        ewma_update(&caps[i].frag_ewma, row[i].frag_permille, first);
+    }
+
+    memcpy(&history[history_next * LIBIOT_HEAP_CAPS_COUNT], row,
+           sizeof(*row) * LIBIOT_HEAP_CAPS_COUNT);
+    history_next = (history_next + 1) % LIBIOT_HEAP_MONITOR_HISTORY;
+    if (history_count < LIBIOT_HEAP_MONITOR_HISTORY) {
+        history_count++;
+    }
+
+    unlock();
+}
+
+// `buff` is `delta_msg_size()` bytes long.
+static void publish_delta(const heap_sample_t *row, char *buff) {
+    // Deltas are relative to what was last published, so while we cannot
+    // publish they simply accumulate.
+    if (!libiot_mqtt_wait_connected(0)) {
+        return;
+    }
+
+    json_writer_t w;
+    json_writer_init(&w, buff, delta_msg_size());
+
+    bool any = false;
+    write_delta(&w, row, &any);
+    json_writer_finish(&w);
+    if (!any) {
+        return;
+    }
+
+    if (!json_writer_ok(&w)) {
+        ESP_LOGW(TAG, "heap: delta too long (%u bytes)", w.len);
+        return;
+    }
+
+    // Only what was actually sent counts as published, so that a failure
+    // leaves the delta to be sent next time.
+    if (libiot_mqtt_try_enqueue(topic_heap->str, buff, 0, 0) < 0) {
+        return;
+    }
+
+    for (size_t i = 0; i < LIBIOT_HEAP_CAPS_COUNT; i++) {
+        if (changed(&row[i], &caps[i].published)) {
+            caps[i].published = row[i];
+        }
+    }
+}
+
+static void task_heap_monitor(void *unused) {
+    heap_sample_t *row = malloc(sizeof(*row) * LIBIOT_HEAP_CAPS_COUNT);
+    char *delta_buff = malloc(delta_msg_size());
+    assert(row && delta_buff);
+
+    TickType_t last_wake = xTaskGetTickCount();
+    while (1) {
+        take_sample(row);
+        record(row);
+        publish_delta(row, delta_buff);
+
+        ESP_ERROR_CHECK(util_stack_overflow_check());
+
+        vTaskDelayUntil(&last_wake, interval_ms / portTICK_PERIOD_MS);
+    }
+
+    vTaskDelete(NULL);
+}
+
+void libiot_heap_monitor_get_stats(libiot_heap_cap_stats_t *stats,
+                                   size_t *count) {
+    size_t max = *count;
+    *count = 0;
+
+    lock();
+
+    for (size_t i = 0; i < LIBIOT_HEAP_CAPS_COUNT && *count < max; i++) {
+        if (!caps[i].present || !history_count) {
+            continue;
+        }
+
+        size_t latest = (history_next + LIBIOT_HEAP_MONITOR_HISTORY - 1)
+                        % LIBIOT_HEAP_MONITOR_HISTORY;
+        const heap_sample_t *now =
+            &history[latest * LIBIOT_HEAP_CAPS_COUNT + i];
+
+        libiot_heap_cap_stats_t *s = &stats[(*count)++];
+        s->name = LIBIOT_HEAP_CAPS[i].name;
+        s->free_bytes = now->free_bytes;
+        s->largest_free_block = now->largest_free_block;
+        s->frag_permille = now->frag_permille;
+
+        s->free_min = s->free_max = now->free_bytes;
+        s->largest_min = s->largest_max = now->largest_free_block;
+        s->frag_min = s->frag_max = now->frag_permille;
+        for (size_t j = 0; j < history_count; j++) {
+            const heap_sample_t *h = &history[j * LIBIOT_HEAP_CAPS_COUNT + i];
+            s->free_min = MIN(s->free_min, h->free_bytes);
+            s->free_max = MAX(s->free_max, h->free_bytes);
+            s->largest_min = MIN(s->largest_min, h->largest_free_block);
+            s->largest_max = MAX(s->largest_max, h->largest_free_block);
+            s->frag_min = MIN(s->frag_min, h->frag_permille);
+            s->frag_max = MAX(s->frag_max, h->frag_permille);
+        }
+
+        s->free_ewma = caps[i].free_ewma >> EWMA_SHIFT;
+        s->largest_ewma = caps[i].largest_ewma >> EWMA_SHIFT;
+        s->frag_ewma = caps[i].frag_ewma >> EWMA_SHIFT;
+        s->minimum_free_bytes =
+            heap_caps_get_minimum_free_size(LIBIOT_HEAP_CAPS[i].code);
+    }
+
+    unlock();
+}
+
+static void write_stats(json_writer_t *w, const libiot_heap_cap_stats_t *stats,
+                        size_t count) {
+    json_writer_obj_open(w);
+    json_writer_key(w, "interval_ms", 11);
+    json_writer_uint(w, interval_ms);
+    json_writer_key(w, "samples", 7);
+    json_writer_uint(w, history_count);
+    json_writer_key(w, "caps", 4);
+    json_writer_obj_open(w);
+    for (size_t i = 0; i < count; i++) {
+        const libiot_heap_cap_stats_t *s = &stats[i];
+
+        json_writer_key(w, s->name, strlen(s->name));
+        json_writer_obj_open(w);
+        json_writer_key(w, "free", 4);
+        json_writer_arr_open(w);
+        json_writer_uint(w, s->free_bytes);
+        json_writer_uint(w, s->free_min);
+        json_writer_uint(w, s->free_max);
+        json_writer_uint(w, s->free_ewma);
+        json_writer_arr_close(w);
+        json_writer_key(w, "largest", 7);
+        json_writer_arr_open(w);
+        json_writer_uint(w, s->largest_free_block);
+        json_writer_uint(w, s->largest_min);
+        json_writer_uint(w, s->largest_max);
+        json_writer_uint(w, s->largest_ewma);
+        json_writer_arr_close(w);
+        json_writer_key(w, "frag", 4);
+        json_writer_arr_open(w);
+        json_writer_uint(w, s->frag_permille);
+        json_writer_uint(w, s->frag_min);
+        json_writer_uint(w, s->frag_max);
+        json_writer_uint(w, s->frag_ewma);
+        json_writer_arr_close(w);
+        json_writer_key(w, "minimum_free", 12);
+        json_writer_uint(w, s->minimum_free_bytes);
+        json_writer_obj_close(w);
+    }
+    json_writer_obj_close(w);
+    json_writer_obj_close(w);
+}
+
+static void route_heap(esp_mqtt_event_handle_t event, void *unused) {
+    ESP_LOGI(TAG, "mqtt: heap");
+
+    size_t count = LIBIOT_HEAP_CAPS_COUNT;
+    libiot_heap_cap_stats_t *stats = malloc(sizeof(*stats) * count);
+    if (!stats) {
+        return;
+    }
+    libiot_heap_monitor_get_stats(stats, &count);
+
+    char *buff = malloc(STATS_MSG_SIZE);
+    if (buff) {
+        json_writer_t w;
+        json_writer_init(&w, buff, STATS_MSG_SIZE);
+        write_stats(&w, stats, count);
+        json_writer_finish(&w);
+
+        // We are on the esp-mqtt task, so we must not block.
+        if (json_writer_ok(&w)) {
+            libiot_mqtt_enqueue_topic(topic_heap_stats, 0, 0, buff);
+        } else {
+            ESP_LOGW(TAG, "heap: stats too long (%u bytes)", w.len);
+        }
+        free(buff);
+    }
+
+    free(stats);
+}
+
+void libiot_init_heap_monitor(int new_interval_ms) {
+    interval_ms = new_interval_ms > 0 ? new_interval_ms : DEFAULT_INTERVAL_MS;
+
+    mutex = xSemaphoreCreateMutexStatic(&mutex_static);
+
+    caps = calloc(LIBIOT_HEAP_CAPS_COUNT, sizeof(*caps));
+    history = calloc(LIBIOT_HEAP_MONITOR_HISTORY * LIBIOT_HEAP_CAPS_COUNT,
+                     sizeof(*history));
+    assert(caps && history);
+
+    for (size_t i = 0; i < LIBIOT_HEAP_CAPS_COUNT; i++) {
+        caps[i].present =
+            heap_caps_get_total_size(LIBIOT_HEAP_CAPS[i].code) > 0;
+    }
+
+    topic_heap = libiot_mqtt_topic_local(MQTT_TOPIC_INFO("heap"));
+    topic_heap_stats = libiot_mqtt_topic_local(MQTT_TOPIC_INFO("heap_stats"));
+    libiot_mqtt_route_local(MQTT_TOPIC_CMD("heap"), route_heap, NULL);
+
+    if (xTaskCreate(task_heap_monitor, "heap_monitor",
+                    HEAP_MONITOR_TASK_STACK_SIZE, NULL,
+                    HEAP_MONITOR_TASK_PRIORITY, NULL)
+        != pdPASS) {
+        ESP_LOGE(TAG, "heap: failed to start task");
+    }
+}
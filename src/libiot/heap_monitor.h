@@ -0,0 +1,7 @@
+#pragma once
+
+#include "private.h"
+
+// Must be called after `libiot_init_mqtt()`. Starts sampling the heaps every
+// `interval_ms` (or a default, if it is not positive).
+void libiot_init_heap_monitor(int interval_ms);
@@ -9,30 +9,37 @@
 #include <libesp.h>
 #include <libesp/json.h>
 
+#include "json_schema.h"
+#include "liveness.h"
 #include "reset_info.h"
+#include "system_id.h"
+#include "wifi.h"
 
-char *libiot_json_build_state_up() {
-    wifi_ap_record_t ap;
-    esp_wifi_sta_get_ap_info(&ap);
-
-    wifi_ps_type_t ps_type;
-    esp_wifi_get_ps(&ps_type);
-
-    const char *ps_type_str = "?";
+const char *libiot_describe_ps_type(wifi_ps_type_t ps_type) {
     switch (ps_type) {
         case WIFI_PS_NONE: {
-            ps_type_str = "none";
-            break;
+            return "none";
         }
         case WIFI_PS_MIN_MODEM: {
-            ps_type_str = "min_modem";
-            break;
+            return "min_modem";
         }
         case WIFI_PS_MAX_MODEM: {
-            ps_type_str = "max_modem";
-            break;
+            return "max_modem";
+        }
+        default: {
+            return "?";
         }
     }
+}
+
+char *libiot_json_build_state_up_cjson() {
+    wifi_ap_record_t ap;
+    esp_wifi_sta_get_ap_info(&ap);
+
+    wifi_ps_type_t ps_type;
+    esp_wifi_get_ps(&ps_type);
+
+    const char *ps_type_str = libiot_describe_ps_type(ps_type);
 
     cJSON *json_root;
     cJSON_CREATE_ROOT_OBJ_OR_GOTO(&json_root, json_fail);
@@ -50,6 +57,19 @@ char *libiot_json_build_state_up() {
     cJSON_INSERT_STRINGREF_INTO_OBJ_OR_GOTO(json_wifi, "ps_type", ps_type_str,
                                             json_fail);
 
+    liveness_state_t liveness;
+    libiot_liveness_get_state(&liveness);
+
+    cJSON *json_liveness;
+    cJSON_INSERT_OBJ_INTO_OBJ_OR_GOTO(json_root, "liveness", &json_liveness,
+                                      json_fail);
+    cJSON_INSERT_NUMBER_INTO_OBJ_OR_GOTO(json_liveness, "keepalive_s",
+                                         liveness.keepalive_s, json_fail);
+    cJSON_INSERT_BOOL_INTO_OBJ_OR_GOTO(json_liveness, "pings_suppressed",
+                                       liveness.pings_suppressed, json_fail);
+    cJSON_INSERT_NUMBER_INTO_OBJ_OR_GOTO(json_liveness, "wakes_per_min",
+                                         liveness.wakes_per_min, json_fail);
+
     char *msg = cJSON_PrintUnformatted(json_root);
     cJSON_Delete(json_root);
     return msg;
@@ -62,7 +82,7 @@ json_fail:
     return NULL;
 }
 
-char *libiot_json_build_state_down() {
+char *libiot_json_build_state_down_cjson() {
     wifi_ap_record_t ap;
     esp_wifi_sta_get_ap_info(&ap);
 
@@ -86,7 +106,7 @@ json_fail:
     return NULL;
 }
 
-char *libiot_json_build_startup() {
+char *libiot_json_build_startup_cjson() {
     reset_info_t *reset_info = libiot_reset_info_get();
 
     cJSON *json_root;
@@ -101,6 +121,26 @@ char *libiot_json_build_startup() {
     cJSON_INSERT_BOOL_INTO_OBJ_OR_GOTO(json_root, "exceptional",
                                        reset_info->exceptional, json_fail);
 
+    wifi_timing_t wifi;
+    libiot_wifi_get_timing(&wifi);
+
+    cJSON *json_wifi;
+    cJSON_INSERT_OBJ_INTO_OBJ_OR_GOTO(json_root, "wifi", &json_wifi, json_fail);
+    cJSON_INSERT_BOOL_INTO_OBJ_OR_GOTO(json_wifi, "fast", wifi.fast,
+                                       json_fail);
+    cJSON_INSERT_BOOL_INTO_OBJ_OR_GOTO(json_wifi, "lease_reused",
+                                       wifi.lease_reused, json_fail);
+    cJSON_INSERT_NUMBER_INTO_OBJ_OR_GOTO(json_wifi, "scan_ms", wifi.scan_ms,
+                                         json_fail);
+    cJSON_INSERT_NUMBER_INTO_OBJ_OR_GOTO(json_wifi, "connect_ms",
+                                         wifi.connect_ms, json_fail);
+    cJSON_INSERT_NUMBER_INTO_OBJ_OR_GOTO(json_wifi, "dhcp_ms", wifi.dhcp_ms,
+                                         json_fail);
+    cJSON_INSERT_NUMBER_INTO_OBJ_OR_GOTO(json_wifi, "total_ms", wifi.total_ms,
+                                         json_fail);
+    cJSON_INSERT_NUMBER_INTO_OBJ_OR_GOTO(json_wifi, "attempts", wifi.attempts,
+                                         json_fail);
+
     char *msg = cJSON_PrintUnformatted(json_root);
     cJSON_Delete(json_root);
     return msg;
@@ -113,14 +153,9 @@ json_fail:
     return NULL;
 }
 
-typedef struct heap_cap_desc {
-    const char *name;
-    uint32_t code;
-} heap_cap_desc_t;
-
 // Note that "any" includes all heaps, and that the other capabilities
 // are not mutually exclusive either.
-const heap_cap_desc_t HEAP_CAPS[] = {
+const heap_cap_desc_t LIBIOT_HEAP_CAPS[] = {
     {.name = "any", .code = 0},
     {.name = "exec", .code = MALLOC_CAP_EXEC},
     {.name = "8bit", .code = MALLOC_CAP_8BIT},
@@ -144,7 +179,10 @@ const heap_cap_desc_t HEAP_CAPS[] = {
     */
 };
 
-char *libiot_json_build_mem_check() {
+const size_t LIBIOT_HEAP_CAPS_COUNT =
+    sizeof(LIBIOT_HEAP_CAPS) / sizeof(heap_cap_desc_t);
+
+char *libiot_json_build_mem_check_cjson() {
     bool heap_integrity_sound = heap_caps_check_integrity_all(true);
     if (heap_integrity_sound) {
         ESP_LOGI(TAG, "heap integrity sound");
@@ -158,9 +196,9 @@ char *libiot_json_build_mem_check() {
     // Note that there is no locking here, so the reported allocation
     // information for the capabilities may not be altogether consistent because
     // of allocations occuring on another task or core.
-    multi_heap_info_t heap_info[sizeof(HEAP_CAPS) / sizeof(heap_cap_desc_t)];
-    for (size_t i = 0; i < sizeof(HEAP_CAPS) / sizeof(heap_cap_desc_t); i++) {
-        heap_caps_get_info(&heap_info[i], HEAP_CAPS[i].code);
+    multi_heap_info_t heap_info[LIBIOT_HEAP_CAPS_COUNT];
+    for (size_t i = 0; i < LIBIOT_HEAP_CAPS_COUNT; i++) {
+        heap_caps_get_info(&heap_info[i], LIBIOT_HEAP_CAPS[i].code);
     }
 
     cJSON *json_root;
@@ -172,33 +210,32 @@ char *libiot_json_build_mem_check() {
     cJSON_INSERT_ARRAY_INTO_OBJ_OR_GOTO(json_root, "heap_capabilities",
                                         &json_heap_capabilities, json_fail);
 
-    for (size_t i = 0; i < sizeof(HEAP_CAPS) / sizeof(heap_cap_desc_t); i++) {
-        multi_heap_info_t info;
-        heap_caps_get_info(&info, HEAP_CAPS[i].code);
+    for (size_t i = 0; i < LIBIOT_HEAP_CAPS_COUNT; i++) {
+        const multi_heap_info_t *info = &heap_info[i];
 
         cJSON *json_cap;
         cJSON_INSERT_OBJ_INTO_ARRAY_OR_GOTO(json_heap_capabilities, &json_cap,
                                             json_fail);
 
-        cJSON_INSERT_STRINGREF_INTO_OBJ_OR_GOTO(json_cap, "name",
-                                                HEAP_CAPS[i].name, json_fail);
+        cJSON_INSERT_STRINGREF_INTO_OBJ_OR_GOTO(
+            json_cap, "name", LIBIOT_HEAP_CAPS[i].name, json_fail);
         cJSON_INSERT_NUMBER_INTO_OBJ_OR_GOTO(json_cap, "total_free_bytes",
-                                             info.total_free_bytes, json_fail);
+                                             info->total_free_bytes, json_fail);
         cJSON_INSERT_NUMBER_INTO_OBJ_OR_GOTO(json_cap, "total_allocated_bytes",
-                                             info.total_allocated_bytes,
+                                             info->total_allocated_bytes,
                                              json_fail);
         cJSON_INSERT_NUMBER_INTO_OBJ_OR_GOTO(json_cap, "largest_free_block",
-                                             info.largest_free_block,
+                                             info->largest_free_block,
                                              json_fail);
         cJSON_INSERT_NUMBER_INTO_OBJ_OR_GOTO(json_cap, "minimum_free_bytes",
-                                             info.minimum_free_bytes,
+                                             info->minimum_free_bytes,
                                              json_fail);
         cJSON_INSERT_NUMBER_INTO_OBJ_OR_GOTO(json_cap, "allocated_blocks",
-                                             info.allocated_blocks, json_fail);
+                                             info->allocated_blocks, json_fail);
         cJSON_INSERT_NUMBER_INTO_OBJ_OR_GOTO(json_cap, "free_blocks",
-                                             info.free_blocks, json_fail);
+                                             info->free_blocks, json_fail);
         cJSON_INSERT_NUMBER_INTO_OBJ_OR_GOTO(json_cap, "total_blocks",
-                                             info.total_blocks, json_fail);
+                                             info->total_blocks, json_fail);
     }
 
     char *msg = cJSON_PrintUnformatted(json_root);
@@ -213,7 +250,7 @@ json_fail:
     return NULL;
 }
 
-const char *lookup_ota_state(esp_ota_img_states_t state) {
+const char *libiot_describe_ota_state(esp_ota_img_states_t state) {
     // Note that "not_present" is also possible at the call site of
     // this function, if the OTA library reports no data recorded.
     switch (state) {
@@ -241,17 +278,13 @@ const char *lookup_ota_state(esp_ota_img_states_t state) {
     }
 }
 
-cJSON *build_part_type(esp_partition_type_t type,
-                       esp_partition_subtype_t subtype) {
-    cJSON *json_type;
-    cJSON_CREATE_ROOT_OBJ_OR_GOTO(&json_type, json_fail);
-
-    cJSON *json_subtype;
-    cJSON_INSERT_OBJ_INTO_OBJ_OR_GOTO(json_type, "subtype", &json_subtype,
-                                      json_fail);
-
+int libiot_describe_part_type(esp_partition_type_t type,
+                              esp_partition_subtype_t subtype,
+                              const char **type_name,
+                              const char **subtype_name) {
     const char *type_name_str = "?";
     const char *subtype_name_str = "?";
+    int ota_id = -1;
 
     switch (type) {
         case ESP_PARTITION_TYPE_APP: {
@@ -283,11 +316,7 @@ cJSON *build_part_type(esp_partition_type_t type,
                 case ESP_PARTITION_SUBTYPE_APP_OTA_14:
                 case ESP_PARTITION_SUBTYPE_APP_OTA_15: {
                     subtype_name_str = "ota";
-
-                    cJSON_INSERT_NUMBER_INTO_OBJ_OR_GOTO(
-                        json_subtype, "id",
-                        subtype - ESP_PARTITION_SUBTYPE_APP_OTA_MIN, json_fail);
-
+                    ota_id = subtype - ESP_PARTITION_SUBTYPE_APP_OTA_MIN;
                     break;
                 }
                 default: {
@@ -349,6 +378,30 @@ cJSON *build_part_type(esp_partition_type_t type,
         }
     }
 
+    *type_name = type_name_str;
+    *subtype_name = subtype_name_str;
+    return ota_id;
+}
+
+cJSON *build_part_type(esp_partition_type_t type,
+                       esp_partition_subtype_t subtype) {
+    const char *type_name_str;
+    const char *subtype_name_str;
+    int ota_id = libiot_describe_part_type(type, subtype, &type_name_str,
+                                           &subtype_name_str);
+
+    cJSON *json_type;
+    cJSON_CREATE_ROOT_OBJ_OR_GOTO(&json_type, json_fail);
+
+    cJSON *json_subtype;
+    cJSON_INSERT_OBJ_INTO_OBJ_OR_GOTO(json_type, "subtype", &json_subtype,
+                                      json_fail);
+
+    if (ota_id >= 0) {
+        cJSON_INSERT_NUMBER_INTO_OBJ_OR_GOTO(json_subtype, "id", ota_id,
+                                             json_fail);
+    }
+
     cJSON_INSERT_STRINGREF_INTO_OBJ_OR_GOTO(json_type, "name", type_name_str,
                                             json_fail);
     cJSON_INSERT_STRINGREF_INTO_OBJ_OR_GOTO(json_subtype, "name",
@@ -390,7 +443,7 @@ static bool add_partitions_to_array(cJSON *json_list,
         const char *ota_state_name = "not_present";
         esp_ota_img_states_t ota_state;
         if (esp_ota_get_state_partition(part, &ota_state) == ESP_OK) {
-            ota_state_name = lookup_ota_state(ota_state);
+            ota_state_name = libiot_describe_ota_state(ota_state);
         }
         cJSON_INSERT_STRINGREF_INTO_OBJ_OR_GOTO(json_part, "ota_state",
                                                 ota_state_name, json_fail);
@@ -426,7 +479,27 @@ json_fail:
     return false;
 }
 
-char *libiot_json_build_system_id() {
+const char *libiot_describe_chip_model(esp_chip_model_t model) {
+    switch (model) {
+        case CHIP_ESP32: {
+            return "ESP32";
+        }
+        case CHIP_ESP32S2: {
+            return "ESP32-S2";
+        }
+        case CHIP_ESP32S3: {
+            return "ESP32-S3";
+        }
+        case CHIP_ESP32C3: {
+            return "ESP32-C3";
+        }
+        default: {
+            return "Unknown";
+        }
+    }
+}
+
+char *libiot_json_build_system_id_cjson() {
     esp_chip_info_t chip_info;
     esp_chip_info(&chip_info);
 
@@ -444,28 +517,7 @@ char *libiot_json_build_system_id() {
     esp_err_t err_mac_custom = esp_efuse_mac_get_custom(mac_custom);
 #endif
 
-    const char *chip_model = "Unknown";
-    switch (chip_info.model) {
-        case CHIP_ESP32: {
-            chip_model = "ESP32";
-            break;
-        }
-        case CHIP_ESP32S2: {
-            chip_model = "ESP32-S2";
-            break;
-        }
-        case CHIP_ESP32S3: {
-            chip_model = "ESP32-S3";
-            break;
-        }
-        case CHIP_ESP32C3: {
-            chip_model = "ESP32-C3";
-            break;
-        }
-        default: {
-            break;
-        }
-    }
+    const char *chip_model = libiot_describe_chip_model(chip_info.model);
 
     cJSON *json_root;
     cJSON_CREATE_ROOT_OBJ_OR_GOTO(&json_root, json_fail);
@@ -612,8 +664,8 @@ char *libiot_json_build_system_id() {
         cJSON_INSERT_ARRAY_INTO_OBJ_OR_GOTO(json_efuse, "mac_custom",
                                             &json_mac_custom, json_fail);
         for (size_t i = 0; i < sizeof(mac_custom); i++) {
-            cJSON_INSERT_NUMBER_INTO_ARRAY_OR_GOTO(json_err, mac_custom[i],
-                                                   json_fail);
+            cJSON_INSERT_NUMBER_INTO_ARRAY_OR_GOTO(json_mac_custom,
+                                                   mac_custom[i], json_fail);
         }
 #endif
     }
@@ -665,3 +717,519 @@ json_fail:
     cJSON_Delete(json_root);
     return NULL;
 }
+
+// The direct serializers below produce the same output as the cJSON builders
+// above, but write straight into a single exactly-sized buffer instead of
+// allocating a cJSON tree node by node.
+
+typedef struct state_up_values {
+    const char *instance_uuid;
+    int64_t uptime_us;
+    int rssi;
+    const char *ps_type;
+    liveness_state_t liveness;
+} state_up_values_t;
+
+#define STATE_UP_SCHEMA(X)                                           \
+    X(STR, "state", "up")                                            \
+    X(STR, "instance_uuid", v->instance_uuid)                        \
+    X(INT, "uptime_us", v->uptime_us)                                \
+    X(OBJ, "wifi", )                                                 \
+    X(INT, "rssi", v->rssi)                                          \
+    X(STR, "ps_type", v->ps_type)                                    \
+    X(END, , )                                                     \
+    X(OBJ, "liveness", )                                             \
+    X(INT, "keepalive_s", v->liveness.keepalive_s)                   \
+    X(BOOL, "pings_suppressed", v->liveness.pings_suppressed)        \
+    X(UINT, "wakes_per_min", v->liveness.wakes_per_min)              \
+    X(END, , )
+
+JSON_SCHEMA_DEFINE(state_up, state_up_values_t, STATE_UP_SCHEMA)
+
+static void get_state_up_values(state_up_values_t *v) {
+    wifi_ap_record_t ap;
+    esp_wifi_sta_get_ap_info(&ap);
+
+    wifi_ps_type_t ps_type;
+    esp_wifi_get_ps(&ps_type);
+
+    v->instance_uuid = libiot_get_instance_uuid();
+    v->uptime_us = esp_timer_get_time();
+    v->rssi = ap.rssi;
+    v->ps_type = libiot_describe_ps_type(ps_type);
+    libiot_liveness_get_state(&v->liveness);
+}
+
+size_t libiot_json_write_state_up(char *buff, size_t cap) {
+    state_up_values_t v;
+    get_state_up_values(&v);
+    return state_up_render_into(buff, cap, &v);
+}
+
+typedef struct state_down_values {
+    const char *instance_uuid;
+} state_down_values_t;
+
+#define STATE_DOWN_SCHEMA(X) \
+    X(STR, "state", "down")  \
+    X(STR, "instance_uuid", v->instance_uuid)
+
+JSON_SCHEMA_DEFINE(state_down, state_down_values_t, STATE_DOWN_SCHEMA)
+
+typedef struct startup_values {
+    uint64_t start_epoch_time_ms;
+    const reset_info_t *reset_info;
+    wifi_timing_t wifi;
+} startup_values_t;
+
+#define STARTUP_SCHEMA(X)                                      \
+    X(UINT, "start_epoch_time_ms", v->start_epoch_time_ms)     \
+    X(STR, "reason", v->reset_info->reason)                    \
+    X(INT, "code", v->reset_info->raw)                         \
+    X(BOOL, "exceptional", v->reset_info->exceptional)         \
+    X(OBJ, "wifi", )                                           \
+    X(BOOL, "fast", v->wifi.fast)                              \
+    X(BOOL, "lease_reused", v->wifi.lease_reused)              \
+    X(UINT, "scan_ms", v->wifi.scan_ms)                        \
+    X(UINT, "connect_ms", v->wifi.connect_ms)                  \
+    X(UINT, "dhcp_ms", v->wifi.dhcp_ms)                        \
+    X(UINT, "total_ms", v->wifi.total_ms)                      \
+    X(UINT, "attempts", v->wifi.attempts)                      \
+    X(END, , )
+
+JSON_SCHEMA_DEFINE(startup, startup_values_t, STARTUP_SCHEMA)
+
+typedef struct heap_cap_values {
+    const char *name;
+    const multi_heap_info_t *info;
+} heap_cap_values_t;
+
+#define HEAP_CAP_SCHEMA(X)                                              \
+    X(STR, "name", v->name)                                             \
+    X(UINT, "total_free_bytes", v->info->total_free_bytes)              \
+    X(UINT, "total_allocated_bytes", v->info->total_allocated_bytes)    \
+    X(UINT, "largest_free_block", v->info->largest_free_block)          \
+    X(UINT, "minimum_free_bytes", v->info->minimum_free_bytes)          \
+    X(UINT, "allocated_blocks", v->info->allocated_blocks)              \
+    X(UINT, "free_blocks", v->info->free_blocks)                        \
+    X(UINT, "total_blocks", v->info->total_blocks)
+
+JSON_SCHEMA_DEFINE(heap_cap, heap_cap_values_t, HEAP_CAP_SCHEMA)
+
+// The rest are only used by the direct builders.
+#ifndef LIBIOT_JSON_USE_CJSON
+
+typedef struct mem_check_values {
+    bool heap_integrity_sound;
+    const multi_heap_info_t *heap_info;
+} mem_check_values_t;
+
+static void mem_check_write(json_writer_t *w, const mem_check_values_t *v) {
+    json_writer_obj_open(w);
+    json_writer_key(w, "heap_integrity_sound", 20);
+    json_writer_bool(w, v->heap_integrity_sound);
+
+    json_writer_key(w, "heap_capabilities", 17);
+    json_writer_arr_open(w);
+    for (size_t i = 0; i < LIBIOT_HEAP_CAPS_COUNT; i++) {
+        heap_cap_values_t cap = {
+            .name = LIBIOT_HEAP_CAPS[i].name,
+            .info = &v->heap_info[i],
+        };
+        heap_cap_write(w, &cap);
+    }
+    json_writer_arr_close(w);
+    json_writer_obj_close(w);
+}
+
+// Writes with `write` twice: first to measure, and then into an exactly sized
+// heap buffer. If the document grew in between (only possible when `write`
+// reads live state), we measure again.
+static char *render_measured(void (*write)(json_writer_t *w, const void *v),
+                             const void *v) {
+    json_writer_t w;
+    json_writer_init(&w, NULL, 0);
+    write(&w, v);
+
+    for (int i = 0; i < 2; i++) {
+        size_t size = w.len;
+        char *buff = malloc(size + 1);
+        if (!buff) {
+            return NULL;
+        }
+
+        json_writer_init(&w, buff, size + 1);
+        write(&w, v);
+        json_writer_finish(&w);
+        if (json_writer_ok(&w)) {
+            return buff;
+        }
+
+        free(buff);
+    }
+
+    return NULL;
+}
+
+static void mem_check_write_any(json_writer_t *w, const void *v) {
+    mem_check_write(w, v);
+}
+
+static void add_partitions(json_writer_t *w) {
+    const esp_partition_t *const *parts;
+    size_t count = libiot_system_id_get_partitions(&parts);
+    for (size_t i = 0; i < count; i++) {
+        const esp_partition_t *part = parts[i];
+
+        const char *type_name;
+        const char *subtype_name;
+        int ota_id = libiot_describe_part_type(part->type, part->subtype,
+                                               &type_name, &subtype_name);
+
+        json_writer_obj_open(w);
+        json_writer_key(w, "flash_chip_id", 13);
+        json_writer_uint(w, part->flash_chip->chip_id);
+
+        json_writer_key(w, "type", 4);
+        json_writer_obj_open(w);
+        json_writer_key(w, "subtype", 7);
+        json_writer_obj_open(w);
+        if (ota_id >= 0) {
+            json_writer_key(w, "id", 2);
+            json_writer_uint(w, ota_id);
+        }
+        json_writer_key(w, "name", 4);
+        json_writer_str(w, subtype_name);
+        json_writer_obj_close(w);
+        json_writer_key(w, "name", 4);
+        json_writer_str(w, type_name);
+        json_writer_obj_close(w);
+
+        json_writer_key(w, "address", 7);
+        json_writer_uint(w, part->address);
+        json_writer_key(w, "size", 4);
+        json_writer_uint(w, part->size);
+        json_writer_key(w, "label", 5);
+        json_writer_str(w, part->label);
+        json_writer_key(w, "encrypted", 9);
+        json_writer_bool(w, part->encrypted);
+        json_writer_key(w, "ota_state", 9);
+        json_writer_str(w, libiot_system_id_get_ota_state(part));
+        json_writer_obj_close(w);
+    }
+}
+
+static void add_partition_address(json_writer_t *w, const char *name,
+                                  const esp_partition_t *part) {
+    json_writer_key(w, name, strlen(name));
+    if (part) {
+        json_writer_uint(w, part->address);
+    } else {
+        json_writer_null(w);
+    }
+}
+
+static void add_byte_array(json_writer_t *w, const char *name,
+                           const uint8_t *bytes, size_t len) {
+    json_writer_key(w, name, strlen(name));
+    json_writer_arr_open(w);
+    for (size_t i = 0; i < len; i++) {
+        json_writer_uint(w, bytes[i]);
+    }
+    json_writer_arr_close(w);
+}
+
+static void system_id_write_partitions(json_writer_t *w,
+                                      const system_id_volatile_t *v) {
+    json_writer_obj_open(w);
+    json_writer_key(w, "is_rollback_possible", 20);
+    json_writer_bool(w, v->is_rollback_possible);
+    add_partition_address(w, "boot", v->boot);
+    add_partition_address(w, "running", v->running);
+    add_partition_address(w, "last_invalid", v->last_invalid);
+    add_partition_address(w, "next_update", v->next_update);
+    json_writer_key(w, "list", 4);
+    json_writer_arr_open(w);
+    add_partitions(w);
+    json_writer_arr_close(w);
+    json_writer_obj_close(w);
+}
+
+// Records where the (volatile) "partitions" object was written, so that the
+// rest of the document can be cached and the object spliced back in.
+typedef struct system_id_splice {
+    system_id_volatile_t v;
+    size_t partitions_start;
+    size_t partitions_end;
+} system_id_splice_t;
+
+static void system_id_write(json_writer_t *w, system_id_splice_t *splice) {
+    esp_chip_info_t chip_info;
+    esp_chip_info(&chip_info);
+
+    const esp_app_desc_t *app_desc = esp_ota_get_app_description();
+
+    uint8_t mac_default[6];
+    memset(mac_default, 0, sizeof(mac_default));
+    // Even if this fails, we use the value of the zero-memset'ed arrays.
+    esp_err_t err_mac_default = esp_efuse_mac_get_default(mac_default);
+
+#ifdef REPORT_MAC_CUSTOM_BLK3
+    uint8_t mac_custom[6];
+    memset(mac_custom, 0, sizeof(mac_custom));
+    // Even if this fails, we use the value of the zero-memset'ed arrays.
+    esp_err_t err_mac_custom = esp_efuse_mac_get_custom(mac_custom);
+#endif
+
+    json_writer_obj_open(w);
+
+    json_writer_key(w, "software", 8);
+    json_writer_obj_open(w);
+    {
+        json_writer_key(w, "app_desc", 8);
+        json_writer_obj_open(w);
+        json_writer_key(w, "magic_word", 10);
+        json_writer_uint(w, app_desc->magic_word);
+        json_writer_key(w, "secure_version", 14);
+        json_writer_uint(w, app_desc->secure_version);
+        json_writer_key(w, "version", 7);
+        json_writer_str(w, app_desc->version);
+        json_writer_key(w, "project_name", 12);
+        json_writer_str(w, app_desc->project_name);
+        json_writer_key(w, "time", 4);
+        json_writer_str(w, app_desc->time);
+        json_writer_key(w, "date", 4);
+        json_writer_str(w, app_desc->date);
+        json_writer_key(w, "idf_ver", 7);
+        json_writer_str(w, app_desc->idf_ver);
+        add_byte_array(w, "app_elf_sha256", app_desc->app_elf_sha256,
+                       sizeof(app_desc->app_elf_sha256));
+        json_writer_obj_close(w);
+
+        json_writer_key(w, "partitions", 10);
+        splice->partitions_start = w->len;
+        system_id_write_partitions(w, &splice->v);
+        splice->partitions_end = w->len;
+
+        json_writer_key(w, "idf_version", 11);
+        json_writer_obj_open(w);
+        json_writer_key(w, "major", 5);
+        json_writer_uint(w, ESP_IDF_VERSION_MAJOR);
+        json_writer_key(w, "minor", 5);
+        json_writer_uint(w, ESP_IDF_VERSION_MINOR);
+        json_writer_key(w, "patch", 5);
+        json_writer_uint(w, ESP_IDF_VERSION_PATCH);
+        json_writer_key(w, "blob", 4);
+        json_writer_str(w, IDF_VER);
+        json_writer_obj_close(w);
+    }
+    json_writer_obj_close(w);
+
+    json_writer_key(w, "efuse", 5);
+    json_writer_obj_open(w);
+    {
+        json_writer_key(w, "err", 3);
+        json_writer_obj_open(w);
+        json_writer_key(w, "mac_default", 11);
+        json_writer_int(w, err_mac_default);
+#ifdef REPORT_MAC_CUSTOM_BLK3
+        json_writer_key(w, "mac_custom", 10);
+        json_writer_int(w, err_mac_custom);
+#endif
+        json_writer_obj_close(w);
+
+        add_byte_array(w, "mac_default", mac_default, sizeof(mac_default));
+#ifdef REPORT_MAC_CUSTOM_BLK3
+        add_byte_array(w, "mac_custom", mac_custom, sizeof(mac_custom));
+#endif
+    }
+    json_writer_obj_close(w);
+
+    json_writer_key(w, "chip", 4);
+    json_writer_obj_open(w);
+    {
+        json_writer_key(w, "model", 5);
+        json_writer_str(w, libiot_describe_chip_model(chip_info.model));
+        json_writer_key(w, "cores", 5);
+        json_writer_uint(w, chip_info.cores);
+        json_writer_key(w, "revision", 8);
+        json_writer_uint(w, chip_info.revision);
+
+        json_writer_key(w, "features", 8);
+        json_writer_arr_open(w);
+        if (chip_info.features & CHIP_FEATURE_EMB_FLASH) {
+            json_writer_str(w, "EMB_FLASH");
+        }
+        if (chip_info.features & CHIP_FEATURE_WIFI_BGN) {
+            json_writer_str(w, "WIFI_BGN");
+        }
+        if (chip_info.features & CHIP_FEATURE_BLE) {
+            json_writer_str(w, "BLE");
+        }
+        if (chip_info.features & CHIP_FEATURE_BT) {
+            json_writer_str(w, "BT");
+        }
+        json_writer_arr_close(w);
+    }
+    json_writer_obj_close(w);
+
+    json_writer_obj_close(w);
+}
+
+#endif
+
+char *libiot_json_build_state_up() {
+#ifdef LIBIOT_JSON_USE_CJSON
+    return libiot_json_build_state_up_cjson();
+#else
+    state_up_values_t v;
+    get_state_up_values(&v);
+    return state_up_render(&v);
+#endif
+}
+
+char *libiot_json_build_state_down() {
+#ifdef LIBIOT_JSON_USE_CJSON
+    return libiot_json_build_state_down_cjson();
+#else
+    state_down_values_t v = {
+        .instance_uuid = libiot_get_instance_uuid(),
+    };
+    return state_down_render(&v);
+#endif
+}
+
+char *libiot_json_build_startup() {
+#ifdef LIBIOT_JSON_USE_CJSON
+    return libiot_json_build_startup_cjson();
+#else
+    startup_values_t v = {
+        .start_epoch_time_ms = libiot_get_start_epoch_time_ms(),
+        .reset_info = libiot_reset_info_get(),
+    };
+    libiot_wifi_get_timing(&v.wifi);
+    return startup_render(&v);
+#endif
+}
+
+char *libiot_json_build_mem_check() {
+#ifdef LIBIOT_JSON_USE_CJSON
+    return libiot_json_build_mem_check_cjson();
+#else
+    bool heap_integrity_sound = heap_caps_check_integrity_all(true);
+    if (heap_integrity_sound) {
+        ESP_LOGI(TAG, "heap integrity sound");
+    } else {
+        ESP_LOGE(TAG, "heap integrity unsound!");
+    }
+
+    // As for the cJSON builder, obtain all of the allocation information
+    // first.
+    multi_heap_info_t heap_info[LIBIOT_HEAP_CAPS_COUNT];
+    for (size_t i = 0; i < LIBIOT_HEAP_CAPS_COUNT; i++) {
+        heap_caps_get_info(&heap_info[i], LIBIOT_HEAP_CAPS[i].code);
+    }
+
+    mem_check_values_t v = {
+        .heap_integrity_sound = heap_integrity_sound,
+        .heap_info = heap_info,
+    };
+    return render_measured(mem_check_write_any, &v);
+#endif
+}
+
+#ifndef LIBIOT_JSON_USE_CJSON
+// Everything in the system id except for the "partitions" object, which is
+// spliced in between `head_len` and `tail_len` bytes of `blob` (the latter
+// not null terminated).
+static char *system_id_blob;
+static size_t system_id_head_len;
+static size_t system_id_tail_len;
+#endif
+
+void libiot_json_cache_system_id() {
+#ifndef LIBIOT_JSON_USE_CJSON
+    system_id_splice_t splice;
+    libiot_system_id_get_volatile(&splice.v);
+
+    json_writer_t w;
+    json_writer_init(&w, NULL, 0);
+    system_id_write(&w, &splice);
+
+    char *buff;
+    while (true) {
+        buff = malloc(w.len + 1);
+        if (!buff) {
+            // `libiot_json_build_system_id()` will fail instead.
+            ESP_LOGE(TAG, "%s: out of memory", __func__);
+            return;
+        }
+
+        json_writer_init(&w, buff, w.len + 1);
+        system_id_write(&w, &splice);
+        json_writer_finish(&w);
+        if (json_writer_ok(&w)) {
+            break;
+        }
+
+        // An OTA state changed in between.
+        free(buff);
+    }
+
+    // Drop the partitions object we just wrote.
+    size_t tail_len = w.len - splice.partitions_end;
+    memmove(buff + splice.partitions_start, buff + splice.partitions_end,
+            tail_len);
+
+    size_t blob_len = splice.partitions_start + tail_len;
+    char *shrunk = realloc(buff, blob_len);
+    system_id_blob = shrunk ? shrunk : buff;
+    system_id_head_len = splice.partitions_start;
+    system_id_tail_len = tail_len;
+#endif
+}
+
+char *libiot_json_build_system_id() {
+#ifdef LIBIOT_JSON_USE_CJSON
+    return libiot_json_build_system_id_cjson();
+#else
+    if (!system_id_blob) {
+        ESP_LOGE(TAG, "%s: not cached", __func__);
+        return NULL;
+    }
+
+    system_id_volatile_t v;
+    libiot_system_id_get_volatile(&v);
+
+    json_writer_t w;
+    json_writer_init(&w, NULL, 0);
+    system_id_write_partitions(&w, &v);
+
+    // The OTA states are read again while writing, so try again if they
+    // changed length in between.
+    for (int i = 0; i < 2; i++) {
+        size_t partitions_len = w.len;
+        char *buff = malloc(system_id_head_len + partitions_len
+                            + system_id_tail_len + 1);
+        if (!buff) {
+            return NULL;
+        }
+
+        json_writer_init(&w, buff + system_id_head_len, partitions_len);
+        system_id_write_partitions(&w, &v);
+        if (json_writer_ok(&w)) {
+            char *pos = buff;
+            memcpy(pos, system_id_blob, system_id_head_len);
+            pos += system_id_head_len + partitions_len;
+            memcpy(pos, system_id_blob + system_id_head_len,
+                   system_id_tail_len);
+            pos[system_id_tail_len] = '\0';
+            return buff;
+        }
+
+        free(buff);
+    }
+
+    return NULL;
+#endif
+}
@@ -1,5 +1,11 @@
 #pragma once
 
+#include <esp_heap_caps.h>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <esp_system.h>
+#include <esp_wifi.h>
+
 #include "private.h"
 
 char *libiot_json_build_state_up();
@@ -11,3 +17,48 @@ char *libiot_json_build_startup();
 char *libiot_json_build_mem_check();
 
 char *libiot_json_build_system_id();
+
+// Serializes the parts of the system id which cannot change at runtime, so
+// that `libiot_json_build_system_id()` need only fill in the rest. Called by
+// `libiot_init_system_id()`.
+void libiot_json_cache_system_id();
+
+// Writes the state up message into `buff` without allocating, returning the
+// length of the message (as for `snprintf()`).
+size_t libiot_json_write_state_up(char *buff, size_t cap);
+
+// The reference builders, which go via a cJSON tree. The builders above
+// produce identical output, and defer to these when
+// `LIBIOT_JSON_USE_CJSON` is defined.
+
+char *libiot_json_build_state_up_cjson();
+
+char *libiot_json_build_state_down_cjson();
+
+char *libiot_json_build_startup_cjson();
+
+char *libiot_json_build_mem_check_cjson();
+
+char *libiot_json_build_system_id_cjson();
+
+// The following describe the system for both the JSON and CBOR builders.
+
+typedef struct heap_cap_desc {
+    const char *name;
+    uint32_t code;
+} heap_cap_desc_t;
+
+extern const heap_cap_desc_t LIBIOT_HEAP_CAPS[];
+extern const size_t LIBIOT_HEAP_CAPS_COUNT;
+
+const char *libiot_describe_ota_state(esp_ota_img_states_t state);
+
+// Returns the OTA slot of an app partition, or -1 if it is not an OTA slot.
+int libiot_describe_part_type(esp_partition_type_t type,
+                              esp_partition_subtype_t subtype,
+                              const char **type_name,
+                              const char **subtype_name);
+
+const char *libiot_describe_chip_model(esp_chip_model_t model);
+
+const char *libiot_describe_ps_type(wifi_ps_type_t ps_type);
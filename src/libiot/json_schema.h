@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stdlib.h>
+
+#include "json_writer.h"
+
+// Generates serializers for JSON objects of a fixed shape, described by an
+// X-macro listing the members in order:
+//
+//     #define FOO_SCHEMA(X)
+//         X(STR, "name", v->name)
+//         X(OBJ, "inner", )
+//         X(INT, "count", v->count)
+//         X(END, , )
+//
+// The value expressions may refer to `v`, a `const <type> *` holding the
+// values to serialize. Kinds are STR (a `const char *`, or NULL for null),
+// INT, UINT, BOOL, and OBJ/END (which open and close a nested object).
+//
+// Since the shape is fixed, the size of the output is computed exactly from
+// the lengths of the values alone (the keys and punctuation folding into a
+// constant), and so the output buffer is the only allocation.
+//
+// `JSON_SCHEMA_DEFINE(name, type, schema)` defines:
+//
+//     static size_t name_size(const type *v);
+//     static void name_write(json_writer_t *w, const type *v);
+//     // Writes into `buff` if it fits, returning the length (as for
+//     // `snprintf()`).
+//     static size_t name_render_into(char *buff, size_t cap, const type *v);
+//     // Returns a heap allocated (null terminated) string.
+//     static char *name_render(const type *v);
+
+// Each member has a key, the quotes around it, a ':', and (we suppose) a
+// trailing ','. Each object then has two braces, less the ',' after its last
+// member which we overcounted.
+#define JSON_SIZE_MEMBER_(key) (sizeof(key) - 1 + 4)
+#define JSON_SIZE_STR_(key, val) \
+    (JSON_SIZE_MEMBER_(key) + json_writer_str_len(val))
+#define JSON_SIZE_INT_(key, val) \
+    (JSON_SIZE_MEMBER_(key) + json_writer_int_len(val))
+#define JSON_SIZE_UINT_(key, val) \
+    (JSON_SIZE_MEMBER_(key) + json_writer_uint_len(val))
+#define JSON_SIZE_BOOL_(key, val) (JSON_SIZE_MEMBER_(key) + ((val) ? 4 : 5))
+#define JSON_SIZE_OBJ_(key, val) (JSON_SIZE_MEMBER_(key) + 2 - 1)
+#define JSON_SIZE_END_(key, val) 0
+#define JSON_SIZE_FIELD_(kind, key, val) +JSON_SIZE_##kind##_(key, val)
+
+#define JSON_WRITE_STR_(w, key, val)           \
+    json_writer_key(w, key, sizeof(key) - 1); \
+    json_writer_str(w, val)
+#define JSON_WRITE_INT_(w, key, val)           \
+    json_writer_key(w, key, sizeof(key) - 1); \
+    json_writer_int(w, val)
+#define JSON_WRITE_UINT_(w, key, val)          \
+    json_writer_key(w, key, sizeof(key) - 1); \
+    json_writer_uint(w, val)
+#define JSON_WRITE_BOOL_(w, key, val)          \
+    json_writer_key(w, key, sizeof(key) - 1); \
+    json_writer_bool(w, val)
+#define JSON_WRITE_OBJ_(w, key, val)           \
+    json_writer_key(w, key, sizeof(key) - 1); \
+    json_writer_obj_open(w)
+#define JSON_WRITE_END_(w, key, val) json_writer_obj_close(w)
+#define JSON_WRITE_FIELD_(kind, key, val) JSON_WRITE_##kind##_(w, key, val);
+
+#define JSON_SCHEMA_DEFINE(name, type, schema)                             \
+    static __unused size_t name##_size(const type *v) {                    \
+        return 2 - 1 schema(JSON_SIZE_FIELD_);                             \
+    }                                                                      \
+                                                                           \
+    static __unused void name##_write(json_writer_t *w, const type *v) {   \
+        json_writer_obj_open(w);                                           \
+        schema(JSON_WRITE_FIELD_) json_writer_obj_close(w);                \
+    }                                                                      \
+                                                                           \
+    static __unused size_t name##_render_into(char *buff, size_t cap,      \
+                                              const type *v) {             \
+        json_writer_t w;                                                   \
+        json_writer_init(&w, buff, cap);                                   \
+        name##_write(&w, v);                                               \
+        json_writer_finish(&w);                                            \
+        return w.len;                                                      \
+    }                                                                      \
+                                                                           \
+    static __unused char *name##_render(const type *v) {                   \
+        size_t size = name##_size(v);                                      \
+        char *buff = malloc(size + 1);                                     \
+        if (buff) {                                                        \
+            size_t len = name##_render_into(buff, size + 1, v);            \
+            assert(len == size);                                           \
+        }                                                                  \
+        return buff;                                                       \
+    }
@@ -0,0 +1,434 @@
+#include <string.h>
+
+#include "private.h"
+
+// Nesting deeper than this is rejected, bounding our stack usage.
+#define MAX_DEPTH 16
+
+typedef struct parser {
+    const char *buff;
+    size_t len;
+    size_t pos;
+
+    libiot_json_tok_t *toks;
+    size_t max_toks;
+    size_t num_toks;
+} parser_t;
+
+static int parse_value(parser_t *p, int depth);
+
+static void skip_ws(parser_t *p) {
+    while (p->pos < p->len) {
+        char c = p->buff[p->pos];
+        if (c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+            break;
+        }
+        p->pos++;
+    }
+}
+
+// Returns the index of the new token, or a (negative) error.
+static int alloc_tok(parser_t *p, libiot_json_type_t type, size_t start) {
+    if (p->num_toks >= p->max_toks) {
+        return LIBIOT_JSON_ERR_NOMEM;
+    }
+
+    int i = p->num_toks++;
+    libiot_json_tok_t *tok = &p->toks[i];
+    tok->type = type;
+    tok->start = start;
+    tok->end = start;
+    tok->size = 0;
+    tok->span = 1;
+    tok->decoded = false;
+    return i;
+}
+
+static int parse_string(parser_t *p) {
+    // Skip the opening quote.
+    p->pos++;
+
+    int i = alloc_tok(p, LIBIOT_JSON_STRING, p->pos);
+    if (i < 0) {
+        return i;
+    }
+
+    while (p->pos < p->len) {
+        char c = p->buff[p->pos];
+        if (c == '"') {
+            p->toks[i].end = p->pos++;
+            return i;
+        }
+
+        if ((unsigned char) c < 0x20) {
+            return LIBIOT_JSON_ERR_INVAL;
+        }
+
+        if (c == '\\') {
+            p->pos++;
+            if (p->pos >= p->len) {
+                break;
+            }
+
+            switch (p->buff[p->pos]) {
+                case '"':
+                case '\\':
+                case '/':
+                case 'b':
+                case 'f':
+                case 'n':
+                case 'r':
+                case 't': {
+                    break;
+                }
+                case 'u': {
+                    for (int j = 0; j < 4; j++) {
+                        p->pos++;
+                        if (p->pos >= p->len) {
+                            return LIBIOT_JSON_ERR_PART;
+                        }
+                        if (!strchr("0123456789abcdefABCDEF",
+                                    p->buff[p->pos])
+                            || !p->buff[p->pos]) {
+                            return LIBIOT_JSON_ERR_INVAL;
+                        }
+                    }
+                    break;
+                }
+                default: {
+                    return LIBIOT_JSON_ERR_INVAL;
+                }
+            }
+        }
+
+        p->pos++;
+    }
+
+    return LIBIOT_JSON_ERR_PART;
+}
+
+// Numbers, `true`, `false` and `null`. We only check that the token is made
+// of characters which can appear in one; the accessors check the rest.
+static int parse_primitive(parser_t *p) {
+    int i = alloc_tok(p, LIBIOT_JSON_PRIMITIVE, p->pos);
+    if (i < 0) {
+        return i;
+    }
+
+    while (p->pos < p->len) {
+        char c = p->buff[p->pos];
+        if (!strchr("0123456789+-.eEtruefalsn", c) || !c) {
+            break;
+        }
+        p->pos++;
+    }
+
+    p->toks[i].end = p->pos;
+    return p->toks[i].end > p->toks[i].start ? i : LIBIOT_JSON_ERR_INVAL;
+}
+
+static int parse_container(parser_t *p, int depth) {
+    bool is_object = p->buff[p->pos] == '{';
+    char close = is_object ? '}' : ']';
+
+    if (depth >= MAX_DEPTH) {
+        return LIBIOT_JSON_ERR_INVAL;
+    }
+
+    int i = alloc_tok(p, is_object ? LIBIOT_JSON_OBJECT : LIBIOT_JSON_ARRAY,
+                      p->pos);
+    if (i < 0) {
+        return i;
+    }
+    p->pos++;
+
+    skip_ws(p);
+    if (p->pos < p->len && p->buff[p->pos] == close) {
+        p->toks[i].end = ++p->pos;
+        return i;
+    }
+
+    while (1) {
+        if (is_object) {
+            skip_ws(p);
+            if (p->pos >= p->len) {
+                return LIBIOT_JSON_ERR_PART;
+            }
+            if (p->buff[p->pos] != '"') {
+                return LIBIOT_JSON_ERR_INVAL;
+            }
+
+            int key = parse_string(p);
+            if (key < 0) {
+                return key;
+            }
+
+            skip_ws(p);
+            if (p->pos >= p->len) {
+                return LIBIOT_JSON_ERR_PART;
+            }
+            if (p->buff[p->pos] != ':') {
+                return LIBIOT_JSON_ERR_INVAL;
+            }
+            p->pos++;
+        }
+
+        int val = parse_value(p, depth + 1);
+        if (val < 0) {
+            return val;
+        }
+        p->toks[i].size++;
+
+        skip_ws(p);
+        if (p->pos >= p->len) {
+            return LIBIOT_JSON_ERR_PART;
+        }
+
+        char c = p->buff[p->pos++];
+        if (c == close) {
+            break;
+        }
+        if (c != ',') {
+            return LIBIOT_JSON_ERR_INVAL;
+        }
+    }
+
+    p->toks[i].end = p->pos;
+    p->toks[i].span = p->num_toks - i;
+    return i;
+}
+
+static int parse_value(parser_t *p, int depth) {
+    skip_ws(p);
+    if (p->pos >= p->len) {
+        return LIBIOT_JSON_ERR_PART;
+    }
+
+    switch (p->buff[p->pos]) {
+        case '{':
+        case '[': {
+            return parse_container(p, depth);
+        }
+        case '"': {
+            return parse_string(p);
+        }
+        default: {
+            return parse_primitive(p);
+        }
+    }
+}
+
+int libiot_json_tokenize(const char *buff, size_t len, libiot_json_tok_t *toks,
+                         size_t max_toks) {
+    parser_t p = {
+        .buff = buff,
+        .len = len,
+        .pos = 0,
+        .toks = toks,
+        .max_toks = max_toks,
+        .num_toks = 0,
+    };
+
+    int root = parse_value(&p, 0);
+    if (root < 0) {
+        return root;
+    }
+
+    skip_ws(&p);
+    // Tolerate a trailing null terminator being counted in `len`.
+    if (p.pos < len && !(p.pos + 1 == len && !buff[p.pos])) {
+        return LIBIOT_JSON_ERR_INVAL;
+    }
+
+    return p.num_toks;
+}
+
+bool libiot_json_eq(const char *buff, const libiot_json_tok_t *tok,
+                    const char *str) {
+    size_t len = tok->end - tok->start;
+    return tok->type == LIBIOT_JSON_STRING && strlen(str) == len
+           && !memcmp(buff + tok->start, str, len);
+}
+
+int libiot_json_get(const char *buff, const libiot_json_tok_t *toks, int obj,
+                    const char *key) {
+    if (obj < 0 || toks[obj].type != LIBIOT_JSON_OBJECT) {
+        return -1;
+    }
+
+    // Keys and values alternate, and `span` lets us skip over each value.
+    int i = obj + 1;
+    for (uint32_t n = 0; n < toks[obj].size; n++) {
+        int val = i + 1;
+        if (libiot_json_eq(buff, &toks[i], key)) {
+            return val;
+        }
+        i = val + toks[val].span;
+    }
+    return -1;
+}
+
+static int hex_val(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return c - 'A' + 10;
+}
+
+static uint32_t read_hex4(const char *s) {
+    return (hex_val(s[0]) << 12) | (hex_val(s[1]) << 8) | (hex_val(s[2]) << 4)
+           | hex_val(s[3]);
+}
+
+// Writes `cp` as UTF-8, returning the number of bytes written.
+static size_t put_utf8(char *out, uint32_t cp) {
+    if (cp < 0x80) {
+        out[0] = cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = 0xC0 | (cp >> 6);
+        out[1] = 0x80 | (cp & 0x3F);
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = 0xE0 | (cp >> 12);
+        out[1] = 0x80 | ((cp >> 6) & 0x3F);
+        out[2] = 0x80 | (cp & 0x3F);
+        return 3;
+    }
+    out[0] = 0xF0 | (cp >> 18);
+    out[1] = 0x80 | ((cp >> 12) & 0x3F);
+    out[2] = 0x80 | ((cp >> 6) & 0x3F);
+    out[3] = 0x80 | (cp & 0x3F);
+    return 4;
+}
+
+char *libiot_json_str(char *buff, libiot_json_tok_t *tok) {
+    if (tok->type != LIBIOT_JSON_STRING) {
+        return NULL;
+    }
+
+    char *str = buff + tok->start;
+    if (tok->decoded) {
+        return str;
+    }
+
+    // Every escape sequence is at least as long as what it decodes to, so we
+    // can decode from left to right over the top of the original. The
+    // closing quote then becomes the null terminator.
+    const char *in = str;
+    const char *in_end = buff + tok->end;
+    char *out = str;
+    while (in < in_end) {
+        if (*in != '\\') {
+            *out++ = *in++;
+            continue;
+        }
+
+        in++;
+        switch (*in++) {
+            case 'b': {
+                *out++ = '\b';
+                break;
+            }
+            case 'f': {
+                *out++ = '\f';
+                break;
+            }
+            case 'n': {
+                *out++ = '\n';
+                break;
+            }
+            case 'r': {
+                *out++ = '\r';
+                break;
+            }
+            case 't': {
+                *out++ = '\t';
+                break;
+            }
+            case 'u': {
+                uint32_t cp = read_hex4(in);
+                in += 4;
+
+                // Combine a UTF-16 surrogate pair.
+                if (cp >= 0xD800 && cp < 0xDC00 && in_end - in >= 6
+                    && in[0] == '\\' && in[1] == 'u') {
+                    uint32_t lo = read_hex4(in + 2);
+                    if (lo >= 0xDC00 && lo < 0xE000) {
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                        in += 6;
+                    }
+                }
+
+                out += put_utf8(out, cp);
+                break;
+            }
+            default: {
+                // '"', '\\' and '/' stand for themselves.
+                *out++ = in[-1];
+                break;
+            }
+        }
+    }
+    *out = '\0';
+
+    tok->end = out - buff;
+    tok->decoded = true;
+    return str;
+}
+
+bool libiot_json_int(const char *buff, const libiot_json_tok_t *tok,
+                     int64_t *val) {
+    if (tok->type != LIBIOT_JSON_PRIMITIVE) {
+        return false;
+    }
+
+    const char *s = buff + tok->start;
+    const char *end = buff + tok->end;
+
+    bool neg = s < end && *s == '-';
+    if (neg) {
+        s++;
+    }
+    if (s == end) {
+        return false;
+    }
+
+    uint64_t acc = 0;
+    for (; s < end; s++) {
+        if (*s < '0' || *s > '9' || acc > (UINT64_MAX - 9) / 10) {
+            return false;
+        }
+        acc = acc * 10 + (*s - '0');
+    }
+
+    if (acc > (uint64_t) INT64_MAX + (neg ? 1 : 0)) {
+        return false;
+    }
+
+    *val = neg ? (int64_t) (0 - acc) : (int64_t) acc;
+    return true;
+}
+
+bool libiot_json_bool(const char *buff, const libiot_json_tok_t *tok,
+                      bool *val) {
+    size_t len = tok->end - tok->start;
+    if (tok->type != LIBIOT_JSON_PRIMITIVE) {
+        return false;
+    }
+
+    if (len == 4 && !memcmp(buff + tok->start, "true", 4)) {
+        *val = true;
+        return true;
+    }
+    if (len == 5 && !memcmp(buff + tok->start, "false", 5)) {
+        *val = false;
+        return true;
+    }
+    return false;
+}
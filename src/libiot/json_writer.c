@@ -0,0 +1,232 @@
+#include "json_writer.h"
+
+#include <string.h>
+
+static void put(json_writer_t *w, const char *data, size_t len) {
+    if (w->buff && w->len + len <= w->cap) {
+        memcpy(w->buff + w->len, data, len);
+    } else {
+        w->buff = NULL;
+    }
+    w->len += len;
+}
+
+static void put_char(json_writer_t *w, char c) {
+    put(w, &c, 1);
+}
+
+// Writes the separator (if any) needed before a value.
+static void sep(json_writer_t *w) {
+    if (w->after_key) {
+        w->after_key = false;
+        return;
+    }
+
+    uint32_t bit = 1UL << w->depth;
+    if (w->nonempty & bit) {
+        put_char(w, ',');
+    }
+    w->nonempty |= bit;
+}
+
+static void open_container(json_writer_t *w, char c) {
+    sep(w);
+    put_char(w, c);
+
+    assert(w->depth + 1 < JSON_WRITER_MAX_DEPTH);
+    w->depth++;
+    w->nonempty &= ~(1UL << w->depth);
+}
+
+static void close_container(json_writer_t *w, char c) {
+    put_char(w, c);
+    w->depth--;
+}
+
+void json_writer_init(json_writer_t *w, char *buff, size_t cap) {
+    w->buff = buff;
+    w->cap = buff ? cap : 0;
+    w->len = 0;
+    w->nonempty = 0;
+    w->depth = 0;
+    w->after_key = false;
+}
+
+bool json_writer_ok(const json_writer_t *w) {
+    return w->buff && w->len <= w->cap;
+}
+
+void json_writer_finish(json_writer_t *w) {
+    if (w->buff && w->len + 1 <= w->cap) {
+        w->buff[w->len] = '\0';
+    } else {
+        w->buff = NULL;
+    }
+}
+
+void json_writer_obj_open(json_writer_t *w) {
+    open_container(w, '{');
+}
+
+void json_writer_obj_close(json_writer_t *w) {
+    close_container(w, '}');
+}
+
+void json_writer_arr_open(json_writer_t *w) {
+    open_container(w, '[');
+}
+
+void json_writer_arr_close(json_writer_t *w) {
+    close_container(w, ']');
+}
+
+void json_writer_key(json_writer_t *w, const char *key, size_t key_len) {
+    sep(w);
+    put_char(w, '"');
+    put(w, key, key_len);
+    put(w, "\":", 2);
+    w->after_key = true;
+}
+
+// Returns the escape sequence for `c`, or NULL if it needs none. `buff` must
+// have room for "\u00XX".
+static const char *escape(unsigned char c, char *buff) {
+    switch (c) {
+        case '"': {
+            return "\\\"";
+        }
+        case '\\': {
+            return "\\\\";
+        }
+        case '\b': {
+            return "\\b";
+        }
+        case '\f': {
+            return "\\f";
+        }
+        case '\n': {
+            return "\\n";
+        }
+        case '\r': {
+            return "\\r";
+        }
+        case '\t': {
+            return "\\t";
+        }
+        default: {
+            if (c < 0x20) {
+                static const char HEX[] = "0123456789abcdef";
+                memcpy(buff, "\\u00", 4);
+                buff[4] = HEX[c >> 4];
+                buff[5] = HEX[c & 0xF];
+                buff[6] = '\0';
+                return buff;
+            }
+            return NULL;
+        }
+    }
+}
+
+void json_writer_str(json_writer_t *w, const char *str) {
+    if (!str) {
+        json_writer_null(w);
+        return;
+    }
+
+    sep(w);
+    put_char(w, '"');
+
+    // Copy runs of characters which need no escaping in one go.
+    const char *run = str;
+    for (const char *c = str; *c; c++) {
+        char buff[7];
+        const char *esc = escape(*c, buff);
+        if (esc) {
+            put(w, run, c - run);
+            put(w, esc, strlen(esc));
+            run = c + 1;
+        }
+    }
+    put(w, run, strlen(run));
+
+    put_char(w, '"');
+}
+
+static size_t format_uint(uint64_t val, char *buff) {
+    char digits[20];
+    size_t n = 0;
+    do {
+        digits[n++] = '0' + val % 10;
+        val /= 10;
+    } while (val);
+
+    for (size_t i = 0; i < n; i++) {
+        buff[i] = digits[n - 1 - i];
+    }
+    return n;
+}
+
+void json_writer_int(json_writer_t *w, int64_t val) {
+    sep(w);
+
+    char buff[21];
+    size_t n = 0;
+    uint64_t mag = val;
+    if (val < 0) {
+        buff[n++] = '-';
+        mag = -(uint64_t) val;
+    }
+    n += format_uint(mag, buff + n);
+    put(w, buff, n);
+}
+
+void json_writer_uint(json_writer_t *w, uint64_t val) {
+    sep(w);
+
+    char buff[20];
+    put(w, buff, format_uint(val, buff));
+}
+
+void json_writer_bool(json_writer_t *w, bool val) {
+    sep(w);
+    if (val) {
+        put(w, "true", 4);
+    } else {
+        put(w, "false", 5);
+    }
+}
+
+void json_writer_null(json_writer_t *w) {
+    sep(w);
+    put(w, "null", 4);
+}
+
+size_t json_writer_str_len(const char *str) {
+    if (!str) {
+        return 4;
+    }
+
+    size_t len = 2;
+    for (const char *c = str; *c; c++) {
+        char buff[7];
+        const char *esc = escape(*c, buff);
+        len += esc ? strlen(esc) : 1;
+    }
+    return len;
+}
+
+size_t json_writer_uint_len(uint64_t val) {
+    size_t n = 1;
+    while (val >= 10) {
+        val /= 10;
+        n++;
+    }
+    return n;
+}
+
+size_t json_writer_int_len(int64_t val) {
+    if (val < 0) {
+        return 1 + json_writer_uint_len(-(uint64_t) val);
+    }
+    return json_writer_uint_len(val);
+}
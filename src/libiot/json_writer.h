@@ -0,0 +1,50 @@
+#pragma once
+
+#include "private.h"
+
+// A minimal JSON writer, which writes straight into a caller-supplied buffer
+// (inserting the separators itself). Like the CBOR writer, if the buffer is
+// NULL or too small nothing more is written, but `len` still counts the bytes
+// which would have been.
+//
+// The output matches `cJSON_PrintUnformatted()` for the same document.
+
+#define JSON_WRITER_MAX_DEPTH 32
+
+typedef struct json_writer {
+    char *buff;
+    size_t cap;
+    size_t len;
+
+    // Bit `d` is set once the container at depth `d` has a member.
+    uint32_t nonempty;
+    uint8_t depth;
+    // Whether a key has just been written (so that no separator is needed).
+    bool after_key;
+} json_writer_t;
+
+void json_writer_init(json_writer_t *w, char *buff, size_t cap);
+// Whether everything written so far fitted in the buffer.
+bool json_writer_ok(const json_writer_t *w);
+// Null terminates the output (without counting the terminator in `len`).
+void json_writer_finish(json_writer_t *w);
+
+void json_writer_obj_open(json_writer_t *w);
+void json_writer_obj_close(json_writer_t *w);
+void json_writer_arr_open(json_writer_t *w);
+void json_writer_arr_close(json_writer_t *w);
+
+// `key` must not require escaping.
+void json_writer_key(json_writer_t *w, const char *key, size_t key_len);
+
+// Writes null if `str` is NULL.
+void json_writer_str(json_writer_t *w, const char *str);
+void json_writer_int(json_writer_t *w, int64_t val);
+void json_writer_uint(json_writer_t *w, uint64_t val);
+void json_writer_bool(json_writer_t *w, bool val);
+void json_writer_null(json_writer_t *w);
+
+// The number of bytes `json_writer_str()` (etc.) would write.
+size_t json_writer_str_len(const char *str);
+size_t json_writer_int_len(int64_t val);
+size_t json_writer_uint_len(uint64_t val);
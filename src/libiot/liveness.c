@@ -0,0 +1,277 @@
+#include "liveness.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <freertos/timers.h>
+
+#include "mqtt.h"
+
+#define DEFAULT_DOWN_DETECT_MS 1500
+
+// The broker considers us gone once 1.5 keepalive periods pass without a
+// packet from us.
+#define BROKER_GRACE_NUM 3
+#define BROKER_GRACE_DEN 2
+
+// esp-mqtt sends a PINGREQ once half a keepalive period has passed since the
+// last one.
+#define PINGS_PER_KEEPALIVE 2
+
+// The local keepalive we give esp-mqtt while application traffic is proving
+// our liveness, which in practice stops it sending PINGREQs. (The broker still
+// holds us to the keepalive we sent in CONNECT.)
+#define SUPPRESSED_KEEPALIVE_S 3600
+
+#define WAKE_WINDOW_MS (60 * 1000)
+
+#define TASK_STACK_SIZE 3072
+#define TASK_PRIORITY 5
+
+static libiot_liveness_mode_t mode;
+static int keepalive_s = 1;
+
+static StaticTimer_t timer_static;
+static TimerHandle_t timer;
+
+// Does the periodic check when woken by the timer, since changing the
+// keepalive calls into esp-mqtt (which may block, and so must not happen on
+// the timer daemon).
+static TaskHandle_t task;
+
+// Protects everything below, except `last_tx_us` and `window_tx` (which are
+// atomic, since they are updated on every publish).
+static StaticSemaphore_t mutex_static;
+static SemaphoreHandle_t mutex;
+
+static int64_t last_tx_us;
+static bool pings_suppressed;
+// Incremented whenever `pings_suppressed` changes.
+static uint32_t suppressed_gen;
+
+// Whether the wake window is running, which it does while we are connected.
+static bool connected;
+
+// Accumulated over the current wake window.
+static int64_t window_start_us;
+static uint32_t window_tx;
+static int64_t window_ping_us;
+static int64_t ping_since_us;
+
+static uint32_t wakes_per_min;
+
+static void lock() {
+    while (xSemaphoreTake(mutex, portMAX_DELAY) == pdFALSE)
+        ;
+}
+
+static void unlock() {
+    xSemaphoreGive(mutex);
+}
+
+static uint32_t check_period_ms() {
+    // We check four times per keepalive period, so that pings resume at most
+    // half a keepalive period after traffic stops, leaving esp-mqtt a full
+    // keepalive period to get a PINGREQ out before the broker gives up on us.
+    return keepalive_s * 1000 / 4;
+}
+
+static uint32_t timer_period_ms() {
+    // Only adaptive mode needs to notice traffic stopping. Otherwise we only
+    // roll the wake window, so we leave the CPU asleep until it is due.
+    return mode == LIBIOT_LIVENESS_ADAPTIVE ? check_period_ms()
+                                            : WAKE_WINDOW_MS;
+}
+
+// Must be called with the lock held. Returns whether the keepalive must be
+// applied (with `apply_keepalive()`).
+static bool set_pings_suppressed(bool suppressed, int64_t now_us) {
+    if (suppressed == pings_suppressed) {
+        return false;
+    }
+
+    if (suppressed) {
+        window_ping_us += now_us - ping_since_us;
+    } else {
+        ping_since_us = now_us;
+    }
+
+    pings_suppressed = suppressed;
+    suppressed_gen++;
+    return true;
+}
+
+// Must be called without the lock held, since `esp_mqtt_set_config()` takes
+// the esp-mqtt client lock, which the esp-mqtt task holds while it calls our
+// event handler. (That also means that we do not race the esp-mqtt task.) If
+// the state changes while we apply it, we apply it again, so that the last
+// keepalive applied is always the current one.
+static void apply_keepalive() {
+    lock();
+    uint32_t gen;
+    do {
+        gen = suppressed_gen;
+        int new_keepalive_s =
+            pings_suppressed ? SUPPRESSED_KEEPALIVE_S : keepalive_s;
+        unlock();
+
+        libiot_mqtt_set_local_keepalive(new_keepalive_s);
+
+        lock();
+    } while (gen != suppressed_gen);
+    unlock();
+}
+
+// Must be called with the lock held.
+static void roll_window(int64_t now_us) {
+    if (now_us - window_start_us < WAKE_WINDOW_MS * 1000LL) {
+        return;
+    }
+
+    int64_t ping_us = window_ping_us;
+    if (!pings_suppressed) {
+        ping_us += now_us - ping_since_us;
+    }
+
+    uint32_t pings =
+        ping_us * PINGS_PER_KEEPALIVE / (keepalive_s * 1000000LL);
+    uint32_t window_ms = (now_us - window_start_us) / 1000;
+    uint32_t tx = __atomic_exchange_n(&window_tx, 0, __ATOMIC_RELAXED);
+    wakes_per_min = (uint64_t) (tx + pings) * WAKE_WINDOW_MS / window_ms;
+
+    window_start_us = now_us;
+    window_ping_us = 0;
+    ping_since_us = now_us;
+}
+
+static void task_liveness(void *unused) {
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        lock();
+
+        bool changed = false;
+        int64_t now_us = esp_timer_get_time();
+        if (mode == LIBIOT_LIVENESS_ADAPTIVE) {
+            int64_t since_tx_us =
+                now_us - __atomic_load_n(&last_tx_us, __ATOMIC_RELAXED);
+            changed = set_pings_suppressed(
+                since_tx_us < check_period_ms() * 1000LL, now_us);
+        }
+
+        roll_window(now_us);
+
+        unlock();
+
+        if (changed) {
+            apply_keepalive();
+        }
+    }
+}
+
+static void timer_cb(TimerHandle_t unused) {
+    xTaskNotifyGive(task);
+}
+
+void libiot_init_liveness(libiot_liveness_mode_t new_mode, int down_detect_ms,
+                          int max_idle_wakes_per_min) {
+    mode = new_mode;
+
+    if (down_detect_ms <= 0) {
+        down_detect_ms = DEFAULT_DOWN_DETECT_MS;
+    }
+
+    keepalive_s = down_detect_ms * BROKER_GRACE_DEN / BROKER_GRACE_NUM / 1000;
+    if (keepalive_s < 1) {
+        keepalive_s = 1;
+    }
+
+    if (max_idle_wakes_per_min > 0) {
+        int min_keepalive_s = (60 * PINGS_PER_KEEPALIVE + max_idle_wakes_per_min
+                               - 1)
+                              / max_idle_wakes_per_min;
+        if (keepalive_s < min_keepalive_s) {
+            ESP_LOGW(TAG,
+                     "liveness: raising keepalive to %ds to meet wake rate, "
+                     "down detection becomes %dms",
+                     min_keepalive_s,
+                     min_keepalive_s * 1000 * BROKER_GRACE_NUM
+                         / BROKER_GRACE_DEN);
+            keepalive_s = min_keepalive_s;
+        }
+    }
+
+    mutex = xSemaphoreCreateMutexStatic(&mutex_static);
+    timer = xTimerCreateStatic("libiot_liveness",
+                               timer_period_ms() / portTICK_PERIOD_MS, pdTRUE,
+                               NULL, timer_cb, &timer_static);
+
+    if (xTaskCreate(task_liveness, "liveness", TASK_STACK_SIZE, NULL,
+                    TASK_PRIORITY, &task)
+        != pdPASS) {
+        libiot_logf_error(TAG, "liveness: can't start task");
+    }
+}
+
+int libiot_liveness_get_keepalive_s() {
+    return keepalive_s;
+}
+
+void libiot_liveness_note_tx() {
+    __atomic_store_n(&last_tx_us, esp_timer_get_time(), __ATOMIC_RELAXED);
+    __atomic_fetch_add(&window_tx, 1, __ATOMIC_RELAXED);
+}
+
+void libiot_liveness_handle_event(esp_mqtt_event_handle_t event) {
+    switch (event->event_id) {
+        case MQTT_EVENT_BEFORE_CONNECT: {
+            // The keepalive we send in CONNECT must always be the real one.
+            lock();
+            bool changed = set_pings_suppressed(false, esp_timer_get_time());
+            unlock();
+
+            if (changed) {
+                apply_keepalive();
+            }
+            break;
+        }
+        case MQTT_EVENT_CONNECTED: {
+            lock();
+            int64_t now_us = esp_timer_get_time();
+            connected = true;
+            window_start_us = now_us;
+            __atomic_store_n(&window_tx, 0, __ATOMIC_RELAXED);
+            window_ping_us = 0;
+            ping_since_us = now_us;
+            unlock();
+
+            xTimerStart(timer, 0);
+            break;
+        }
+        case MQTT_EVENT_DISCONNECTED: {
+            lock();
+            connected = false;
+            unlock();
+
+            xTimerStop(timer, 0);
+            break;
+        }
+        default: {
+            break;
+        }
+    }
+}
+
+void libiot_liveness_get_state(liveness_state_t *state) {
+    lock();
+    // The timer may fire just short of the end of a window.
+    if (connected) {
+        roll_window(esp_timer_get_time());
+    }
+    state->keepalive_s = keepalive_s;
+    state->pings_suppressed = pings_suppressed;
+    state->wakes_per_min = wakes_per_min;
+    unlock();
+}
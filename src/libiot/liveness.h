@@ -0,0 +1,31 @@
+#pragma once
+
+#include <mqtt_client.h>
+
+#include "private.h"
+
+// Called even if mqtt will not be started.
+void libiot_init_liveness(libiot_liveness_mode_t mode, int down_detect_ms,
+                          int max_idle_wakes_per_min);
+
+// The keepalive (in seconds) which we must send in CONNECT in order to meet
+// the down detection target.
+int libiot_liveness_get_keepalive_s();
+
+// Called whenever we hand a packet to esp-mqtt, since any packet we send
+// proves our liveness to the broker just as well as a PINGREQ.
+void libiot_liveness_note_tx();
+
+// Called from the esp-mqtt event task for every event.
+void libiot_liveness_handle_event(esp_mqtt_event_handle_t event);
+
+typedef struct liveness_state {
+    int keepalive_s;
+    // Whether PINGREQs are currently suppressed by application traffic.
+    bool pings_suppressed;
+    // Our estimate of the number of times per minute the radio woke to
+    // transmit over the last minute (packets plus PINGREQs).
+    uint32_t wakes_per_min;
+} liveness_state_t;
+
+void libiot_liveness_get_state(liveness_state_t *state);
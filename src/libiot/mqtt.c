@@ -1,25 +1,38 @@
 #include "mqtt.h"
 
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
+#include <freertos/semphr.h>
 #include <libesp.h>
 #include <mqtt_client.h>
 #include <stdio.h>
 
+#include "bench.h"
 #include "certs.h"
+#include "connect_seq.h"
+#include "format.h"
 #include "gpio.h"
-#include "json_builder.h"
+#include "liveness.h"
 #include "ota.h"
+#include "ota_mqtt.h"
+#include "outbox.h"
+#include "payload.h"
+#include "post_queue.h"
+#include "reassembly.h"
+#include "router.h"
+#include "subscriptions.h"
 
 static char device_topic_root[64];
 static size_t device_topic_root_len;
 
-static bool first_connect = true;
 static void (*mqtt_event_handler_cb)(esp_mqtt_event_handle_t event);
 static StaticEventGroup_t events_static;
 static EventGroupHandle_t events;
 
+static uint32_t disconnect_count;
+
 // These are two separate bits in order to be able to wait on either condition.
 // The guarentee is that they will never both be set, but neither could be
 // (during a transition, or before the first connect).
@@ -33,60 +46,179 @@ static EventGroupHandle_t events;
 
 #define FIRST_CONNECT_TIMEOUT_INTERVAL_MS (2 * 60 * 1000)
 
+#define TOPIC_BUFF_SIZE 128
+
 static esp_mqtt_client_handle_t client = NULL;
+static esp_mqtt_client_config_t mqtt_cfg;
+
+// Handles for the topics of built-in messages, resolved in
+// `libiot_init_mqtt()`.
+static const libiot_topic_t *topic_status;
+static const libiot_topic_t *topic_info;
+static const libiot_topic_t *topic_startup;
+static const libiot_topic_t *topic_mem_check;
+
+static void send_resp(const libiot_topic_t *topic, payload_t *payload,
+                      bool retain) {
+    assert(payload->data);
+    libiot_mqtt_publishb_topic(topic, 2, retain ? 1 : 0, payload->data,
+                               payload->len);
+    libiot_payload_free(payload);
+}
+
+// Like `send_resp()`, but returns whether the publish succeeded instead of
+// asserting it (and does not free `payload`).
+static bool try_send_resp(const libiot_topic_t *topic,
+                          const payload_t *payload, bool retain) {
+    if (!payload->data) {
+        return false;
+    }
+
+    return libiot_mqtt_try_publish(topic->str, payload->data, payload->len, 2,
+                                   retain ? 1 : 0)
+           >= 0;
+}
+
+// The system id only changes when OTA commands are processed (which send a
+// refresh), so we keep the last one built to publish on every reconnect
+// instead of rebuilding it each time.
+static StaticSemaphore_t system_id_cache_mutex_static;
+static SemaphoreHandle_t system_id_cache_mutex;
+static payload_t system_id_cache;
+
+static void lock_system_id_cache() {
+    while (xSemaphoreTake(system_id_cache_mutex, portMAX_DELAY) == pdFALSE)
+        ;
+}
+
+static void unlock_system_id_cache() {
+    xSemaphoreGive(system_id_cache_mutex);
+}
+
+// Copies the cached system id (building it first if need be) into `out`, so
+// that it can be published without holding the cache lock. Leaves
+// `out->data == NULL` on failure.
+static void copy_system_id_cache(payload_t *out) {
+    out->data = NULL;
+    out->len = 0;
+
+    lock_system_id_cache();
+    if (!system_id_cache.data) {
+        libiot_payload_build_system_id(&system_id_cache);
+    }
 
-static void send_resp(const char *suffix, char *msg, bool retain) {
-    assert(msg);
-    libiot_mqtt_publish_local(suffix, 2, retain ? 1 : 0, msg);
-    free(msg);
+    if (system_id_cache.data) {
+        // Note that JSON payloads are null terminated.
+        out->data = malloc(system_id_cache.len + 1);
+        if (out->data) {
+            memcpy(out->data, system_id_cache.data, system_id_cache.len);
+            out->data[system_id_cache.len] = '\0';
+            out->len = system_id_cache.len;
+        }
+    }
+    unlock_system_id_cache();
 }
 
 void libiot_mqtt_send_ping_resp() {
-    send_resp(MQTT_TOPIC_INFO("status"), libiot_json_build_state_up(), true);
+    payload_t payload;
+    libiot_payload_build_state_up(&payload);
+    send_resp(topic_status, &payload, true);
 }
 
 void libiot_mqtt_send_refresh_resp() {
-    send_resp(MQTT_TOPIC_INFO("info"), libiot_json_build_system_id(), true);
+    int64_t start_us = esp_timer_get_time();
+
+    payload_t payload;
+    libiot_payload_build_system_id(&payload);
+    assert(payload.data);
+
+    uint32_t build_us = esp_timer_get_time() - start_us;
+    ESP_LOGI(TAG, "system id rebuilt in %uus (%u bytes)", build_us,
+             payload.len);
+    libiot_mqtt_postf_local(MQTT_TOPIC_INFO("refresh"), 0, 0,
+                            "{\"build_us\":%u,\"bytes\":%u}", build_us,
+                            payload.len);
+
+    // The publish blocks, so we publish before the payload is shared through
+    // the cache (rather than publish a copy, or hold the lock).
+    libiot_mqtt_publishb_topic(topic_info, 2, 1, payload.data, payload.len);
+
+    lock_system_id_cache();
+    libiot_payload_free(&system_id_cache);
+    system_id_cache = payload;
+    unlock_system_id_cache();
+}
+
+bool libiot_mqtt_connect_send_status() {
+    // Send the up status message and WiFi RSSI info
+    payload_t payload;
+    libiot_payload_build_state_up(&payload);
+    bool sent = try_send_resp(topic_status, &payload, true);
+    libiot_payload_free(&payload);
+    return sent;
+}
+
+bool libiot_mqtt_connect_send_info() {
+    // Publish device hardware information
+    payload_t payload;
+    copy_system_id_cache(&payload);
+    bool sent = try_send_resp(topic_info, &payload, true);
+    libiot_payload_free(&payload);
+    return sent;
+}
+
+bool libiot_mqtt_connect_send_startup() {
+    // Publish the last reset reason
+    payload_t payload;
+    libiot_payload_build_startup(&payload);
+    bool sent = try_send_resp(topic_startup, &payload, true);
+    libiot_payload_free(&payload);
+    return sent;
 }
 
 void libiot_mqtt_send_mem_check_resp() {
-    send_resp(MQTT_TOPIC_INFO("mem_check"), libiot_json_build_mem_check(),
-              false);
+    payload_t payload;
+    libiot_payload_build_mem_check(&payload);
+    send_resp(topic_mem_check, &payload, false);
 }
 
-// Note: `topic_suffix` must be null terminated, but `topic` need not be, and
-// `len` is the length of the latter.
-static bool matches_local_topic(const char *topic_suffix, const char *topic,
-                                size_t len) {
-    if (len < device_topic_root_len
-        || memcmp(device_topic_root, topic, device_topic_root_len)) {
-        return false;
-    }
+static void route_restart(esp_mqtt_event_handle_t event, void *unused) {
+    // Any message to this topic will trigger a restart of the ESP32.
+    ESP_LOGW(TAG, "mqtt: restart");
+    esp_restart();
+}
 
-    topic += device_topic_root_len;
-    len -= device_topic_root_len;
+#ifndef LIBIOT_DISABLE_OTA
+static void route_ota(esp_mqtt_event_handle_t event, void *unused) {
+    // Message to begin OTA
+    ESP_LOGW(TAG, "mqtt: ota");
 
-    if (!len || *topic != '/') {
-        return false;
-    }
+    char *dup = strndup(event->data, event->data_len);
+    libiot_ota_dispatch_request(dup);
+}
 
-    topic++;
-    len--;
+static void route_ota_chunk(esp_mqtt_event_handle_t event, void *unused) {
+    libiot_ota_mqtt_handle_chunk(event);
+}
+#endif
 
-    while (*topic_suffix) {
-        if (!len || *topic_suffix != *topic) {
-            return false;
-        }
-        topic_suffix++;
-        topic++;
-        len--;
-    }
+static void route_ping(esp_mqtt_event_handle_t event, void *unused) {
+    // Re-publish up status whenever pinged
+    ESP_LOGI(TAG, "mqtt: ping");
+    libiot_mqtt_send_ping_resp();
+}
 
-    if (len) {
-        return false;
-    }
+static void route_refresh(esp_mqtt_event_handle_t event, void *unused) {
+    // Re-publish up hardware information whenever refreshed
+    ESP_LOGI(TAG, "mqtt: refresh");
+    libiot_mqtt_send_refresh_resp();
+}
 
-    return true;
+static void route_mem_check(esp_mqtt_event_handle_t event, void *unused) {
+    // Perform a memory integrity check, and also report the current heap
+    // state.
+    ESP_LOGI(TAG, "mqtt: mem_check");
+    libiot_mqtt_send_mem_check_resp();
 }
 
 static void mqtt_event_handler(void *handler_args, esp_event_base_t base,
@@ -94,29 +226,20 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base,
     ESP_LOGD(TAG, "mqtt event: base='%s', event_id=%d", base, event_id);
 
     esp_mqtt_event_handle_t event = (esp_mqtt_event_handle_t) event_data;
+    libiot_subscriptions_handle_event(event);
+    libiot_liveness_handle_event(event);
+
     switch (event->event_id) {
         case MQTT_EVENT_CONNECTED: {
-            // TODO Could this technically fail to arrive? Do something
-            // fancy here to periodically check?
-            libiot_mqtt_subscribe(IOT_MQTT_COMMAND_TOPIC("ping"), 0);
-            libiot_mqtt_subscribe_local("#", 0);
-
-            // Send the up status message and WiFi RSSI info
-            libiot_mqtt_send_ping_resp();
-
-            // Publish device hardware information and the last reset reason
-            libiot_mqtt_send_refresh_resp();
-            if (first_connect) {
-                send_resp(MQTT_TOPIC_INFO("startup"),
-                          libiot_json_build_startup(), true);
-                first_connect = false;
-            }
+            xEventGroupClearBits(events, MQTT_EVENT_DISCONNECTED);
+            xEventGroupSetBits(events, MQTT_EVENT_CONNECTED);
 
             libiot_gpio_led_set_state(true);
-            ESP_LOGI(TAG, "mqtt connected, up status published");
+            ESP_LOGI(TAG, "mqtt connected");
 
-            xEventGroupClearBits(events, MQTT_EVENT_DISCONNECTED);
-            xEventGroupSetBits(events, MQTT_EVENT_CONNECTED);
+            // Subscribing and publishing our status is left to the connect
+            // sequence task, so that we don't hold up the event task.
+            libiot_connect_seq_notify();
             break;
         }
         case MQTT_EVENT_DISCONNECTED: {
@@ -132,52 +255,15 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base,
             libiot_gpio_led_set_state(false);
             ESP_LOGI(TAG, "mqtt disconnected");
 
+            __atomic_fetch_add(&disconnect_count, 1, __ATOMIC_RELAXED);
             xEventGroupClearBits(events, MQTT_EVENT_CONNECTED);
             xEventGroupSetBits(events, MQTT_EVENT_DISCONNECTED);
+
+            libiot_reassembly_reset();
             break;
         }
         case MQTT_EVENT_DATA: {
-            if (matches_local_topic(MQTT_TOPIC_CMD("restart"), event->topic,
-                                    event->topic_len)) {
-                // Any message to this topic will trigger a restart of the
-                // ESP32.
-                ESP_LOGW(TAG, "mqtt: restart");
-                esp_restart();
-            }
-
-#ifndef LIBIOT_DISABLE_OTA
-            if (matches_local_topic(MQTT_TOPIC_CMD("ota"), event->topic,
-                                    event->topic_len)) {
-                // Message to begin OTA
-                ESP_LOGW(TAG, "mqtt: ota");
-
-                char *dup = strndup(event->data, event->data_len);
-                libiot_ota_dispatch_request(dup);
-            }
-#endif
-
-            if (!strncmp(IOT_MQTT_COMMAND_TOPIC("ping"), event->topic,
-                         event->topic_len)) {
-                // Re-publish up status whenever pinged
-                ESP_LOGI(TAG, "mqtt: ping");
-                libiot_mqtt_send_ping_resp();
-            }
-
-            if (matches_local_topic(MQTT_TOPIC_CMD("refresh"), event->topic,
-                                    event->topic_len)) {
-                // Re-publish up hardware information whenever refreshed
-                ESP_LOGI(TAG, "mqtt: refresh");
-                libiot_mqtt_send_refresh_resp();
-            }
-
-            if (matches_local_topic(MQTT_TOPIC_CMD("mem_check"), event->topic,
-                                    event->topic_len)) {
-                // Perform a memory integrity check, and also report the current
-                // heap state.
-                ESP_LOGI(TAG, "mqtt: mem_check");
-                libiot_mqtt_send_mem_check_resp();
-            }
-
+            libiot_reassembly_handle_data(event);
             break;
         }
         default: {
@@ -226,11 +312,48 @@ static __unused void task_mqtt_watchdog(void *unused) {
     vTaskDelete(NULL);
 }
 
+// Returns the handle for the topic of a built-in payload, which advertises the
+// payload format.
+static const libiot_topic_t *builtin_topic(const char *suffix) {
+    char buff[TOPIC_BUFF_SIZE];
+    int len = snprintf(buff, sizeof(buff), "%s%s", suffix,
+                       libiot_payload_topic_suffix());
+    assert(len + 1 <= sizeof(buff));
+    return libiot_mqtt_topic_local(buff);
+}
+
 void libiot_init_mqtt(const char *name) {
     device_topic_root_len =
         snprintf(device_topic_root, sizeof(device_topic_root),
                  IOT_MQTT_DEVICE_TOPIC_ROOT("%s"), name);
     assert(device_topic_root_len + 1 <= sizeof(device_topic_root));
+
+    system_id_cache_mutex =
+        xSemaphoreCreateMutexStatic(&system_id_cache_mutex_static);
+
+    topic_status = builtin_topic(MQTT_TOPIC_INFO("status"));
+    topic_info = builtin_topic(MQTT_TOPIC_INFO("info"));
+    topic_startup = builtin_topic(MQTT_TOPIC_INFO("startup"));
+    topic_mem_check = builtin_topic(MQTT_TOPIC_INFO("mem_check"));
+
+    libiot_mqtt_route_local(MQTT_TOPIC_CMD("restart"), route_restart, NULL);
+#ifndef LIBIOT_DISABLE_OTA
+    libiot_mqtt_route_local(MQTT_TOPIC_CMD("ota"), route_ota, NULL);
+    libiot_mqtt_route_local(MQTT_TOPIC_CMD("ota_chunk"), route_ota_chunk,
+                            NULL);
+#endif
+    libiot_mqtt_route(IOT_MQTT_COMMAND_TOPIC("ping"), route_ping, NULL);
+    libiot_mqtt_route_local(MQTT_TOPIC_CMD("refresh"), route_refresh, NULL);
+    libiot_mqtt_route_local(MQTT_TOPIC_CMD("mem_check"), route_mem_check,
+                            NULL);
+#ifdef LIBIOT_ENABLE_BENCH
+    libiot_init_bench();
+#endif
+
+    // These are subscribed to whenever we connect.
+    libiot_init_subscriptions();
+    libiot_mqtt_subscribe(IOT_MQTT_COMMAND_TOPIC("ping"), 0);
+    libiot_mqtt_subscribe_local("#", 0);
 }
 
 void libiot_start_mqtt(const char *uri, const char *cert, const char *key,
@@ -239,13 +362,11 @@ void libiot_start_mqtt(const char *uri, const char *cert, const char *key,
                        void (*cb)(esp_mqtt_event_handle_t event)) {
     mqtt_event_handler_cb = cb;
 
-    char *lwt_topic;
-    assert(
-        asprintf(&lwt_topic, "%s/" MQTT_TOPIC_INFO("status"), device_topic_root)
-        >= 0);
-    char *lwt_msg = libiot_json_build_state_down();
+    payload_t lwt;
+    libiot_payload_build_state_down(&lwt);
+    assert(lwt.data);
 
-    esp_mqtt_client_config_t mqtt_cfg = {
+    mqtt_cfg = (esp_mqtt_client_config_t){
         .uri = uri,
         .cert_pem = LIBIOT_CERT_AUTHORITY_ENDPOINT,
         .client_cert_pem = cert,
@@ -253,10 +374,11 @@ void libiot_start_mqtt(const char *uri, const char *cert, const char *key,
         .username = name,
         .password = pass,
 
-        // Keepalive interval in seconds (this is the time between ping messages
-        // exchanged with the broker, i.e. roughly how long it will take for
-        // other devices to observe that we are down.)
-        .keepalive = 1,
+        // Keepalive interval in seconds (the broker will consider us down
+        // after 1.5 intervals without hearing from us, and so this is roughly
+        // how long it will take for other devices to observe that we are
+        // down.)
+        .keepalive = libiot_liveness_get_keepalive_s(),
 
         .disable_auto_reconnect = false,
         .reconnect_timeout_ms = 1000,
@@ -266,8 +388,9 @@ void libiot_start_mqtt(const char *uri, const char *cert, const char *key,
         .task_stack = mqtt_task_stack_size,
 
         // "Last Will and Testament" status (down) message
-        .lwt_topic = lwt_topic,
-        .lwt_msg = lwt_msg,
+        .lwt_topic = topic_status->str,
+        .lwt_msg = lwt.data,
+        .lwt_msg_len = lwt.len,
         .lwt_qos = 2,
         .lwt_retain = 1,
     };
@@ -276,8 +399,12 @@ void libiot_start_mqtt(const char *uri, const char *cert, const char *key,
 
     client = esp_mqtt_client_init(&mqtt_cfg);
 
-    free(lwt_topic);
-    free(lwt_msg);
+    libiot_payload_free(&lwt);
+
+    // Already copied by esp-mqtt, and so must not be set again by
+    // `libiot_mqtt_set_local_keepalive()`.
+    mqtt_cfg.lwt_topic = NULL;
+    mqtt_cfg.lwt_msg = NULL;
 
     ESP_LOGI(TAG, "mqtt connecting");
 
@@ -285,6 +412,8 @@ void libiot_start_mqtt(const char *uri, const char *cert, const char *key,
                                    client);
     esp_mqtt_client_start(client);
 
+    libiot_start_post_queue();
+
 #ifdef LIBIOT_ENABLE_MQTT_WATCHDOG
     xTaskCreate(task_mqtt_watchdog, "mqtt_watchdog", WATCHDOG_TASK_STACK_SIZE,
                 NULL, WATCHDOG_TASK_PRIORITY, NULL);
@@ -301,6 +430,93 @@ void libiot_start_mqtt(const char *uri, const char *cert, const char *key,
     }
 }
 
+bool libiot_mqtt_wait_connected(TickType_t ticks) {
+    if (!events) {
+        return false;
+    }
+
+    EventBits_t bits =
+        xEventGroupWaitBits(events, MQTT_EVENT_CONNECTED, false, false, ticks);
+    return bits & MQTT_EVENT_CONNECTED;
+}
+
+uint32_t libiot_mqtt_get_disconnect_count() {
+    return __atomic_load_n(&disconnect_count, __ATOMIC_RELAXED);
+}
+
+void libiot_mqtt_set_local_keepalive(int keepalive_s) {
+#ifndef LIBIOT_DISABLE_WIFI
+    // Note that `esp_mqtt_set_config()` overwrites some fields (e.g. the LWT
+    // QoS) even when they are zero, so we pass our original config again.
+    esp_mqtt_client_config_t cfg = mqtt_cfg;
+    cfg.keepalive = keepalive_s;
+    ESP_ERROR_CHECK(esp_mqtt_set_config(client, &cfg));
+#endif
+}
+
+int libiot_mqtt_try_subscribe(const char *topic, int qos) {
+#ifdef LIBIOT_DISABLE_WIFI
+    return -1;
+#else
+    return esp_mqtt_client_subscribe(client, topic, qos);
+#endif
+}
+
+int libiot_mqtt_try_publish(const char *topic, const char *msg, int len,
+                            int qos, int retain) {
+#ifdef LIBIOT_DISABLE_WIFI
+    return -1;
+#else
+    int msg_id = esp_mqtt_client_publish(client, topic, msg, len, qos, retain);
+    if (msg_id >= 0) {
+        libiot_liveness_note_tx();
+    }
+    return msg_id;
+#endif
+}
+
+int libiot_mqtt_try_enqueue(const char *topic, const char *msg, int qos,
+                            int retain) {
+#ifdef LIBIOT_DISABLE_WIFI
+    return -1;
+#else
+    if (libiot_outbox_capture(topic, msg, strlen(msg), qos, retain)) {
+        return 0;
+    }
+
+    int msg_id =
+        esp_mqtt_client_enqueue(client, topic, msg, 0, qos, retain, true);
+    if (msg_id >= 0) {
+        libiot_liveness_note_tx();
+    }
+    return msg_id;
+#endif
+}
+
+// Builds 'hoek/iot/<device_name>/<topic_suffix>' into `buff` if it fits, and
+// onto the heap otherwise. The result must be released with
+// `release_local_topic()`.
+static char *build_local_topic(char *buff, size_t buff_len,
+                               const char *topic_suffix) {
+    size_t suffix_len = strlen(topic_suffix);
+    size_t len = device_topic_root_len + 1 + suffix_len;
+    if (len + 1 > buff_len) {
+        buff = malloc(len + 1);
+        assert(buff);
+    }
+
+    memcpy(buff, device_topic_root, device_topic_root_len);
+    buff[device_topic_root_len] = '/';
+    memcpy(buff + device_topic_root_len + 1, topic_suffix, suffix_len + 1);
+    return buff;
+}
+
+static void release_local_topic(const char *buff, char *topic) {
+    if (topic != buff) {
+        free(topic);
+    }
+}
+
 void libiot_mqtt_build_local_topic_from_suffix(char *buff, size_t buff_len,
                                                const char *topic_suffix) {
     int len =
@@ -308,50 +524,93 @@ void libiot_mqtt_build_local_topic_from_suffix(char *buff, size_t buff_len,
     assert(len + 1 <= buff_len);
 }
 
-void libiot_mqtt_subscribe(const char *topic, int qos) {
-#ifdef LIBIOT_DISABLE_WIFI
-    ESP_LOGW(TAG, "dropped mqtt subscribe! (wifi disabled)");
-#else
-    assert(esp_mqtt_client_subscribe(client, topic, qos) >= 0);
-#endif
+void libiot_mqtt_route(const char *topic_filter, libiot_mqtt_route_cb_t cb,
+                       void *ctx) {
+    libiot_router_insert(topic_filter, cb, ctx, false);
 }
 
-#define TOPIC_BUFF_SIZE 128
+void libiot_mqtt_route_local(const char *topic_filter_suffix,
+                             libiot_mqtt_route_cb_t cb, void *ctx) {
+    char topic_buff[TOPIC_BUFF_SIZE];
+    char *topic =
+        build_local_topic(topic_buff, sizeof(topic_buff), topic_filter_suffix);
+    libiot_router_insert(topic, cb, ctx, false);
+    release_local_topic(topic_buff, topic);
+}
+
+void libiot_mqtt_route_stream(const char *topic_filter,
+                              libiot_mqtt_route_cb_t cb, void *ctx) {
+    libiot_router_insert(topic_filter, cb, ctx, true);
+}
+
+void libiot_mqtt_route_stream_local(const char *topic_filter_suffix,
+                                    libiot_mqtt_route_cb_t cb, void *ctx) {
+    char topic_buff[TOPIC_BUFF_SIZE];
+    char *topic =
+        build_local_topic(topic_buff, sizeof(topic_buff), topic_filter_suffix);
+    libiot_router_insert(topic, cb, ctx, true);
+    release_local_topic(topic_buff, topic);
+}
 
 void libiot_mqtt_subscribe_local(const char *topic_suffix, int qos) {
     char topic_buff[TOPIC_BUFF_SIZE];
-    libiot_mqtt_build_local_topic_from_suffix(topic_buff, sizeof(topic_buff),
-                                              topic_suffix);
-    libiot_mqtt_subscribe(topic_buff, qos);
+    char *topic =
+        build_local_topic(topic_buff, sizeof(topic_buff), topic_suffix);
+    libiot_mqtt_subscribe(topic, qos);
+    release_local_topic(topic_buff, topic);
 }
 
 void libiot_mqtt_publish(const char *topic, int qos, int retain,
                          const char *msg) {
+    libiot_mqtt_publishb(topic, qos, retain, msg, strlen(msg));
+}
+
+void libiot_mqtt_publishb(const char *topic, int qos, int retain,
+                          const void *data, size_t len) {
 #ifdef LIBIOT_DISABLE_WIFI
     ESP_LOGW(TAG, "dropped mqtt publish! (wifi disabled)");
 #else
-    assert(esp_mqtt_client_publish(client, topic, msg, 0, qos, retain) >= 0);
+    if (libiot_outbox_capture(topic, data, len, qos, retain)) {
+        return;
+    }
+
+    // Note that esp-mqtt takes a zero length to mean a null terminated `data`.
+    assert(esp_mqtt_client_publish(client, topic, len ? data : "", len, qos,
+                                   retain)
+           >= 0);
+    libiot_liveness_note_tx();
 #endif
 }
 
+void libiot_mqtt_publishb_local(const char *topic_suffix, int qos, int retain,
+                                const void *data, size_t len) {
+    char topic_buff[TOPIC_BUFF_SIZE];
+    char *topic =
+        build_local_topic(topic_buff, sizeof(topic_buff), topic_suffix);
+    libiot_mqtt_publishb(topic, qos, retain, data, len);
+    release_local_topic(topic_buff, topic);
+}
+
 void libiot_mqtt_publish_local(const char *topic_suffix, int qos, int retain,
                                const char *msg) {
     char topic_buff[TOPIC_BUFF_SIZE];
-    libiot_mqtt_build_local_topic_from_suffix(topic_buff, sizeof(topic_buff),
-                                              topic_suffix);
-    libiot_mqtt_publish(topic_buff, qos, retain, msg);
+    char *topic =
+        build_local_topic(topic_buff, sizeof(topic_buff), topic_suffix);
+    libiot_mqtt_publish(topic, qos, retain, msg);
+    release_local_topic(topic_buff, topic);
 }
 
 void libiot_mqtt_publishv_local(const char *topic_suffix, int qos, int retain,
                                 const char *fmt, va_list va) {
-    char *msg;
-    if (vasprintf(&msg, fmt, va) < 0) {
+    char buff[LIBIOT_FORMAT_SCRATCH_SIZE];
+    char *msg = libiot_vformat(buff, sizeof(buff), fmt, va);
+    if (!msg) {
         return;
     }
 
     libiot_mqtt_publish_local(topic_suffix, qos, retain, msg);
 
-    free(msg);
+    libiot_format_release(buff, msg);
 }
 
 void libiot_mqtt_publishf_local(const char *topic_suffix, int qos, int retain,
@@ -369,29 +628,36 @@ void libiot_mqtt_enqueue(const char *topic, int qos, int retain,
 #ifdef LIBIOT_DISABLE_WIFI
     ESP_LOGW(TAG, "dropped mqtt enqueue! (wifi disabled)");
 #else
+    if (libiot_outbox_capture(topic, msg, strlen(msg), qos, retain)) {
+        return;
+    }
+
     assert(esp_mqtt_client_enqueue(client, topic, msg, 0, qos, retain, true)
            >= 0);
+    libiot_liveness_note_tx();
 #endif
 }
 
 void libiot_mqtt_enqueue_local(const char *topic_suffix, int qos, int retain,
                                const char *msg) {
     char topic_buff[TOPIC_BUFF_SIZE];
-    libiot_mqtt_build_local_topic_from_suffix(topic_buff, sizeof(topic_buff),
-                                              topic_suffix);
-    libiot_mqtt_enqueue(topic_buff, qos, retain, msg);
+    char *topic =
+        build_local_topic(topic_buff, sizeof(topic_buff), topic_suffix);
+    libiot_mqtt_enqueue(topic, qos, retain, msg);
+    release_local_topic(topic_buff, topic);
 }
 
 void libiot_mqtt_enqueuev_local(const char *topic_suffix, int qos, int retain,
                                 const char *fmt, va_list va) {
-    char *msg;
-    if (vasprintf(&msg, fmt, va) < 0) {
+    char buff[LIBIOT_FORMAT_SCRATCH_SIZE];
+    char *msg = libiot_vformat(buff, sizeof(buff), fmt, va);
+    if (!msg) {
         return;
     }
 
     libiot_mqtt_enqueue_local(topic_suffix, qos, retain, msg);
 
-    free(msg);
+    libiot_format_release(buff, msg);
 }
 
 void libiot_mqtt_enqueuef_local(const char *topic_suffix, int qos, int retain,
@@ -403,3 +669,191 @@ void libiot_mqtt_enqueuef_local(const char *topic_suffix, int qos, int retain,
 
     va_end(va);
 }
+
+bool libiot_mqtt_post_local(const char *topic_suffix, int qos, int retain,
+                            const char *msg) {
+    char topic_buff[TOPIC_BUFF_SIZE];
+    char *topic =
+        build_local_topic(topic_buff, sizeof(topic_buff), topic_suffix);
+    bool posted = libiot_mqtt_post(topic, qos, retain, msg);
+    release_local_topic(topic_buff, topic);
+    return posted;
+}
+
+bool libiot_mqtt_postv_local(const char *topic_suffix, int qos, int retain,
+                             const char *fmt, va_list va) {
+    char buff[LIBIOT_FORMAT_SCRATCH_SIZE];
+    char *msg = libiot_vformat(buff, sizeof(buff), fmt, va);
+    if (!msg) {
+        return false;
+    }
+
+    bool posted = libiot_mqtt_post_local(topic_suffix, qos, retain, msg);
+
+    libiot_format_release(buff, msg);
+    return posted;
+}
+
+bool libiot_mqtt_postf_local(const char *topic_suffix, int qos, int retain,
+                             const char *fmt, ...) {
+    va_list va;
+    va_start(va, fmt);
+
+    bool posted = libiot_mqtt_postv_local(topic_suffix, qos, retain, fmt, va);
+
+    va_end(va);
+    return posted;
+}
+
+typedef struct interned_topic interned_topic_t;
+struct interned_topic {
+    libiot_topic_t handle;
+    interned_topic_t *next;
+    char str[];
+};
+
+static interned_topic_t *interned_topics;
+
+static StaticSemaphore_t interned_topics_mutex_static;
+static SemaphoreHandle_t interned_topics_mutex;
+
+static const libiot_topic_t *intern_topic(const char *topic, size_t len) {
+    if (!interned_topics_mutex) {
+        // Note that `libiot_init_mqtt()` interns the built-in topics, before
+        // any other task could race us here.
+        interned_topics_mutex =
+            xSemaphoreCreateMutexStatic(&interned_topics_mutex_static);
+    }
+
+    while (xSemaphoreTake(interned_topics_mutex, portMAX_DELAY) == pdFALSE)
+        ;
+
+    interned_topic_t *it;
+    for (it = interned_topics; it; it = it->next) {
+        if (it->handle.len == len && !memcmp(it->str, topic, len)) {
+            break;
+        }
+    }
+
+    if (!it) {
+        it = malloc(sizeof(interned_topic_t) + len + 1);
+        assert(it);
+
+        memcpy(it->str, topic, len);
+        it->str[len] = '\0';
+        it->handle.str = it->str;
+        it->handle.len = len;
+
+        it->next = interned_topics;
+        interned_topics = it;
+    }
+
+    xSemaphoreGive(interned_topics_mutex);
+
+    return &it->handle;
+}
+
+const libiot_topic_t *libiot_mqtt_topic(const char *topic) {
+    return intern_topic(topic, strlen(topic));
+}
+
+const libiot_topic_t *libiot_mqtt_topic_local(const char *topic_suffix) {
+    char topic_buff[TOPIC_BUFF_SIZE];
+    char *topic =
+        build_local_topic(topic_buff, sizeof(topic_buff), topic_suffix);
+    const libiot_topic_t *handle = libiot_mqtt_topic(topic);
+    release_local_topic(topic_buff, topic);
+    return handle;
+}
+
+void libiot_mqtt_publish_topic(const libiot_topic_t *topic, int qos,
+                               int retain, const char *msg) {
+    libiot_mqtt_publish(topic->str, qos, retain, msg);
+}
+
+void libiot_mqtt_publishb_topic(const libiot_topic_t *topic, int qos,
+                                int retain, const void *data, size_t len) {
+    libiot_mqtt_publishb(topic->str, qos, retain, data, len);
+}
+
+void libiot_mqtt_publishv_topic(const libiot_topic_t *topic, int qos,
+                                int retain, const char *fmt, va_list va) {
+    char buff[LIBIOT_FORMAT_SCRATCH_SIZE];
+    char *msg = libiot_vformat(buff, sizeof(buff), fmt, va);
+    if (!msg) {
+        return;
+    }
+
+    libiot_mqtt_publish_topic(topic, qos, retain, msg);
+
+    libiot_format_release(buff, msg);
+}
+
+void libiot_mqtt_publishf_topic(const libiot_topic_t *topic, int qos,
+                                int retain, const char *fmt, ...) {
+    va_list va;
+    va_start(va, fmt);
+
+    libiot_mqtt_publishv_topic(topic, qos, retain, fmt, va);
+
+    va_end(va);
+}
+
+void libiot_mqtt_enqueue_topic(const libiot_topic_t *topic, int qos,
+                               int retain, const char *msg) {
+    libiot_mqtt_enqueue(topic->str, qos, retain, msg);
+}
+
+void libiot_mqtt_enqueuev_topic(const libiot_topic_t *topic, int qos,
+                                int retain, const char *fmt, va_list va) {
+    char buff[LIBIOT_FORMAT_SCRATCH_SIZE];
+    char *msg = libiot_vformat(buff, sizeof(buff), fmt, va);
+    if (!msg) {
+        return;
+    }
+
+    libiot_mqtt_enqueue_topic(topic, qos, retain, msg);
+
+    libiot_format_release(buff, msg);
+}
+
+void libiot_mqtt_enqueuef_topic(const libiot_topic_t *topic, int qos,
+                                int retain, const char *fmt, ...) {
+    va_list va;
+    va_start(va, fmt);
+
+    libiot_mqtt_enqueuev_topic(topic, qos, retain, fmt, va);
+
+    va_end(va);
+}
+
+bool libiot_mqtt_post_topic(const libiot_topic_t *topic, int qos, int retain,
+                            const char *msg) {
+    return libiot_post_queue_push(topic->str, topic->len, msg, strlen(msg),
+                                  qos, retain);
+}
+
+bool libiot_mqtt_postv_topic(const libiot_topic_t *topic, int qos, int retain,
+                             const char *fmt, va_list va) {
+    char buff[LIBIOT_FORMAT_SCRATCH_SIZE];
+    char *msg = libiot_vformat(buff, sizeof(buff), fmt, va);
+    if (!msg) {
+        return false;
+    }
+
+    bool posted = libiot_mqtt_post_topic(topic, qos, retain, msg);
+
+    libiot_format_release(buff, msg);
+    return posted;
+}
+
+bool libiot_mqtt_postf_topic(const libiot_topic_t *topic, int qos, int retain,
+                             const char *fmt, ...) {
+    va_list va;
+    va_start(va, fmt);
+
+    bool posted = libiot_mqtt_postv_topic(topic, qos, retain, fmt, va);
+
+    va_end(va);
+    return posted;
+}
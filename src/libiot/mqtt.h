@@ -1,5 +1,6 @@
 #pragma once
 
+#include <freertos/FreeRTOS.h>
 #include <mqtt_client.h>
 #include <stdarg.h>
 
@@ -21,6 +22,38 @@ void libiot_start_mqtt(
     const char *pass, int mqtt_task_stack_size,
     void (*mqtt_event_handler_cb)(esp_mqtt_event_handle_t event));
 
+// Blocks until MQTT is connected, or `ticks` have elapsed. Returns whether MQTT
+// is connected.
+bool libiot_mqtt_wait_connected(TickType_t ticks);
+
+// Counts the disconnect events since boot (including those for failed
+// reconnects), so that a caller can tell whether MQTT stayed connected.
+uint32_t libiot_mqtt_get_disconnect_count();
+
+// Like `libiot_mqtt_publish()`, but takes the length of `msg` explicitly and
+// returns the esp-mqtt message id (negative on failure) instead of asserting
+// success.
+int libiot_mqtt_try_publish(const char *topic, const char *msg, int len,
+                            int qos, int retain);
+
+// Like `libiot_mqtt_enqueue()`, but returns the esp-mqtt message id (negative
+// on failure) instead of asserting success.
+int libiot_mqtt_try_enqueue(const char *topic, const char *msg, int qos,
+                            int retain);
+
+// Changes the keepalive esp-mqtt uses to schedule PINGREQs, without
+// reconnecting. (The broker continues to use the keepalive sent in CONNECT.)
+void libiot_mqtt_set_local_keepalive(int keepalive_s);
+
+// Like `libiot_mqtt_try_publish()`, but subscribes.
+int libiot_mqtt_try_subscribe(const char *topic, int qos);
+
 void libiot_mqtt_send_ping_resp();
 void libiot_mqtt_send_refresh_resp();
 void libiot_mqtt_send_mem_check_resp();
+
+// The steps of the connect sequence (see "connect_seq.h"). Each returns false
+// if it failed, e.g. because we disconnected.
+bool libiot_mqtt_connect_send_status();
+bool libiot_mqtt_connect_send_info();
+bool libiot_mqtt_connect_send_startup();
@@ -1,133 +1,769 @@
 #include "ota.h"
 
-#include <cJSON.h>
-#include <esp_https_ota.h>
 #include <esp_log.h>
 #include <esp_ota_ops.h>
+#include <esp_system.h>
+#include <esp_timer.h>
 #include <freertos/FreeRTOS.h>
-#include <freertos/queue.h>
+#include <freertos/task.h>
 #include <libiot.h>
+#include <mbedtls/sha256.h>
+#include <string.h>
 
 #include "mqtt.h"
+#include "ota_delta.h"
+#include "ota_http.h"
+#include "ota_inflate.h"
+#include "ota_mqtt.h"
+#include "ota_progress.h"
+#include "ota_resume.h"
+#include "ota_sched.h"
+#include "ota_sink.h"
+#include "ota_verify.h"
 
-#define RECV_TIMEOUT_MS 5000
 #define TASK_STACK_DEPTH 8192
-#define QUEUE_LENGTH 16
 
-static StaticQueue_t ota_cmd_queue_static;
-static uint8_t ota_cmd_queue_buff[QUEUE_LENGTH * sizeof(char *)];
-static QueueHandle_t ota_cmd_queue;
+// The image is downloaded in ranges of this many bytes (a whole number of
+// flash sectors), and our progress is saved after each one.
+#define RANGE_BYTES (64 * 1024)
+// Each range is attempted this many times, with exponential backoff starting
+// from `RETRY_DELAY_MS`, before we give up (until the next attempt at the
+// update, which resumes from the last range downloaded).
+#define RANGE_ATTEMPTS 5
+#define RETRY_DELAY_MS 1000
+
+// When the image is sent over MQTT, the bytes the sender may have in flight
+// (i.e. beyond those we have acknowledged).
+#ifndef LIBIOT_OTA_MQTT_WINDOW_BYTES
+#define LIBIOT_OTA_MQTT_WINDOW_BYTES 16384
+#endif
+// If no chunk arrives for this long we acknowledge again, and after
+// `CHUNK_ATTEMPTS` such timeouts in a row we give up (until the sender asks
+// again, when we resume from the last checkpoint).
+#define CHUNK_TIMEOUT_MS 5000
+#define CHUNK_ATTEMPTS 6
+
+typedef struct download {
+    const esp_partition_t *part;
+    ota_http_t http;
+
+    // Only begun once we know the length of the image (which for a delta is
+    // done by `delta`).
+    ota_sink_t sink;
+    bool sink_begun;
+    // Set if writing to the sink failed (or the update was cancelled), which
+    // retrying will not fix.
+    esp_err_t sink_err;
+
+    // What we have saved (and rewind to if a range fails).
+    ota_resume_t checkpoint;
+
+    // Set if what we download is compressed, and/or is a delta against the
+    // running image. We cannot checkpoint the state of these decoders, so
+    // rather than being fetched in ranges these downloads are streamed, and
+    // `stream_offset` counts the bytes consumed so far.
+    ota_inflate_t *inflate;
+    ota_delta_t *delta;
+    uint32_t stream_offset;
+
+    // For progress reports.
+    int64_t start_us;
+    uint32_t rx_bytes;
+    uint32_t out_start;
+    uint32_t retries;
+    uint32_t start_free_heap;
+    uint32_t min_free_heap;
+} download_t;
+
+typedef struct update {
+    const char *url;
+    const char *ca_cert;
+    // If not NULL then the image must have this hash.
+    const uint8_t *sha256;
+    // If not NULL, a delta from the running image to the new one, which is
+    // tried before `url`. (Requires `sha256`.)
+    const char *delta_url;
+    // Whether the image (and delta) are zlib streams.
+    bool compressed;
+
+    // Set if the image is sent over MQTT instead of being downloaded from
+    // `url`, in which case `sha256` and `image_len` are required.
+    bool over_mqtt;
+    uint32_t image_len;
+} update_t;
+
+static void download_init(download_t *d, const esp_partition_t *part) {
+    memset(d, 0, sizeof(*d));
+    d->part = part;
+    d->start_us = esp_timer_get_time();
+    d->start_free_heap = esp_get_free_heap_size();
+    d->min_free_heap = d->start_free_heap;
+}
+
+static void download_cleanup(download_t *d) {
+    if (d->sink_begun) {
+        libiot_ota_sink_free(&d->sink);
+        d->sink_begun = false;
+    }
+    libiot_ota_http_cleanup(&d->http);
+}
+
+static void get_progress(const download_t *d, ota_progress_t *p) {
+    p->start_us = d->start_us;
+    // A compressed image's sink is given the whole partition, and a delta
+    // writes much of the image without downloading it, so these go by the
+    // download instead.
+    bool streamed = d->inflate || d->delta;
+    p->image_len = d->sink_begun && !streamed ? d->sink.image_len : 0;
+    p->out_bytes = libiot_ota_sink_offset(&d->sink);
+    p->out_start = d->out_start;
+    p->dl_bytes = d->rx_bytes;
+    p->dl_len = d->http.total_len;
+    p->retries = d->retries;
+    p->peak_ram = d->start_free_heap - d->min_free_heap;
+    libiot_ota_sink_get_stats(&d->sink, &p->sink);
+}
+
+// Records our progress, which is published from elsewhere.
+static void report_progress(download_t *d) {
+    uint32_t free_heap = esp_get_free_heap_size();
+    if (free_heap < d->min_free_heap) {
+        d->min_free_heap = free_heap;
+    }
+
+    ota_progress_t p;
+    get_progress(d, &p);
+    libiot_ota_progress_update(&p);
+}
 
-#define MILESTONE_BYTES 100000
+// Fails the download, without retrying, if the update has been cancelled.
+static bool check_cancelled(download_t *d) {
+    if (!libiot_ota_sched_cancelled()) {
+        return false;
+    }
+
+    d->sink_err = ESP_ERR_INVALID_STATE;
+    return true;
+}
 
-static bool perform_update(const char *url, const char *ca_cert_pem) {
-    ESP_LOGI(TAG, "ota: start (%s)", url);
-    libiot_mqtt_publishf_local(MQTT_TOPIC_INFO("ota"), 2, 0,
-                               "{\"state\":\"start\"}");
+static esp_err_t on_data(void *ctx, const char *data, size_t len) {
+    download_t *d = ctx;
+    d->rx_bytes += len;
+
+    if (check_cancelled(d)) {
+        return d->sink_err;
+    }
+
+    if (!d->sink_begun) {
+        if (!d->http.total_len) {
+            ESP_LOGE(TAG, "ota: server did not give the image length");
+            d->sink_err = ESP_ERR_INVALID_RESPONSE;
+            return d->sink_err;
+        }
+
+        d->sink_err = libiot_ota_sink_begin(&d->sink, d->part,
+                                            d->http.total_len, NULL);
+        if (d->sink_err != ESP_OK) {
+            return d->sink_err;
+        }
+        d->sink_begun = true;
+
+        libiot_ota_sink_checkpoint(&d->sink, &d->checkpoint);
+    }
+
+    d->sink_err = libiot_ota_sink_write(&d->sink, data, len);
+    if (d->sink_err != ESP_OK) {
+        return d->sink_err;
+    }
+
+    report_progress(d);
+    return ESP_OK;
+}
+
+// Downloads the next range of the image, retrying as necessary.
+static esp_err_t fetch_range(download_t *d) {
+    esp_err_t err = ESP_FAIL;
+    uint32_t delay_ms = RETRY_DELAY_MS;
+    for (int i = 0; i < RANGE_ATTEMPTS; i++) {
+        if (i) {
+            vTaskDelay(delay_ms / portTICK_PERIOD_MS);
+            delay_ms *= 2;
+        }
+        if (check_cancelled(d)) {
+            return d->sink_err;
+        }
+
+        uint32_t start = d->sink_begun ? d->checkpoint.written : 0;
+        err = libiot_ota_http_fetch(&d->http, start, start + RANGE_BYTES,
+                                    on_data, d);
+        if (err == ESP_OK) {
+            return ESP_OK;
+        }
+
+        if (d->sink_err != ESP_OK) {
+            return d->sink_err;
+        }
+
+        ESP_LOGW(TAG, "ota: range at %u failed (0x%X), attempt %d/%d", start,
+                 err, i + 1, RANGE_ATTEMPTS);
+        d->retries++;
+        if (d->sink_begun) {
+            libiot_ota_sink_rewind(&d->sink, &d->checkpoint);
+        }
+    }
+
+    return err;
+}
+
+// Picks up where a previous attempt at downloading the same image into the
+// same partition left off, if there was one.
+static void try_resume(download_t *d, const uint8_t *image_id,
+                       bool image_id_is_sha256) {
+    ota_resume_t *r = &d->checkpoint;
+    if (libiot_ota_resume_load(r) && !memcmp(r->image_id, image_id, 32)
+        && r->image_id_is_sha256 == image_id_is_sha256
+        && r->part_address == d->part->address
+        && r->written <= r->image_len
+        && libiot_ota_sink_begin(&d->sink, d->part, r->image_len, r)
+               == ESP_OK) {
+        ESP_LOGI(TAG, "ota: resuming at %u/%u bytes", r->written,
+                 r->image_len);
+        d->sink_begun = true;
+        d->http.total_len = r->image_len;
+        d->out_start = r->written;
+        return;
+    }
+
+    libiot_ota_resume_clear();
+
+    memset(r, 0, sizeof(*r));
+    memcpy(r->image_id, image_id, 32);
+    r->image_id_is_sha256 = image_id_is_sha256;
+}
+
+// Receives the (decompressed) bytes of a streamed download.
+static esp_err_t on_stream_output(void *ctx, const void *data, size_t len) {
+    download_t *d = ctx;
 
     esp_err_t err;
-    const char *fail_msg = NULL;
+    if (d->delta) {
+        err = libiot_ota_delta_write(d->delta, data, len);
+        d->sink_begun = d->delta->sink_begun;
+    } else {
+        err = libiot_ota_sink_write(&d->sink, data, len);
+    }
 
-    esp_http_client_config_t config = {
-        .url = url,
-        .cert_pem = (char *) ca_cert_pem,
-        .timeout_ms = RECV_TIMEOUT_MS,
-        .buffer_size_tx =
-            1024,  // Note: needed for chunky google cloud signed URLs
-        .keep_alive_enable = true,
-    };
+    if (err == ESP_OK && d->sink_begun) {
+        report_progress(d);
+    }
+    return err;
+}
 
-    esp_https_ota_config_t ota_config = {
-        .http_config = &config,
-        // FIXME do we want this?
-        // .partial_http_download = true,
-        // .max_http_request_size = CONFIG_EXAMPLE_HTTP_REQUEST_SIZE,
-    };
+static esp_err_t on_stream_data(void *ctx, const char *data, size_t len) {
+    download_t *d = ctx;
+    d->rx_bytes += len;
+
+    if (check_cancelled(d)) {
+        return d->sink_err;
+    }
+
+    if (d->inflate) {
+        d->sink_err = libiot_ota_inflate_write(d->inflate, data, len);
+    } else {
+        d->sink_err = on_stream_output(d, data, len);
+    }
+    if (d->sink_err != ESP_OK) {
+        return d->sink_err;
+    }
+
+    d->stream_offset += len;
+    return ESP_OK;
+}
+
+static bool stream_done(const download_t *d) {
+    return (!d->inflate || libiot_ota_inflate_done(d->inflate))
+           && (!d->delta || libiot_ota_delta_done(d->delta));
+}
+
+// Downloads the rest of a streamed image, retrying as necessary. Since the
+// stream is consumed as it arrives, a retry picks up from exactly where the
+// last attempt stopped.
+static esp_err_t fetch_stream(download_t *d) {
+    esp_err_t err = ESP_FAIL;
+    uint32_t delay_ms = RETRY_DELAY_MS;
+    for (int i = 0; i < RANGE_ATTEMPTS; i++) {
+        if (i) {
+            vTaskDelay(delay_ms / portTICK_PERIOD_MS);
+            delay_ms *= 2;
+        }
+        if (check_cancelled(d)) {
+            return d->sink_err;
+        }
+
+        uint32_t start = d->stream_offset;
+        err = libiot_ota_http_fetch(&d->http, start, 0, on_stream_data, d);
+        if (err == ESP_OK) {
+            return stream_done(d) ? ESP_OK : ESP_ERR_INVALID_SIZE;
+        }
+
+        if (d->sink_err != ESP_OK) {
+            return d->sink_err;
+        }
+
+        ESP_LOGW(TAG, "ota: stream at %u failed (0x%X), attempt %d/%d", start,
+                 err, i + 1, RANGE_ATTEMPTS);
+        d->retries++;
+        if (d->stream_offset != start) {
+            // We made progress, so start counting again.
+            i = -1;
+            delay_ms = RETRY_DELAY_MS;
+        }
+    }
+
+    return err;
+}
+
+// Builds the new image in `d->part` from a delta against the running image
+// (if `is_delta` is set) or from a compressed image. These are not resumed
+// after a reboot: deltas are small, and we cannot save the state of the
+// inflater.
+static esp_err_t stream_image(download_t *d, const update_t *u, bool is_delta,
+                              uint8_t digest[32]) {
+    // We are about to overwrite any partially downloaded image.
+    libiot_ota_resume_clear();
+
+    ota_delta_t delta;
+    ota_inflate_t inflate;
 
-    esp_https_ota_handle_t handle;
-    err = esp_https_ota_begin(&ota_config, &handle);
+    esp_err_t err;
+    if (is_delta) {
+        err = libiot_ota_delta_init(&delta, esp_ota_get_running_partition(),
+                                    d->part, &d->sink);
+        if (err != ESP_OK) {
+            return err;
+        }
+        d->delta = &delta;
+    } else {
+        // We only learn the length of the image when the stream ends.
+        err = libiot_ota_sink_begin(&d->sink, d->part, d->part->size, NULL);
+        if (err != ESP_OK) {
+            return err;
+        }
+        d->sink_begun = true;
+    }
+
+    if (u->compressed) {
+        err = libiot_ota_inflate_init(&inflate, on_stream_output, d);
+        if (err != ESP_OK) {
+            goto stream_end;
+        }
+        d->inflate = &inflate;
+    }
+
+    err = libiot_ota_http_init(&d->http, is_delta ? u->delta_url : u->url,
+                               u->ca_cert);
     if (err != ESP_OK) {
-        fail_msg = "begin failed";
-        goto ota_end_skip_abort;
+        goto stream_end;
     }
 
-    int32_t last_milestone_count = -1;
-    while (1) {
-        err = esp_https_ota_perform(handle);
-        if (err != ESP_ERR_HTTPS_OTA_IN_PROGRESS) {
+    err = fetch_stream(d);
+    if (err != ESP_OK) {
+        goto stream_end;
+    }
+
+    if (is_delta
+        && memcmp(delta.target_sha256, u->sha256,
+                  sizeof(delta.target_sha256))) {
+        ESP_LOGE(TAG, "ota: delta is for a different image");
+        err = ESP_ERR_INVALID_VERSION;
+        goto stream_end;
+    }
+
+    if (!is_delta) {
+        libiot_ota_sink_truncate(&d->sink);
+    }
+    err = libiot_ota_sink_finish(&d->sink, digest);
+
+stream_end:
+    if (d->inflate) {
+        libiot_ota_inflate_free(d->inflate);
+        d->inflate = NULL;
+    }
+    if (d->delta) {
+        libiot_ota_delta_free(d->delta);
+        d->delta = NULL;
+    }
+    return err;
+}
+
+// Receives the image over MQTT (see "ota_mqtt.h"), checkpointing as we go.
+static esp_err_t receive_mqtt(download_t *d, const update_t *u,
+                              uint8_t digest[32]) {
+    try_resume(d, u->sha256, true);
+    if (d->sink_begun && d->sink.image_len != u->image_len) {
+        d->sink_err = ESP_ERR_INVALID_SIZE;
+        return d->sink_err;
+    }
+
+    if (!d->sink_begun) {
+        d->sink_err =
+            libiot_ota_sink_begin(&d->sink, d->part, u->image_len, NULL);
+        if (d->sink_err != ESP_OK) {
+            return d->sink_err;
+        }
+        d->sink_begun = true;
+
+        libiot_ota_sink_checkpoint(&d->sink, &d->checkpoint);
+    }
+
+    libiot_ota_mqtt_begin(LIBIOT_OTA_MQTT_WINDOW_BYTES);
+
+    esp_err_t err = ESP_OK;
+    uint32_t next = libiot_ota_sink_offset(&d->sink);
+    libiot_ota_mqtt_ack(next);
+
+    int timeouts = 0;
+    // Whether we have acknowledged `next` again since a chunk was dropped,
+    // so that a burst of dropped chunks only prompts one.
+    bool reacked = false;
+    while (next < u->image_len) {
+        if (check_cancelled(d)) {
+            err = d->sink_err;
             break;
         }
 
-        // Note `esp_https_ota_perform` returns after every read operation, and
-        // needs to be called again until it does not return
-        // `ESP_ERR_HTTPS_OTA_IN_PROGRESS`.
+        ota_chunk_t *c = libiot_ota_mqtt_recv(CHUNK_TIMEOUT_MS);
+        if (!c) {
+            if (++timeouts >= CHUNK_ATTEMPTS) {
+                err = ESP_ERR_TIMEOUT;
+                break;
+            }
+
+            ESP_LOGW(TAG, "ota: no chunk at %u, attempt %d/%d", next,
+                     timeouts, CHUNK_ATTEMPTS);
+            d->retries++;
+            libiot_ota_mqtt_ack(next);
+            continue;
+        }
+        timeouts = 0;
+        d->rx_bytes += c->len;
+
+        if (c->offset != next) {
+            free(c);
+            if (!reacked) {
+                libiot_ota_mqtt_ack(next);
+                reacked = true;
+            }
+            continue;
+        }
+        reacked = false;
+
+        d->sink_err = libiot_ota_sink_write(&d->sink, c->data, c->len);
+        free(c);
+        if (d->sink_err != ESP_OK) {
+            err = d->sink_err;
+            break;
+        }
+
+        uint32_t last = next;
+        next = libiot_ota_sink_offset(&d->sink);
+        if (next / RANGE_BYTES != last / RANGE_BYTES) {
+            libiot_ota_sink_checkpoint(&d->sink, &d->checkpoint);
+            libiot_ota_resume_save(&d->checkpoint);
+        }
+
+        report_progress(d);
+        libiot_ota_mqtt_ack(next);
+    }
+
+    libiot_ota_mqtt_end();
+
+    if (err != ESP_OK) {
+        return err;
+    }
+    return libiot_ota_sink_finish(&d->sink, digest);
+}
+
+static const char *download_fail_msg(esp_err_t err, const char *otherwise) {
+    // The sink checks the start of the image as soon as it arrives.
+    if (err == ESP_ERR_OTA_VALIDATE_FAILED) {
+        return "image rejected";
+    }
+    return otherwise;
+}
+
+static bool perform_update(const update_t *u) {
+    ESP_LOGI(TAG, "ota: start (%s)", u->over_mqtt ? "over mqtt" : u->url);
+    // Note that the start and end of the update are published (and so are
+    // never dropped, unlike the progress messages, which are posted).
+    libiot_mqtt_publish_local(MQTT_TOPIC_INFO("ota"), 2, 0,
+                              "{\"state\":\"start\"}");
+    libiot_ota_progress_start();
+
+    esp_err_t err = ESP_OK;
+    const char *fail_msg = NULL;
+    // Whether a later attempt can pick up where we left off.
+    bool resumable = false;
+    uint8_t digest[32];
+
+    download_t d;
+    download_init(&d, esp_ota_get_next_update_partition(NULL));
+    if (!d.part) {
+        fail_msg = "no partition to update";
+        goto ota_end;
+    }
+
+    // The other partition holds the image we would roll back to. (Checked up
+    // front so that a saved download is kept for once we are validated.)
+    if (libiot_ota_sink_running_unverified()) {
+        err = ESP_ERR_INVALID_STATE;
+        fail_msg = "running image not yet validated";
+        resumable = true;
+        goto ota_end;
+    }
+
+    if (u->delta_url) {
+        ESP_LOGI(TAG, "ota: trying delta (%s)", u->delta_url);
+        err = stream_image(&d, u, true, digest);
+        if (err == ESP_OK) {
+            goto ota_activate;
+        }
+
+        if (libiot_ota_sched_cancelled()) {
+            fail_msg = "cancelled";
+            goto ota_end;
+        }
+
+        libiot_logf_error(TAG, "ota: delta failed (0x%X), using full image",
+                          err);
+        libiot_mqtt_post_local(MQTT_TOPIC_INFO("ota"), 2, 0,
+                               "{\"state\":\"delta_fail\"}");
+
+        download_cleanup(&d);
+        download_init(&d, d.part);
+    }
+
+    if (u->over_mqtt) {
+        err = receive_mqtt(&d, u, digest);
+        if (err != ESP_OK) {
+            fail_msg = download_fail_msg(err, "receive failed");
+            resumable = d.sink_err == ESP_OK;
+            goto ota_end;
+        }
+        goto ota_activate;
+    }
 
-        uint32_t byte_count = esp_https_ota_get_image_len_read(handle);
-        int32_t milestone_count = byte_count / MILESTONE_BYTES;
-        if (milestone_count > last_milestone_count) {
-            uint32_t kb_count = byte_count / 1000;
-            ESP_LOGI(TAG, "ota: read %d kB", kb_count);
-            libiot_mqtt_publishf_local(
-                MQTT_TOPIC_INFO("ota"), 2, 0,
-                "{\"state\":\"in_progress\", \"rx_kb\":%d}", kb_count);
-            last_milestone_count = milestone_count;
+    if (u->compressed) {
+        err = stream_image(&d, u, false, digest);
+        if (err != ESP_OK) {
+            fail_msg = download_fail_msg(err, "download failed");
+            goto ota_end;
         }
+        goto ota_activate;
     }
 
-    if (esp_https_ota_is_complete_data_received(handle) != true) {
-        fail_msg = "complete data was not received";
+    err = libiot_ota_http_init(&d.http, u->url, u->ca_cert);
+    if (err != ESP_OK) {
+        fail_msg = "begin failed";
+        // We haven't touched any saved progress yet.
+        resumable = true;
         goto ota_end;
     }
 
+    uint8_t image_id[32];
+    if (u->sha256) {
+        memcpy(image_id, u->sha256, sizeof(image_id));
+    } else {
+        mbedtls_sha256_ret((const unsigned char *) u->url, strlen(u->url),
+                           image_id, false);
+    }
+    try_resume(&d, image_id, u->sha256);
+    libiot_ota_resume_save_source(u->url, u->ca_cert);
+
+    while (!d.sink_begun
+           || libiot_ota_sink_offset(&d.sink) < d.sink.image_len) {
+        err = fetch_range(&d);
+        if (err != ESP_OK) {
+            fail_msg = download_fail_msg(err, "download failed");
+            resumable = d.sink_err == ESP_OK;
+            goto ota_end;
+        }
+
+        libiot_ota_sink_checkpoint(&d.sink, &d.checkpoint);
+        libiot_ota_resume_save(&d.checkpoint);
+    }
+
+    err = libiot_ota_sink_finish(&d.sink, digest);
     if (err != ESP_OK) {
-        fail_msg = "perform failed";
+        fail_msg = download_fail_msg(err, "finish failed");
+        goto ota_end;
+    }
+
+ota_activate:
+    libiot_ota_progress_stop();
+
+    // Once cancelled, we never switch to the image, even if it arrived.
+    if (check_cancelled(&d)) {
+        fail_msg = "cancelled";
         goto ota_end;
     }
 
-    err = esp_https_ota_finish(handle);
+    if (u->sha256 && memcmp(digest, u->sha256, sizeof(digest))) {
+        fail_msg = "image does not match sha256";
+        goto ota_end;
+    }
+
+    err = esp_ota_set_boot_partition(d.part);
     if (err != ESP_OK) {
         if (err == ESP_ERR_OTA_VALIDATE_FAILED) {
             fail_msg = "image validation failed, image is corrupted";
         } else {
-            fail_msg = "finish failed";
+            fail_msg = "set boot partition failed";
         }
-
-        goto ota_end_skip_abort;
+        goto ota_end;
     }
 
+    ota_progress_t p;
+    get_progress(&d, &p);
+    ota_progress_stats_t stats;
+    libiot_ota_progress_get_stats(&p, &stats);
+
     ESP_LOGI(TAG, "ota: upgrade successful");
-    libiot_mqtt_publishf_local(MQTT_TOPIC_INFO("ota"), 2, 0,
-                               "{\"state\":\"done\"}");
-    return true;
+    libiot_mqtt_publishf_local(
+        MQTT_TOPIC_INFO("ota"), 2, 0,
+        "{\"state\":\"done\",\"dl_bps\":%u,\"out_bps\":%u,\"flash_bps\":%u,"
+        "\"stall_ms\":[%u,%u],\"peak_ram\":%u,\"retries\":%u}",
+        stats.dl_bps, stats.out_bps, stats.flash_bps, stats.reader_stall_ms,
+        stats.writer_stall_ms, p.peak_ram, p.retries);
 
 ota_end:
-    esp_https_ota_abort(handle);
+    libiot_ota_progress_stop();
+    if (!resumable) {
+        libiot_ota_resume_clear();
+    }
+    download_cleanup(&d);
+
+    if (fail_msg && libiot_ota_sched_cancelled()) {
+        ESP_LOGW(TAG, "ota: cancelled");
+        libiot_mqtt_publish_local(MQTT_TOPIC_INFO("ota"), 2, 0,
+                                  "{\"state\":\"cancelled\"}");
+        return false;
+    }
 
-ota_end_skip_abort:
-    libiot_logf_error(TAG, "ota: %s (0x%X)", fail_msg ? fail_msg : "???", err);
-    libiot_mqtt_publishf_local(MQTT_TOPIC_INFO("ota"), 2, 0,
-                               "{\"state\":\"fail\"}");
+    if (!fail_msg) {
+        return true;
+    }
+
+    libiot_logf_error(TAG, "ota: %s (0x%X)", fail_msg, err);
+    libiot_mqtt_publishf_local(
+        MQTT_TOPIC_INFO("ota"), 2, 0,
+        "{\"state\":\"fail\",\"reason\":\"%s\",\"resumable\":%s}", fail_msg,
+        resumable ? "true" : "false");
     return false;
 }
 
-static const char *process_cmd_update(const cJSON *json_root) {
-    const cJSON *json_url = cJSON_GetObjectItemCaseSensitive(json_root, "url");
-    if (!json_url || !cJSON_IsString(json_url)) {
+static const char *process_cmd_update(char *cmd_json, libiot_json_tok_t *toks) {
+    // Optional, but allows a download to be resumed even if the URL changes
+    // (e.g. because it is signed, and the signature expired).
+    uint8_t sha256[32];
+    bool has_sha256 = false;
+    int sha256_hex = libiot_json_get(cmd_json, toks, 0, "sha256");
+    if (sha256_hex >= 0) {
+        const char *hex = libiot_json_str(cmd_json, &toks[sha256_hex]);
+        if (!hex || !libiot_ota_verify_parse_sha256(hex, sha256)) {
+            return "update: `sha256` is not 64 hex digits!";
+        }
+        has_sha256 = true;
+    }
+
+    update_t u = {
+        .sha256 = has_sha256 ? sha256 : NULL,
+    };
+
+    // Optional, either "https" (the default) or "mqtt".
+    int transport = libiot_json_get(cmd_json, toks, 0, "transport");
+    if (transport >= 0) {
+        if (libiot_json_eq(cmd_json, &toks[transport], "mqtt")) {
+            u.over_mqtt = true;
+        } else if (!libiot_json_eq(cmd_json, &toks[transport], "https")) {
+            return "update: unknown `transport`!";
+        }
+    }
+
+    // If we have a signing key, the command must carry a signature of the
+    // hash of the image (which the image is then checked against).
+    if (libiot_ota_verify_has_key()) {
+        int sig = libiot_json_get(cmd_json, toks, 0, "signature");
+        if (!has_sha256 || sig < 0) {
+            return "update: `sha256` and `signature` are required!";
+        }
+
+        const char *sig_b64 = libiot_json_str(cmd_json, &toks[sig]);
+        if (!sig_b64
+            || libiot_ota_verify_signature(sha256, sig_b64) != ESP_OK) {
+            return "update: bad `signature`!";
+        }
+    }
+
+    if (u.over_mqtt) {
+        // The sender has nothing else to identify the image by.
+        if (!has_sha256) {
+            return "update: mqtt transport requires `sha256`!";
+        }
+
+        int64_t image_len;
+        int len = libiot_json_get(cmd_json, toks, 0, "image_len");
+        if (len < 0 || !libiot_json_int(cmd_json, &toks[len], &image_len)
+            || image_len <= 0 || image_len > UINT32_MAX) {
+            return "update: no `image_len` or not a positive integer!";
+        }
+        u.image_len = image_len;
+
+        perform_update(&u);
+        return NULL;
+    }
+
+    int url = libiot_json_get(cmd_json, toks, 0, "url");
+    if (url < 0 || toks[url].type != LIBIOT_JSON_STRING) {
         return "update: no `url` or not a string!";
     }
+    u.url = libiot_json_str(cmd_json, &toks[url]);
 
-    const cJSON *json_ca_cert =
-        cJSON_GetObjectItemCaseSensitive(json_root, "ca_cert");
-    if (!json_ca_cert || !cJSON_IsString(json_ca_cert)) {
+    int ca_cert = libiot_json_get(cmd_json, toks, 0, "ca_cert");
+    if (ca_cert < 0 || toks[ca_cert].type != LIBIOT_JSON_STRING) {
         return "update: no `ca_cert` or not a string!";
     }
+    u.ca_cert = libiot_json_str(cmd_json, &toks[ca_cert]);
+
+    // Optional, a delta from the running image to the new one. We need the
+    // hash of the new image to know that the delta produced it.
+    int delta_url = libiot_json_get(cmd_json, toks, 0, "delta_url");
+    if (delta_url >= 0) {
+        if (toks[delta_url].type != LIBIOT_JSON_STRING) {
+            return "update: `delta_url` is not a string!";
+        }
+        if (!has_sha256) {
+            return "update: `delta_url` requires `sha256`!";
+        }
+        u.delta_url = libiot_json_str(cmd_json, &toks[delta_url]);
+    }
+
+    // Optional, how the image (and delta) are compressed.
+    int compression = libiot_json_get(cmd_json, toks, 0, "compression");
+    if (compression >= 0) {
+        if (!libiot_json_eq(cmd_json, &toks[compression], "zlib")) {
+            return "update: unknown `compression`!";
+        }
+        u.compressed = true;
+    }
 
-    perform_update(json_url->valuestring, json_ca_cert->valuestring);
+    perform_update(&u);
 
     return NULL;
 }
 
-static const char *process_cmd_validate(const cJSON *json_root) {
+static const char *process_cmd_validate(char *cmd_json,
+                                        libiot_json_tok_t *toks) {
     esp_err_t err = esp_ota_mark_app_valid_cancel_rollback();
     if (err != ESP_OK) {
         libiot_logf_error(TAG, "ota: validate failed with error code (0x%X)",
@@ -137,7 +773,8 @@ static const char *process_cmd_validate(const cJSON *json_root) {
     return NULL;
 }
 
-static const char *process_cmd_rollback(const cJSON *json_root) {
+static const char *process_cmd_rollback(char *cmd_json,
+                                        libiot_json_tok_t *toks) {
     esp_err_t err = esp_ota_mark_app_invalid_rollback_and_reboot();
     if (err != ESP_OK) {
         libiot_logf_error(TAG, "ota: rollback failed with error code (0x%X)",
@@ -147,30 +784,33 @@ static const char *process_cmd_rollback(const cJSON *json_root) {
     return NULL;
 }
 
-static void process_cmd(const char *manifest_json) {
-    ESP_LOGI(TAG, "ota: reading cmd (%d bytes)", strlen(manifest_json));
+// Note that the fields of `cmd_json` are decoded in place.
+static void process_cmd(char *cmd_json) {
+    size_t len = strlen(cmd_json);
+    ESP_LOGI(TAG, "ota: reading cmd (%d bytes)", len);
 
     const char *fail_msg = NULL;
 
-    cJSON *json_root = cJSON_Parse(manifest_json);
-    if (!json_root) {
+    libiot_json_tok_t toks[OTA_CMD_MAX_TOKENS];
+    int num_toks =
+        libiot_json_tokenize(cmd_json, len, toks, OTA_CMD_MAX_TOKENS);
+    if (num_toks < 0 || toks[0].type != LIBIOT_JSON_OBJECT) {
         fail_msg = "JSON parse error";
         goto process_cmd_out;
     }
 
-    const cJSON *json_type =
-        cJSON_GetObjectItemCaseSensitive(json_root, "type");
-    if (!json_type || !cJSON_IsString(json_type)) {
+    int type = libiot_json_get(cmd_json, toks, 0, "type");
+    if (type < 0 || toks[type].type != LIBIOT_JSON_STRING) {
         fail_msg = "no `type` or not a string!";
         goto process_cmd_out;
     }
 
-    if (!strcmp(json_type->valuestring, "update")) {
-        fail_msg = process_cmd_update(json_root);
-    } else if (!strcmp(json_type->valuestring, "validate")) {
-        fail_msg = process_cmd_validate(json_root);
-    } else if (!strcmp(json_type->valuestring, "rollback")) {
-        fail_msg = process_cmd_rollback(json_root);
+    if (libiot_json_eq(cmd_json, &toks[type], "update")) {
+        fail_msg = process_cmd_update(cmd_json, toks);
+    } else if (libiot_json_eq(cmd_json, &toks[type], "validate")) {
+        fail_msg = process_cmd_validate(cmd_json, toks);
+    } else if (libiot_json_eq(cmd_json, &toks[type], "rollback")) {
+        fail_msg = process_cmd_rollback(cmd_json, toks);
     } else {
         fail_msg = "unknown cmd `type`";
     }
@@ -179,20 +819,46 @@ process_cmd_out:
     if (fail_msg) {
         libiot_logf_error(TAG, "ota: %s", fail_msg);
     }
+}
+
+// Resumes an update which was interrupted by a reboot, once we are online.
+static void resume_interrupted_update() {
+    ota_resume_t r;
+    char *url;
+    char *ca_cert;
+    if (!libiot_ota_resume_load(&r)
+        || !libiot_ota_resume_load_source(&url, &ca_cert)) {
+        return;
+    }
+
+    libiot_mqtt_wait_connected(portMAX_DELAY);
+
+    ESP_LOGI(TAG, "ota: resuming interrupted update");
+    ota_job_t job;
+    libiot_ota_sched_resume(&job, r.image_id);
+
+    update_t u = {
+        .url = url,
+        .ca_cert = ca_cert,
+        .sha256 = r.image_id_is_sha256 ? r.image_id : NULL,
+    };
+    perform_update(&u);
+    libiot_ota_sched_finish(&job);
+    free(url);
+    free(ca_cert);
 
-    // It is safe to call this with `json_root == NULL`.
-    cJSON_Delete(json_root);
+    libiot_mqtt_send_refresh_resp();
 }
 
 static void task_run(void *unused) {
+    resume_interrupted_update();
+
     while (1) {
-        char *cmd_json;
-        while (xQueueReceive(ota_cmd_queue, &cmd_json, portMAX_DELAY)
-               == pdFALSE)
-            ;
+        ota_job_t job;
+        libiot_ota_sched_next(&job);
 
-        process_cmd(cmd_json);
-        free(cmd_json);
+        process_cmd(job.cmd_json);
+        libiot_ota_sched_finish(&job);
 
         // Refresh the published partition states
         libiot_mqtt_send_refresh_resp();
@@ -200,23 +866,22 @@ static void task_run(void *unused) {
 }
 
 void libiot_ota_dispatch_request(char *cmd_json) {
-    if (!ota_cmd_queue) {
-        libiot_logf_error(TAG,
-                          "ota: dispatch request with ota not initialized!");
-        return;
-    }
+    libiot_ota_sched_submit(cmd_json);
+}
 
-    if (xQueueSend(ota_cmd_queue, &cmd_json, 0) != pdTRUE) {
-        libiot_logf_error(TAG, "ota: can't queue manifest");
+esp_err_t libiot_init_ota(const char *signing_key_pem) {
+    esp_err_t err = libiot_ota_verify_init(signing_key_pem);
+    if (err != ESP_OK) {
+        return err;
     }
-}
 
-esp_err_t libiot_init_ota() {
-    ota_cmd_queue =
-        xQueueCreateStatic(QUEUE_LENGTH, sizeof(char *), ota_cmd_queue_buff,
-                           &ota_cmd_queue_static);
+    libiot_init_ota_progress();
+    libiot_init_ota_mqtt();
+    libiot_init_ota_sched();
 
-    if (xTaskCreate(task_run, "ota_task", TASK_STACK_DEPTH, NULL, 5, NULL)
+    // Note that the sink writes to flash from the other core.
+    if (xTaskCreatePinnedToCore(task_run, "ota_task", TASK_STACK_DEPTH, NULL,
+                                5, NULL, 0)
         != pdPASS) {
         return ESP_FAIL;
     }
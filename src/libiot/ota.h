@@ -2,5 +2,5 @@
 
 #include "private.h"
 
-esp_err_t libiot_init_ota();
+esp_err_t libiot_init_ota(const char *signing_key_pem);
 void libiot_ota_dispatch_request(char *manifest_json);
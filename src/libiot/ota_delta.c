@@ -0,0 +1,275 @@
+#include "ota_delta.h"
+
+#include <esp_log.h>
+#include <mbedtls/sha256.h>
+#include <string.h>
+#include <sys/param.h>
+
+#define DELTA_MAGIC "LDLT"
+#define DELTA_VERSION 1
+
+#define OP_END 0x00
+#define OP_COPY 0x01
+#define OP_ADD 0x02
+#define OP_INSERT 0x03
+
+// The size of the buffer which the source is read into.
+#define SOURCE_BUFF_SIZE 1024
+
+static uint32_t get_u32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+esp_err_t libiot_ota_delta_init(ota_delta_t *dl, const esp_partition_t *source,
+                                const esp_partition_t *target,
+                                ota_sink_t *sink) {
+    memset(dl, 0, sizeof(*dl));
+
+    dl->buff = malloc(SOURCE_BUFF_SIZE);
+    if (!dl->buff) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    dl->source = source;
+    dl->target = target;
+    dl->sink = sink;
+    dl->state = OTA_DELTA_HEADER;
+    dl->field_want = OTA_DELTA_HEADER_LEN;
+    return ESP_OK;
+}
+
+static esp_err_t check_source(ota_delta_t *dl, const uint8_t *sha256) {
+    if (dl->source_len > dl->source->size) {
+        return ESP_ERR_INVALID_VERSION;
+    }
+
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts_ret(&sha, false);
+
+    esp_err_t err = ESP_OK;
+    for (uint32_t off = 0; off < dl->source_len; off += SOURCE_BUFF_SIZE) {
+        size_t n = MIN(SOURCE_BUFF_SIZE, dl->source_len - off);
+        err = esp_partition_read(dl->source, off, dl->buff, n);
+        if (err != ESP_OK) {
+            break;
+        }
+        mbedtls_sha256_update_ret(&sha, dl->buff, n);
+    }
+
+    uint8_t digest[32];
+    mbedtls_sha256_finish_ret(&sha, digest);
+    mbedtls_sha256_free(&sha);
+
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    if (memcmp(digest, sha256, sizeof(digest))) {
+        ESP_LOGW(TAG, "ota: delta was made against a different image");
+        return ESP_ERR_INVALID_VERSION;
+    }
+
+    return ESP_OK;
+}
+
+static esp_err_t handle_header(ota_delta_t *dl) {
+    const uint8_t *h = dl->field;
+    if (memcmp(h, DELTA_MAGIC, 4) || get_u32(h + 4) != DELTA_VERSION) {
+        ESP_LOGE(TAG, "ota: not a delta (or an unsupported version)");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    dl->source_len = get_u32(h + 8);
+    dl->target_len = get_u32(h + 12);
+    memcpy(dl->target_sha256, h + 48, sizeof(dl->target_sha256));
+
+    esp_err_t err = check_source(dl, h + 16);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    err = libiot_ota_sink_begin(dl->sink, dl->target, dl->target_len, NULL);
+    if (err != ESP_OK) {
+        return err;
+    }
+    dl->sink_begun = true;
+
+    return ESP_OK;
+}
+
+// Checks that [off, off + len) lies within the source.
+static bool source_contains(const ota_delta_t *dl, uint32_t off,
+                            uint32_t len) {
+    return off <= dl->source_len && len <= dl->source_len - off;
+}
+
+static esp_err_t do_copy(ota_delta_t *dl) {
+    while (dl->remaining) {
+        size_t n = MIN(SOURCE_BUFF_SIZE, dl->remaining);
+        esp_err_t err = esp_partition_read(dl->source, dl->src_off, dl->buff,
+                                           n);
+        if (err != ESP_OK) {
+            return err;
+        }
+
+        err = libiot_ota_sink_write(dl->sink, dl->buff, n);
+        if (err != ESP_OK) {
+            return err;
+        }
+
+        dl->src_off += n;
+        dl->remaining -= n;
+    }
+
+    return ESP_OK;
+}
+
+static esp_err_t handle_args(ota_delta_t *dl) {
+    const uint8_t *a = dl->field;
+    if (dl->op == OP_INSERT) {
+        dl->remaining = get_u32(a);
+        dl->state = dl->remaining ? OTA_DELTA_INSERT : OTA_DELTA_OP;
+        return ESP_OK;
+    }
+
+    dl->src_off = get_u32(a);
+    dl->remaining = get_u32(a + 4);
+    if (!source_contains(dl, dl->src_off, dl->remaining)) {
+        ESP_LOGE(TAG, "ota: delta reads past the end of the source");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (dl->op == OP_COPY) {
+        dl->state = OTA_DELTA_OP;
+        return do_copy(dl);
+    }
+
+    dl->state = dl->remaining ? OTA_DELTA_ADD : OTA_DELTA_OP;
+    return ESP_OK;
+}
+
+static esp_err_t handle_op(ota_delta_t *dl) {
+    dl->op = dl->field[0];
+    switch (dl->op) {
+        case OP_END: {
+            if (libiot_ota_sink_offset(dl->sink) != dl->target_len) {
+                ESP_LOGE(TAG, "ota: delta ended before the image did");
+                return ESP_ERR_INVALID_ARG;
+            }
+            dl->state = OTA_DELTA_DONE;
+            return ESP_OK;
+        }
+        case OP_COPY:
+        case OP_ADD: {
+            dl->field_want = 8;
+            break;
+        }
+        case OP_INSERT: {
+            dl->field_want = 4;
+            break;
+        }
+        default: {
+            ESP_LOGE(TAG, "ota: unknown delta op 0x%02X", dl->op);
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+
+    dl->state = OTA_DELTA_ARGS;
+    return ESP_OK;
+}
+
+// Consumes bytes of the patch into `dl->field`, returning how many were
+// used.
+static size_t fill_field(ota_delta_t *dl, const uint8_t *data, size_t len) {
+    size_t n = MIN(len, dl->field_want - dl->field_len);
+    memcpy(dl->field + dl->field_len, data, n);
+    dl->field_len += n;
+    return n;
+}
+
+static esp_err_t apply_add(ota_delta_t *dl, const uint8_t *data, size_t n) {
+    esp_err_t err = esp_partition_read(dl->source, dl->src_off, dl->buff, n);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        dl->buff[i] += data[i];
+    }
+
+    return libiot_ota_sink_write(dl->sink, dl->buff, n);
+}
+
+esp_err_t libiot_ota_delta_write(ota_delta_t *dl, const void *data,
+                                 size_t len) {
+    const uint8_t *pos = data;
+    while (len) {
+        size_t n;
+        esp_err_t err = ESP_OK;
+        switch (dl->state) {
+            case OTA_DELTA_HEADER:
+            case OTA_DELTA_OP:
+            case OTA_DELTA_ARGS: {
+                n = fill_field(dl, pos, len);
+                if (dl->field_len < dl->field_want) {
+                    break;
+                }
+
+                ota_delta_state_t state = dl->state;
+                dl->field_len = 0;
+                dl->field_want = 1;
+                dl->state = OTA_DELTA_OP;
+
+                if (state == OTA_DELTA_HEADER) {
+                    err = handle_header(dl);
+                } else if (state == OTA_DELTA_OP) {
+                    err = handle_op(dl);
+                } else {
+                    err = handle_args(dl);
+                }
+                break;
+            }
+            case OTA_DELTA_ADD: {
+                n = MIN(MIN(len, dl->remaining), SOURCE_BUFF_SIZE);
+                err = apply_add(dl, pos, n);
+                dl->src_off += n;
+                dl->remaining -= n;
+                break;
+            }
+            case OTA_DELTA_INSERT: {
+                n = MIN(len, dl->remaining);
+                err = libiot_ota_sink_write(dl->sink, pos, n);
+                dl->remaining -= n;
+                break;
+            }
+            default: {
+                ESP_LOGE(TAG, "ota: data after the end of the delta");
+                return ESP_ERR_INVALID_ARG;
+            }
+        }
+
+        if (err != ESP_OK) {
+            return err;
+        }
+
+        if ((dl->state == OTA_DELTA_ADD || dl->state == OTA_DELTA_INSERT)
+            && !dl->remaining) {
+            dl->state = OTA_DELTA_OP;
+        }
+
+        pos += n;
+        len -= n;
+    }
+
+    return ESP_OK;
+}
+
+bool libiot_ota_delta_done(const ota_delta_t *dl) {
+    return dl->state == OTA_DELTA_DONE;
+}
+
+void libiot_ota_delta_free(ota_delta_t *dl) {
+    free(dl->buff);
+    dl->buff = NULL;
+}
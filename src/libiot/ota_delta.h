@@ -0,0 +1,82 @@
+#pragma once
+
+#include <esp_partition.h>
+
+#include "ota_sink.h"
+#include "private.h"
+
+// Applies a binary patch to the image in one app partition (the source),
+// streaming the result into an `ota_sink_t`. The patch is consumed as it
+// arrives, and the source is read back from flash as needed, so the RAM used
+// does not depend on the size of the image or the patch.
+//
+// A patch is a header followed by a sequence of ops, with all integers
+// little-endian:
+//
+//   header: "LDLT", u32 version (1), u32 source_len, u32 target_len,
+//           u8 source_sha256[32], u8 target_sha256[32]
+//
+//   0x00                        END: the target is complete.
+//   0x01 u32 off, u32 len       COPY: `len` bytes of the source from `off`.
+//   0x02 u32 off, u32 len, ...  ADD: `len` bytes, each the sum (mod 256) of
+//                               the next patch byte and the source byte from
+//                               `off` onwards.
+//   0x03 u32 len, ...           INSERT: the next `len` bytes of the patch.
+//
+// `source_sha256` is the hash of the first `source_len` bytes of the source
+// partition, and is checked before anything is written. `target_sha256` is
+// the hash of the image which the patch produces.
+
+#define OTA_DELTA_HEADER_LEN 80
+
+typedef enum ota_delta_state {
+    OTA_DELTA_HEADER,
+    OTA_DELTA_OP,
+    OTA_DELTA_ARGS,
+    OTA_DELTA_ADD,
+    OTA_DELTA_INSERT,
+    OTA_DELTA_DONE,
+} ota_delta_state_t;
+
+typedef struct ota_delta {
+    const esp_partition_t *source;
+    const esp_partition_t *target;
+
+    // Only begun once the header has been read.
+    ota_sink_t *sink;
+    bool sink_begun;
+
+    ota_delta_state_t state;
+    uint8_t op;
+
+    // The header, or the arguments of the current op, as they accumulate.
+    uint8_t field[OTA_DELTA_HEADER_LEN];
+    size_t field_len;
+    size_t field_want;
+
+    // The position in the source, and the number of bytes left, of the
+    // current op.
+    uint32_t src_off;
+    uint32_t remaining;
+
+    uint32_t source_len;
+    uint32_t target_len;
+    uint8_t target_sha256[32];
+
+    uint8_t *buff;
+} ota_delta_t;
+
+esp_err_t libiot_ota_delta_init(ota_delta_t *dl, const esp_partition_t *source,
+                                const esp_partition_t *target,
+                                ota_sink_t *sink);
+
+// Consumes the next `len` bytes of the patch. Returns
+// `ESP_ERR_INVALID_VERSION` if the patch was made against a different source
+// image, and `ESP_ERR_INVALID_ARG` if the patch is malformed.
+esp_err_t libiot_ota_delta_write(ota_delta_t *dl, const void *data,
+                                 size_t len);
+
+// Whether the END op has been read.
+bool libiot_ota_delta_done(const ota_delta_t *dl);
+
+void libiot_ota_delta_free(ota_delta_t *dl);
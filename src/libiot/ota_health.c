@@ -0,0 +1,209 @@
+#include "ota_health.h"
+
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+#include <esp_ota_ops.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <libiot.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "json_writer.h"
+#include "mqtt.h"
+#include "ota_sink.h"
+#include "reset_info.h"
+
+#define TASK_STACK_DEPTH 3072
+
+#define DEFAULT_WINDOW_MS (60 * 1000)
+#define DEFAULT_MIN_FREE_HEAP (16 * 1024)
+
+// How long we wait for MQTT to connect, both at boot and at the end of the
+// window, before giving up on the image.
+#define CONNECT_TIMEOUT_MS (5 * 60 * 1000)
+
+#define MAX_PROBES 8
+
+typedef struct probe {
+    const char *name;
+    libiot_ota_health_probe_t cb;
+    void *ctx;
+} probe_t;
+
+static StaticSemaphore_t probe_mutex_static;
+static SemaphoreHandle_t probe_mutex;
+
+// Protected by `probe_mutex`.
+static probe_t probes[MAX_PROBES];
+static size_t probe_count;
+
+static uint32_t window_ms;
+static uint32_t min_free_heap;
+
+void libiot_ota_add_health_probe(const char *name,
+                                 libiot_ota_health_probe_t cb, void *ctx) {
+    // Probes may be added even if the image is not being checked (or OTA is
+    // disabled), in which case they are never called.
+    if (!probe_mutex) {
+        return;
+    }
+
+    while (xSemaphoreTake(probe_mutex, portMAX_DELAY) == pdFALSE)
+        ;
+
+    assert(probe_count < MAX_PROBES);
+    probes[probe_count++] = (probe_t){
+        .name = name,
+        .cb = cb,
+        .ctx = ctx,
+    };
+
+    xSemaphoreGive(probe_mutex);
+}
+
+static bool wait_connected() {
+    return libiot_mqtt_wait_connected(CONNECT_TIMEOUT_MS / portTICK_PERIOD_MS);
+}
+
+// Returns the name of the first probe which fails, or NULL if they all pass.
+static const char *run_probes() {
+    while (xSemaphoreTake(probe_mutex, portMAX_DELAY) == pdFALSE)
+        ;
+
+    const char *failed = NULL;
+    for (size_t i = 0; i < probe_count; i++) {
+        if (!probes[i].cb(probes[i].ctx)) {
+            failed = probes[i].name;
+            break;
+        }
+    }
+
+    xSemaphoreGive(probe_mutex);
+    return failed;
+}
+
+// Returns NULL if the image is healthy, or otherwise why it is not.
+static const char *check_health(char *buff, size_t len) {
+    if (libiot_reset_info_get()->exceptional) {
+        snprintf(buff, len, "exceptional reset (%s)",
+                 libiot_reset_info_get()->reason);
+        return buff;
+    }
+
+    if (!wait_connected()) {
+        return "mqtt never connected";
+    }
+
+    ESP_LOGI(TAG, "ota: checking image health for %us", window_ms / 1000);
+    uint32_t disconnects = libiot_mqtt_get_disconnect_count();
+    vTaskDelay(window_ms / portTICK_PERIOD_MS);
+
+    if (libiot_mqtt_get_disconnect_count() != disconnects
+        || !libiot_mqtt_wait_connected(0)) {
+        return "mqtt did not stay connected";
+    }
+
+    size_t heap = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+    if (heap < min_free_heap) {
+        snprintf(buff, len, "free heap fell to %u bytes", heap);
+        return buff;
+    }
+
+    const char *probe = run_probes();
+    if (probe) {
+        snprintf(buff, len, "probe `%s` failed", probe);
+        return buff;
+    }
+
+    return NULL;
+}
+
+static void write_rollback(json_writer_t *w, const char *reason) {
+    json_writer_obj_open(w);
+    json_writer_key(w, "state", 5);
+    json_writer_str(w, "rollback");
+    json_writer_key(w, "reason", 6);
+    json_writer_str(w, reason);
+    json_writer_obj_close(w);
+}
+
+// The reason may include a probe name or reset reason, so it is escaped.
+static void publish_rollback(const char *reason) {
+    json_writer_t w;
+    json_writer_init(&w, NULL, 0);
+    write_rollback(&w, reason);
+
+    size_t size = w.len + 1;
+    char *msg = malloc(size);
+    if (!msg) {
+        ESP_LOGE(TAG, "ota: out of memory for rollback message");
+        return;
+    }
+
+    json_writer_init(&w, msg, size);
+    write_rollback(&w, reason);
+    json_writer_finish(&w);
+
+    libiot_mqtt_publish_local(MQTT_TOPIC_INFO("ota"), 2, 0, msg);
+    free(msg);
+}
+
+static void task_health(void *unused) {
+    char buff[64];
+    const char *reason = check_health(buff, sizeof(buff));
+
+    // Someone may have already decided, with the `validate` or `rollback`
+    // commands.
+    if (!libiot_ota_sink_running_unverified()) {
+        ESP_LOGI(TAG, "ota: image already validated or rolled back");
+        goto task_health_out;
+    }
+
+    if (!reason) {
+        esp_err_t err = esp_ota_mark_app_valid_cancel_rollback();
+        if (err != ESP_OK) {
+            libiot_logf_error(TAG,
+                              "ota: validate failed with error code (0x%X)",
+                              err);
+            goto task_health_out;
+        }
+
+        ESP_LOGI(TAG, "ota: image is healthy, marked valid");
+        libiot_mqtt_post_local(MQTT_TOPIC_INFO("ota"), 2, 0,
+                               "{\"state\":\"validated\"}");
+        libiot_mqtt_send_refresh_resp();
+        goto task_health_out;
+    }
+
+    // Note that these block until sent (if we are connected), since we are
+    // about to reboot.
+    libiot_logf_error(TAG, "ota: image is unhealthy (%s), rolling back",
+                      reason);
+    if (libiot_mqtt_wait_connected(0)) {
+        publish_rollback(reason);
+    }
+
+    esp_err_t err = esp_ota_mark_app_invalid_rollback_and_reboot();
+    libiot_logf_error(TAG, "ota: rollback failed with error code (0x%X)",
+                      err);
+
+task_health_out:
+    vTaskDelete(NULL);
+}
+
+void libiot_init_ota_health(int window, int min_heap, bool manual) {
+    if (manual || !libiot_ota_sink_running_unverified()) {
+        return;
+    }
+
+    window_ms = window > 0 ? window : DEFAULT_WINDOW_MS;
+    min_free_heap = min_heap > 0 ? min_heap : DEFAULT_MIN_FREE_HEAP;
+
+    probe_mutex = xSemaphoreCreateMutexStatic(&probe_mutex_static);
+
+    BaseType_t ret = xTaskCreate(task_health, "ota_health", TASK_STACK_DEPTH,
+                                 NULL, 2, NULL);
+    assert(ret == pdPASS);
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "private.h"
+
+// Decides whether a newly installed OTA image, which is pending verification,
+// is healthy, and then marks it valid or rolls it back without waiting for a
+// `validate` or `rollback` command. Does nothing if the running image is not
+// pending verification, or if `manual` is set.
+//
+// Must be called after `libiot_init_reset_info()`. Non-positive arguments
+// are replaced by defaults.
+void libiot_init_ota_health(int window, int min_heap, bool manual);
@@ -0,0 +1,190 @@
+#include "ota_http.h"
+
+#include <esp_log.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+
+#define RECV_TIMEOUT_MS 5000
+#define READ_BUFF_SIZE 2048
+
+#define HTTP_STATUS_OK 200
+#define HTTP_STATUS_PARTIAL_CONTENT 206
+
+static esp_err_t http_event_handler(esp_http_client_event_t *evt) {
+    ota_http_t *h = evt->user_data;
+
+    // e.g. "Content-Range: bytes 0-65535/1543210"
+    if (evt->event_id == HTTP_EVENT_ON_HEADER
+        && !strcasecmp(evt->header_key, "Content-Range")) {
+        const char *slash = strchr(evt->header_value, '/');
+        if (slash && slash[1] != '*') {
+            h->range_total_len = strtoul(slash + 1, NULL, 10);
+        }
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t libiot_ota_http_init(ota_http_t *h, const char *url,
+                               const char *ca_cert) {
+    memset(h, 0, sizeof(*h));
+
+    h->buff = malloc(READ_BUFF_SIZE);
+    if (!h->buff) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_http_client_config_t config = {
+        .url = url,
+        .cert_pem = ca_cert,
+        .timeout_ms = RECV_TIMEOUT_MS,
+        .buffer_size_tx =
+            1024,  // Note: needed for chunky google cloud signed URLs
+        .keep_alive_enable = true,
+        .event_handler = http_event_handler,
+        .user_data = h,
+    };
+
+    h->client = esp_http_client_init(&config);
+    if (!h->client) {
+        free(h->buff);
+        h->buff = NULL;
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+// Reads exactly `len` bytes of the body (or until the end of the body if
+// `len` is 0), passing them to `cb` if it is not NULL.
+static esp_err_t read_body(ota_http_t *h, uint32_t len, ota_http_data_cb_t cb,
+                           void *ctx) {
+    uint32_t remaining = len;
+    while (!len || remaining) {
+        int want = len ? MIN(remaining, READ_BUFF_SIZE) : READ_BUFF_SIZE;
+        int n = esp_http_client_read(h->client, h->buff, want);
+        if (n < 0) {
+            return ESP_FAIL;
+        }
+        if (n == 0) {
+            if (!len && esp_http_client_is_complete_data_received(h->client)) {
+                break;
+            }
+            // The connection was closed (or timed out) early.
+            return ESP_ERR_TIMEOUT;
+        }
+
+        if (cb) {
+            esp_err_t err = cb(ctx, h->buff, n);
+            if (err != ESP_OK) {
+                return err;
+            }
+        }
+        remaining -= len ? n : 0;
+    }
+
+    return ESP_OK;
+}
+
+// Sends the request for the bytes [start, end) of the image, and reads the
+// headers of the response, into `status`.
+static esp_err_t open_range(ota_http_t *h, uint32_t start, uint32_t end,
+                            int *status) {
+    char range[32];
+    if (end) {
+        snprintf(range, sizeof(range), "bytes=%u-%u", start, end - 1);
+    } else {
+        snprintf(range, sizeof(range), "bytes=%u-", start);
+    }
+    esp_http_client_set_header(h->client, "Range", range);
+
+    h->range_total_len = 0;
+
+    esp_err_t err = esp_http_client_open(h->client, 0);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    int content_len = esp_http_client_fetch_headers(h->client);
+    *status = esp_http_client_get_status_code(h->client);
+
+    switch (*status) {
+        case HTTP_STATUS_PARTIAL_CONTENT: {
+            if (h->range_total_len) {
+                h->total_len = h->range_total_len;
+            }
+            return ESP_OK;
+        }
+        case HTTP_STATUS_OK: {
+            // The server does not do ranges, so we get everything and skip
+            // to what we want. (Only once: see `streaming`.)
+            if (content_len > 0) {
+                h->total_len = content_len;
+            }
+
+            return start ? read_body(h, start, NULL, NULL) : ESP_OK;
+        }
+        default: {
+            ESP_LOGE(TAG, "ota: http status %d", *status);
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+    }
+}
+
+esp_err_t libiot_ota_http_fetch(ota_http_t *h, uint32_t start, uint32_t end,
+                                ota_http_data_cb_t cb, void *ctx) {
+    esp_err_t err;
+
+    // Carry on with the response to the last range if it is where we left
+    // off, rather than asking (and skipping through the image) all over again.
+    int status = HTTP_STATUS_OK;
+    if (!h->streaming || start != h->stream_offset) {
+        if (h->streaming) {
+            esp_http_client_close(h->client);
+        }
+
+        err = open_range(h, start, end, &status);
+        if (err != ESP_OK) {
+            goto fetch_fail;
+        }
+    }
+    h->streaming = false;
+
+    if (end && h->total_len) {
+        end = MIN(end, h->total_len);
+    } else if (!end) {
+        end = h->total_len;
+    }
+
+    err = read_body(h, end > start ? end - start : 0, cb, ctx);
+    if (err != ESP_OK) {
+        goto fetch_fail;
+    }
+
+    // A server which ignored the range is still sending the rest of the
+    // image, which the next range can pick up.
+    if (status == HTTP_STATUS_OK && end != h->total_len) {
+        h->streaming = true;
+        h->stream_offset = end;
+    }
+
+    return ESP_OK;
+
+fetch_fail:
+    // Start the next attempt with a fresh connection.
+    esp_http_client_close(h->client);
+    h->streaming = false;
+    return err;
+}
+
+void libiot_ota_http_cleanup(ota_http_t *h) {
+    if (h->client) {
+        esp_http_client_close(h->client);
+        esp_http_client_cleanup(h->client);
+        h->client = NULL;
+    }
+
+    free(h->buff);
+    h->buff = NULL;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <esp_http_client.h>
+
+#include "private.h"
+
+typedef esp_err_t (*ota_http_data_cb_t)(void *ctx, const char *data,
+                                        size_t len);
+
+// Fetches an image over HTTP(S) in ranges, reusing the connection between
+// them where the server allows.
+typedef struct ota_http {
+    esp_http_client_handle_t client;
+    char *buff;
+
+    // The length of the whole image, once a response has told us (or 0).
+    uint32_t total_len;
+    // Parsed from the headers of the current response.
+    uint32_t range_total_len;
+
+    // Set while we are part way through the body of a response from a server
+    // which ignored our range (and so sent the whole image), along with the
+    // offset in the image of the next byte of it.
+    bool streaming;
+    uint32_t stream_offset;
+} ota_http_t;
+
+esp_err_t libiot_ota_http_init(ota_http_t *h, const char *url,
+                               const char *ca_cert);
+
+// Fetches the bytes [start, end) of the image (or from `start` to the end if
+// `end` is 0), passing them to `cb` as they arrive. If the server ignores the
+// range and sends the whole image, the bytes before `start` are skipped, and
+// the rest is left unread for the next call to carry on from (if it starts at
+// `end`), so that the image is still only downloaded once.
+esp_err_t libiot_ota_http_fetch(ota_http_t *h, uint32_t start, uint32_t end,
+                                ota_http_data_cb_t cb, void *ctx);
+
+void libiot_ota_http_cleanup(ota_http_t *h);
@@ -0,0 +1,73 @@
+#include "ota_inflate.h"
+
+#include <esp_log.h>
+#include <string.h>
+
+esp_err_t libiot_ota_inflate_init(ota_inflate_t *inf, ota_inflate_out_cb_t cb,
+                                  void *ctx) {
+    memset(inf, 0, sizeof(*inf));
+
+    inf->decomp = malloc(sizeof(tinfl_decompressor));
+    inf->dict = malloc(TINFL_LZ_DICT_SIZE);
+    if (!inf->decomp || !inf->dict) {
+        libiot_ota_inflate_free(inf);
+        return ESP_ERR_NO_MEM;
+    }
+
+    tinfl_init(inf->decomp);
+    inf->cb = cb;
+    inf->ctx = ctx;
+    return ESP_OK;
+}
+
+esp_err_t libiot_ota_inflate_write(ota_inflate_t *inf, const void *data,
+                                   size_t len) {
+    const uint8_t *pos = data;
+    while (len || !inf->done) {
+        if (inf->done) {
+            ESP_LOGE(TAG, "ota: data after the end of the compressed image");
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        size_t in_n = len;
+        size_t out_n = TINFL_LZ_DICT_SIZE - inf->dict_pos;
+        tinfl_status status = tinfl_decompress(
+            inf->decomp, pos, &in_n, inf->dict, inf->dict + inf->dict_pos,
+            &out_n,
+            TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_HAS_MORE_INPUT);
+        pos += in_n;
+        len -= in_n;
+
+        if (status < TINFL_STATUS_DONE) {
+            ESP_LOGE(TAG, "ota: compressed image is corrupt (%d)", status);
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        if (out_n) {
+            esp_err_t err = inf->cb(inf->ctx, inf->dict + inf->dict_pos, out_n);
+            if (err != ESP_OK) {
+                return err;
+            }
+            inf->dict_pos = (inf->dict_pos + out_n) % TINFL_LZ_DICT_SIZE;
+        }
+
+        if (status == TINFL_STATUS_DONE) {
+            inf->done = true;
+        } else if (status == TINFL_STATUS_NEEDS_MORE_INPUT) {
+            break;
+        }
+    }
+
+    return ESP_OK;
+}
+
+bool libiot_ota_inflate_done(const ota_inflate_t *inf) {
+    return inf->done;
+}
+
+void libiot_ota_inflate_free(ota_inflate_t *inf) {
+    free(inf->decomp);
+    free(inf->dict);
+    inf->decomp = NULL;
+    inf->dict = NULL;
+}
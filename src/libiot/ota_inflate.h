@@ -0,0 +1,51 @@
+#pragma once
+
+#include <sdkconfig.h>
+
+#if CONFIG_IDF_TARGET_ESP32
+#include <esp32/rom/miniz.h>
+#elif CONFIG_IDF_TARGET_ESP32S2
+#include <esp32s2/rom/miniz.h>
+#elif CONFIG_IDF_TARGET_ESP32S3
+#include <esp32s3/rom/miniz.h>
+#elif CONFIG_IDF_TARGET_ESP32C3
+#include <esp32c3/rom/miniz.h>
+#else
+#error "ota: no ROM inflater for this target"
+#endif
+
+#include "private.h"
+
+typedef esp_err_t (*ota_inflate_out_cb_t)(void *ctx, const void *data,
+                                          size_t len);
+
+// Decompresses a zlib stream as it arrives, passing the output to a callback.
+// This uses the inflater in the ROM, whose output buffer doubles as the
+// fixed 32 kB window, so (with its own state) this needs about 43 kB of RAM
+// however large the image is.
+typedef struct ota_inflate {
+    tinfl_decompressor *decomp;
+
+    // The window, which output is written to (and passed on from) in place.
+    uint8_t *dict;
+    size_t dict_pos;
+
+    bool done;
+
+    ota_inflate_out_cb_t cb;
+    void *ctx;
+} ota_inflate_t;
+
+esp_err_t libiot_ota_inflate_init(ota_inflate_t *inf, ota_inflate_out_cb_t cb,
+                                  void *ctx);
+
+// Consumes the next `len` bytes of the stream. Returns `ESP_ERR_INVALID_ARG`
+// if the stream is corrupt or continues past its end, or any error returned
+// by the callback.
+esp_err_t libiot_ota_inflate_write(ota_inflate_t *inf, const void *data,
+                                   size_t len);
+
+// Whether the end of the stream has been reached.
+bool libiot_ota_inflate_done(const ota_inflate_t *inf);
+
+void libiot_ota_inflate_free(ota_inflate_t *inf);
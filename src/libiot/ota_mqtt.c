@@ -0,0 +1,106 @@
+#include "ota_mqtt.h"
+
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <libiot.h>
+#include <string.h>
+
+#include "mqtt.h"
+
+// The most chunks which may be waiting for the OTA task. (The bytes waiting
+// are also limited, by the window.)
+#define QUEUE_LENGTH 16
+
+#define CHUNK_HEADER_LEN 4
+
+static StaticQueue_t chunk_queue_static;
+static uint8_t chunk_queue_buff[QUEUE_LENGTH * sizeof(ota_chunk_t *)];
+static QueueHandle_t chunk_queue;
+
+static bool active;
+static uint32_t window;
+// The bytes of the chunks in `chunk_queue`.
+static uint32_t queued_bytes;
+
+void libiot_init_ota_mqtt() {
+    chunk_queue =
+        xQueueCreateStatic(QUEUE_LENGTH, sizeof(ota_chunk_t *),
+                           chunk_queue_buff, &chunk_queue_static);
+}
+
+void libiot_ota_mqtt_handle_chunk(esp_mqtt_event_handle_t event) {
+    if (!__atomic_load_n(&active, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    if (event->data_len < CHUNK_HEADER_LEN) {
+        ESP_LOGW(TAG, "ota: runt chunk (%d bytes)", event->data_len);
+        return;
+    }
+
+    const uint8_t *hdr = (const uint8_t *) event->data;
+    size_t len = event->data_len - CHUNK_HEADER_LEN;
+
+    // The sender should never exceed the window, but in case it does we drop
+    // the chunk (and it will be sent again).
+    uint32_t total =
+        __atomic_add_fetch(&queued_bytes, len, __ATOMIC_RELAXED);
+    if (total > window) {
+        __atomic_sub_fetch(&queued_bytes, len, __ATOMIC_RELAXED);
+        return;
+    }
+
+    ota_chunk_t *c = malloc(sizeof(ota_chunk_t) + len);
+    if (!c) {
+        __atomic_sub_fetch(&queued_bytes, len, __ATOMIC_RELAXED);
+        return;
+    }
+
+    c->offset = hdr[0] | (hdr[1] << 8) | (hdr[2] << 16)
+                | ((uint32_t) hdr[3] << 24);
+    c->len = len;
+    memcpy(c->data, hdr + CHUNK_HEADER_LEN, len);
+
+    if (xQueueSend(chunk_queue, &c, 0) != pdTRUE) {
+        __atomic_sub_fetch(&queued_bytes, len, __ATOMIC_RELAXED);
+        free(c);
+    }
+}
+
+static void discard_chunks() {
+    ota_chunk_t *c;
+    while (xQueueReceive(chunk_queue, &c, 0) == pdTRUE) {
+        __atomic_sub_fetch(&queued_bytes, c->len, __ATOMIC_RELAXED);
+        free(c);
+    }
+}
+
+void libiot_ota_mqtt_begin(uint32_t new_window) {
+    // In case a chunk slipped in as the last download ended.
+    discard_chunks();
+
+    window = new_window;
+    __atomic_store_n(&active, true, __ATOMIC_RELEASE);
+}
+
+ota_chunk_t *libiot_ota_mqtt_recv(uint32_t timeout_ms) {
+    ota_chunk_t *c;
+    if (xQueueReceive(chunk_queue, &c, timeout_ms / portTICK_PERIOD_MS)
+        == pdFALSE) {
+        return NULL;
+    }
+
+    __atomic_sub_fetch(&queued_bytes, c->len, __ATOMIC_RELAXED);
+    return c;
+}
+
+void libiot_ota_mqtt_ack(uint32_t next) {
+    libiot_mqtt_postf_local(MQTT_TOPIC_INFO("ota_ack"), 1, 0,
+                            "{\"next\":%u,\"window\":%u}", next, window);
+}
+
+void libiot_ota_mqtt_end() {
+    __atomic_store_n(&active, false, __ATOMIC_RELEASE);
+    discard_chunks();
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <mqtt_client.h>
+
+#include "private.h"
+
+// Receives an OTA image over the MQTT connection, as chunks published to
+// 'hoek/iot/<device_name>/_cmd/ota_chunk'. Each chunk is the (little-endian
+// u32) offset of its data in the image, followed by the data.
+//
+// We acknowledge chunks by posting `{"next":<offset>,"window":<bytes>}` to
+// 'hoek/iot/<device_name>/_info/ota_ack', after which the sender may have
+// chunks covering [next, next + window) in flight. A chunk at any offset
+// other than `next` is dropped and `next` acknowledged again, so that the
+// sender goes back to it. (This is also how a download resumes from its last
+// checkpoint: the first acknowledgement asks for the image from there.)
+typedef struct ota_chunk {
+    uint32_t offset;
+    size_t len;
+    uint8_t data[];
+} ota_chunk_t;
+
+void libiot_init_ota_mqtt();
+
+// Called on the esp-mqtt task for each chunk.
+void libiot_ota_mqtt_handle_chunk(esp_mqtt_event_handle_t event);
+
+// Starts accepting up to `window` bytes of chunks at a time.
+void libiot_ota_mqtt_begin(uint32_t window);
+// Returns the next chunk (which the caller must free), or NULL if none
+// arrives within `timeout_ms`.
+ota_chunk_t *libiot_ota_mqtt_recv(uint32_t timeout_ms);
+void libiot_ota_mqtt_ack(uint32_t next);
+void libiot_ota_mqtt_end();
@@ -0,0 +1,121 @@
+#include "ota_progress.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/timers.h>
+#include <libiot.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "mqtt.h"
+
+#ifndef LIBIOT_OTA_PROGRESS_INTERVAL_MS
+#define LIBIOT_OTA_PROGRESS_INTERVAL_MS 5000
+#endif
+
+static StaticSemaphore_t mutex_static;
+static SemaphoreHandle_t mutex;
+
+static StaticTimer_t timer_static;
+static TimerHandle_t timer;
+
+// Protected by `mutex`.
+static bool active;
+static ota_progress_t current;
+
+static uint32_t per_second(uint32_t bytes, int64_t us) {
+    return bytes * 1000000LL / MAX(us, 1);
+}
+
+void libiot_ota_progress_get_stats(const ota_progress_t *p,
+                                   ota_progress_stats_t *stats) {
+    int64_t elapsed_us = esp_timer_get_time() - p->start_us;
+    uint32_t out_bytes = p->out_bytes - p->out_start;
+
+    stats->dl_bps = per_second(p->dl_bytes, elapsed_us);
+    stats->out_bps = per_second(out_bytes, elapsed_us);
+    stats->flash_bps =
+        per_second(p->sink.flash_bytes, p->sink.erase_us + p->sink.write_us);
+
+    stats->reader_stall_ms = p->sink.reader_stall_us / 1000;
+    stats->writer_stall_ms = p->sink.writer_stall_us / 1000;
+
+    // Go by the image if we know its length, otherwise by the download (e.g.
+    // when it is compressed).
+    stats->eta_s = -1;
+    if (p->image_len && stats->out_bps) {
+        stats->eta_s = (p->image_len - p->out_bytes) / stats->out_bps;
+    } else if (p->dl_len && stats->dl_bps) {
+        uint32_t dl_left = p->dl_len - MIN(p->dl_bytes, p->dl_len);
+        stats->eta_s = dl_left / stats->dl_bps;
+    }
+}
+
+static void timer_cb(TimerHandle_t unused) {
+    // Note that we hold the lock while posting (which does not block), so
+    // that nothing is posted once `libiot_ota_progress_stop()` returns.
+    while (xSemaphoreTake(mutex, portMAX_DELAY) == pdFALSE)
+        ;
+
+    if (active) {
+        const ota_progress_t *p = &current;
+
+        ota_progress_stats_t stats;
+        libiot_ota_progress_get_stats(p, &stats);
+
+        ESP_LOGI(TAG, "ota: read %u/%u kB (%u B/s), eta %ds",
+                 p->out_bytes / 1000, p->image_len / 1000, stats.out_bps,
+                 stats.eta_s);
+
+        // Note that this must fit in a post queue record.
+        libiot_mqtt_postf_local(
+            MQTT_TOPIC_INFO("ota"), 2, 0,
+            "{\"state\":\"in_progress\",\"rx_kb\":%u,\"image_len\":%u,"
+            "\"dl_kb\":%u,\"dl_bps\":%u,\"out_bps\":%u,\"flash_bps\":%u,"
+            "\"stall_ms\":[%u,%u],\"peak_ram\":%u,\"eta_s\":%d,"
+            "\"retries\":%u}",
+            p->out_bytes / 1000, p->image_len, p->dl_bytes / 1000,
+            stats.dl_bps, stats.out_bps, stats.flash_bps,
+            stats.reader_stall_ms, stats.writer_stall_ms, p->peak_ram,
+            stats.eta_s, p->retries);
+    }
+
+    xSemaphoreGive(mutex);
+}
+
+void libiot_init_ota_progress() {
+    mutex = xSemaphoreCreateMutexStatic(&mutex_static);
+    timer = xTimerCreateStatic(
+        "libiot_ota", LIBIOT_OTA_PROGRESS_INTERVAL_MS / portTICK_PERIOD_MS,
+        pdTRUE, NULL, timer_cb, &timer_static);
+}
+
+void libiot_ota_progress_start() {
+    while (xSemaphoreTake(mutex, portMAX_DELAY) == pdFALSE)
+        ;
+    memset(&current, 0, sizeof(current));
+    current.start_us = esp_timer_get_time();
+    active = true;
+    xSemaphoreGive(mutex);
+
+    xTimerStart(timer, portMAX_DELAY);
+}
+
+void libiot_ota_progress_update(const ota_progress_t *p) {
+    while (xSemaphoreTake(mutex, portMAX_DELAY) == pdFALSE)
+        ;
+    current = *p;
+    xSemaphoreGive(mutex);
+}
+
+void libiot_ota_progress_stop() {
+    xTimerStop(timer, portMAX_DELAY);
+
+    // The timer callback may already be running.
+    while (xSemaphoreTake(mutex, portMAX_DELAY) == pdFALSE)
+        ;
+    active = false;
+    xSemaphoreGive(mutex);
+}
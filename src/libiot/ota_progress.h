@@ -0,0 +1,58 @@
+#pragma once
+
+#include "ota_sink.h"
+#include "private.h"
+
+// The state of an OTA download, which the download records as it goes. It is
+// published periodically by a timer, so that the download itself never waits
+// on the broker.
+typedef struct ota_progress {
+    int64_t start_us;
+
+    // The length of the image, or 0 if it is not yet known (or if progress
+    // should be judged by the download, e.g. for a compressed image).
+    uint32_t image_len;
+    // The offset in the image reached, and the offset this attempt started
+    // from (if it resumed an earlier one).
+    uint32_t out_bytes;
+    uint32_t out_start;
+
+    // The bytes downloaded by this attempt, and the length of the download
+    // (or 0 if it is not yet known).
+    uint32_t dl_bytes;
+    uint32_t dl_len;
+
+    uint32_t retries;
+    // How far the free heap has fallen since the download started.
+    uint32_t peak_ram;
+
+    ota_sink_stats_t sink;
+} ota_progress_t;
+
+typedef struct ota_progress_stats {
+    // Bytes per second downloaded, and written to the image.
+    uint32_t dl_bps;
+    uint32_t out_bps;
+    // Bytes per second written to flash, counting only the time spent
+    // erasing and writing.
+    uint32_t flash_bps;
+
+    // Time the download waited on flash, and flash waited on the download.
+    uint32_t reader_stall_ms;
+    uint32_t writer_stall_ms;
+
+    // Seconds until the download is done, or -1 if we cannot tell.
+    int32_t eta_s;
+} ota_progress_stats_t;
+
+void libiot_init_ota_progress();
+
+// Starts publishing the progress of a download, until
+// `libiot_ota_progress_stop()`.
+void libiot_ota_progress_start();
+void libiot_ota_progress_update(const ota_progress_t *p);
+void libiot_ota_progress_stop();
+
+// The rates are averages over the whole attempt.
+void libiot_ota_progress_get_stats(const ota_progress_t *p,
+                                   ota_progress_stats_t *stats);
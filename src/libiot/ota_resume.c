@@ -0,0 +1,141 @@
+#include "ota_resume.h"
+
+#include <esp_log.h>
+#include <esp_ota_ops.h>
+#include <nvs.h>
+#include <string.h>
+
+#define NVS_NAMESPACE "libiot_ota"
+#define NVS_KEY_RECORD "resume"
+#define NVS_KEY_URL "url"
+#define NVS_KEY_CA_CERT "ca_cert"
+
+typedef struct record {
+    // The app which wrote the record.
+    uint8_t app_elf_sha256[32];
+    ota_resume_t resume;
+} record_t;
+
+static bool open_nvs(nvs_open_mode_t mode, nvs_handle_t *handle) {
+    esp_err_t err = nvs_open(NVS_NAMESPACE, mode, handle);
+    if (err != ESP_OK) {
+        if (mode == NVS_READWRITE || err != ESP_ERR_NVS_NOT_FOUND) {
+            ESP_LOGE(TAG, "ota: can't open nvs (0x%X)", err);
+        }
+        return false;
+    }
+    return true;
+}
+
+bool libiot_ota_resume_load(ota_resume_t *r) {
+    nvs_handle_t handle;
+    if (!open_nvs(NVS_READONLY, &handle)) {
+        return false;
+    }
+
+    record_t record;
+    size_t len = sizeof(record);
+    esp_err_t err = nvs_get_blob(handle, NVS_KEY_RECORD, &record, &len);
+    nvs_close(handle);
+
+    if (err != ESP_OK || len != sizeof(record)) {
+        return false;
+    }
+
+    if (memcmp(record.app_elf_sha256,
+               esp_ota_get_app_description()->app_elf_sha256,
+               sizeof(record.app_elf_sha256))) {
+        ESP_LOGW(TAG, "ota: ignoring resume record from another app");
+        return false;
+    }
+
+    *r = record.resume;
+    return true;
+}
+
+void libiot_ota_resume_save(const ota_resume_t *r) {
+    nvs_handle_t handle;
+    if (!open_nvs(NVS_READWRITE, &handle)) {
+        return;
+    }
+
+    record_t record;
+    memcpy(record.app_elf_sha256,
+           esp_ota_get_app_description()->app_elf_sha256,
+           sizeof(record.app_elf_sha256));
+    record.resume = *r;
+
+    esp_err_t err = nvs_set_blob(handle, NVS_KEY_RECORD, &record,
+                                 sizeof(record));
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "ota: can't save resume record (0x%X)", err);
+    }
+
+    nvs_close(handle);
+}
+
+void libiot_ota_resume_save_source(const char *url, const char *ca_cert) {
+    nvs_handle_t handle;
+    if (!open_nvs(NVS_READWRITE, &handle)) {
+        return;
+    }
+
+    esp_err_t err = nvs_set_str(handle, NVS_KEY_URL, url);
+    if (err == ESP_OK) {
+        err = nvs_set_str(handle, NVS_KEY_CA_CERT, ca_cert);
+    }
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "ota: can't save source (0x%X)", err);
+    }
+
+    nvs_close(handle);
+}
+
+static char *get_str(nvs_handle_t handle, const char *key) {
+    size_t len;
+    if (nvs_get_str(handle, key, NULL, &len) != ESP_OK) {
+        return NULL;
+    }
+
+    char *str = malloc(len);
+    if (str && nvs_get_str(handle, key, str, &len) != ESP_OK) {
+        free(str);
+        str = NULL;
+    }
+    return str;
+}
+
+bool libiot_ota_resume_load_source(char **url, char **ca_cert) {
+    nvs_handle_t handle;
+    if (!open_nvs(NVS_READONLY, &handle)) {
+        return false;
+    }
+
+    *url = get_str(handle, NVS_KEY_URL);
+    *ca_cert = get_str(handle, NVS_KEY_CA_CERT);
+    nvs_close(handle);
+
+    if (!*url || !*ca_cert) {
+        free(*url);
+        free(*ca_cert);
+        return false;
+    }
+    return true;
+}
+
+void libiot_ota_resume_clear() {
+    nvs_handle_t handle;
+    if (!open_nvs(NVS_READWRITE, &handle)) {
+        return;
+    }
+
+    nvs_erase_all(handle);
+    nvs_commit(handle);
+    nvs_close(handle);
+}
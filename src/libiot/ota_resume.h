@@ -0,0 +1,38 @@
+#pragma once
+
+#include <mbedtls/sha256.h>
+
+#include "private.h"
+
+// The progress of an interrupted OTA download, persisted in NVS so that it
+// can be resumed (even after a reboot) instead of started again.
+typedef struct ota_resume {
+    // Identifies the image being downloaded: its SHA-256 if the command gave
+    // one (in which case the downloaded image must match it), otherwise the
+    // SHA-256 of its URL.
+    uint8_t image_id[32];
+    bool image_id_is_sha256;
+
+    // The partition being written, and the length of the whole image.
+    uint32_t part_address;
+    uint32_t image_len;
+
+    // The number of bytes of the image which have been written to flash (and
+    // fed to `sha`).
+    uint32_t written;
+    mbedtls_sha256_context sha;
+} ota_resume_t;
+
+// Returns false if there is no record, or if it was written by a different
+// app (whose `mbedtls_sha256_context` might not mean the same thing).
+bool libiot_ota_resume_load(ota_resume_t *r);
+void libiot_ota_resume_save(const ota_resume_t *r);
+
+// Saves where the image is downloaded from, so that a download interrupted
+// by a reboot can be resumed without being asked again.
+void libiot_ota_resume_save_source(const char *url, const char *ca_cert);
+// Returns heap allocated copies of the saved URL and CA certificate, or false
+// if there are none.
+bool libiot_ota_resume_load_source(char **url, char **ca_cert);
+
+void libiot_ota_resume_clear();
@@ -0,0 +1,315 @@
+#include "ota_sched.h"
+
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <libiot.h>
+#include <mbedtls/sha256.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mqtt.h"
+#include "ota_verify.h"
+
+#define QUEUE_LENGTH 16
+
+static const char *JOB_TYPE_NAMES[] = {
+    [OTA_JOB_UPDATE] = "update",     [OTA_JOB_VALIDATE] = "validate",
+    [OTA_JOB_ROLLBACK] = "rollback", [OTA_JOB_CANCEL] = "cancel",
+    [OTA_JOB_OTHER] = "other",
+};
+
+static StaticSemaphore_t mutex_static;
+static SemaphoreHandle_t mutex;
+
+// Given whenever a job is queued.
+static StaticSemaphore_t wake_static;
+static SemaphoreHandle_t wake;
+
+// Protected by `mutex`. `queue[0]` is the next job to run.
+static ota_job_t queue[QUEUE_LENGTH];
+static size_t queue_len;
+
+// Protected by `mutex`. Of the active job, only the type and image id are
+// kept.
+static bool has_active;
+static ota_job_t active;
+
+// Whether the active job has been cancelled. Written with `mutex` held, but
+// polled without it.
+static bool cancelled;
+
+void libiot_init_ota_sched() {
+    mutex = xSemaphoreCreateMutexStatic(&mutex_static);
+    wake = xSemaphoreCreateBinaryStatic(&wake_static);
+}
+
+// Must be called with `mutex` held. (Posting does not block.)
+static void report(const char *event, const ota_job_t *job) {
+    // The first 8 bytes of the image id are plenty to tell images apart.
+    char id[17] = "";
+    if (job->type == OTA_JOB_UPDATE) {
+        for (int i = 0; i < 8; i++) {
+            sprintf(id + 2 * i, "%02x", job->image_id[i]);
+        }
+    }
+
+    ESP_LOGI(TAG, "ota: %s %s (%u queued) %s", JOB_TYPE_NAMES[job->type],
+             event, queue_len, id);
+    libiot_mqtt_postf_local(
+        MQTT_TOPIC_INFO("ota_queue"), 2, 0,
+        "{\"event\":\"%s\",\"type\":\"%s\",\"id\":\"%s\",\"queued\":%u}",
+        event, JOB_TYPE_NAMES[job->type], id, queue_len);
+}
+
+// Note that we must not decode `buff` in place, since the OTA task parses it
+// again.
+static bool get_image_id(const char *buff, const libiot_json_tok_t *toks,
+                         uint8_t image_id[32]) {
+    int sha256 = libiot_json_get(buff, toks, 0, "sha256");
+    if (sha256 >= 0 && toks[sha256].type == LIBIOT_JSON_STRING
+        && toks[sha256].end - toks[sha256].start == 64) {
+        char hex[65];
+        memcpy(hex, buff + toks[sha256].start, 64);
+        hex[64] = '\0';
+        if (libiot_ota_verify_parse_sha256(hex, image_id)) {
+            return true;
+        }
+    }
+
+    // As for the resume state, without a hash the image is identified by the
+    // hash of its (decoded) URL, which we decode from a copy.
+    int url = libiot_json_get(buff, toks, 0, "url");
+    if (url < 0 || toks[url].type != LIBIOT_JSON_STRING) {
+        return false;
+    }
+
+    size_t raw_len = toks[url].end - toks[url].start;
+    char *copy = malloc(raw_len + 1);
+    if (!copy) {
+        return false;
+    }
+    memcpy(copy, buff + toks[url].start, raw_len);
+    copy[raw_len] = '\0';
+
+    libiot_json_tok_t tok = toks[url];
+    tok.start = 0;
+    tok.end = raw_len;
+    const char *decoded = libiot_json_str(copy, &tok);
+    mbedtls_sha256_ret((const unsigned char *) decoded, strlen(decoded),
+                       image_id, false);
+    free(copy);
+    return true;
+}
+
+static ota_job_type_t classify(ota_job_t *job) {
+    const char *buff = job->cmd_json;
+
+    libiot_json_tok_t toks[OTA_CMD_MAX_TOKENS];
+    int num_toks =
+        libiot_json_tokenize(buff, strlen(buff), toks, OTA_CMD_MAX_TOKENS);
+    if (num_toks < 0 || toks[0].type != LIBIOT_JSON_OBJECT) {
+        return OTA_JOB_OTHER;
+    }
+
+    int type = libiot_json_get(buff, toks, 0, "type");
+    if (type < 0) {
+        return OTA_JOB_OTHER;
+    }
+
+    if (libiot_json_eq(buff, &toks[type], "update")) {
+        // Updates we cannot identify are left for the OTA task to reject.
+        return get_image_id(buff, toks, job->image_id) ? OTA_JOB_UPDATE
+                                                        : OTA_JOB_OTHER;
+    } else if (libiot_json_eq(buff, &toks[type], "validate")) {
+        return OTA_JOB_VALIDATE;
+    } else if (libiot_json_eq(buff, &toks[type], "rollback")) {
+        return OTA_JOB_ROLLBACK;
+    } else if (libiot_json_eq(buff, &toks[type], "cancel")) {
+        return OTA_JOB_CANCEL;
+    }
+    return OTA_JOB_OTHER;
+}
+
+static bool same_image(const ota_job_t *a, const ota_job_t *b) {
+    return a->type == OTA_JOB_UPDATE && b->type == OTA_JOB_UPDATE
+           && !memcmp(a->image_id, b->image_id, sizeof(a->image_id));
+}
+
+// Must be called with `mutex` held.
+static void cancel_active() {
+    if (has_active && active.type == OTA_JOB_UPDATE && !cancelled) {
+        __atomic_store_n(&cancelled, true, __ATOMIC_RELEASE);
+        report("cancelling", &active);
+    }
+}
+
+// Must be called with `mutex` held.
+static void remove_at(size_t i) {
+    free(queue[i].cmd_json);
+    memmove(&queue[i], &queue[i + 1], (queue_len - i - 1) * sizeof(*queue));
+    queue_len--;
+}
+
+// Must be called with `mutex` held. Returns false if `job` should be
+// dropped.
+static bool make_room(const ota_job_t *job) {
+    switch (job->type) {
+        case OTA_JOB_UPDATE: {
+            if (has_active && same_image(job, &active) && !cancelled) {
+                report("duplicate", job);
+                return false;
+            }
+
+            for (size_t i = 0; i < queue_len;) {
+                if (same_image(job, &queue[i])) {
+                    report("duplicate", job);
+                    return false;
+                }
+
+                if (queue[i].type == OTA_JOB_UPDATE) {
+                    ota_job_t old = queue[i];
+                    remove_at(i);
+                    report("superseded", &old);
+                    continue;
+                }
+                i++;
+            }
+            break;
+        }
+        case OTA_JOB_ROLLBACK: {
+            for (size_t i = 0; i < queue_len; i++) {
+                if (queue[i].type == OTA_JOB_ROLLBACK) {
+                    report("duplicate", job);
+                    return false;
+                }
+            }
+
+            cancel_active();
+            break;
+        }
+        default: {
+            break;
+        }
+    }
+
+    if (queue_len == QUEUE_LENGTH) {
+        report("dropped", job);
+        return false;
+    }
+
+    return true;
+}
+
+// Must be called with `mutex` held.
+static void cancel() {
+    for (size_t i = 0; i < queue_len;) {
+        if (queue[i].type == OTA_JOB_UPDATE) {
+            ota_job_t old = queue[i];
+            remove_at(i);
+            report("cancelled", &old);
+            continue;
+        }
+        i++;
+    }
+
+    cancel_active();
+}
+
+void libiot_ota_sched_submit(char *cmd_json) {
+    if (!mutex) {
+        libiot_logf_error(TAG,
+                          "ota: dispatch request with ota not initialized!");
+        free(cmd_json);
+        return;
+    }
+
+    ota_job_t job = {
+        .cmd_json = cmd_json,
+    };
+    job.type = classify(&job);
+
+    while (xSemaphoreTake(mutex, portMAX_DELAY) == pdFALSE)
+        ;
+
+    if (job.type == OTA_JOB_CANCEL) {
+        cancel();
+        free(cmd_json);
+        xSemaphoreGive(mutex);
+        return;
+    }
+
+    if (!make_room(&job)) {
+        free(cmd_json);
+        xSemaphoreGive(mutex);
+        return;
+    }
+
+    // Rollbacks run before anything else which is queued.
+    size_t pos = queue_len;
+    if (job.type == OTA_JOB_ROLLBACK) {
+        pos = 0;
+        memmove(&queue[1], &queue[0], queue_len * sizeof(*queue));
+    }
+    queue[pos] = job;
+    queue_len++;
+    report("queued", &job);
+
+    xSemaphoreGive(mutex);
+    xSemaphoreGive(wake);
+}
+
+static void set_active(const ota_job_t *job) {
+    has_active = true;
+    active = *job;
+    active.cmd_json = NULL;
+    __atomic_store_n(&cancelled, false, __ATOMIC_RELEASE);
+    report("started", job);
+}
+
+void libiot_ota_sched_next(ota_job_t *job) {
+    while (1) {
+        while (xSemaphoreTake(mutex, portMAX_DELAY) == pdFALSE)
+            ;
+
+        if (queue_len) {
+            *job = queue[0];
+            memmove(&queue[0], &queue[1], (queue_len - 1) * sizeof(*queue));
+            queue_len--;
+
+            set_active(job);
+            xSemaphoreGive(mutex);
+            return;
+        }
+
+        xSemaphoreGive(mutex);
+        xSemaphoreTake(wake, portMAX_DELAY);
+    }
+}
+
+void libiot_ota_sched_resume(ota_job_t *job, const uint8_t image_id[32]) {
+    memset(job, 0, sizeof(*job));
+    job->type = OTA_JOB_UPDATE;
+    memcpy(job->image_id, image_id, sizeof(job->image_id));
+
+    while (xSemaphoreTake(mutex, portMAX_DELAY) == pdFALSE)
+        ;
+    set_active(job);
+    xSemaphoreGive(mutex);
+}
+
+void libiot_ota_sched_finish(ota_job_t *job) {
+    while (xSemaphoreTake(mutex, portMAX_DELAY) == pdFALSE)
+        ;
+    has_active = false;
+    report(cancelled ? "cancelled" : "finished", job);
+    xSemaphoreGive(mutex);
+
+    free(job->cmd_json);
+    job->cmd_json = NULL;
+}
+
+bool libiot_ota_sched_cancelled() {
+    return __atomic_load_n(&cancelled, __ATOMIC_ACQUIRE);
+}
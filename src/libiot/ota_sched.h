@@ -0,0 +1,57 @@
+#pragma once
+
+#include "private.h"
+
+// Orders the OTA commands waiting for the OTA task. Commands are classified
+// (but otherwise left unparsed) as they arrive, so that:
+//
+// * an `update` for the image already being installed, or already queued
+//   (e.g. a QoS 1 redelivery), is dropped as a duplicate,
+// * an `update` for a different image supersedes any update still queued,
+// * a `rollback` jumps ahead of queued updates, and cancels the update in
+//   progress (which would otherwise overwrite the image we roll back to),
+// * a `cancel` drops queued updates, and cancels the update in progress.
+//
+// Updates are identified by their `sha256`, or else by their `url`. Every
+// change to the queue is posted to '_info/ota_queue'.
+
+// OTA commands are small objects, so this leaves plenty of room for fields
+// we do not know about.
+#define OTA_CMD_MAX_TOKENS 32
+
+typedef enum ota_job_type {
+    OTA_JOB_UPDATE,
+    OTA_JOB_VALIDATE,
+    OTA_JOB_ROLLBACK,
+    // Handled as soon as it arrives, and never queued.
+    OTA_JOB_CANCEL,
+    // Malformed or unknown commands, which are left for the OTA task to
+    // report.
+    OTA_JOB_OTHER,
+} ota_job_type_t;
+
+typedef struct ota_job {
+    ota_job_type_t type;
+    char *cmd_json;
+
+    // For updates, the hash of the image, or otherwise of its URL.
+    uint8_t image_id[32];
+} ota_job_t;
+
+void libiot_init_ota_sched();
+
+// Takes ownership of `cmd_json`. Called on the esp-mqtt task.
+void libiot_ota_sched_submit(char *cmd_json);
+
+// Blocks until there is a job, which becomes the active job until
+// `libiot_ota_sched_finish()`.
+void libiot_ota_sched_next(ota_job_t *job);
+// Makes an update which was interrupted by a reboot the active job, so that
+// it can be deduplicated against and cancelled.
+void libiot_ota_sched_resume(ota_job_t *job, const uint8_t image_id[32]);
+// Frees `job->cmd_json`.
+void libiot_ota_sched_finish(ota_job_t *job);
+
+// Whether the active job has been cancelled. Long running jobs should poll
+// this, and stop early if it is set.
+bool libiot_ota_sched_cancelled();
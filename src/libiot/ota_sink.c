@@ -0,0 +1,418 @@
+#include "ota_sink.h"
+
+#include <esp_log.h>
+#include <esp_ota_ops.h>
+#include <esp_spi_flash.h>
+#include <esp_timer.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "ota_verify.h"
+
+// Writes to encrypted partitions must be whole 16 byte blocks.
+#define WRITE_ALIGN 16
+
+// How many sectors past the one being written the writer erases while it
+// waits for data.
+#define ERASE_AHEAD_SECTORS 2
+
+#define WRITER_STACK_DEPTH 4096
+#define WRITER_PRIORITY 5
+
+// The downloader runs alongside the network stack on the PRO CPU, so the
+// writer takes the APP CPU (where there is one).
+#if portNUM_PROCESSORS > 1
+#define WRITER_CORE 1
+#else
+#define WRITER_CORE tskNO_AFFINITY
+#endif
+
+typedef enum sector_op {
+    SECTOR_WRITE,
+    // Pause until `drain()` is over.
+    SECTOR_SYNC,
+    SECTOR_STOP,
+} sector_op_t;
+
+typedef struct sector {
+    sector_op_t op;
+    uint8_t *buff;
+    uint32_t offset;
+    size_t len;
+} sector_t;
+
+static uint32_t elapsed_us(int64_t start_us) {
+    return esp_timer_get_time() - start_us;
+}
+
+static esp_err_t erase_sector(ota_sink_t *s, uint32_t offset) {
+    int64_t start_us = esp_timer_get_time();
+    esp_err_t err =
+        esp_partition_erase_range(s->part, offset, SPI_FLASH_SEC_SIZE);
+    s->stats.erase_us += elapsed_us(start_us);
+
+    if (err == ESP_OK) {
+        s->erased_to = offset + SPI_FLASH_SEC_SIZE;
+    }
+    return err;
+}
+
+// Erases the next sector of the image ahead of time, if there is one within
+// reach, returning whether there was.
+static bool erase_ahead(ota_sink_t *s) {
+    uint32_t limit =
+        s->written + (1 + ERASE_AHEAD_SECTORS) * SPI_FLASH_SEC_SIZE;
+    if (s->writer_err != ESP_OK || s->erased_to >= MIN(s->image_len, limit)) {
+        return false;
+    }
+
+    s->writer_err = erase_sector(s, s->erased_to);
+    return true;
+}
+
+static esp_err_t write_sector(ota_sink_t *s, const sector_t *sec) {
+    if (sec->offset >= s->erased_to) {
+        esp_err_t err = erase_sector(s, sec->offset);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+
+    // Pad the last sector of the image out to a whole block.
+    size_t padded_len = (sec->len + WRITE_ALIGN - 1) & ~(WRITE_ALIGN - 1);
+    memset(sec->buff + sec->len, 0xFF, padded_len - sec->len);
+
+    int64_t start_us = esp_timer_get_time();
+    esp_err_t err =
+        esp_partition_write(s->part, sec->offset, sec->buff, padded_len);
+    s->stats.write_us += elapsed_us(start_us);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    mbedtls_sha256_update_ret(&s->sha, sec->buff, sec->len);
+    s->written += sec->len;
+    s->stats.flash_bytes += sec->len;
+    return ESP_OK;
+}
+
+static void task_writer(void *arg) {
+    ota_sink_t *s = arg;
+
+    while (1) {
+        sector_t sec;
+        if (xQueueReceive(s->full_queue, &sec, 0) == pdFALSE) {
+            if (erase_ahead(s)) {
+                continue;
+            }
+
+            int64_t start_us = esp_timer_get_time();
+            while (xQueueReceive(s->full_queue, &sec, portMAX_DELAY)
+                   == pdFALSE)
+                ;
+            s->stats.writer_stall_us += elapsed_us(start_us);
+        }
+
+        if (sec.op == SECTOR_STOP) {
+            break;
+        }
+
+        if (sec.op == SECTOR_SYNC) {
+            xSemaphoreGive(s->synced);
+            while (xSemaphoreTake(s->resumed, portMAX_DELAY) == pdFALSE)
+                ;
+            continue;
+        }
+
+        if (s->writer_err == ESP_OK) {
+            s->writer_err = write_sector(s, &sec);
+        }
+
+        while (xQueueSend(s->free_queue, &sec.buff, portMAX_DELAY) == pdFALSE)
+            ;
+    }
+
+    xSemaphoreGive(s->writer_done);
+    vTaskDelete(NULL);
+}
+
+static void send_sector(ota_sink_t *s, const sector_t *sec) {
+    while (xQueueSend(s->full_queue, sec, portMAX_DELAY) == pdFALSE)
+        ;
+}
+
+// Waits until the writer has finished with every sector handed to it, and
+// then holds it paused (so that the state it owns may be touched) until
+// `undrain()`.
+static void drain(ota_sink_t *s) {
+    sector_t sync = {.op = SECTOR_SYNC};
+    send_sector(s, &sync);
+    while (xSemaphoreTake(s->synced, portMAX_DELAY) == pdFALSE)
+        ;
+}
+
+static void undrain(ota_sink_t *s) {
+    xSemaphoreGive(s->resumed);
+}
+
+// Note that the writer must not be running.
+static void restore(ota_sink_t *s, const ota_resume_t *resume) {
+    mbedtls_sha256_free(&s->sha);
+    mbedtls_sha256_init(&s->sha);
+    mbedtls_sha256_clone(&s->sha, &resume->sha);
+
+    s->written = resume->written;
+    s->queued = resume->written;
+    s->sector_len = 0;
+
+    // Anything past the checkpoint may since have been written, so must be
+    // erased again.
+    s->erased_to = resume->written;
+}
+
+static esp_err_t check_written_header(ota_sink_t *s) {
+    if (s->written < OTA_VERIFY_HEADER_LEN) {
+        return ESP_OK;
+    }
+
+    uint8_t *header = malloc(OTA_VERIFY_HEADER_LEN);
+    if (!header) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_err_t err =
+        esp_partition_read(s->part, 0, header, OTA_VERIFY_HEADER_LEN);
+    if (err == ESP_OK) {
+        err = libiot_ota_verify_header(header);
+    }
+    free(header);
+
+    s->header_checked = err == ESP_OK;
+    return err;
+}
+
+bool libiot_ota_sink_running_unverified() {
+    esp_ota_img_states_t state;
+    return esp_ota_get_state_partition(esp_ota_get_running_partition(), &state)
+               == ESP_OK
+           && state == ESP_OTA_IMG_PENDING_VERIFY;
+}
+
+esp_err_t libiot_ota_sink_begin(ota_sink_t *s, const esp_partition_t *part,
+                                uint32_t image_len,
+                                const ota_resume_t *resume) {
+    memset(s, 0, sizeof(*s));
+
+    if (libiot_ota_sink_running_unverified()) {
+        ESP_LOGE(TAG, "ota: running image not yet validated");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (image_len > part->size) {
+        ESP_LOGE(TAG, "ota: image too large (%u > %u bytes)", image_len,
+                 part->size);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    s->part = part;
+    s->image_len = image_len;
+    mbedtls_sha256_init(&s->sha);
+
+    s->full_queue = xQueueCreate(OTA_SINK_BUFFERS, sizeof(sector_t));
+    s->free_queue = xQueueCreate(OTA_SINK_BUFFERS, sizeof(uint8_t *));
+    s->writer_done = xSemaphoreCreateBinary();
+    s->synced = xSemaphoreCreateBinary();
+    s->resumed = xSemaphoreCreateBinary();
+    if (!s->full_queue || !s->free_queue || !s->writer_done || !s->synced
+        || !s->resumed) {
+        libiot_ota_sink_free(s);
+        return ESP_ERR_NO_MEM;
+    }
+
+    for (int i = 0; i < OTA_SINK_BUFFERS; i++) {
+        s->buffs[i] = malloc(SPI_FLASH_SEC_SIZE);
+        if (!s->buffs[i]) {
+            libiot_ota_sink_free(s);
+            return ESP_ERR_NO_MEM;
+        }
+        xQueueSend(s->free_queue, &s->buffs[i], 0);
+    }
+
+    if (resume) {
+        restore(s, resume);
+
+        // The header was checked when it was written, but check it again
+        // in case the running app (which it is checked against) changed.
+        esp_err_t err = check_written_header(s);
+        if (err != ESP_OK) {
+            libiot_ota_sink_free(s);
+            return err;
+        }
+    } else {
+        mbedtls_sha256_starts_ret(&s->sha, false);
+    }
+
+    if (xTaskCreatePinnedToCore(task_writer, "ota_writer", WRITER_STACK_DEPTH,
+                                s, WRITER_PRIORITY, &s->writer, WRITER_CORE)
+        != pdPASS) {
+        libiot_ota_sink_free(s);
+        return ESP_ERR_NO_MEM;
+    }
+
+    return ESP_OK;
+}
+
+static void take_buffer(ota_sink_t *s) {
+    int64_t start_us = esp_timer_get_time();
+    while (xQueueReceive(s->free_queue, &s->sector, portMAX_DELAY) == pdFALSE)
+        ;
+    s->stats.reader_stall_us += elapsed_us(start_us);
+
+    s->sector_len = 0;
+}
+
+static void submit_sector(ota_sink_t *s) {
+    sector_t sec = {
+        .op = SECTOR_WRITE,
+        .buff = s->sector,
+        .offset = s->queued,
+        .len = s->sector_len,
+    };
+    send_sector(s, &sec);
+
+    s->queued += s->sector_len;
+    s->sector = NULL;
+    s->sector_len = 0;
+}
+
+esp_err_t libiot_ota_sink_write(ota_sink_t *s, const void *data, size_t len) {
+    if (s->writer_err != ESP_OK) {
+        return s->writer_err;
+    }
+
+    if (len > s->image_len - libiot_ota_sink_offset(s)) {
+        ESP_LOGE(TAG, "ota: more data than the image length");
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    const uint8_t *pos = data;
+    while (len) {
+        if (!s->sector) {
+            take_buffer(s);
+        }
+
+        size_t n = MIN(len, SPI_FLASH_SEC_SIZE - s->sector_len);
+        memcpy(s->sector + s->sector_len, pos, n);
+        s->sector_len += n;
+        pos += n;
+        len -= n;
+
+        // Note that the header lies within the first sector.
+        if (!s->header_checked && !s->queued
+            && s->sector_len >= OTA_VERIFY_HEADER_LEN) {
+            esp_err_t err = libiot_ota_verify_header(s->sector);
+            if (err != ESP_OK) {
+                return err;
+            }
+            s->header_checked = true;
+        }
+
+        if (s->sector_len == SPI_FLASH_SEC_SIZE) {
+            submit_sector(s);
+        }
+    }
+
+    return ESP_OK;
+}
+
+uint32_t libiot_ota_sink_offset(const ota_sink_t *s) {
+    return s->queued + s->sector_len;
+}
+
+void libiot_ota_sink_checkpoint(ota_sink_t *s, ota_resume_t *resume) {
+    drain(s);
+
+    resume->part_address = s->part->address;
+    resume->image_len = s->image_len;
+    resume->written = s->written;
+
+    // Note that on the ESP32 this also copies the state out of the SHA
+    // hardware (if `s->sha` is using it), so the copy can be persisted.
+    mbedtls_sha256_init(&resume->sha);
+    mbedtls_sha256_clone(&resume->sha, &s->sha);
+
+    undrain(s);
+}
+
+void libiot_ota_sink_rewind(ota_sink_t *s, const ota_resume_t *resume) {
+    drain(s);
+    restore(s, resume);
+    undrain(s);
+}
+
+void libiot_ota_sink_truncate(ota_sink_t *s) {
+    s->image_len = libiot_ota_sink_offset(s);
+}
+
+esp_err_t libiot_ota_sink_finish(ota_sink_t *s, uint8_t digest[32]) {
+    if (libiot_ota_sink_offset(s) != s->image_len) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // The image is too short to have been checked.
+    if (!s->header_checked) {
+        return ESP_ERR_OTA_VALIDATE_FAILED;
+    }
+
+    if (s->sector_len) {
+        submit_sector(s);
+    }
+
+    drain(s);
+    esp_err_t err = s->writer_err;
+    if (err == ESP_OK) {
+        mbedtls_sha256_finish_ret(&s->sha, digest);
+    }
+    undrain(s);
+
+    return err;
+}
+
+void libiot_ota_sink_get_stats(const ota_sink_t *s, ota_sink_stats_t *stats) {
+    *stats = s->stats;
+}
+
+void libiot_ota_sink_free(ota_sink_t *s) {
+    if (s->writer) {
+        sector_t stop = {.op = SECTOR_STOP};
+        send_sector(s, &stop);
+        while (xSemaphoreTake(s->writer_done, portMAX_DELAY) == pdFALSE)
+            ;
+        s->writer = NULL;
+    }
+
+    if (s->full_queue) {
+        vQueueDelete(s->full_queue);
+        s->full_queue = NULL;
+    }
+    if (s->free_queue) {
+        vQueueDelete(s->free_queue);
+        s->free_queue = NULL;
+    }
+
+    SemaphoreHandle_t *sems[] = {&s->writer_done, &s->synced, &s->resumed};
+    for (int i = 0; i < sizeof(sems) / sizeof(*sems); i++) {
+        if (*sems[i]) {
+            vSemaphoreDelete(*sems[i]);
+            *sems[i] = NULL;
+        }
+    }
+
+    for (int i = 0; i < OTA_SINK_BUFFERS; i++) {
+        free(s->buffs[i]);
+        s->buffs[i] = NULL;
+    }
+    s->sector = NULL;
+
+    mbedtls_sha256_free(&s->sha);
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <esp_partition.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <mbedtls/sha256.h>
+
+#include "ota_resume.h"
+#include "private.h"
+
+// The number of sector buffers: while one is being filled from the network,
+// the other is being written to flash.
+#define OTA_SINK_BUFFERS 2
+
+typedef struct ota_sink_stats {
+    // Time the downloader spent waiting for a free buffer (i.e. on flash).
+    uint32_t reader_stall_us;
+    // Time the writer spent waiting for a full sector (i.e. on the network).
+    uint32_t writer_stall_us;
+
+    // Time spent erasing and writing flash, and the bytes written.
+    uint32_t erase_us;
+    uint32_t write_us;
+    uint32_t flash_bytes;
+} ota_sink_stats_t;
+
+// Writes an OTA image to an app partition one flash sector at a time (erasing
+// each just before it is written), hashing the image as it goes.
+//
+// Unlike `esp_ota_begin()` this does not erase the partition up front, so
+// that a download can be resumed from a checkpoint.
+//
+// The start of the image is checked with `libiot_ota_verify_header()` as soon
+// as it arrives, so that a download of the wrong image fails after a few
+// hundred bytes rather than at the end.
+//
+// The flash is erased and written by a writer task on the other core, so that
+// downloading the next sector overlaps with writing the last. While it waits
+// for data, the writer erases the next few sectors ahead of time.
+typedef struct ota_sink {
+    const esp_partition_t *part;
+    uint32_t image_len;
+
+    // The number of bytes handed to the writer (a whole number of sectors
+    // until the image is finished).
+    uint32_t queued;
+
+    // The sector being filled, if we hold a buffer.
+    uint8_t *sector;
+    size_t sector_len;
+
+    bool header_checked;
+
+    // Owned by the writer, and only touched by others while it is paused.
+    //
+    // The number of bytes written to flash (and fed to `sha`), and the end of
+    // the sectors erased ahead of them.
+    uint32_t written;
+    uint32_t erased_to;
+    mbedtls_sha256_context sha;
+    // The first error the writer encountered (after which it writes nothing).
+    volatile esp_err_t writer_err;
+
+    TaskHandle_t writer;
+    SemaphoreHandle_t writer_done;
+    // For pausing the writer while we touch the state it owns.
+    SemaphoreHandle_t synced;
+    SemaphoreHandle_t resumed;
+    // Full sectors for the writer, and the buffers it is done with.
+    QueueHandle_t full_queue;
+    QueueHandle_t free_queue;
+    uint8_t *buffs[OTA_SINK_BUFFERS];
+
+    ota_sink_stats_t stats;
+} ota_sink_t;
+
+// Whether the running image is still pending verification. Until it is marked
+// valid, the other app partition holds the image we would roll back to, so
+// the sink refuses to write over it.
+bool libiot_ota_sink_running_unverified();
+
+// If `resume` is not NULL then we continue from it, and the next byte written
+// must be at offset `resume->written` of the image.
+//
+// Returns `ESP_ERR_INVALID_STATE` if the running image is not yet validated.
+esp_err_t libiot_ota_sink_begin(ota_sink_t *s, const esp_partition_t *part,
+                                uint32_t image_len, const ota_resume_t *resume);
+
+// Returns `ESP_ERR_OTA_VALIDATE_FAILED` if the start of the image is rejected.
+esp_err_t libiot_ota_sink_write(ota_sink_t *s, const void *data, size_t len);
+
+// The offset in the image of the next byte to be written.
+uint32_t libiot_ota_sink_offset(const ota_sink_t *s);
+
+// Records what has been written to flash in `resume` (whose other fields are
+// left alone), waiting for the writer to catch up. Bytes not yet making up a
+// whole sector are not included.
+void libiot_ota_sink_checkpoint(ota_sink_t *s, ota_resume_t *resume);
+
+// Returns to `resume`, discarding anything written since.
+void libiot_ota_sink_rewind(ota_sink_t *s, const ota_resume_t *resume);
+
+// Ends the image at the current offset, for images whose length was not known
+// when the sink was begun (which should then be given the partition size).
+void libiot_ota_sink_truncate(ota_sink_t *s);
+
+// Writes out the last partial sector (once the whole image has been written)
+// and returns the SHA-256 of the image in `digest`.
+esp_err_t libiot_ota_sink_finish(ota_sink_t *s, uint8_t digest[32]);
+
+// Note that the stats are updated by the writer as it goes, so are only
+// exact once it has caught up (e.g. after a checkpoint).
+void libiot_ota_sink_get_stats(const ota_sink_t *s, ota_sink_stats_t *stats);
+
+void libiot_ota_sink_free(ota_sink_t *s);
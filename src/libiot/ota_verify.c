@@ -0,0 +1,126 @@
+#include "ota_verify.h"
+
+#include <esp_log.h>
+#include <esp_ota_ops.h>
+#include <mbedtls/base64.h>
+#include <mbedtls/pk.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef CONFIG_BOOTLOADER_APP_ANTI_ROLLBACK
+#include <esp_efuse.h>
+#endif
+
+static bool has_key;
+static mbedtls_pk_context key;
+
+esp_err_t libiot_ota_verify_init(const char *signing_key_pem) {
+    if (!signing_key_pem) {
+        return ESP_OK;
+    }
+
+    mbedtls_pk_init(&key);
+
+    // Note that the length of a PEM key must include the null terminator.
+    int ret = mbedtls_pk_parse_public_key(
+        &key, (const unsigned char *) signing_key_pem,
+        strlen(signing_key_pem) + 1);
+    if (ret) {
+        ESP_LOGE(TAG, "ota: can't parse signing key (-0x%X)", -ret);
+        mbedtls_pk_free(&key);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    has_key = true;
+    return ESP_OK;
+}
+
+esp_err_t libiot_ota_verify_header(const uint8_t *image) {
+    const esp_image_header_t *hdr = (const esp_image_header_t *) image;
+    if (hdr->magic != ESP_IMAGE_HEADER_MAGIC) {
+        ESP_LOGE(TAG, "ota: not an app image (magic 0x%02X)", hdr->magic);
+        return ESP_ERR_OTA_VALIDATE_FAILED;
+    }
+
+#ifdef CONFIG_IDF_FIRMWARE_CHIP_ID
+    if (hdr->chip_id != CONFIG_IDF_FIRMWARE_CHIP_ID) {
+        ESP_LOGE(TAG, "ota: image is for another chip (id %d)",
+                 hdr->chip_id);
+        return ESP_ERR_OTA_VALIDATE_FAILED;
+    }
+#endif
+
+    // Note that the description need not be aligned in `image`.
+    esp_app_desc_t desc;
+    memcpy(&desc,
+           image + sizeof(esp_image_header_t)
+               + sizeof(esp_image_segment_header_t),
+           sizeof(desc));
+    if (desc.magic_word != ESP_APP_DESC_MAGIC_WORD) {
+        ESP_LOGE(TAG, "ota: image has no app description");
+        return ESP_ERR_OTA_VALIDATE_FAILED;
+    }
+
+    const esp_app_desc_t *running = esp_ota_get_app_description();
+    if (strncmp(desc.project_name, running->project_name,
+                sizeof(desc.project_name))) {
+        ESP_LOGE(TAG, "ota: image is for project '%.*s'",
+                 sizeof(desc.project_name), desc.project_name);
+        return ESP_ERR_OTA_VALIDATE_FAILED;
+    }
+
+#ifdef CONFIG_BOOTLOADER_APP_ANTI_ROLLBACK
+    if (!esp_efuse_check_secure_version(desc.secure_version)) {
+        ESP_LOGE(TAG, "ota: image secure_version %u has been revoked",
+                 desc.secure_version);
+        return ESP_ERR_OTA_VALIDATE_FAILED;
+    }
+#endif
+
+    ESP_LOGI(TAG, "ota: image is '%.*s' version '%.*s'",
+             sizeof(desc.project_name), desc.project_name,
+             sizeof(desc.version), desc.version);
+    return ESP_OK;
+}
+
+bool libiot_ota_verify_has_key() {
+    return has_key;
+}
+
+esp_err_t libiot_ota_verify_signature(const uint8_t sha256[32],
+                                      const char *signature) {
+    if (!has_key) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    unsigned char sig[MBEDTLS_PK_SIGNATURE_MAX_SIZE];
+    size_t sig_len;
+    if (mbedtls_base64_decode(sig, sizeof(sig), &sig_len,
+                              (const unsigned char *) signature,
+                              strlen(signature))) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (mbedtls_pk_verify(&key, MBEDTLS_MD_SHA256, sha256, 32, sig,
+                          sig_len)) {
+        return ESP_ERR_INVALID_CRC;
+    }
+
+    return ESP_OK;
+}
+
+bool libiot_ota_verify_parse_sha256(const char *hex, uint8_t out[32]) {
+    if (strlen(hex) != 64) {
+        return false;
+    }
+
+    for (int i = 0; i < 32; i++) {
+        char byte[3] = {hex[2 * i], hex[2 * i + 1], '\0'};
+        char *end;
+        out[i] = strtoul(byte, &end, 16);
+        if (*end) {
+            return false;
+        }
+    }
+    return true;
+}
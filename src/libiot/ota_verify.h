@@ -0,0 +1,33 @@
+#pragma once
+
+#include <esp_app_format.h>
+#include <esp_image_format.h>
+
+#include "private.h"
+
+// The length of the start of an app image which `libiot_ota_verify_header()`
+// checks: the image header, the header of the first segment, and the app
+// description at the start of that segment.
+#define OTA_VERIFY_HEADER_LEN                                                 \
+    (sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t)         \
+     + sizeof(esp_app_desc_t))
+
+// `signing_key_pem` may be NULL, in which case update commands need not be
+// signed.
+esp_err_t libiot_ota_verify_init(const char *signing_key_pem);
+
+// Checks that the first `OTA_VERIFY_HEADER_LEN` bytes at `image` start an app
+// image which we could boot: for this chip, for the same project as the
+// running app, and (if anti-rollback is enabled) with a secure version which
+// has not been revoked. Returns `ESP_ERR_OTA_VALIDATE_FAILED` if not.
+esp_err_t libiot_ota_verify_header(const uint8_t *image);
+
+bool libiot_ota_verify_has_key();
+
+// Checks that the base64 `signature` is a signature of the image SHA-256
+// `sha256` by the signing key.
+esp_err_t libiot_ota_verify_signature(const uint8_t sha256[32],
+                                      const char *signature);
+
+// Parses the 64 hex digit `hex` into `out`.
+bool libiot_ota_verify_parse_sha256(const char *hex, uint8_t out[32]);
@@ -0,0 +1,571 @@
+#include "outbox.h"
+
+#include <esp_log.h>
+#include <esp_partition.h>
+#include <esp_rom_crc.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <libesp.h>
+#include <string.h>
+
+#include "mqtt.h"
+
+// The outbox is an append-only log of records on a raw data partition, written
+// circularly one flash sector at a time. Since the head only ever advances,
+// every sector is erased equally often (which is all the wear leveling we
+// need), and when the head catches up with the tail the sector holding the
+// oldest records is simply erased (evicting them).
+//
+// Each sector begins with a `sector_header_t`, whose `seq` increases by one
+// every time a sector is (re)started, so that the order of the sectors can be
+// recovered at boot. Records never span sectors. A record is marked replayed
+// by clearing its `consumed` word (flash bits can be cleared without an
+// erase).
+
+#define SECTOR_SIZE SPI_FLASH_SEC_SIZE
+#define SECTOR_MAGIC 0x3158424F  // "OBX1"
+
+#define DEFAULT_REPLAY_RATE 20
+
+#define MAX_RECORD_DATA_SIZE 1024
+
+// If publishing a replayed message fails while we are still connected (e.g.
+// because esp-mqtt's own outbox is full) we wait and try again, since until
+// the outbox is drained every new QoS>=1 message is diverted to it. A record
+// which fails this many times in a row is dropped, so that it cannot wedge
+// the outbox.
+#define REPLAY_RETRY_DELAY_MS 1000
+#define REPLAY_MAX_ATTEMPTS 5
+
+#define REPLAY_TASK_STACK_SIZE 3072
+#define REPLAY_TASK_PRIORITY 5
+
+typedef struct sector_header {
+    uint32_t magic;
+    uint32_t seq;
+} sector_header_t;
+
+typedef struct record_header {
+    // All ones (as erased) marks the end of the records in a sector.
+    uint16_t topic_len;
+    uint16_t msg_len;
+    uint8_t qos;
+    uint8_t retain;
+    uint16_t reserved;
+    // Over the header fields above, the topic and the message.
+    uint32_t crc;
+    // All ones until the record has been replayed, and then zero.
+    uint32_t consumed;
+} record_header_t;
+
+#define RECORD_END 0xFFFF
+#define RECORD_CONSUMED 0
+
+#define ALIGN4(n) (((n) + 3) & ~3)
+
+typedef struct pos {
+    uint32_t sector;
+    uint32_t offset;
+} pos_t;
+
+static const esp_partition_t *part;
+static uint32_t sector_count;
+// The `seq` of each sector, or 0 if the sector is not in use.
+static uint32_t *sector_seqs;
+
+static uint32_t head_seq;
+static pos_t head;
+// The next record to replay (which may have been consumed or evicted already,
+// in which case it is skipped).
+static pos_t tail;
+// Only modified with the lock held.
+static uint32_t pending;
+
+static uint32_t replay_period_ms;
+
+static StaticSemaphore_t mutex_static;
+static SemaphoreHandle_t mutex;
+
+static TaskHandle_t replay_task;
+
+typedef struct outbox_stats {
+    uint32_t stored;
+    uint32_t replayed;
+    uint32_t evicted;
+    // Messages which were too large to store, could not be written, or
+    // repeatedly failed to replay.
+    uint32_t dropped;
+    uint32_t corrupt;
+    uint32_t sector_erases;
+} outbox_stats_t;
+
+static outbox_stats_t stats;
+
+// Static in order to keep it off of the (small) stacks of our callers.
+static uint8_t record_buff[sizeof(record_header_t) + MAX_RECORD_DATA_SIZE];
+
+static void lock() {
+    while (xSemaphoreTake(mutex, portMAX_DELAY) == pdFALSE)
+        ;
+}
+
+static void unlock() {
+    xSemaphoreGive(mutex);
+}
+
+static size_t sector_addr(uint32_t sector) {
+    return sector * SECTOR_SIZE;
+}
+
+static uint32_t record_crc(const record_header_t *hdr, const uint8_t *data) {
+    uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *) hdr,
+                                    offsetof(record_header_t, crc));
+    return esp_rom_crc32_le(crc, data, hdr->topic_len + hdr->msg_len);
+}
+
+static bool read_record_header(pos_t pos, record_header_t *hdr) {
+    if (pos.offset + sizeof(record_header_t) > SECTOR_SIZE) {
+        return false;
+    }
+
+    if (esp_partition_read(part, sector_addr(pos.sector) + pos.offset, hdr,
+                           sizeof(record_header_t))
+        != ESP_OK) {
+        return false;
+    }
+
+    if (hdr->topic_len == RECORD_END) {
+        return false;
+    }
+
+    // Treat a nonsensical header (e.g. one torn by power loss) as the end of
+    // the sector.
+    size_t len = sizeof(record_header_t) + hdr->topic_len + hdr->msg_len;
+    if (hdr->topic_len + hdr->msg_len > MAX_RECORD_DATA_SIZE
+        || pos.offset + len > SECTOR_SIZE) {
+        return false;
+    }
+
+    return true;
+}
+
+static uint32_t record_size(const record_header_t *hdr) {
+    return ALIGN4(sizeof(record_header_t) + hdr->topic_len + hdr->msg_len);
+}
+
+static uint32_t next_sector(uint32_t sector) {
+    return (sector + 1) % sector_count;
+}
+
+// Counts the unconsumed records in `sector` at or after `offset`.
+static uint32_t count_pending(uint32_t sector, uint32_t offset) {
+    uint32_t count = 0;
+
+    pos_t pos = {.sector = sector, .offset = offset};
+    record_header_t hdr;
+    while (read_record_header(pos, &hdr)) {
+        if (hdr.consumed != RECORD_CONSUMED) {
+            count++;
+        }
+        pos.offset += record_size(&hdr);
+    }
+
+    return count;
+}
+
+// Erases the sector after the head and makes it the new head, evicting any
+// records it still holds. Must be called with the lock held.
+static esp_err_t advance_head() {
+    uint32_t sector = next_sector(head.sector);
+
+    if (sector_seqs[sector]) {
+        uint32_t evicted =
+            count_pending(sector, tail.sector == sector
+                                      ? tail.offset
+                                      : sizeof(sector_header_t));
+        if (evicted) {
+            ESP_LOGW(TAG, "outbox: full, evicting %d oldest messages", evicted);
+            stats.evicted += evicted;
+            pending -= evicted;
+        }
+
+        if (tail.sector == sector) {
+            tail.sector = next_sector(sector);
+            tail.offset = sizeof(sector_header_t);
+        }
+    }
+
+    sector_seqs[sector] = 0;
+
+    esp_err_t err = esp_partition_erase_range(part, sector_addr(sector),
+                                              SECTOR_SIZE);
+    if (err != ESP_OK) {
+        return err;
+    }
+    stats.sector_erases++;
+
+    sector_header_t hdr = {.magic = SECTOR_MAGIC, .seq = ++head_seq};
+    err = esp_partition_write(part, sector_addr(sector), &hdr, sizeof(hdr));
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    sector_seqs[sector] = hdr.seq;
+    head.sector = sector;
+    head.offset = sizeof(sector_header_t);
+
+    if (!pending) {
+        tail = head;
+    }
+
+    return ESP_OK;
+}
+
+bool libiot_outbox_capture(const char *topic, const void *msg, size_t msg_len,
+                           int qos, int retain) {
+    if (!part || qos <= 0) {
+        return false;
+    }
+
+    // Note that this races with the connection state changing, which is fine:
+    // esp-mqtt will report failure (or hold the message in its own outbox) if
+    // we lose.
+    if (!__atomic_load_n(&pending, __ATOMIC_RELAXED)
+        && libiot_mqtt_wait_connected(0)) {
+        return false;
+    }
+
+    size_t topic_len = strlen(topic);
+    if (topic_len + msg_len > MAX_RECORD_DATA_SIZE) {
+        ESP_LOGW(TAG, "outbox: message too large to store (%d bytes), dropped",
+                 topic_len + msg_len);
+        lock();
+        stats.dropped++;
+        unlock();
+        return true;
+    }
+
+    lock();
+
+    record_header_t *hdr = (record_header_t *) record_buff;
+    uint8_t *data = record_buff + sizeof(record_header_t);
+    memset(hdr, 0xFF, sizeof(record_header_t));
+    hdr->topic_len = topic_len;
+    hdr->msg_len = msg_len;
+    hdr->qos = qos;
+    hdr->retain = retain;
+    memcpy(data, topic, topic_len);
+    memcpy(data + topic_len, msg, msg_len);
+    hdr->crc = record_crc(hdr, data);
+
+    uint32_t size = record_size(hdr);
+    // Pad with erased bytes, so that we write whole words.
+    memset(data + topic_len + msg_len, 0xFF,
+           size - sizeof(record_header_t) - topic_len - msg_len);
+
+    esp_err_t err = ESP_OK;
+    if (head.offset + size > SECTOR_SIZE) {
+        err = advance_head();
+    }
+
+    if (err == ESP_OK) {
+        err = esp_partition_write(part,
+                                  sector_addr(head.sector) + head.offset,
+                                  record_buff, size);
+        head.offset += size;
+    }
+
+    if (err == ESP_OK) {
+        stats.stored++;
+        pending++;
+    } else {
+        ESP_LOGE(TAG, "outbox: write failed (0x%X)", err);
+        stats.dropped++;
+    }
+
+    unlock();
+
+    return true;
+}
+
+// Finds the next unconsumed record at or after `tail`, copying it into
+// `record_buff`, and setting `tail` to point at it. Returns false if there are
+// no more (valid) records. Must be called with the lock held.
+static bool read_next_pending(uint32_t *seq) {
+    while (pending) {
+        record_header_t hdr;
+        if (!sector_seqs[tail.sector] || !read_record_header(tail, &hdr)) {
+            if (tail.sector == head.sector) {
+                // We have reached the end of the log, so `pending` must have
+                // been out of sync (because of corrupt records).
+                pending = 0;
+                break;
+            }
+
+            tail.sector = next_sector(tail.sector);
+            tail.offset = sizeof(sector_header_t);
+            continue;
+        }
+
+        if (hdr.consumed == RECORD_CONSUMED) {
+            tail.offset += record_size(&hdr);
+            continue;
+        }
+
+        uint8_t *data = record_buff + sizeof(record_header_t);
+        if (esp_partition_read(part,
+                               sector_addr(tail.sector) + tail.offset
+                                   + sizeof(record_header_t),
+                               data, hdr.topic_len + hdr.msg_len)
+                != ESP_OK
+            || record_crc(&hdr, data) != hdr.crc) {
+            ESP_LOGW(TAG, "outbox: skipping corrupt record");
+            stats.corrupt++;
+            pending--;
+            tail.offset += record_size(&hdr);
+            continue;
+        }
+
+        memcpy(record_buff, &hdr, sizeof(hdr));
+        *seq = sector_seqs[tail.sector];
+        return true;
+    }
+
+    return false;
+}
+
+// Marks the record at `tail` (of size `size`) consumed, unless its sector has
+// been recycled (with sequence number `seq` having been replaced) in the
+// meantime. Must be called with the lock held.
+static void consume_tail(uint32_t seq, uint32_t size) {
+    if (sector_seqs[tail.sector] != seq) {
+        // The record was evicted while we were publishing it, and so has
+        // already been removed from `pending`.
+        return;
+    }
+
+    uint32_t consumed = RECORD_CONSUMED;
+    esp_partition_write(part,
+                        sector_addr(tail.sector) + tail.offset
+                            + offsetof(record_header_t, consumed),
+                        &consumed, sizeof(consumed));
+
+    tail.offset += size;
+    pending--;
+}
+
+static void replay() {
+    // Static in order to keep them off of our (small) stack. The record is
+    // copied out of `record_buff` (which is shared with
+    // `libiot_outbox_capture()`) so that we need not hold the lock while we
+    // publish.
+    static char topic[MAX_RECORD_DATA_SIZE + 1];
+    static char msg[MAX_RECORD_DATA_SIZE + 1];
+
+    uint32_t count = 0;
+    uint32_t bytes = 0;
+    // Of the record at the tail.
+    int attempts = 0;
+    int64_t start_us = esp_timer_get_time();
+    TickType_t last_wake = xTaskGetTickCount();
+
+    while (libiot_mqtt_wait_connected(0)) {
+        lock();
+
+        uint32_t seq;
+        if (!read_next_pending(&seq)) {
+            unlock();
+            break;
+        }
+
+        const record_header_t *hdr = (const record_header_t *) record_buff;
+        const char *data = (const char *) record_buff + sizeof(record_header_t);
+        int qos = hdr->qos;
+        int retain = hdr->retain;
+        int msg_len = hdr->msg_len;
+        uint32_t size = record_size(hdr);
+        memcpy(topic, data, hdr->topic_len);
+        topic[hdr->topic_len] = '\0';
+        memcpy(msg, data + hdr->topic_len, msg_len);
+        msg[msg_len] = '\0';
+
+        unlock();
+
+        if (libiot_mqtt_try_publish(topic, msg, msg_len, qos, retain) < 0) {
+            if (++attempts < REPLAY_MAX_ATTEMPTS) {
+                vTaskDelay(REPLAY_RETRY_DELAY_MS / portTICK_PERIOD_MS);
+                last_wake = xTaskGetTickCount();
+                continue;
+            }
+
+            ESP_LOGW(TAG, "outbox: replay failed %d times, dropped message",
+                     attempts);
+            lock();
+            consume_tail(seq, size);
+            stats.dropped++;
+            unlock();
+
+            attempts = 0;
+            continue;
+        }
+        attempts = 0;
+
+        lock();
+        consume_tail(seq, size);
+        stats.replayed++;
+        unlock();
+        count++;
+        bytes += msg_len;
+
+        vTaskDelayUntil(&last_wake, replay_period_ms / portTICK_PERIOD_MS);
+    }
+
+    if (!count) {
+        return;
+    }
+
+    lock();
+    uint32_t now_pending = pending;
+    outbox_stats_t now_stats = stats;
+    unlock();
+
+    uint32_t elapsed_ms = (esp_timer_get_time() - start_us) / 1000;
+    ESP_LOGI(TAG, "outbox: replayed %d messages (%d bytes) in %d ms", count,
+             bytes, elapsed_ms);
+    libiot_mqtt_enqueuef_local(
+        MQTT_TOPIC_INFO("outbox"), 0, 0,
+        "{\"replayed\":%u,\"bytes\":%u,\"ms\":%u,\"msgs_per_s\":%.1f,"
+        "\"bytes_per_s\":%.1f,\"pending\":%u,\"stored\":%u,\"evicted\":%u,"
+        "\"dropped\":%u,\"corrupt\":%u,\"sector_erases\":%u}",
+        count, bytes, elapsed_ms,
+        elapsed_ms ? count * 1000.0 / elapsed_ms : 0.0,
+        elapsed_ms ? bytes * 1000.0 / elapsed_ms : 0.0, now_pending,
+        now_stats.stored, now_stats.evicted, now_stats.dropped,
+        now_stats.corrupt, now_stats.sector_erases);
+}
+
+static void task_replay(void *unused) {
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        replay();
+
+        ESP_ERROR_CHECK(util_stack_overflow_check());
+    }
+
+    vTaskDelete(NULL);
+}
+
+void libiot_outbox_replay() {
+    if (replay_task) {
+        xTaskNotifyGive(replay_task);
+    }
+}
+
+// Recovers the head, tail and pending count from the sector headers and
+// records. Note that we always start appending in a fresh sector, so that we
+// never write over a record torn by a power loss. The head is left marked
+// full, so that the fresh sector is only erased once there is something to
+// store in it (rather than on every boot).
+static esp_err_t recover() {
+    uint32_t newest = 0;
+    bool any = false;
+
+    for (uint32_t i = 0; i < sector_count; i++) {
+        sector_header_t hdr;
+        esp_err_t err =
+            esp_partition_read(part, sector_addr(i), &hdr, sizeof(hdr));
+        if (err != ESP_OK) {
+            return err;
+        }
+
+        sector_seqs[i] = hdr.magic == SECTOR_MAGIC ? hdr.seq : 0;
+        if (sector_seqs[i] && (!any || sector_seqs[i] > head_seq)) {
+            head_seq = sector_seqs[i];
+            newest = i;
+            any = true;
+        }
+    }
+
+    head.sector = newest;
+    head.offset = SECTOR_SIZE;
+    tail = head;
+    pending = 0;
+
+    if (any) {
+        // Walk the sectors from oldest to newest.
+        bool found_tail = false;
+        uint32_t sector = newest;
+        do {
+            sector = next_sector(sector);
+            if (!sector_seqs[sector]) {
+                continue;
+            }
+
+            uint32_t count = count_pending(sector, sizeof(sector_header_t));
+            if (count && !found_tail) {
+                tail.sector = sector;
+                tail.offset = sizeof(sector_header_t);
+                found_tail = true;
+            }
+            pending += count;
+        } while (sector != newest);
+    }
+
+    return ESP_OK;
+}
+
+void libiot_init_outbox(int replay_rate) {
+    const esp_partition_t *found =
+        esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                 ESP_PARTITION_SUBTYPE_ANY,
+                                 LIBIOT_OUTBOX_PARTITION_LABEL);
+    if (!found) {
+        ESP_LOGI(TAG, "outbox: no '%s' partition, disabled",
+                 LIBIOT_OUTBOX_PARTITION_LABEL);
+        return;
+    }
+
+    if (found->encrypted) {
+        // We rely on being able to clear the `consumed` word of a record in
+        // place, which is impossible for an encrypted partition.
+        ESP_LOGE(TAG, "outbox: partition is encrypted, disabled");
+        return;
+    }
+
+    sector_count = found->size / SECTOR_SIZE;
+    if (sector_count < 2) {
+        ESP_LOGE(TAG, "outbox: partition too small, disabled");
+        return;
+    }
+
+    sector_seqs = calloc(sector_count, sizeof(uint32_t));
+    assert(sector_seqs);
+
+    replay_period_ms =
+        1000 / (replay_rate > 0 ? replay_rate : DEFAULT_REPLAY_RATE);
+    if (!replay_period_ms) {
+        replay_period_ms = 1;
+    }
+
+    mutex = xSemaphoreCreateMutexStatic(&mutex_static);
+
+    part = found;
+    esp_err_t err = recover();
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "outbox: recovery failed (0x%X), disabled", err);
+        part = NULL;
+        return;
+    }
+
+    ESP_LOGI(TAG, "outbox: %d sectors, %d messages pending", sector_count,
+             pending);
+
+    if (xTaskCreate(task_replay, "outbox_replay", REPLAY_TASK_STACK_SIZE, NULL,
+                    REPLAY_TASK_PRIORITY, &replay_task)
+        != pdPASS) {
+        ESP_LOGE(TAG, "outbox: failed to start replay task");
+    }
+}
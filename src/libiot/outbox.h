@@ -0,0 +1,21 @@
+#pragma once
+
+#include "private.h"
+
+// The outbox is only enabled if the partition table contains a data partition
+// with this label.
+#ifndef LIBIOT_OUTBOX_PARTITION_LABEL
+#define LIBIOT_OUTBOX_PARTITION_LABEL "outbox"
+#endif
+
+// If `replay_rate` is not positive then a default is used.
+void libiot_init_outbox(int replay_rate);
+
+// Stores the message in the outbox (instead of it being published now) if MQTT
+// is disconnected, or if earlier messages are still waiting to be replayed.
+// Returns whether the message was stored.
+bool libiot_outbox_capture(const char *topic, const void *msg, size_t msg_len,
+                           int qos, int retain);
+
+// Begins replaying stored messages. Called whenever MQTT (re)connects.
+void libiot_outbox_replay();
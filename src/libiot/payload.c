@@ -0,0 +1,108 @@
+#include "payload.h"
+
+#include <esp_log.h>
+#include <string.h>
+
+#include "cbor_builder.h"
+#include "json_builder.h"
+
+// Our first guess at the size of a CBOR payload. If it is wrong we retry with
+// the size the writer counted, plus some slack in case the payload changes
+// in between (e.g. a counter gaining a digit).
+#define CBOR_INITIAL_SIZE 256
+#define CBOR_SLACK 32
+#define CBOR_MAX_ATTEMPTS 3
+
+static libiot_payload_format_t format;
+
+void libiot_init_payload(libiot_payload_format_t new_format) {
+    format = new_format;
+}
+
+libiot_payload_format_t libiot_payload_get_format() {
+    return format;
+}
+
+const char *libiot_payload_topic_suffix() {
+    switch (format) {
+        case LIBIOT_PAYLOAD_CBOR: {
+            return "/cbor";
+        }
+        case LIBIOT_PAYLOAD_JSON:
+        default: {
+            return "";
+        }
+    }
+}
+
+bool libiot_payload_encode_cbor(void (*build)(libiot_cbor_writer_t *w),
+                                payload_t *out) {
+    size_t cap = CBOR_INITIAL_SIZE;
+    for (int i = 0; i < CBOR_MAX_ATTEMPTS; i++) {
+        char *buff = malloc(cap);
+        if (!buff) {
+            break;
+        }
+
+        libiot_cbor_writer_t w;
+        libiot_cbor_init(&w, buff, cap);
+        build(&w);
+
+        if (libiot_cbor_ok(&w)) {
+            // Give back the slack.
+            char *shrunk = realloc(buff, w.len ? w.len : 1);
+            out->data = shrunk ? shrunk : buff;
+            out->len = w.len;
+            return true;
+        }
+
+        free(buff);
+        cap = w.len + CBOR_SLACK;
+    }
+
+    ESP_LOGE(TAG, "%s: CBOR fail", __func__);
+    out->data = NULL;
+    out->len = 0;
+    return false;
+}
+
+static bool build(char *(*build_json)(),
+                  void (*build_cbor)(libiot_cbor_writer_t *w),
+                  payload_t *out) {
+    if (format == LIBIOT_PAYLOAD_CBOR) {
+        return libiot_payload_encode_cbor(build_cbor, out);
+    }
+
+    out->data = build_json();
+    out->len = out->data ? strlen(out->data) : 0;
+    return out->data;
+}
+
+bool libiot_payload_build_state_up(payload_t *out) {
+    return build(libiot_json_build_state_up, libiot_cbor_build_state_up, out);
+}
+
+bool libiot_payload_build_state_down(payload_t *out) {
+    return build(libiot_json_build_state_down, libiot_cbor_build_state_down,
+                 out);
+}
+
+bool libiot_payload_build_startup(payload_t *out) {
+    return build(libiot_json_build_startup, libiot_cbor_build_startup, out);
+}
+
+bool libiot_payload_build_mem_check(payload_t *out) {
+    return build(libiot_json_build_mem_check, libiot_cbor_build_mem_check,
+                 out);
+}
+
+bool libiot_payload_build_system_id(payload_t *out) {
+    return build(libiot_json_build_system_id, libiot_cbor_build_system_id,
+                 out);
+}
+
+void libiot_payload_free(payload_t *payload) {
+    free(payload->data);
+    payload->data = NULL;
+    payload->len = 0;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "private.h"
+
+// A built-in payload, encoded according to `node_config_t.payload_format`.
+// (JSON payloads are also null terminated.)
+typedef struct payload {
+    char *data;
+    size_t len;
+} payload_t;
+
+// Called before `libiot_init_mqtt()`.
+void libiot_init_payload(libiot_payload_format_t format);
+
+libiot_payload_format_t libiot_payload_get_format();
+
+// The suffix appended to the topics of built-in payloads, e.g. "/cbor".
+const char *libiot_payload_topic_suffix();
+
+// Each returns false (and leaves `out->data == NULL`) on failure.
+bool libiot_payload_build_state_up(payload_t *out);
+bool libiot_payload_build_state_down(payload_t *out);
+bool libiot_payload_build_startup(payload_t *out);
+bool libiot_payload_build_mem_check(payload_t *out);
+bool libiot_payload_build_system_id(payload_t *out);
+
+void libiot_payload_free(payload_t *payload);
+
+// Encodes a CBOR payload with `build`, into a heap buffer of exactly the
+// required size (which is returned in `out`).
+bool libiot_payload_encode_cbor(void (*build)(libiot_cbor_writer_t *w),
+                                payload_t *out);
@@ -0,0 +1,342 @@
+#include "post_queue.h"
+
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <libesp.h>
+#include <string.h>
+
+#include "mqtt.h"
+
+#ifndef LIBIOT_MQTT_POST_QUEUE_LENGTH
+#define LIBIOT_MQTT_POST_QUEUE_LENGTH 32
+#endif
+
+#ifndef LIBIOT_MQTT_POST_RECORD_SIZE
+#define LIBIOT_MQTT_POST_RECORD_SIZE 256
+#endif
+
+_Static_assert((LIBIOT_MQTT_POST_QUEUE_LENGTH
+                & (LIBIOT_MQTT_POST_QUEUE_LENGTH - 1))
+                   == 0,
+               "LIBIOT_MQTT_POST_QUEUE_LENGTH must be a power of two");
+
+#define QUEUE_MASK (LIBIOT_MQTT_POST_QUEUE_LENGTH - 1)
+
+#define SENDER_TASK_STACK_SIZE 3072
+#define SENDER_TASK_PRIORITY 5
+
+// The number of records published by the sender task before it yields.
+#define SENDER_BATCH_SIZE 8
+
+// The number of times a producer will discard the oldest record to make room
+// before giving up and discarding its own.
+#define DROP_OLDEST_MAX_ATTEMPTS 4
+
+typedef struct record {
+    uint8_t qos;
+    uint8_t retain;
+    uint16_t topic_len;
+    uint16_t msg_len;
+    // The topic (null terminated), followed immediately by the message.
+    char data[LIBIOT_MQTT_POST_RECORD_SIZE];
+} record_t;
+
+// This is Vyukov's bounded MPMC queue. Every slot carries a sequence number
+// which tells producers and consumers whether it is their turn to use the slot,
+// so the queue never takes a lock. (It is multi-consumer only so that a
+// producer can discard the oldest record under `LIBIOT_MQTT_POST_DROP_OLDEST`,
+// the sender task being the only real consumer.)
+typedef struct slot {
+    uint32_t seq;
+    record_t rec;
+} slot_t;
+
+static slot_t slots[LIBIOT_MQTT_POST_QUEUE_LENGTH];
+static uint32_t enqueue_pos;
+static uint32_t dequeue_pos;
+
+static libiot_mqtt_post_policy_t policy;
+static TickType_t block_timeout_ticks;
+
+static StaticSemaphore_t space_sem_static;
+static SemaphoreHandle_t space_sem;
+
+static TaskHandle_t sender_task;
+
+static libiot_mqtt_post_stats_t stats;
+
+static void stat_inc(uint32_t *stat) {
+    __atomic_fetch_add(stat, 1, __ATOMIC_RELAXED);
+}
+
+static void update_high_water() {
+    uint32_t depth = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED)
+                     - __atomic_load_n(&dequeue_pos, __ATOMIC_RELAXED);
+    if (depth > LIBIOT_MQTT_POST_QUEUE_LENGTH) {
+        // We raced with a consumer.
+        depth = LIBIOT_MQTT_POST_QUEUE_LENGTH;
+    }
+
+    uint32_t high_water = __atomic_load_n(&stats.high_water, __ATOMIC_RELAXED);
+    while (depth > high_water
+           && !__atomic_compare_exchange_n(&stats.high_water, &high_water,
+                                           depth, true, __ATOMIC_RELAXED,
+                                           __ATOMIC_RELAXED))
+        ;
+}
+
+// Returns a slot which the caller has exclusive write access to, or NULL if
+// the queue is full. The slot must be passed to `commit_write()`.
+static slot_t *claim_write(uint32_t *pos_out) {
+    uint32_t pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+    while (1) {
+        slot_t *slot = &slots[pos & QUEUE_MASK];
+        uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        int32_t diff = (int32_t) (seq - pos);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&enqueue_pos, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                *pos_out = pos;
+                return slot;
+            }
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void commit_write(slot_t *slot, uint32_t pos) {
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+// Returns a slot which the caller has exclusive read access to, or NULL if
+// the queue is empty. The slot must be passed to `release_read()`.
+static slot_t *claim_read(uint32_t *pos_out) {
+    uint32_t pos = __atomic_load_n(&dequeue_pos, __ATOMIC_RELAXED);
+    while (1) {
+        slot_t *slot = &slots[pos & QUEUE_MASK];
+        uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        int32_t diff = (int32_t) (seq - (pos + 1));
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&dequeue_pos, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                *pos_out = pos;
+                return slot;
+            }
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void release_read(slot_t *slot, uint32_t pos) {
+    __atomic_store_n(&slot->seq, pos + LIBIOT_MQTT_POST_QUEUE_LENGTH,
+                     __ATOMIC_RELEASE);
+
+    if (space_sem) {
+        xSemaphoreGive(space_sem);
+    }
+}
+
+static bool drop_oldest() {
+    uint32_t pos;
+    slot_t *slot = claim_read(&pos);
+    if (!slot) {
+        return false;
+    }
+
+    release_read(slot, pos);
+    stat_inc(&stats.dropped_oldest);
+    return true;
+}
+
+static slot_t *claim_write_with_policy(uint32_t *pos) {
+    slot_t *slot = claim_write(pos);
+    if (slot) {
+        return slot;
+    }
+
+    switch (policy) {
+        case LIBIOT_MQTT_POST_DROP_OLDEST: {
+            for (int i = 0; !slot && i < DROP_OLDEST_MAX_ATTEMPTS; i++) {
+                drop_oldest();
+                slot = claim_write(pos);
+            }
+            break;
+        }
+        case LIBIOT_MQTT_POST_BLOCK: {
+            TickType_t start = xTaskGetTickCount();
+            while (!slot) {
+                TickType_t waited = xTaskGetTickCount() - start;
+                if (waited >= block_timeout_ticks) {
+                    break;
+                }
+
+                // The sender task gives `space_sem` whenever it frees a slot.
+                // (A stale count just costs us another iteration.)
+                xSemaphoreTake(space_sem, block_timeout_ticks - waited);
+                slot = claim_write(pos);
+            }
+            break;
+        }
+        case LIBIOT_MQTT_POST_DROP_NEWEST:
+        default: {
+            break;
+        }
+    }
+
+    return slot;
+}
+
+bool libiot_post_queue_push(const char *topic, size_t topic_len,
+                            const char *msg, size_t msg_len, int qos,
+                            int retain) {
+    if (topic_len + 1 + msg_len > LIBIOT_MQTT_POST_RECORD_SIZE) {
+        ESP_LOGW(TAG, "mqtt post: dropped oversize message (%d bytes)",
+                 topic_len + 1 + msg_len);
+        stat_inc(&stats.dropped_oversize);
+        return false;
+    }
+
+    uint32_t pos;
+    slot_t *slot = claim_write_with_policy(&pos);
+    if (!slot) {
+        stat_inc(&stats.dropped_newest);
+        return false;
+    }
+
+    record_t *rec = &slot->rec;
+    rec->qos = qos;
+    rec->retain = retain;
+    rec->topic_len = topic_len;
+    rec->msg_len = msg_len;
+    memcpy(rec->data, topic, topic_len);
+    rec->data[topic_len] = '\0';
+    memcpy(rec->data + topic_len + 1, msg, msg_len);
+
+    commit_write(slot, pos);
+    stat_inc(&stats.posted);
+    update_high_water();
+
+    TaskHandle_t task = __atomic_load_n(&sender_task, __ATOMIC_ACQUIRE);
+    if (task) {
+        xTaskNotifyGive(task);
+    }
+
+    return true;
+}
+
+bool libiot_mqtt_post(const char *topic, int qos, int retain,
+                      const char *msg) {
+    return libiot_post_queue_push(topic, strlen(topic), msg, strlen(msg), qos,
+                                  retain);
+}
+
+void libiot_mqtt_post_get_stats(libiot_mqtt_post_stats_t *out) {
+    out->posted = __atomic_load_n(&stats.posted, __ATOMIC_RELAXED);
+    out->sent = __atomic_load_n(&stats.sent, __ATOMIC_RELAXED);
+    out->failed = __atomic_load_n(&stats.failed, __ATOMIC_RELAXED);
+    out->dropped_oldest =
+        __atomic_load_n(&stats.dropped_oldest, __ATOMIC_RELAXED);
+    out->dropped_newest =
+        __atomic_load_n(&stats.dropped_newest, __ATOMIC_RELAXED);
+    out->dropped_oversize =
+        __atomic_load_n(&stats.dropped_oversize, __ATOMIC_RELAXED);
+    out->high_water = __atomic_load_n(&stats.high_water, __ATOMIC_RELAXED);
+    out->capacity = LIBIOT_MQTT_POST_QUEUE_LENGTH;
+}
+
+// Copies the oldest record into `rec`, returning false if the queue is empty.
+// We copy the record out (rather than publishing directly from the slot) so
+// that the slot is held only for the duration of a `memcpy()`, and not for a
+// broker round-trip.
+static bool pop(record_t *rec) {
+    uint32_t pos;
+    slot_t *slot = claim_read(&pos);
+    if (!slot) {
+        return false;
+    }
+
+    memcpy(rec, &slot->rec,
+           offsetof(record_t, data) + slot->rec.topic_len + 1
+               + slot->rec.msg_len);
+    release_read(slot, pos);
+    return true;
+}
+
+static void task_sender(void *unused) {
+    // Static in order to keep it off of our (small) stack.
+    static record_t rec;
+
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        bool more = true;
+        while (more) {
+            // Leave records in the queue (subject to `policy`) while we are
+            // disconnected.
+            while (!libiot_mqtt_wait_connected(portMAX_DELAY))
+                ;
+
+            for (int i = 0; i < SENDER_BATCH_SIZE; i++) {
+                if (!pop(&rec)) {
+                    more = false;
+                    break;
+                }
+
+                const char *topic = rec.data;
+                const char *msg = rec.data + rec.topic_len + 1;
+                if (libiot_mqtt_try_publish(topic, msg, rec.msg_len, rec.qos,
+                                            rec.retain)
+                    >= 0) {
+                    stat_inc(&stats.sent);
+                } else {
+                    stat_inc(&stats.failed);
+                }
+            }
+
+            taskYIELD();
+        }
+
+        ESP_ERROR_CHECK(util_stack_overflow_check());
+    }
+
+    vTaskDelete(NULL);
+}
+
+void libiot_init_post_queue(libiot_mqtt_post_policy_t new_policy,
+                            int block_timeout_ms) {
+    for (uint32_t i = 0; i < LIBIOT_MQTT_POST_QUEUE_LENGTH; i++) {
+        slots[i].seq = i;
+    }
+
+    policy = new_policy;
+    block_timeout_ticks = block_timeout_ms / portTICK_PERIOD_MS;
+    space_sem = xSemaphoreCreateCountingStatic(LIBIOT_MQTT_POST_QUEUE_LENGTH, 0,
+                                               &space_sem_static);
+}
+
+void libiot_start_post_queue() {
+    TaskHandle_t task;
+    if (xTaskCreate(task_sender, "mqtt_post", SENDER_TASK_STACK_SIZE, NULL,
+                    SENDER_TASK_PRIORITY, &task)
+        != pdPASS) {
+        ESP_LOGE(TAG, "mqtt post: failed to start sender task");
+        return;
+    }
+
+    __atomic_store_n(&sender_task, task, __ATOMIC_RELEASE);
+
+    // Flush anything posted before we started.
+    xTaskNotifyGive(task);
+}
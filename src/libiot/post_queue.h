@@ -0,0 +1,18 @@
+#pragma once
+
+#include "private.h"
+
+// Called even if mqtt will not be started, so that messages may be posted
+// (and queued) before the sender task is running.
+void libiot_init_post_queue(libiot_mqtt_post_policy_t policy,
+                            int block_timeout_ms);
+
+// Starts the sender task which drains the queue. Must be called after
+// `libiot_start_mqtt()` has created the client.
+void libiot_start_post_queue();
+
+// Like `libiot_mqtt_post()`, but takes the lengths of `topic` and `msg`
+// explicitly.
+bool libiot_post_queue_push(const char *topic, size_t topic_len,
+                            const char *msg, size_t msg_len, int qos,
+                            int retain);
@@ -0,0 +1,150 @@
+#include "reassembly.h"
+
+#include <esp_log.h>
+#include <string.h>
+
+#include "router.h"
+
+#ifndef LIBIOT_MQTT_REASSEMBLY_MAX_BYTES
+#define LIBIOT_MQTT_REASSEMBLY_MAX_BYTES 16384
+#endif
+
+// esp-mqtt delivers a message larger than its buffer as a series of
+// `MQTT_EVENT_DATA` events, the first carrying the topic and each carrying
+// the offset of its chunk within the message (`current_data_offset`) and the
+// length of the whole message (`total_data_len`). The chunks of a message are
+// always delivered consecutively, so we need only track one message at a
+// time.
+//
+// Note that all of this state is only accessed from the esp-mqtt event task.
+
+typedef struct message {
+    // Whether we are in the middle of a multi-chunk message.
+    bool active;
+
+    // The topic (which only the first chunk carries).
+    char *topic;
+    int topic_len;
+
+    // The number of bytes received so far.
+    int received;
+    int total_len;
+
+    // Whether any stream routes, and any other routes, match the topic.
+    bool streaming;
+    // Allocated (to exactly `total_len`) only if there are whole message
+    // routes to pass the message to.
+    char *data;
+} message_t;
+
+static message_t msg;
+
+void libiot_reassembly_reset() {
+    if (msg.active && msg.received < msg.total_len) {
+        ESP_LOGW(TAG, "mqtt: discarding partial message (%d/%d bytes)",
+                 msg.received, msg.total_len);
+    }
+
+    free(msg.topic);
+    free(msg.data);
+    memset(&msg, 0, sizeof(msg));
+}
+
+static bool begin(esp_mqtt_event_handle_t event) {
+    libiot_reassembly_reset();
+
+    msg.topic = malloc(event->topic_len);
+    if (!msg.topic) {
+        ESP_LOGE(TAG, "mqtt: no memory for topic of partial message");
+        return false;
+    }
+    memcpy(msg.topic, event->topic, event->topic_len);
+    msg.topic_len = event->topic_len;
+    msg.total_len = event->total_data_len;
+    msg.active = true;
+
+    msg.streaming = libiot_router_count(msg.topic, msg.topic_len, true);
+
+    if (libiot_router_count(msg.topic, msg.topic_len, false)) {
+        if (msg.total_len > LIBIOT_MQTT_REASSEMBLY_MAX_BYTES) {
+            ESP_LOGW(TAG, "mqtt: message too large to reassemble (%d bytes)",
+                     msg.total_len);
+        } else {
+            msg.data = malloc(msg.total_len);
+            if (!msg.data) {
+                ESP_LOGE(TAG, "mqtt: no memory to reassemble %d bytes",
+                         msg.total_len);
+            }
+        }
+    }
+
+    return true;
+}
+
+void libiot_reassembly_handle_data(esp_mqtt_event_handle_t event) {
+    // The common case: the whole message in one event. Nothing is copied.
+    if (event->current_data_offset == 0
+        && event->data_len >= event->total_data_len) {
+        if (msg.active) {
+            libiot_reassembly_reset();
+        }
+
+        libiot_router_dispatch(event, true);
+        libiot_router_dispatch(event, false);
+        return;
+    }
+
+    if (event->current_data_offset == 0) {
+        if (!event->topic || event->topic_len <= 0 || !begin(event)) {
+            return;
+        }
+    } else if (!msg.active || event->current_data_offset != msg.received
+               || event->total_data_len != msg.total_len) {
+        // We missed the start of this message (or part of it), so we can do
+        // nothing with the rest.
+        if (msg.active) {
+            ESP_LOGW(TAG, "mqtt: chunk out of sequence (offset %d, not %d)",
+                     event->current_data_offset, msg.received);
+            libiot_reassembly_reset();
+        }
+        return;
+    }
+
+    if (event->data_len > msg.total_len - msg.received) {
+        ESP_LOGW(TAG, "mqtt: chunk overruns message");
+        libiot_reassembly_reset();
+        return;
+    }
+
+    // Stream routes see each chunk with the topic of the message filled in,
+    // and can tell the last by `current_data_offset + data_len ==
+    // total_data_len`.
+    if (msg.streaming) {
+        esp_mqtt_event_t chunk = *event;
+        chunk.topic = msg.topic;
+        chunk.topic_len = msg.topic_len;
+        libiot_router_dispatch(&chunk, true);
+    }
+
+    if (msg.data) {
+        memcpy(msg.data + msg.received, event->data, event->data_len);
+    }
+    msg.received += event->data_len;
+
+    if (msg.received < msg.total_len) {
+        return;
+    }
+
+    if (msg.data) {
+        esp_mqtt_event_t whole = *event;
+        whole.topic = msg.topic;
+        whole.topic_len = msg.topic_len;
+        whole.data = msg.data;
+        whole.data_len = msg.total_len;
+        whole.current_data_offset = 0;
+        whole.total_data_len = msg.total_len;
+        libiot_router_dispatch(&whole, false);
+    }
+
+    libiot_reassembly_reset();
+}
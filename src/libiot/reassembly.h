@@ -0,0 +1,14 @@
+#pragma once
+
+#include <mqtt_client.h>
+
+#include "private.h"
+
+// Called from the esp-mqtt event task for every `MQTT_EVENT_DATA` event.
+// Passes each chunk to the matching stream routes, and each whole message
+// (reassembled if it arrived in more than one chunk) to the other routes.
+void libiot_reassembly_handle_data(esp_mqtt_event_handle_t event);
+
+// Called from the esp-mqtt event task when the connection is lost, since the
+// rest of a partially received message will never arrive.
+void libiot_reassembly_reset();
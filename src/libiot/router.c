@@ -0,0 +1,221 @@
+#include "router.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <string.h>
+
+// The routing table is a trie keyed on topic levels (the '/'-separated
+// components of a topic). Matching a topic walks the trie once, one level at a
+// time, so the cost of a dispatch is proportional to the length of the topic
+// rather than to the number of registered routes. The only branching occurs
+// at `+` wildcards.
+//
+// Nodes and routes are never removed, and are fully initialized before they
+// are linked into the trie, so `libiot_router_dispatch()` can walk the trie
+// without taking the lock which serializes insertions.
+
+typedef struct route route_t;
+struct route {
+    libiot_mqtt_route_cb_t cb;
+    void *ctx;
+    // Whether the route receives each chunk of a message as it arrives,
+    // rather than the whole message once it has been reassembled.
+    bool stream;
+    route_t *next;
+};
+
+typedef struct node node_t;
+struct node {
+    // The next child of our parent.
+    node_t *sibling;
+
+    // Children matching a literal topic level.
+    node_t *children;
+    // Child matching a `+` topic level.
+    node_t *plus;
+
+    // Routes for filters which end at this node.
+    route_t *routes;
+    // Routes for filters which end in a `#` directly below this node. (Note
+    // that these also match the topic which ends at this node.)
+    route_t *routes_hash;
+
+    size_t level_len;
+    char level[];
+};
+
+static node_t root;
+
+static StaticSemaphore_t insert_mutex_static;
+static SemaphoreHandle_t insert_mutex;
+
+static void publish_ptr(void *slot, void *ptr) {
+    __atomic_store_n((void **) slot, ptr, __ATOMIC_RELEASE);
+}
+
+static void *load_ptr(void *const *slot) {
+    return __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+}
+
+static node_t *find_child(const node_t *node, const char *level,
+                          size_t level_len) {
+    for (node_t *child = load_ptr((void *const *) &node->children); child;
+         child = load_ptr((void *const *) &child->sibling)) {
+        if (child->level_len == level_len
+            && !memcmp(child->level, level, level_len)) {
+            return child;
+        }
+    }
+
+    return NULL;
+}
+
+static node_t *new_node(const char *level, size_t level_len) {
+    node_t *node = calloc(1, sizeof(node_t) + level_len);
+    assert(node);
+
+    memcpy(node->level, level, level_len);
+    node->level_len = level_len;
+    return node;
+}
+
+static void append_route(route_t **list, libiot_mqtt_route_cb_t cb,
+                         void *ctx, bool stream) {
+    route_t *route = malloc(sizeof(route_t));
+    assert(route);
+
+    route->cb = cb;
+    route->ctx = ctx;
+    route->stream = stream;
+    route->next = NULL;
+
+    // Routes fire in registration order, so append to the end of the list.
+    while (*list) {
+        list = &(*list)->next;
+    }
+    publish_ptr(list, route);
+}
+
+void libiot_router_insert(const char *filter, libiot_mqtt_route_cb_t cb,
+                          void *ctx, bool stream) {
+    if (!insert_mutex) {
+        // Note that the first insertion always happens during
+        // `libiot_init_mqtt()`, before any other task could race us here.
+        insert_mutex = xSemaphoreCreateMutexStatic(&insert_mutex_static);
+    }
+
+    while (xSemaphoreTake(insert_mutex, portMAX_DELAY) == pdFALSE)
+        ;
+
+    node_t *node = &root;
+    const char *level = filter;
+    while (1) {
+        const char *sep = strchr(level, '/');
+        size_t level_len = sep ? sep - level : strlen(level);
+
+        if (level_len == 1 && *level == '#') {
+            // A `#` must be the final level of a filter.
+            assert(!sep);
+
+            append_route(&node->routes_hash, cb, ctx, stream);
+            break;
+        }
+
+        node_t *next;
+        if (level_len == 1 && *level == '+') {
+            next = node->plus;
+            if (!next) {
+                next = new_node(level, level_len);
+                publish_ptr(&node->plus, next);
+            }
+        } else {
+            next = find_child(node, level, level_len);
+            if (!next) {
+                next = new_node(level, level_len);
+                next->sibling = node->children;
+                publish_ptr(&node->children, next);
+            }
+        }
+        node = next;
+
+        if (!sep) {
+            append_route(&node->routes, cb, ctx, stream);
+            break;
+        }
+
+        level = sep + 1;
+    }
+
+    xSemaphoreGive(insert_mutex);
+}
+
+// The routes to fire, and the event to pass them. If `event` is NULL then
+// the matching routes are only counted.
+typedef struct dispatch {
+    bool stream;
+    esp_mqtt_event_handle_t event;
+} dispatch_t;
+
+static size_t fire_routes(route_t *const *list, const dispatch_t *d) {
+    size_t count = 0;
+    for (route_t *route = load_ptr((void *const *) list); route;
+         route = load_ptr((void *const *) &route->next)) {
+        if (route->stream != d->stream) {
+            continue;
+        }
+
+        if (d->event) {
+            route->cb(d->event, route->ctx);
+        }
+        count++;
+    }
+    return count;
+}
+
+// Note: `topic` need not be null terminated, and `len` is its length. If
+// `done` is set then every level of the topic has already been consumed.
+static size_t match(const node_t *node, const char *topic, size_t len,
+                    bool done, const dispatch_t *d) {
+    size_t count = fire_routes(&node->routes_hash, d);
+
+    if (done) {
+        return count + fire_routes(&node->routes, d);
+    }
+
+    const char *sep = memchr(topic, '/', len);
+    size_t level_len = sep ? sep - topic : len;
+    const char *rest = sep ? sep + 1 : topic + len;
+    size_t rest_len = sep ? len - level_len - 1 : 0;
+
+    const node_t *child = find_child(node, topic, level_len);
+    if (child) {
+        count += match(child, rest, rest_len, !sep, d);
+    }
+
+    const node_t *plus = load_ptr((void *const *) &node->plus);
+    if (plus) {
+        count += match(plus, rest, rest_len, !sep, d);
+    }
+
+    return count;
+}
+
+size_t libiot_router_dispatch(esp_mqtt_event_handle_t event, bool stream) {
+    if (!event->topic || event->topic_len <= 0) {
+        return 0;
+    }
+
+    dispatch_t d = {
+        .stream = stream,
+        .event = event,
+    };
+    return match(&root, event->topic, event->topic_len, false, &d);
+}
+
+size_t libiot_router_count(const char *topic, size_t len, bool stream) {
+    dispatch_t d = {
+        .stream = stream,
+        .event = NULL,
+    };
+    return match(&root, topic, len, false, &d);
+}
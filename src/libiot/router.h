@@ -0,0 +1,20 @@
+#pragma once
+
+#include <mqtt_client.h>
+
+#include "private.h"
+
+// Registers `cb` against the (absolute) MQTT topic filter `filter`, which may
+// contain the `+` and `#` wildcards. A `stream` route is passed each chunk of
+// a message as it arrives, and other routes only whole messages. Safe to call
+// concurrently with `libiot_router_dispatch()`.
+void libiot_router_insert(const char *filter, libiot_mqtt_route_cb_t cb,
+                          void *ctx, bool stream);
+
+// Invokes every `stream` (or other) route whose filter matches the topic of
+// `event`. Returns the number of routes which were invoked.
+size_t libiot_router_dispatch(esp_mqtt_event_handle_t event, bool stream);
+
+// Returns the number of `stream` (or other) routes whose filter matches the
+// topic `topic` (of length `len`, which need not be null terminated).
+size_t libiot_router_count(const char *topic, size_t len, bool stream);
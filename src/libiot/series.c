@@ -0,0 +1,269 @@
+#include "series.h"
+
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <freertos/timers.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "format.h"
+#include "mqtt.h"
+
+// Our estimate of the bytes which each MQTT PUBLISH packet costs on the wire
+// in addition to its topic and payload: the MQTT fixed header (<= 5 bytes),
+// topic length (2 bytes) and packet id (2 bytes), plus the TLS record header
+// (5 bytes), explicit nonce (8 bytes) and AEAD tag (16 bytes).
+#define PACKET_OVERHEAD_BYTES (5 + 2 + 2 + 5 + 8 + 16)
+
+#define FLUSH_TASK_STACK_SIZE 3072
+#define FLUSH_TASK_PRIORITY 5
+
+// The most series whose batches may be waiting to be sent by the flush task.
+// A series which does not fit is retried after another `max_age_ms`.
+#define FLUSH_QUEUE_LENGTH 8
+
+struct libiot_series {
+    const libiot_topic_t *topic;
+    int qos;
+
+    StaticSemaphore_t mutex_static;
+    SemaphoreHandle_t mutex;
+
+    StaticTimer_t timer_static;
+    TimerHandle_t timer;
+    // Whether the series is in `flush_queue`.
+    bool flush_queued;
+    // Whether the timer could not be started for the current batch, which
+    // must then be sent without waiting for it.
+    bool timer_failed;
+
+    libiot_mqtt_series_stats_t stats;
+
+    // Samples in the current batch.
+    uint32_t count;
+    // The length of the current batch, including the leading '['.
+    size_t len;
+    size_t cap;
+    char buff[];
+};
+
+// Series whose timers have expired, for the flush task to send. (Sending
+// from the timer daemon would stall every other timer.)
+static StaticQueue_t flush_queue_static;
+static uint8_t
+    flush_queue_buff[FLUSH_QUEUE_LENGTH * sizeof(libiot_series_t *)];
+static QueueHandle_t flush_queue;
+
+static void lock(libiot_series_t *series) {
+    while (xSemaphoreTake(series->mutex, portMAX_DELAY) == pdFALSE)
+        ;
+}
+
+static void unlock(libiot_series_t *series) {
+    xSemaphoreGive(series->mutex);
+}
+
+// Must be called with the series lock held.
+static void flush_locked(libiot_series_t *series) {
+    xTimerStop(series->timer, 0);
+    series->timer_failed = false;
+
+    if (!series->count) {
+        return;
+    }
+
+    series->buff[series->len] = ']';
+    series->buff[series->len + 1] = '\0';
+
+    size_t payload_len = series->len + 1;
+    libiot_mqtt_series_stats_t *stats = &series->stats;
+
+    // Note that unlike `libiot_mqtt_enqueue()` we do not assert success, so
+    // that a full esp-mqtt outbox only costs us this batch.
+    if (libiot_mqtt_try_enqueue(series->topic->str, series->buff, series->qos,
+                                0)
+        < 0) {
+        ESP_LOGW(TAG, "series: enqueue failed, dropped %u samples",
+                 series->count);
+        stats->dropped += series->count;
+        series->count = 0;
+        series->len = 1;
+        return;
+    }
+
+    stats->packets++;
+    stats->payload_bytes += payload_len;
+
+    // Each sample after the first avoids a packet of its own, at the cost of
+    // one ',' (with the enclosing "[]" costing two bytes per packet).
+    stats->bytes_saved +=
+        (int32_t) (series->count - 1)
+            * (PACKET_OVERHEAD_BYTES + (int32_t) series->topic->len - 1)
+        - 2;
+
+    series->count = 0;
+    series->len = 1;
+}
+
+static void timer_cb(TimerHandle_t timer) {
+    libiot_series_t *series = pvTimerGetTimerID(timer);
+
+    if (__atomic_exchange_n(&series->flush_queued, true, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+
+    if (xQueueSend(flush_queue, &series, 0) != pdTRUE) {
+        __atomic_store_n(&series->flush_queued, false, __ATOMIC_RELEASE);
+        // Try again after another period.
+        xTimerReset(timer, 0);
+    }
+}
+
+static void task_flush(void *arg) {
+    while (1) {
+        libiot_series_t *series;
+        xQueueReceive(flush_queue, &series, portMAX_DELAY);
+
+        lock(series);
+        __atomic_store_n(&series->flush_queued, false, __ATOMIC_RELEASE);
+        flush_locked(series);
+        unlock(series);
+    }
+}
+
+void libiot_init_series() {
+    flush_queue =
+        xQueueCreateStatic(FLUSH_QUEUE_LENGTH, sizeof(libiot_series_t *),
+                           flush_queue_buff, &flush_queue_static);
+
+    if (xTaskCreate(task_flush, "series_flush", FLUSH_TASK_STACK_SIZE, NULL,
+                    FLUSH_TASK_PRIORITY, NULL)
+        != pdPASS) {
+        libiot_logf_error(TAG, "series: can't start flush task");
+    }
+}
+
+libiot_series_t *libiot_mqtt_series_create(const libiot_topic_t *topic,
+                                           int qos, size_t max_bytes,
+                                           uint32_t max_age_ms) {
+    // We need room for at least "[]" and the null terminator.
+    assert(max_bytes >= 3);
+    assert(max_age_ms > 0);
+
+    libiot_series_t *series = malloc(sizeof(libiot_series_t) + max_bytes);
+    if (!series) {
+        return NULL;
+    }
+
+    memset(series, 0, sizeof(libiot_series_t));
+    series->topic = topic;
+    series->qos = qos;
+    series->cap = max_bytes;
+    series->buff[0] = '[';
+    series->len = 1;
+
+    series->mutex = xSemaphoreCreateMutexStatic(&series->mutex_static);
+    series->timer = xTimerCreateStatic("libiot_series",
+                                       MAX(1, max_age_ms / portTICK_PERIOD_MS),
+                                       pdFALSE, series, timer_cb,
+                                       &series->timer_static);
+
+    return series;
+}
+
+libiot_series_t *libiot_mqtt_series_create_local(const char *topic_suffix,
+                                                 int qos, size_t max_bytes,
+                                                 uint32_t max_age_ms) {
+    return libiot_mqtt_series_create(libiot_mqtt_topic_local(topic_suffix),
+                                     qos, max_bytes, max_age_ms);
+}
+
+// Appends the `len` bytes at `sample` to the current batch, and returns
+// whether it fitted. Must be called with the series lock held.
+static bool try_append_locked(libiot_series_t *series, const char *sample,
+                              size_t len) {
+    // Leave room for the ',' separator, the trailing ']' and the null
+    // terminator.
+    size_t sep = series->count ? 1 : 0;
+    if (series->len + sep + len + 2 > series->cap) {
+        return false;
+    }
+
+    if (sep) {
+        series->buff[series->len] = ',';
+    }
+    memcpy(series->buff + series->len + sep, sample, len);
+    series->len += sep + len;
+
+    if (!series->count++ && xTimerStart(series->timer, 0) != pdPASS) {
+        series->timer_failed = true;
+    }
+
+    series->stats.samples++;
+    series->stats.sample_bytes += len;
+    return true;
+}
+
+void libiot_mqtt_series_append(libiot_series_t *series, const char *sample) {
+    size_t len = strlen(sample);
+
+    lock(series);
+
+    if (!try_append_locked(series, sample, len)) {
+        flush_locked(series);
+
+        if (!try_append_locked(series, sample, len)) {
+            ESP_LOGW(TAG, "series: sample too large (%d bytes), dropped", len);
+            series->stats.dropped++;
+        }
+    }
+
+    // If the batch is full anyway, there's no need to wait for the timer.
+    // Without the timer (because the timer command queue was full), we must
+    // not wait.
+    if (series->len + 4 > series->cap || series->timer_failed) {
+        flush_locked(series);
+    }
+
+    unlock(series);
+}
+
+void libiot_mqtt_series_appendv(libiot_series_t *series, const char *fmt,
+                                va_list va) {
+    char buff[LIBIOT_FORMAT_SCRATCH_SIZE];
+    char *sample = libiot_vformat(buff, sizeof(buff), fmt, va);
+    if (!sample) {
+        return;
+    }
+
+    libiot_mqtt_series_append(series, sample);
+
+    libiot_format_release(buff, sample);
+}
+
+void libiot_mqtt_series_appendf(libiot_series_t *series, const char *fmt,
+                                ...) {
+    va_list va;
+    va_start(va, fmt);
+
+    libiot_mqtt_series_appendv(series, fmt, va);
+
+    va_end(va);
+}
+
+void libiot_mqtt_series_flush(libiot_series_t *series) {
+    lock(series);
+    flush_locked(series);
+    unlock(series);
+}
+
+void libiot_mqtt_series_get_stats(libiot_series_t *series,
+                                  libiot_mqtt_series_stats_t *stats) {
+    lock(series);
+    *stats = series->stats;
+    unlock(series);
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+#include "private.h"
+
+// Starts the task which sends the batches whose `max_age_ms` has passed.
+void libiot_init_series();
@@ -0,0 +1,501 @@
+#include "subscriptions.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <freertos/timers.h>
+#include <string.h>
+
+#include "mqtt.h"
+
+// The most topics sent at once (each in its own SUBSCRIBE packet) before we
+// check for new ones.
+#define SUBSCRIBE_BATCH_MAX 16
+
+#define TASK_STACK_SIZE 3072
+#define TASK_PRIORITY 5
+
+// How long we wait for a SUBACK before sending the SUBSCRIBE again, and how
+// many times we do so before giving up on the topic until the next connect.
+#define SUBACK_TIMEOUT_MS 5000
+#define SUBSCRIBE_MAX_RETRIES 3
+
+#define CHECK_PERIOD_MS 1000
+
+// The SUBACK return code indicating failure.
+#define SUBACK_FAILURE 0x80
+
+// The number of SUBACKs we remember which arrived before we knew their message
+// id (see `record_early_ack()`).
+#define EARLY_ACKS_LENGTH 4
+#define EARLY_ACK_CODES_MAX 4
+
+typedef enum sub_state {
+    // Waiting to be sent.
+    SUB_PENDING,
+    // Sent, awaiting a SUBACK.
+    SUB_IN_FLIGHT,
+    SUB_SUBSCRIBED,
+    SUB_FAILED,
+} sub_state_t;
+
+typedef struct sub sub_t;
+struct sub {
+    sub_t *next;
+
+    int qos;
+    sub_state_t state;
+    int msg_id;
+    TickType_t sent_at;
+    uint32_t retries;
+
+    char topic[];
+};
+
+typedef struct early_ack {
+    int msg_id;
+    int codes_len;
+    // We only send one topic per SUBSCRIBE, but keep room for a few codes in
+    // case the broker sends more.
+    uint8_t codes[EARLY_ACK_CODES_MAX];
+} early_ack_t;
+
+// Entries are never freed, so their topics may be referenced without holding
+// the lock.
+static sub_t *subs;
+
+static StaticSemaphore_t mutex_static;
+static SemaphoreHandle_t mutex;
+
+// Set whenever every registered topic is subscribed (or failed).
+#define EVENT_SETTLED (1ULL << 0)
+
+static StaticEventGroup_t events_static;
+static EventGroupHandle_t events;
+
+static StaticTimer_t timer_static;
+static TimerHandle_t timer;
+
+// Checks for SUBACK timeouts and sends SUBSCRIBEs when woken by the timer.
+// (The timer daemon must not block on esp-mqtt.)
+static TaskHandle_t task;
+
+static early_ack_t early_acks[EARLY_ACKS_LENGTH];
+static uint32_t early_acks_next;
+
+static bool connected;
+static int64_t connected_at_us;
+// Whether we have yet to measure the latency of the current connect.
+static bool latency_unmeasured;
+// Whether the measured latency is yet to be published.
+static bool report_due;
+
+static libiot_mqtt_subscription_stats_t stats;
+
+static void lock() {
+    while (xSemaphoreTake(mutex, portMAX_DELAY) == pdFALSE)
+        ;
+}
+
+static void unlock() {
+    xSemaphoreGive(mutex);
+}
+
+static sub_t *find_locked(const char *topic) {
+    for (sub_t *sub = subs; sub; sub = sub->next) {
+        if (!strcmp(sub->topic, topic)) {
+            return sub;
+        }
+    }
+    return NULL;
+}
+
+// Must be called with the lock held.
+static void update_settled_locked() {
+    uint32_t pending = 0;
+    uint32_t subscribed = 0;
+    uint32_t failed = 0;
+    for (sub_t *sub = subs; sub; sub = sub->next) {
+        switch (sub->state) {
+            case SUB_PENDING:
+            case SUB_IN_FLIGHT: {
+                pending++;
+                break;
+            }
+            case SUB_SUBSCRIBED: {
+                subscribed++;
+                break;
+            }
+            case SUB_FAILED: {
+                failed++;
+                break;
+            }
+        }
+    }
+
+    stats.pending = pending;
+    stats.subscribed = subscribed;
+    stats.failed = failed;
+
+    if (pending) {
+        xEventGroupClearBits(events, EVENT_SETTLED);
+        return;
+    }
+
+    xEventGroupSetBits(events, EVENT_SETTLED);
+
+    if (connected && latency_unmeasured) {
+        latency_unmeasured = false;
+        stats.last_latency_ms =
+            (esp_timer_get_time() - connected_at_us) / 1000;
+        report_due = true;
+    }
+}
+
+// We may be on the esp-mqtt task when we settle, so the report is posted later
+// from our task.
+static void report_latency() {
+    lock();
+    bool due = report_due;
+    report_due = false;
+    libiot_mqtt_subscription_stats_t snapshot = stats;
+    unlock();
+
+    if (!due) {
+        return;
+    }
+
+    libiot_mqtt_postf_local(MQTT_TOPIC_INFO("subscriptions"), 0, 0,
+                            "{\"latency_ms\":%u,\"subscribed\":%u,"
+                            "\"failed\":%u,\"retries\":%u,\"packets\":%u}",
+                            snapshot.last_latency_ms, snapshot.subscribed,
+                            snapshot.failed, snapshot.retries,
+                            snapshot.packets);
+}
+
+// Must be called with the lock held. Applies the return `codes` of a SUBACK to
+// the topics which were sent with `msg_id`, in order, returning whether there
+// were any.
+static bool apply_ack_locked(int msg_id, const uint8_t *codes, int codes_len) {
+    int i = 0;
+    for (sub_t *sub = subs; sub; sub = sub->next) {
+        if (sub->state != SUB_IN_FLIGHT || sub->msg_id != msg_id) {
+            continue;
+        }
+
+        // Not every version of esp-mqtt passes the return codes through, in
+        // which case we assume success.
+        if (i < codes_len && codes[i] == SUBACK_FAILURE) {
+            ESP_LOGW(TAG, "mqtt: subscribe to '%s' refused", sub->topic);
+            sub->state = SUB_FAILED;
+        } else {
+            sub->state = SUB_SUBSCRIBED;
+        }
+        i++;
+    }
+
+    return i;
+}
+
+// A SUBACK can be dispatched before `esp_mqtt_client_subscribe()` has even
+// returned its message id to us, so we keep any which we can't match yet.
+static void record_early_ack(int msg_id, const uint8_t *codes, int codes_len) {
+    early_ack_t *ack = &early_acks[early_acks_next++ % EARLY_ACKS_LENGTH];
+    ack->msg_id = msg_id;
+    ack->codes_len =
+        codes_len < EARLY_ACK_CODES_MAX ? codes_len : EARLY_ACK_CODES_MAX;
+    memcpy(ack->codes, codes, ack->codes_len);
+}
+
+static void apply_early_ack_locked(int msg_id) {
+    for (int i = 0; i < EARLY_ACKS_LENGTH; i++) {
+        early_ack_t *ack = &early_acks[i];
+        if (ack->msg_id == msg_id
+            && apply_ack_locked(msg_id, ack->codes, ack->codes_len)) {
+            ack->msg_id = -1;
+            return;
+        }
+    }
+}
+
+// The esp-mqtt we target cannot put more than one topic in a SUBSCRIBE
+// packet, so instead we pipeline one packet per topic (without waiting for
+// each SUBACK in turn). Returns the number of packets sent. Must be called
+// without the lock held.
+static int send_batch(sub_t **batch, int count) {
+    int packets = 0;
+    for (int i = 0; i < count; i++) {
+        int msg_id = libiot_mqtt_try_subscribe(batch[i]->topic, batch[i]->qos);
+
+        lock();
+        batch[i]->msg_id = msg_id;
+        if (msg_id < 0) {
+            batch[i]->state = SUB_PENDING;
+        } else {
+            apply_early_ack_locked(msg_id);
+            packets++;
+        }
+        unlock();
+    }
+    return packets;
+}
+
+// Must be called with the lock held. Sends up to `SUBSCRIBE_BATCH_MAX` pending
+// topics, returning false if there were none or sending failed.
+//
+// Note that the lock is dropped while sending, since the esp-mqtt task holds
+// the esp-mqtt client lock while dispatching the SUBACK to us.
+static bool send_batch_locked() {
+    sub_t *batch[SUBSCRIBE_BATCH_MAX];
+    int count = 0;
+    TickType_t now = xTaskGetTickCount();
+    for (sub_t *sub = subs; sub && count < SUBSCRIBE_BATCH_MAX;
+         sub = sub->next) {
+        if (sub->state == SUB_PENDING) {
+            sub->state = SUB_IN_FLIGHT;
+            sub->msg_id = -1;
+            sub->sent_at = now;
+            batch[count++] = sub;
+        }
+    }
+
+    if (!count) {
+        return false;
+    }
+
+    unlock();
+    int packets = send_batch(batch, count);
+    lock();
+
+    stats.packets += packets;
+    update_settled_locked();
+    return packets;
+}
+
+static bool send_pending() {
+    if (!libiot_mqtt_wait_connected(0)) {
+        return false;
+    }
+
+    lock();
+    while (send_batch_locked())
+        ;
+    // Sending failed if anything is left pending.
+    bool ok = true;
+    for (sub_t *sub = subs; sub; sub = sub->next) {
+        ok &= sub->state != SUB_PENDING;
+    }
+    unlock();
+
+    return ok;
+}
+
+static void check_timeouts() {
+    TickType_t now = xTaskGetTickCount();
+
+    lock();
+
+    for (sub_t *sub = subs; sub; sub = sub->next) {
+        if (sub->state != SUB_IN_FLIGHT
+            || now - sub->sent_at < SUBACK_TIMEOUT_MS / portTICK_PERIOD_MS) {
+            continue;
+        }
+
+        if (sub->retries++ >= SUBSCRIBE_MAX_RETRIES) {
+            ESP_LOGW(TAG, "mqtt: subscribe to '%s' not acknowledged, giving up",
+                     sub->topic);
+            sub->state = SUB_FAILED;
+        } else {
+            stats.retries++;
+            sub->state = SUB_PENDING;
+        }
+    }
+
+    update_settled_locked();
+
+    unlock();
+}
+
+static void task_subscriptions(void *unused) {
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        check_timeouts();
+        send_pending();
+        report_latency();
+    }
+}
+
+static void timer_cb(TimerHandle_t unused) {
+    xTaskNotifyGive(task);
+}
+
+void libiot_init_subscriptions() {
+    mutex = xSemaphoreCreateMutexStatic(&mutex_static);
+    events = xEventGroupCreateStatic(&events_static);
+    xEventGroupSetBits(events, EVENT_SETTLED);
+
+    for (int i = 0; i < EARLY_ACKS_LENGTH; i++) {
+        early_acks[i].msg_id = -1;
+    }
+
+    timer = xTimerCreateStatic("libiot_subs", CHECK_PERIOD_MS
+                                                  / portTICK_PERIOD_MS,
+                               pdTRUE, NULL, timer_cb, &timer_static);
+
+    if (xTaskCreate(task_subscriptions, "mqtt_subs", TASK_STACK_SIZE, NULL,
+                    TASK_PRIORITY, &task)
+        != pdPASS) {
+        libiot_logf_error(TAG, "mqtt: can't start subscriptions task");
+    }
+}
+
+void libiot_subscriptions_handle_event(esp_mqtt_event_handle_t event) {
+    switch (event->event_id) {
+        case MQTT_EVENT_CONNECTED: {
+            lock();
+            connected = true;
+            connected_at_us = esp_timer_get_time();
+            latency_unmeasured = true;
+
+            // We always connect with a clean session, so everything must be
+            // subscribed to again.
+            for (sub_t *sub = subs; sub; sub = sub->next) {
+                sub->state = SUB_PENDING;
+                sub->retries = 0;
+            }
+            update_settled_locked();
+            unlock();
+
+            xTimerStart(timer, 0);
+            break;
+        }
+        case MQTT_EVENT_DISCONNECTED: {
+            xTimerStop(timer, 0);
+
+            lock();
+            connected = false;
+            for (sub_t *sub = subs; sub; sub = sub->next) {
+                sub->state = SUB_PENDING;
+            }
+            update_settled_locked();
+            unlock();
+            break;
+        }
+        case MQTT_EVENT_SUBSCRIBED: {
+            const uint8_t *codes = (const uint8_t *) event->data;
+            int codes_len = codes ? event->data_len : 0;
+
+            lock();
+            if (!apply_ack_locked(event->msg_id, codes, codes_len)) {
+                record_early_ack(event->msg_id, codes, codes_len);
+            }
+            update_settled_locked();
+            unlock();
+            break;
+        }
+        default: {
+            break;
+        }
+    }
+}
+
+bool libiot_subscriptions_renew() {
+    return send_pending();
+}
+
+void libiot_mqtt_subscribe(const char *topic, int qos) {
+    lock();
+
+    sub_t *sub = find_locked(topic);
+    if (!sub) {
+        size_t len = strlen(topic);
+        sub = malloc(sizeof(sub_t) + len + 1);
+        assert(sub);
+
+        memcpy(sub->topic, topic, len + 1);
+        sub->next = NULL;
+        stats.count++;
+
+        // Keep the list in the order of registration.
+        sub_t **tail = &subs;
+        while (*tail) {
+            tail = &(*tail)->next;
+        }
+        *tail = sub;
+    } else if (sub->qos == qos && sub->state != SUB_FAILED) {
+        unlock();
+        return;
+    }
+
+    sub->qos = qos;
+    sub->state = SUB_PENDING;
+    sub->msg_id = -1;
+    sub->retries = 0;
+    update_settled_locked();
+
+    unlock();
+
+    // If we are not connected this will happen when we connect.
+    xTaskNotifyGive(task);
+}
+
+libiot_mqtt_subscription_state_t
+libiot_mqtt_subscription_get_state(const char *topic) {
+    libiot_mqtt_subscription_state_t state = LIBIOT_MQTT_SUB_UNKNOWN;
+
+    lock();
+    sub_t *sub = find_locked(topic);
+    if (sub) {
+        switch (sub->state) {
+            case SUB_PENDING:
+            case SUB_IN_FLIGHT: {
+                state = LIBIOT_MQTT_SUB_PENDING;
+                break;
+            }
+            case SUB_SUBSCRIBED: {
+                state = LIBIOT_MQTT_SUB_SUBSCRIBED;
+                break;
+            }
+            case SUB_FAILED: {
+                state = LIBIOT_MQTT_SUB_FAILED;
+                break;
+            }
+        }
+    }
+    unlock();
+
+    return state;
+}
+
+bool libiot_mqtt_wait_subscribed(int timeout_ms) {
+    if (timeout_ms < 0) {
+        return libiot_mqtt_wait_connected(portMAX_DELAY)
+               && (xEventGroupWaitBits(events, EVENT_SETTLED, false, false,
+                                       portMAX_DELAY)
+                   & EVENT_SETTLED);
+    }
+
+    // The timeout covers both waits.
+    TickType_t ticks = timeout_ms / portTICK_PERIOD_MS;
+    TickType_t start = xTaskGetTickCount();
+    if (!libiot_mqtt_wait_connected(ticks)) {
+        return false;
+    }
+
+    TickType_t elapsed = xTaskGetTickCount() - start;
+    TickType_t remaining = elapsed < ticks ? ticks - elapsed : 0;
+    EventBits_t bits =
+        xEventGroupWaitBits(events, EVENT_SETTLED, false, false, remaining);
+    return bits & EVENT_SETTLED;
+}
+
+void libiot_mqtt_subscription_get_stats(
+    libiot_mqtt_subscription_stats_t *out) {
+    lock();
+    *out = stats;
+    unlock();
+}
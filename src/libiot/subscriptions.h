@@ -0,0 +1,17 @@
+#pragma once
+
+#include <mqtt_client.h>
+
+#include "private.h"
+
+// Called even if mqtt will not be started, so that topics may be registered
+// before the client exists.
+void libiot_init_subscriptions();
+
+// Called from the esp-mqtt event task for every event, to track connects,
+// disconnects and SUBACKs.
+void libiot_subscriptions_handle_event(esp_mqtt_event_handle_t event);
+
+// Sends SUBSCRIBE packets for every registered topic which is not yet
+// subscribed. Returns false if a packet could not be sent.
+bool libiot_subscriptions_renew();
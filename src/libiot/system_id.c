@@ -0,0 +1,73 @@
+#include "system_id.h"
+
+#include <esp_log.h>
+#include <esp_ota_ops.h>
+
+#include "cbor_builder.h"
+#include "json_builder.h"
+#include "payload.h"
+
+static const esp_partition_t **partitions;
+static size_t partition_count;
+
+static size_t collect_partitions(esp_partition_type_t type,
+                                 const esp_partition_t **out) {
+    size_t count = 0;
+    esp_partition_iterator_t it =
+        esp_partition_find(type, ESP_PARTITION_SUBTYPE_ANY, NULL);
+    while (it) {
+        if (out) {
+            out[count] = esp_partition_get(it);
+        }
+        count++;
+
+        it = esp_partition_next(it);
+    }
+    return count;
+}
+
+void libiot_init_system_id() {
+    // Note that the `esp_partition_t`s returned by `esp_partition_get()` live
+    // forever, so we need only keep the pointers.
+    partition_count = collect_partitions(ESP_PARTITION_TYPE_APP, NULL)
+                      + collect_partitions(ESP_PARTITION_TYPE_DATA, NULL);
+    partitions = malloc(sizeof(*partitions) * partition_count);
+    assert(partitions || !partition_count);
+
+    size_t count = collect_partitions(ESP_PARTITION_TYPE_APP, partitions);
+    collect_partitions(ESP_PARTITION_TYPE_DATA, partitions + count);
+
+    // Only the encoding we publish in is kept (except that the bench
+    // compares both).
+#ifndef LIBIOT_ENABLE_BENCH
+    if (libiot_payload_get_format() == LIBIOT_PAYLOAD_CBOR) {
+        libiot_cbor_cache_system_id();
+    } else {
+        libiot_json_cache_system_id();
+    }
+#else
+    libiot_json_cache_system_id();
+    libiot_cbor_cache_system_id();
+#endif
+}
+
+size_t libiot_system_id_get_partitions(const esp_partition_t *const **parts) {
+    *parts = partitions;
+    return partition_count;
+}
+
+const char *libiot_system_id_get_ota_state(const esp_partition_t *part) {
+    esp_ota_img_states_t ota_state;
+    if (esp_ota_get_state_partition(part, &ota_state) != ESP_OK) {
+        return "not_present";
+    }
+    return libiot_describe_ota_state(ota_state);
+}
+
+void libiot_system_id_get_volatile(system_id_volatile_t *v) {
+    v->is_rollback_possible = esp_ota_check_rollback_is_possible();
+    v->boot = esp_ota_get_boot_partition();
+    v->running = esp_ota_get_running_partition();
+    v->last_invalid = esp_ota_get_last_invalid_partition();
+    v->next_update = esp_ota_get_next_update_partition(NULL);
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <esp_partition.h>
+
+#include "private.h"
+
+// Called once at boot (after `libiot_init_payload()`), before the system id is
+// first built. Takes a copy of the partition table and serializes the parts of
+// the system id which cannot change at runtime, in the payload format only.
+void libiot_init_system_id();
+
+// The APP partitions followed by the DATA partitions, in table order.
+size_t libiot_system_id_get_partitions(const esp_partition_t *const **parts);
+
+// The OTA state of `part` (which may change at runtime), or "not_present".
+const char *libiot_system_id_get_ota_state(const esp_partition_t *part);
+
+// The other parts of the system id which change as OTA updates are applied,
+// validated, or rolled back.
+typedef struct system_id_volatile {
+    bool is_rollback_possible;
+    const esp_partition_t *boot;
+    const esp_partition_t *running;
+    const esp_partition_t *last_invalid;
+    const esp_partition_t *next_update;
+} system_id_volatile_t;
+
+void libiot_system_id_get_volatile(system_id_volatile_t *v);
@@ -2,7 +2,9 @@
 
 #include <esp_event.h>
 #include <esp_log.h>
+#include <esp_netif.h>
 #include <esp_system.h>
+#include <esp_timer.h>
 #include <esp_wifi.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
@@ -11,16 +13,30 @@
 #include <lwip/sys.h>
 #include <mdns.h>
 #include <string.h>
+#include <sys/time.h>
+
+#include "wifi_cache.h"
 
 // Negative means infinite retries
 #define NUM_RETRIES -1
 
+// The most APs (with our SSID) which a scan reports, of which we pick the
+// strongest.
+#define SCAN_MAX_APS 8
+
+#ifndef LIBIOT_WIFI_LEASE_REUSE_S
+#define LIBIOT_WIFI_LEASE_REUSE_S 0
+#endif
+
 static StaticEventGroup_t wifi_event_group_static;
 static EventGroupHandle_t wifi_event_group;
 
 static StaticSemaphore_t local_ip_mutex_static;
 static SemaphoreHandle_t local_ip_mutex;
 
+static StaticSemaphore_t timing_mutex_static;
+static SemaphoreHandle_t timing_mutex;
+
 /* The event group allows multiple bits for each event, but we only care about
  * two events:
  * - we are connected to the AP with an IP
@@ -32,6 +48,32 @@ static int retry_count = 0;
 static char *local_ip = NULL;
 static char *hostname = NULL;
 
+static esp_netif_t *netif;
+static wifi_config_t wifi_config;
+
+static bool has_static_ip;
+static esp_netif_ip_info_t static_ip_info;
+static esp_ip4_addr_t static_dns;
+
+// The AP (and lease) of our last connection.
+static bool has_cache;
+static wifi_cache_t cache;
+
+// The state of the connection in progress, which only the event loop task
+// touches.
+static bool associated;
+// Whether we went straight to the cached AP, without scanning.
+static bool directed;
+static bool reusing_lease;
+static int64_t attempt_start_us;
+static int64_t phase_start_us;
+static wifi_timing_t timing;
+// Only used by `handle_scan_done()`, but too large for the stack.
+static wifi_ap_record_t scan_aps[SCAN_MAX_APS];
+
+// Protected by `timing_mutex`.
+static wifi_timing_t last_timing;
+
 const char *libiot_get_local_ip() {
     while (xSemaphoreTake(local_ip_mutex, portMAX_DELAY) == pdFALSE)
         ;
@@ -43,6 +85,208 @@ const char *libiot_get_local_ip() {
     return local_ip_copy;
 }
 
+void libiot_wifi_get_timing(wifi_timing_t *t) {
+    if (!timing_mutex) {
+        memset(t, 0, sizeof(*t));
+        return;
+    }
+
+    while (xSemaphoreTake(timing_mutex, portMAX_DELAY) == pdFALSE)
+        ;
+
+    *t = last_timing;
+
+    xSemaphoreGive(timing_mutex);
+}
+
+// Returns the length of the phase which just ended, and starts the next.
+static uint32_t end_phase() {
+    int64_t now = esp_timer_get_time();
+    uint32_t ms = (now - phase_start_us) / 1000;
+    phase_start_us = now;
+    return ms;
+}
+
+// Note that unlike `esp_timer_get_time()`, this keeps counting through deep
+// sleep.
+static int64_t get_time_s() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec;
+}
+
+static bool lease_is_fresh() {
+    if (!LIBIOT_WIFI_LEASE_REUSE_S || !cache.has_lease) {
+        return false;
+    }
+
+    int64_t age_s = get_time_s() - cache.lease_time_s;
+    return age_s >= 0 && age_s < LIBIOT_WIFI_LEASE_REUSE_S;
+}
+
+static void apply_ip(const esp_netif_ip_info_t *ip_info,
+                     const esp_ip4_addr_t *dns) {
+    // Note that this fails harmlessly if the client is already stopped.
+    esp_netif_dhcpc_stop(netif);
+    ESP_ERROR_CHECK(esp_netif_set_ip_info(netif, ip_info));
+
+    if (dns->addr) {
+        esp_netif_dns_info_t dns_info = {0};
+        dns_info.ip.type = ESP_IPADDR_TYPE_V4;
+        dns_info.ip.u_addr.ip4.addr = dns->addr;
+        ESP_ERROR_CHECK(
+            esp_netif_set_dns_info(netif, ESP_NETIF_DNS_MAIN, &dns_info));
+    }
+}
+
+static void connect_to(const uint8_t bssid[6], uint8_t channel) {
+    wifi_config.sta.bssid_set = true;
+    memcpy(wifi_config.sta.bssid, bssid, sizeof(wifi_config.sta.bssid));
+    wifi_config.sta.channel = channel;
+    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
+
+    timing.attempts++;
+    phase_start_us = esp_timer_get_time();
+    esp_wifi_connect();
+}
+
+static void start_scan() {
+    directed = false;
+    phase_start_us = esp_timer_get_time();
+
+    wifi_scan_config_t scan_config = {
+        .ssid = wifi_config.sta.ssid,
+    };
+    esp_err_t err = esp_wifi_scan_start(&scan_config, false);
+    if (err == ESP_OK) {
+        return;
+    }
+
+    // Leave the driver to find the AP itself.
+    ESP_LOGW(TAG, "wifi: can't scan (0x%X)", err);
+    wifi_config.sta.bssid_set = false;
+    wifi_config.sta.channel = 0;
+    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
+
+    timing.attempts++;
+    esp_wifi_connect();
+}
+
+// Starts a connection, going straight to the AP we last connected to if we
+// know it.
+static void begin_connect() {
+    memset(&timing, 0, sizeof(timing));
+    attempt_start_us = esp_timer_get_time();
+
+    // We may have stopped the DHCP client to reuse a lease. (Note that this
+    // fails harmlessly if the client is already started.)
+    if (!has_static_ip) {
+        esp_netif_dhcpc_start(netif);
+    }
+
+    if (!has_cache) {
+        start_scan();
+        return;
+    }
+
+    ESP_LOGI(TAG, "wifi: connecting to last AP (channel %u)", cache.channel);
+    directed = true;
+    timing.fast = true;
+    connect_to(cache.bssid, cache.channel);
+}
+
+// Tries again, from a fresh scan, after an attempt failed.
+static void retry() {
+    if (NUM_RETRIES < 0 || retry_count < NUM_RETRIES) {
+        start_scan();
+        retry_count++;
+        ESP_LOGW(TAG, "retry to connect to the AP");
+    } else {
+        xEventGroupSetBits(wifi_event_group, WIFI_FAIL_BIT);
+    }
+}
+
+static void handle_scan_done() {
+    timing.scan_ms += end_phase();
+
+    uint16_t num_aps = SCAN_MAX_APS;
+    if (esp_wifi_scan_get_ap_records(&num_aps, scan_aps) != ESP_OK) {
+        num_aps = 0;
+    }
+
+    if (!num_aps) {
+        ESP_LOGW(TAG, "wifi: no AP found");
+        retry();
+        return;
+    }
+
+    const wifi_ap_record_t *best = &scan_aps[0];
+    for (uint16_t i = 1; i < num_aps; i++) {
+        if (scan_aps[i].rssi > best->rssi) {
+            best = &scan_aps[i];
+        }
+    }
+
+    ESP_LOGI(TAG, "wifi: found %u APs, strongest %ddBm (channel %u)",
+             num_aps, best->rssi, best->primary);
+    connect_to(best->bssid, best->primary);
+}
+
+static void handle_connected(const wifi_event_sta_connected_t *event) {
+    timing.connect_ms = end_phase();
+    associated = true;
+
+    // A lease is only reused with the AP it was obtained through.
+    bool same_ap = has_cache
+                   && !memcmp(cache.bssid, event->bssid, sizeof(cache.bssid));
+    if (!same_ap) {
+        memset(&cache, 0, sizeof(cache));
+        memcpy(cache.bssid, event->bssid, sizeof(cache.bssid));
+    }
+    cache.channel = event->channel;
+
+    reusing_lease = false;
+    if (has_static_ip) {
+        timing.lease_reused = true;
+        apply_ip(&static_ip_info, &static_dns);
+    } else if (same_ap && lease_is_fresh()) {
+        ESP_LOGI(TAG, "wifi: reusing last lease");
+        reusing_lease = true;
+        timing.lease_reused = true;
+        apply_ip(&cache.ip_info, &cache.dns);
+    }
+}
+
+static void handle_got_ip(const ip_event_got_ip_t *event) {
+    timing.dhcp_ms = end_phase();
+    timing.total_ms = (esp_timer_get_time() - attempt_start_us) / 1000;
+
+    if (!has_static_ip && !reusing_lease) {
+        cache.has_lease = true;
+        cache.ip_info = event->ip_info;
+        cache.lease_time_s = get_time_s();
+
+        esp_netif_dns_info_t dns_info;
+        if (esp_netif_get_dns_info(netif, ESP_NETIF_DNS_MAIN, &dns_info)
+            == ESP_OK) {
+            cache.dns.addr = dns_info.ip.u_addr.ip4.addr;
+        }
+    }
+    has_cache = true;
+    libiot_wifi_cache_save((const char *) wifi_config.sta.ssid, &cache);
+
+    ESP_LOGI(TAG, "wifi: up in %ums (scan %ums, connect %ums, dhcp %ums)",
+             timing.total_ms, timing.scan_ms, timing.connect_ms,
+             timing.dhcp_ms);
+
+    while (xSemaphoreTake(timing_mutex, portMAX_DELAY) == pdFALSE)
+        ;
+
+    last_timing = timing;
+
+    xSemaphoreGive(timing_mutex);
+}
+
 static void wifi_event_handler(void *arg, esp_event_base_t event_base,
                                int32_t event_id, void *event_data) {
     if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
@@ -53,7 +297,12 @@ static void wifi_event_handler(void *arg, esp_event_base_t event_base,
         ESP_ERROR_CHECK(mdns_init());
         ESP_ERROR_CHECK(mdns_hostname_set(hostname));
 
-        esp_wifi_connect();
+        begin_connect();
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_SCAN_DONE) {
+        handle_scan_done();
+    } else if (event_base == WIFI_EVENT
+               && event_id == WIFI_EVENT_STA_CONNECTED) {
+        handle_connected(event_data);
     } else if (event_base == WIFI_EVENT
                && event_id == WIFI_EVENT_STA_DISCONNECTED) {
         while (xSemaphoreTake(local_ip_mutex, portMAX_DELAY) == pdFALSE)
@@ -66,14 +315,19 @@ static void wifi_event_handler(void *arg, esp_event_base_t event_base,
 
         free(to_free);
 
-        if (NUM_RETRIES < 0 || retry_count < NUM_RETRIES) {
-            esp_wifi_connect();
-            retry_count++;
-            ESP_LOGW(TAG, "retry to connect to the AP");
+        ESP_LOGW(TAG, "failed to connect to the AP");
+        if (associated) {
+            // We lost a working connection, so try the same AP first.
+            associated = false;
+            begin_connect();
+        } else if (directed) {
+            ESP_LOGW(TAG, "wifi: last AP unreachable, scanning");
+            has_cache = false;
+            libiot_wifi_cache_clear();
+            start_scan();
         } else {
-            xEventGroupSetBits(wifi_event_group, WIFI_FAIL_BIT);
+            retry();
         }
-        ESP_LOGW(TAG, "failed to connect to the AP");
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
         ip_event_got_ip_t *event = (ip_event_got_ip_t *) event_data;
 
@@ -90,21 +344,40 @@ static void wifi_event_handler(void *arg, esp_event_base_t event_base,
 
         ESP_LOGI(TAG, "(%d retries) got ip: %s", retry_count, local_ip);
         retry_count = 0;
+        handle_got_ip(event);
         xEventGroupSetBits(wifi_event_group, WIFI_CONNECTED_BIT);
     }
 }
 
+static void parse_static_ip(const libiot_static_ip_t *cfg) {
+    ESP_ERROR_CHECK(esp_netif_str_to_ip4(cfg->ip, &static_ip_info.ip));
+    ESP_ERROR_CHECK(
+        esp_netif_str_to_ip4(cfg->netmask, &static_ip_info.netmask));
+    ESP_ERROR_CHECK(esp_netif_str_to_ip4(cfg->gw, &static_ip_info.gw));
+    if (cfg->dns) {
+        ESP_ERROR_CHECK(esp_netif_str_to_ip4(cfg->dns, &static_dns));
+    }
+    has_static_ip = true;
+}
+
 static void wifi_init_sta(const char *ssid, const char *pass,
-                          wifi_ps_type_t ps_type) {
+                          wifi_ps_type_t ps_type,
+                          const libiot_static_ip_t *static_ip) {
     ESP_LOGI(TAG, "wifi init start");
 
     wifi_event_group = xEventGroupCreateStatic(&wifi_event_group_static);
     local_ip_mutex = xSemaphoreCreateMutexStatic(&local_ip_mutex_static);
+    timing_mutex = xSemaphoreCreateMutexStatic(&timing_mutex_static);
+
+    if (static_ip) {
+        parse_static_ip(static_ip);
+    }
+    has_cache = libiot_wifi_cache_load(ssid, &cache);
 
     ESP_ERROR_CHECK(esp_netif_init());
 
     ESP_ERROR_CHECK(esp_event_loop_create_default());
-    esp_netif_create_default_wifi_sta();
+    netif = esp_netif_create_default_wifi_sta();
 
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
@@ -114,7 +387,6 @@ static void wifi_init_sta(const char *ssid, const char *pass,
     ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP,
                                                &wifi_event_handler, NULL));
 
-    wifi_config_t wifi_config;
     memset(&wifi_config, 0, sizeof(wifi_config));
     assert(strlen(ssid) < 32);  // Remember the null byte! (hence strict)
     assert(strlen(pass) < 64);  // Remember the null byte! (hence strict)
@@ -160,7 +432,8 @@ static void wifi_init_sta(const char *ssid, const char *pass,
 }
 
 void libiot_start_wifi(const char *ssid, const char *pass, const char *name,
-                       wifi_ps_type_t ps_type) {
+                       wifi_ps_type_t ps_type,
+                       const libiot_static_ip_t *static_ip) {
     assert(asprintf(&hostname, "iot-%s", name) >= 0);
-    wifi_init_sta(ssid, pass, ps_type);
+    wifi_init_sta(ssid, pass, ps_type, static_ip);
 }
@@ -2,6 +2,31 @@
 
 #include "private.h"
 
-// Returns when WiFi has connected succesfully.
+// Returns when WiFi has connected succesfully. `static_ip` may be NULL.
 void libiot_start_wifi(const char *ssid, const char *pass, const char *name,
-                       wifi_ps_type_t ps_type);
+                       wifi_ps_type_t ps_type,
+                       const libiot_static_ip_t *static_ip);
+
+// How long each phase of the last successful connection took.
+typedef struct wifi_timing {
+    // Whether we went straight to the AP we last connected to.
+    bool fast;
+    // Whether we reused our last DHCP lease (or have a static address).
+    bool lease_reused;
+
+    // Zero if we did not scan.
+    uint32_t scan_ms;
+    // The driver authenticates, associates and then completes the key
+    // handshake without reporting the steps in between, so these are timed
+    // as one.
+    uint32_t connect_ms;
+    uint32_t dhcp_ms;
+    // From starting WiFi (or losing the connection) until we had an address,
+    // including any failed attempts.
+    uint32_t total_ms;
+
+    uint32_t attempts;
+} wifi_timing_t;
+
+// Zeroes `timing` if we have never connected.
+void libiot_wifi_get_timing(wifi_timing_t *timing);
@@ -0,0 +1,121 @@
+#include "wifi_cache.h"
+
+#include <esp_attr.h>
+#include <esp_log.h>
+#include <nvs.h>
+#include <string.h>
+
+#define NVS_NAMESPACE "libiot_wifi"
+#define NVS_KEY_AP "ap"
+
+// The AP is only of use for the network it belongs to.
+typedef struct ap_record {
+    char ssid[33];
+    uint8_t bssid[6];
+    uint8_t channel;
+} ap_record_t;
+
+typedef struct rtc_record {
+    bool valid;
+    char ssid[33];
+    wifi_cache_t cache;
+} rtc_record_t;
+
+// Zeroed on every boot except a wake from deep sleep.
+static RTC_DATA_ATTR rtc_record_t rtc_record;
+
+static bool open_nvs(nvs_open_mode_t mode, nvs_handle_t *handle) {
+    esp_err_t err = nvs_open(NVS_NAMESPACE, mode, handle);
+    if (err != ESP_OK) {
+        if (mode == NVS_READWRITE || err != ESP_ERR_NVS_NOT_FOUND) {
+            ESP_LOGE(TAG, "wifi: can't open nvs (0x%X)", err);
+        }
+        return false;
+    }
+    return true;
+}
+
+static bool load_ap(ap_record_t *ap) {
+    nvs_handle_t handle;
+    if (!open_nvs(NVS_READONLY, &handle)) {
+        return false;
+    }
+
+    size_t len = sizeof(*ap);
+    esp_err_t err = nvs_get_blob(handle, NVS_KEY_AP, ap, &len);
+    nvs_close(handle);
+
+    return err == ESP_OK && len == sizeof(*ap);
+}
+
+bool libiot_wifi_cache_load(const char *ssid, wifi_cache_t *c) {
+    if (rtc_record.valid && !strcmp(rtc_record.ssid, ssid)) {
+        *c = rtc_record.cache;
+        return true;
+    }
+
+    ap_record_t ap;
+    if (!load_ap(&ap) || strcmp(ap.ssid, ssid)) {
+        return false;
+    }
+
+    memset(c, 0, sizeof(*c));
+    memcpy(c->bssid, ap.bssid, sizeof(c->bssid));
+    c->channel = ap.channel;
+    return true;
+}
+
+void libiot_wifi_cache_save(const char *ssid, const wifi_cache_t *c) {
+    assert(strlen(ssid) < sizeof(rtc_record.ssid));
+
+    rtc_record.valid = true;
+    strcpy(rtc_record.ssid, ssid);
+    rtc_record.cache = *c;
+
+    // Note that the padding is zeroed so that records can be compared whole.
+    ap_record_t ap;
+    memset(&ap, 0, sizeof(ap));
+    strcpy(ap.ssid, ssid);
+    memcpy(ap.bssid, c->bssid, sizeof(ap.bssid));
+    ap.channel = c->channel;
+
+    // Spare the flash when we reconnect to the same AP (which is usual).
+    ap_record_t saved;
+    if (load_ap(&saved) && !memcmp(&saved, &ap, sizeof(ap))) {
+        return;
+    }
+
+    nvs_handle_t handle;
+    if (!open_nvs(NVS_READWRITE, &handle)) {
+        return;
+    }
+
+    esp_err_t err = nvs_set_blob(handle, NVS_KEY_AP, &ap, sizeof(ap));
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "wifi: can't save AP (0x%X)", err);
+    }
+
+    nvs_close(handle);
+}
+
+void libiot_wifi_cache_clear() {
+    rtc_record.valid = false;
+
+    nvs_handle_t handle;
+    if (!open_nvs(NVS_READWRITE, &handle)) {
+        return;
+    }
+
+    esp_err_t err = nvs_erase_key(handle, NVS_KEY_AP);
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+        ESP_LOGE(TAG, "wifi: can't clear AP (0x%X)", err);
+    }
+
+    nvs_close(handle);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <esp_netif.h>
+
+#include "private.h"
+
+// What we remember of the last successful connection, so that the next one
+// can go straight to the same AP instead of scanning for it, and (if the
+// lease is recent enough) skip DHCP.
+//
+// The whole record is kept in RTC memory, which survives deep sleep. The AP
+// is also saved to NVS, which survives power loss, but the lease is not:
+// after a power cycle the system time starts again, so we could not tell how
+// old the lease was.
+typedef struct wifi_cache {
+    uint8_t bssid[6];
+    uint8_t channel;
+
+    bool has_lease;
+    esp_netif_ip_info_t ip_info;
+    esp_ip4_addr_t dns;
+    // The system time (in seconds) when the lease was obtained.
+    int64_t lease_time_s;
+} wifi_cache_t;
+
+// Returns false if nothing is cached for `ssid`.
+bool libiot_wifi_cache_load(const char *ssid, wifi_cache_t *c);
+// Only writes to NVS if the AP has changed.
+void libiot_wifi_cache_save(const char *ssid, const wifi_cache_t *c);
+// Forgets the cached AP, e.g. because it could not be reached.
+void libiot_wifi_cache_clear();
@@ -0,0 +1,116 @@
+#!/usr/bin/env python3
+"""Makes a delta which turns one app image into another, for use as the
+`delta_url` of an OTA update command. See `src/libiot/ota_delta.h` for the
+format. Deltas (like full images) may also be zlib compressed, for use with
+`"compression": "zlib"`.
+
+usage: ota_delta.py SOURCE.bin TARGET.bin OUT.delta
+"""
+
+import hashlib
+import struct
+import sys
+
+MAGIC = b"LDLT"
+VERSION = 1
+
+OP_END = 0x00
+OP_COPY = 0x01
+OP_ADD = 0x02
+OP_INSERT = 0x03
+
+# Matches are found by indexing blocks of the source of this length at this
+# stride, so any common run of at least `BLOCK + STRIDE` bytes is found.
+BLOCK = 32
+STRIDE = 8
+# Copies shorter than this cost more to encode than they save.
+MIN_COPY = 16
+
+
+def index_source(source):
+    index = {}
+    for off in range(0, len(source) - BLOCK + 1, STRIDE):
+        index.setdefault(source[off:off + BLOCK], off)
+    return index
+
+
+def emit_literal(out, source, target, start, end, src_off):
+    """Encodes target[start:end], as an ADD against the source from
+    `src_off` if that is mostly the same (since small edits tend to leave
+    the surrounding code in place), and otherwise as an INSERT."""
+    if start == end:
+        return
+    n = end - start
+    if 0 <= src_off and src_off + n <= len(source):
+        old = source[src_off:src_off + n]
+        new = target[start:end]
+        if sum(a == b for a, b in zip(old, new)) * 2 >= n:
+            diff = bytes((b - a) & 0xFF for a, b in zip(old, new))
+            out += struct.pack("<BII", OP_ADD, src_off, n) + diff
+            return
+    out += struct.pack("<BI", OP_INSERT, n) + target[start:end]
+
+
+def make_delta(source, target):
+    index = index_source(source)
+    out = bytearray()
+    out += MAGIC + struct.pack("<III", VERSION, len(source), len(target))
+    out += hashlib.sha256(source).digest()
+    out += hashlib.sha256(target).digest()
+
+    # Where the source would be, had the last copy carried on.
+    src_pos = 0
+    literal = 0
+    pos = 0
+    while pos < len(target):
+        off = index.get(target[pos:pos + BLOCK])
+        if off is None:
+            pos += 1
+            continue
+
+        # Grow the match in both directions.
+        end = pos + BLOCK
+        src_end = off + BLOCK
+        while (end < len(target) and src_end < len(source)
+               and target[end] == source[src_end]):
+            end += 1
+            src_end += 1
+        start = pos
+        while (start > literal and off > 0
+               and target[start - 1] == source[off - 1]):
+            start -= 1
+            off -= 1
+
+        if end - start < MIN_COPY:
+            pos += 1
+            continue
+
+        emit_literal(out, source, target, literal, start, src_pos)
+        out += struct.pack("<BII", OP_COPY, off, end - start)
+        src_pos = src_end
+        literal = pos = end
+
+    emit_literal(out, source, target, literal, len(target), src_pos)
+    out += bytes([OP_END])
+    return bytes(out)
+
+
+def main():
+    if len(sys.argv) != 4:
+        sys.exit(__doc__)
+
+    with open(sys.argv[1], "rb") as f:
+        source = f.read()
+    with open(sys.argv[2], "rb") as f:
+        target = f.read()
+
+    delta = make_delta(source, target)
+    with open(sys.argv[3], "wb") as f:
+        f.write(delta)
+
+    print("%d bytes (%.1f%% of the image)"
+          % (len(delta), 100 * len(delta) / max(len(target), 1)))
+
+
+if __name__ == "__main__":
+    main()